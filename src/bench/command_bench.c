@@ -0,0 +1,91 @@
+/**
+ * @file
+ * @brief Микробенчмарк разбора команд клиента
+ *
+ * Сравнивает регулярные выражения (с данными совпадения на каждый вызов
+ * и с контекстом потока) и рукописный разборщик на типичном наборе
+ * команд сессии. Запуск: make bench && ./bench/command_bench
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../commands.h"
+#include "../util.h"
+
+
+static const char *commands[] =
+{
+    "EHLO client.example.org",
+    "MAIL FROM:<sender.name@client.example.org>",
+    "RCPT TO:<oleg@mysmtp.pvs.bmstu>",
+    "RCPT TO:<Postmaster>",
+    "DATA",
+    ".",
+    "RSET",
+    "NOOP",
+    "QUIT",
+};
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static command_regex_context_t context;
+
+static void run(const char *name, command_match_t (*parse)(message_t *message))
+{
+    const int rounds = 200000;
+    int n = ARRAYNUM(commands);
+    message_t messages[ARRAYNUM(commands)];
+    for (int i = 0; i < n; i++)
+    {
+        messages[i].text = (char*)commands[i];
+        messages[i].len = strlen(commands[i]);
+    }
+
+    int recognized = 0;
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            command_match_t match = parse(messages + i);
+            recognized += match.command != CLIENT_UNKNOWN_COMMAND;
+            command_match_free(&match);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    printf("%-10s %8.1f ns/command (%d recognized)\n", name, elapsed * 1e9 / (rounds * n), recognized);
+}
+
+static command_match_t parse_regex(message_t *message)
+{
+    return client_command_parse_message_regex(message, NULL);
+}
+
+static command_match_t parse_regex_context(message_t *message)
+{
+    return client_command_parse_message_regex(message, &context);
+}
+
+static command_match_t parse_handwritten(message_t *message)
+{
+    command_match_t match;
+    command_parse_line(message->text, message->len, &match);
+    return match;
+}
+
+int main()
+{
+    client_command_parser_init();
+    command_regex_context_init(&context);
+    run("regex", parse_regex);
+    run("regex+ctx", parse_regex_context);
+    run("parser", parse_handwritten);
+    command_regex_context_free(&context);
+    client_command_parser_free();
+    return 0;
+}
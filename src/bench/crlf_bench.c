@@ -0,0 +1,142 @@
+/**
+ * @file
+ * @brief Микробенчмарк выделения строк из входного потока
+ *
+ * Сравнивает прежний цикл message_builder (побайтовый просмотр всего
+ * необработанного буфера на каждом чтении) с инкрементальным поиском.
+ * Запуск: make bench && ./bench/crlf_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../crlf_scan.h"
+#include "../message_builder.h"
+
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Прежний алгоритм: буфер просматривается с нуля при каждом чтении,
+// хвост сдвигается в начало
+static int legacy_add_string(dynamic_vector_t *unparsed, const char *str, int len)
+{
+    int lines = 0;
+    dynamic_vector_copy_back(unparsed, str, len);
+
+    const char *data = unparsed->data;
+    int message_start = 0;
+    for (int i = 0; i < unparsed->size - 1; i++)
+    {
+        if (data[i] == '\r' && data[i + 1] == '\n')
+        {
+            lines++;
+            message_start = i + 2;
+            i++;
+        }
+    }
+
+    int left = unparsed->size - message_start;
+    memmove(unparsed->data, unparsed->data + message_start, left);
+    unparsed->size = left;
+    return lines;
+}
+
+static void run_legacy(const char *name, const char *input, int size, int segment)
+{
+    dynamic_vector_t unparsed = dynamic_vector_create(sizeof(char), 256);
+    int lines = 0;
+    double start = now_seconds();
+    for (int pos = 0; pos < size; pos += segment)
+    {
+        int len = size - pos < segment ? size - pos : segment;
+        lines += legacy_add_string(&unparsed, input + pos, len);
+    }
+    double elapsed = now_seconds() - start;
+    printf("%-28s legacy      %8.1f MB/s (%d lines)\n", name, size / elapsed / 1e6, lines);
+    dynamic_vector_close(&unparsed);
+}
+
+static void run_builder(const char *name, const char *input, int size, int segment)
+{
+    message_builder_t builder = create_message_builder();
+    int lines = 0;
+    double start = now_seconds();
+    for (int pos = 0; pos < size; pos += segment)
+    {
+        int len = size - pos < segment ? size - pos : segment;
+        memcpy(message_builder_reserve(&builder, len), input + pos, len);
+        message_builder_commit(&builder, len);
+
+        message_t line;
+        while (message_builder_next_line(&builder, &line))
+        {
+            lines++;
+        }
+        message_builder_release_lines(&builder);
+    }
+    double elapsed = now_seconds() - start;
+    printf("%-28s builder     %8.1f MB/s (%d lines)\n", name, size / elapsed / 1e6, lines);
+    message_builder_close(&builder);
+}
+
+static void run_scanner(const char *name, const char *impl, int (*find)(const char *, int, int), const char *input, int size)
+{
+    int lines = 0;
+    double start = now_seconds();
+    int pos = 0;
+    int cr;
+    while ((cr = find(input, pos, size)) >= 0)
+    {
+        lines++;
+        pos = cr + 2;
+    }
+    double elapsed = now_seconds() - start;
+    printf("%-28s %-11s %8.1f MB/s (%d lines)\n", name, impl, size / elapsed / 1e6, lines);
+}
+
+// Текст письма: строки по line_len символов
+static char *make_payload(int size, int line_len)
+{
+    char *data = malloc(size);
+    for (int i = 0; i < size; i++)
+    {
+        data[i] = 'a' + i % 26;
+    }
+    for (int i = line_len; i + 1 < size; i += line_len + 2)
+    {
+        data[i] = '\r';
+        data[i + 1] = '\n';
+    }
+    return data;
+}
+
+int main()
+{
+    const int data_size = 64 * 1024 * 1024;
+    char *data = make_payload(data_size, 76);
+    run_legacy("DATA, 76-char lines, 4K", data, data_size, 4096);
+    run_builder("DATA, 76-char lines, 4K", data, data_size, 4096);
+
+    char *wide = make_payload(data_size, 4000);
+    run_legacy("DATA, 4000-char lines, 4K", wide, data_size, 4096);
+    run_builder("DATA, 4000-char lines, 4K", wide, data_size, 4096);
+
+    // Одна длинная строка мелкими кусками: прежний цикл квадратичен
+    const int long_size = 1024 * 1024;
+    char *longline = make_payload(long_size, long_size - 2);
+    run_legacy("1M line, 64-byte segments", longline, long_size, 64);
+    run_builder("1M line, 64-byte segments", longline, long_size, 64);
+
+    run_scanner("raw scan, 76-char lines", "memchr", crlf_find, data, data_size);
+    run_scanner("raw scan, 4000-char lines", "memchr", crlf_find, wide, data_size);
+
+    free(data);
+    free(wide);
+    free(longline);
+    return 0;
+}
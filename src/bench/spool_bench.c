@@ -0,0 +1,138 @@
+/**
+ * @file
+ * @brief Бенчмарк записи писем: maildir против сегментов
+ *
+ * Пишет одинаковые письма по файлу на письмо (создание в tmp, запись,
+ * перенос в cur) и дописыванием в сегмент, без сброса на диск и со сбросом
+ * каждого письма. Папка для записи - первый аргумент, по умолчанию /tmp.
+ * Запуск: make bench && ./bench/spool_bench [папка]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../maildir.h"
+#include "../segment_spool.h"
+
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, int messages, int body_len, double elapsed)
+{
+    printf("%-22s %8.0f msg/s %8.1f MB/s\n", name, messages / elapsed,
+            (double)messages * body_len / elapsed / (1024 * 1024));
+}
+
+static void run_maildir(maildir_t *maildir, const char *body, int body_len, int messages, bool sync)
+{
+    double start = now_seconds();
+    for (int i = 0; i < messages; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "%d.%d.mail", (int)sync, i);
+        int fd = maildir_create_in_tmp(maildir, name);
+        if (fd < 0 || write(fd, body, body_len) != body_len)
+        {
+            perror("maildir");
+            exit(1);
+        }
+        if (sync)
+        {
+            fdatasync(fd);
+        }
+        maildir_move_to_cur(maildir, fd, name);
+        if (sync)
+        {
+            maildir_sync_folder(maildir, MAILDIR_CUR);
+        }
+        close(fd);
+    }
+    report(sync ? "maildir, fsync" : "maildir", messages, body_len, now_seconds() - start);
+
+    for (int i = 0; i < messages; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "%d.%d.mail", (int)sync, i);
+        unlinkat(maildir->cur_fd, name, 0);
+    }
+}
+
+static void run_segments(maildir_t *maildir, const char *body, int body_len, int messages, bool sync)
+{
+    segment_spool_t spool;
+    segment_spool_init(&spool, maildir->segments_fd, sync, SEGMENT_DEFAULT_SIZE, 0, sync);
+
+    double start = now_seconds();
+    for (int i = 0; i < messages; i++)
+    {
+        const char *from = "sender@client.example.org";
+        const char *rcpt = "oleg@mysmtp.pvs.bmstu";
+        if (!segment_spool_append(&spool, from, strlen(from), rcpt, strlen(rcpt), body, body_len, MAILDIR_CUR, false))
+        {
+            perror("segment");
+            exit(1);
+        }
+        if (sync)
+        {
+            segment_spool_sync(&spool);
+        }
+    }
+    segment_spool_close(&spool);
+    report(sync ? "segments, msync" : "segments", messages, body_len, now_seconds() - start);
+
+    for (int i = 0; i < spool.sequence; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "0-W%d-%d.seg", (int)sync, i);
+        unlinkat(maildir->segments_fd, name, 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char root[256];
+    snprintf(root, sizeof(root), "%s/spool_benchXXXXXX", argc > 1 ? argv[1] : "/tmp");
+    if (!mkdtemp(root))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    int error;
+    maildir_t maildir = maildir_open(root, &error);
+    if (error != 0 || !maildir_open_segments(&maildir))
+    {
+        perror("maildir");
+        return 1;
+    }
+
+    const int body_lens[] = { 1024, 16 * 1024 };
+    for (int i = 0; i < 2; i++)
+    {
+        int body_len = body_lens[i];
+        char *body = malloc(body_len);
+        memset(body, 'x', body_len);
+        printf("Body %d bytes\n", body_len);
+        run_maildir(&maildir, body, body_len, 20000, false);
+        run_segments(&maildir, body, body_len, 20000, false);
+        run_maildir(&maildir, body, body_len, 500, true);
+        run_segments(&maildir, body, body_len, 500, true);
+        free(body);
+    }
+
+    const char *dirs[] = { "tmp", "cur", "relay", "segments" };
+    for (int i = 0; i < 4; i++)
+    {
+        unlinkat(maildir.root_fd, dirs[i], AT_REMOVEDIR);
+    }
+    maildir_close(&maildir);
+    rmdir(root);
+    return 0;
+}
@@ -0,0 +1,512 @@
+#include "commands.h"
+#include <ctype.h>
+
+/**
+ * @file
+ * @brief Рукописный разборщик команд клиента
+ *
+ * Разбор методом рекурсивного спуска по грамматике RFC 5321 в том же
+ * объёме, что и регулярные выражения в commands.c: команда выбирается по
+ * глаголу, поля записываются смещениями в строке, память не выделяется.
+ */
+
+typedef struct parser_t
+{
+    const char *s;
+    int len;
+    int pos;
+    command_match_t *match;
+} parser_t;
+
+static bool is_word(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool is_hex(char c)
+{
+    return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+// atext из RFC 5322
+static bool is_atext(char c)
+{
+    if (isalnum((unsigned char)c)) return true;
+    switch (c)
+    {
+    case '!': case '#': case '$': case '%': case '&': case '\'': case '*':
+    case '+': case '-': case '/': case '=': case '?': case '^': case '_':
+    case '`': case '{': case '|': case '}': case '~':
+        return true;
+    default:
+        return false;
+    }
+}
+
+static char peek(parser_t *p)
+{
+    return p->pos < p->len ? p->s[p->pos] : '\0';
+}
+
+static bool accept_char(parser_t *p, char c)
+{
+    if (p->pos < p->len && p->s[p->pos] == c)
+    {
+        p->pos++;
+        return true;
+    }
+    return false;
+}
+
+// Конец строки. Как и '$' в PCRE2, допускаем один завершающий '\n'
+static bool at_end(parser_t *p)
+{
+    return p->pos == p->len || (p->pos == p->len - 1 && p->s[p->pos] == '\n');
+}
+
+// Слово целиком в верхнем или целиком в нижнем регистре: "HELO" или "helo"
+static bool accept_verb(parser_t *p, const char *upper)
+{
+    int n = 0;
+    bool is_upper = true;
+    bool is_lower = true;
+    for (; upper[n]; n++)
+    {
+        if (p->pos + n >= p->len)
+        {
+            return false;
+        }
+        char c = p->s[p->pos + n];
+        is_upper = is_upper && c == upper[n];
+        is_lower = is_lower && c == tolower((unsigned char)upper[n]);
+    }
+    if (!is_upper && !is_lower)
+    {
+        return false;
+    }
+    p->pos += n;
+    return true;
+}
+
+static bool accept_literal(parser_t *p, const char *word)
+{
+    int n = 0;
+    for (; word[n]; n++)
+    {
+        if (p->pos + n >= p->len || p->s[p->pos + n] != word[n])
+        {
+            return false;
+        }
+    }
+    p->pos += n;
+    return true;
+}
+
+static bool accept_word_ci(parser_t *p, const char *word)
+{
+    int n = 0;
+    for (; word[n]; n++)
+    {
+        if (p->pos + n >= p->len || tolower((unsigned char)p->s[p->pos + n]) != tolower((unsigned char)word[n]))
+        {
+            return false;
+        }
+    }
+    p->pos += n;
+    return true;
+}
+
+static void clear_fields(command_match_t *match)
+{
+    for (int field = 0; field < COMMAND_FIELD_COUNT; field++)
+    {
+        match->fields[field] = (command_span_t){ .offset = -1, .len = 0 };
+    }
+}
+
+static void set_field(parser_t *p, enum command_field field, int start)
+{
+    p->match->fields[field].offset = start;
+    p->match->fields[field].len = p->pos - start;
+}
+
+static void unset_field(parser_t *p, enum command_field field)
+{
+    p->match->fields[field].offset = -1;
+    p->match->fields[field].len = 0;
+}
+
+// sub-domain: буква или цифра, затем [\w-]*, последний символ - не дефис;
+// не короче двух символов
+static bool parse_subdomain(parser_t *p)
+{
+    int start = p->pos;
+    while (p->pos < p->len && (is_word(p->s[p->pos]) || p->s[p->pos] == '-'))
+    {
+        p->pos++;
+    }
+    if (p->pos - start < 2 || !is_word(p->s[start]) || !is_word(p->s[p->pos - 1]))
+    {
+        p->pos = start;
+        return false;
+    }
+    return true;
+}
+
+// Domain = sub-domain *("." sub-domain)
+static bool parse_domain(parser_t *p)
+{
+    if (!parse_subdomain(p))
+    {
+        return false;
+    }
+    while (peek(p) == '.')
+    {
+        int dot = p->pos;
+        p->pos++;
+        if (!parse_subdomain(p))
+        {
+            p->pos = dot;
+            break;
+        }
+    }
+    return true;
+}
+
+static bool parse_digits(parser_t *p, int max)
+{
+    int n = 0;
+    while (n < max && is_digit(peek(p)))
+    {
+        p->pos++;
+        n++;
+    }
+    return n > 0;
+}
+
+// IPv4-address-literal: 1*3DIGIT 3("." 1*3DIGIT)
+static bool parse_ipv4(parser_t *p)
+{
+    int start = p->pos;
+    for (int i = 0; i < 4; i++)
+    {
+        if ((i > 0 && !accept_char(p, '.')) || !parse_digits(p, 3))
+        {
+            p->pos = start;
+            return false;
+        }
+    }
+    return true;
+}
+
+// IPv6-full: 8 групп по 1-4 шестнадцатеричные цифры
+static bool parse_ipv6_full(parser_t *p)
+{
+    int start = p->pos;
+    for (int i = 0; i < 8; i++)
+    {
+        if (i > 0 && !accept_char(p, ':'))
+        {
+            p->pos = start;
+            return false;
+        }
+        int n = 0;
+        while (n < 4 && is_hex(peek(p)))
+        {
+            p->pos++;
+            n++;
+        }
+        if (n == 0)
+        {
+            p->pos = start;
+            return false;
+        }
+    }
+    return true;
+}
+
+// ( Domain / address-literal )
+static bool parse_domain_or_literal(parser_t *p)
+{
+    int start = p->pos;
+    if (parse_domain(p))
+    {
+        set_field(p, COMMAND_FIELD_DOMAIN, start);
+        return true;
+    }
+    if (!accept_char(p, '['))
+    {
+        return false;
+    }
+
+    int literal = p->pos;
+    if (parse_ipv4(p))
+    {
+        set_field(p, COMMAND_FIELD_IPV4, literal);
+        if (accept_char(p, ']'))
+        {
+            return true;
+        }
+        unset_field(p, COMMAND_FIELD_IPV4);
+        p->pos = literal;
+    }
+
+    if (accept_literal(p, "IPv6:"))
+    {
+        int address = p->pos;
+        if (parse_ipv6_full(p))
+        {
+            set_field(p, COMMAND_FIELD_IPV6, address);
+            set_field(p, COMMAND_FIELD_IPV6_LITERAL, literal);
+            if (accept_char(p, ']'))
+            {
+                return true;
+            }
+            unset_field(p, COMMAND_FIELD_IPV6);
+            unset_field(p, COMMAND_FIELD_IPV6_LITERAL);
+        }
+    }
+
+    p->pos = start;
+    return false;
+}
+
+// Local-part = Dot-string = Atom *("." Atom)
+static bool parse_localpart(parser_t *p)
+{
+    int start = p->pos;
+    if (!is_atext(peek(p)))
+    {
+        return false;
+    }
+    while (is_atext(peek(p)))
+    {
+        p->pos++;
+    }
+    while (peek(p) == '.' && p->pos + 1 < p->len && is_atext(p->s[p->pos + 1]))
+    {
+        p->pos++;
+        while (is_atext(peek(p)))
+        {
+            p->pos++;
+        }
+    }
+    set_field(p, COMMAND_FIELD_LOCALPART, start);
+    return true;
+}
+
+// Path = "<" Mailbox ">", Mailbox = Local-part "@" ( Domain / address-literal )
+static bool parse_path(parser_t *p)
+{
+    int start = p->pos;
+    if (accept_char(p, '<') && parse_localpart(p) && accept_char(p, '@')
+            && parse_domain_or_literal(p) && accept_char(p, '>'))
+    {
+        return true;
+    }
+    p->pos = start;
+    unset_field(p, COMMAND_FIELD_LOCALPART);
+    unset_field(p, COMMAND_FIELD_DOMAIN);
+    unset_field(p, COMMAND_FIELD_IPV4);
+    unset_field(p, COMMAND_FIELD_IPV6);
+    unset_field(p, COMMAND_FIELD_IPV6_LITERAL);
+    return false;
+}
+
+// RFC 1870: "SIZE=" 1*20DIGIT, ключевое слово - без учёта регистра
+static bool parse_size_param(parser_t *p)
+{
+    if (!accept_word_ci(p, "SIZE") || !accept_char(p, '='))
+    {
+        return false;
+    }
+    int start = p->pos;
+    while (is_digit(peek(p)))
+    {
+        p->pos++;
+    }
+    if (p->pos == start || p->pos - start > 20)
+    {
+        return false;
+    }
+    set_field(p, COMMAND_FIELD_SIZE, start);
+    return true;
+}
+
+// "MAIL FROM:" Reverse-path [SP "SIZE=" size], Reverse-path = Path / "<>"
+static bool parse_mail(parser_t *p)
+{
+    if (!accept_verb(p, "MAIL") || !accept_char(p, ' ') || !accept_verb(p, "FROM") || !accept_char(p, ':'))
+    {
+        return false;
+    }
+
+    int start = p->pos;
+    if (accept_char(p, '<') && accept_char(p, '>'))
+    {
+        set_field(p, COMMAND_FIELD_EMPTYRPATH, start);
+    }
+    else
+    {
+        p->pos = start;
+        if (!parse_path(p))
+        {
+            return false;
+        }
+        set_field(p, COMMAND_FIELD_RPATH, start);
+    }
+    set_field(p, COMMAND_FIELD_SENDER, start);
+    if (accept_char(p, ' ') && !parse_size_param(p))
+    {
+        return false;
+    }
+    return at_end(p);
+}
+
+// "RCPT TO:" ( "<Postmaster@" Domain ">" / "<Postmaster>" / Forward-path )
+static bool parse_rcpt(parser_t *p)
+{
+    if (!accept_verb(p, "RCPT") || !accept_char(p, ' ') || !accept_verb(p, "TO") || !accept_char(p, ':'))
+    {
+        return false;
+    }
+
+    int start = p->pos;
+    if (accept_char(p, '<') && accept_word_ci(p, "Postmaster"))
+    {
+        int after_postmaster = p->pos;
+        if (accept_char(p, '>') && at_end(p))
+        {
+            set_field(p, COMMAND_FIELD_THISPOSTMASTER, start);
+            set_field(p, COMMAND_FIELD_RECEPIENT, start);
+            return true;
+        }
+
+        p->pos = after_postmaster;
+        if (accept_char(p, '@') && parse_domain(p) && accept_char(p, '>') && at_end(p))
+        {
+            set_field(p, COMMAND_FIELD_OTHERPOSTMASTER, start);
+            set_field(p, COMMAND_FIELD_RECEPIENT, start);
+            return true;
+        }
+    }
+
+    p->pos = start;
+    if (!parse_path(p) || !at_end(p))
+    {
+        return false;
+    }
+    set_field(p, COMMAND_FIELD_FPATH, start);
+    set_field(p, COMMAND_FIELD_RECEPIENT, start);
+    return true;
+}
+
+// Глагол без параметров: "RSET", "QUIT", "DATA"
+static bool parse_bare(parser_t *p, const char *verb)
+{
+    return accept_verb(p, verb) && at_end(p);
+}
+
+// "HELO" SP Domain, "EHLO" SP ( Domain / address-literal )
+static bool parse_hello(parser_t *p, const char *verb, bool literal_allowed)
+{
+    if (!accept_verb(p, verb) || !is_space(peek(p)))
+    {
+        return false;
+    }
+    p->pos++;
+
+    int start = p->pos;
+    if (literal_allowed)
+    {
+        return parse_domain_or_literal(p) && at_end(p);
+    }
+    if (!parse_domain(p))
+    {
+        return false;
+    }
+    set_field(p, COMMAND_FIELD_DOMAIN, start);
+    return at_end(p);
+}
+
+// "VRFY" SP String: параметр - любая строка без перевода строки
+static bool parse_vrfy(parser_t *p)
+{
+    if (!accept_verb(p, "VRFY") || !is_space(peek(p)))
+    {
+        return false;
+    }
+    p->pos++;
+    while (p->pos < p->len && p->s[p->pos] != '\n')
+    {
+        p->pos++;
+    }
+    return at_end(p);
+}
+
+static bool parse_command(parser_t *p)
+{
+    // Глагол определяется по первым двум символам
+    char first = toupper((unsigned char)peek(p));
+    char second = p->len > 1 ? toupper((unsigned char)p->s[1]) : '\0';
+    switch (first)
+    {
+    case 'H':
+        p->match->command = CLIENT_HELO;
+        return parse_hello(p, "HELO", false);
+    case 'E':
+        p->match->command = CLIENT_EHLO;
+        return parse_hello(p, "EHLO", true);
+    case 'V':
+        p->match->command = CLIENT_VRFY;
+        return parse_vrfy(p);
+    case 'R':
+        if (second == 'S')
+        {
+            p->match->command = CLIENT_RSET;
+            return parse_bare(p, "RSET");
+        }
+        p->match->command = CLIENT_RCPTTO;
+        return parse_rcpt(p);
+    case 'Q':
+        p->match->command = CLIENT_QUIT;
+        return parse_bare(p, "QUIT");
+    case 'M':
+        p->match->command = CLIENT_MAILFROM;
+        return parse_mail(p);
+    case 'D':
+        p->match->command = CLIENT_DATA;
+        return parse_bare(p, "DATA");
+    case '.':
+        p->match->command = CLIENT_ENDDATA;
+        p->pos++;
+        return at_end(p);
+    default:
+        return false;
+    }
+}
+
+bool command_parse_line(const char *text, int len, command_match_t *match)
+{
+    parser_t p = { .s = text, .len = len, .pos = 0, .match = match };
+    match->text = text;
+    clear_fields(match);
+
+    if (!parse_command(&p))
+    {
+        match->command = CLIENT_UNKNOWN_COMMAND;
+        clear_fields(match);
+        return false;
+    }
+    return true;
+}
@@ -1,8 +1,9 @@
 #include "commands.h"
 #include "util.h"
 #include <assert.h>
+#include <stdlib.h>
 
-#define DEFINE_COMMAND(cmd, name, str) (command_regex_t){(cmd), (name), (PCRE2_SPTR)(str), NULL}
+#define DEFINE_COMMAND(cmd, name, str) (command_regex_t){(cmd), (name), (PCRE2_SPTR)(str), NULL, {0}}
 
 #define SUBDOMAIN "\\w(?:[\\w\\-]*\\w)"
 #define DOMAIN SUBDOMAIN "(?:\\." SUBDOMAIN ")*"
@@ -37,6 +38,24 @@
 
 static bool init_done = false;
 
+// Имена групп выражений, по #command_field
+static const char *field_names[COMMAND_FIELD_COUNT] =
+{
+    [COMMAND_FIELD_DOMAIN] = "domain",
+    [COMMAND_FIELD_IPV4] = "ipv4",
+    [COMMAND_FIELD_IPV6_LITERAL] = "ipv6_literal",
+    [COMMAND_FIELD_IPV6] = "ipv6",
+    [COMMAND_FIELD_LOCALPART] = "localpart",
+    [COMMAND_FIELD_SENDER] = "sender",
+    [COMMAND_FIELD_EMPTYRPATH] = "emptyrpath",
+    [COMMAND_FIELD_RPATH] = "rpath",
+    [COMMAND_FIELD_RECEPIENT] = "recepient",
+    [COMMAND_FIELD_THISPOSTMASTER] = "thispostmaster",
+    [COMMAND_FIELD_OTHERPOSTMASTER] = "otherpostmaster",
+    [COMMAND_FIELD_FPATH] = "fpath",
+    [COMMAND_FIELD_SIZE] = "size",
+};
+
 static command_regex_t client_commands[] =
 {
     // "HELO" SP domain
@@ -49,9 +68,10 @@ static command_regex_t client_commands[] =
     DEFINE_COMMAND(CLIENT_RSET, "RSET", "^(RSET|rset)$"),
     // "QUIT"
     DEFINE_COMMAND(CLIENT_QUIT, "QUIT", "^(QUIT|quit)$"),
-    // TODO: не распознаём Mail-Parameters
-    // "MAIL FROM:" Reverse-path [SP Mail-Parameters]
-    DEFINE_COMMAND(CLIENT_MAILFROM, "MAIL FROM", "^(MAIL|mail) (FROM|from):(?<sender>" REVERSEPATH ")$"),
+    // TODO: из Mail-Parameters распознаём только SIZE
+    // "MAIL FROM:" Reverse-path [SP Mail-Parameters], RFC 1870: "SIZE=" 1*20DIGIT
+    DEFINE_COMMAND(CLIENT_MAILFROM, "MAIL FROM",
+            "^(MAIL|mail) (FROM|from):(?<sender>" REVERSEPATH ")(?: (?i:SIZE)=(?<size>\\d{1,20}))?$"),
     // TODO: не рапспознаём Rcpt-parameters
     // "RCPT TO:" ("<Postmaster@" Domain ">" / "<Postmaster>"
     // / Forward-path ) [ SP Rcpt-parameters]
@@ -82,6 +102,20 @@ bool client_command_parser_init()
             pcre2_get_error_message(error_number, buffer, sizeof(buffer));
             printf("PCRE2 compilation of string %s failed at offset %d: %s\n",
                     cmd->pattern, (int)error_offset, buffer);
+            continue;
+        }
+
+        // Без поддержки JIT в сборке PCRE2 остаётся интерпретатор
+        int jit_result = pcre2_jit_compile(cmd->re, PCRE2_JIT_COMPLETE);
+        if (jit_result < 0 && jit_result != PCRE2_ERROR_JIT_BADOPTION)
+        {
+            printf("PCRE2 JIT compilation of %s failed: %d\n", cmd->name, jit_result);
+        }
+
+        for (int field = 0; field < COMMAND_FIELD_COUNT; field++)
+        {
+            int group = pcre2_substring_number_from_name(cmd->re, (PCRE2_SPTR)field_names[field]);
+            cmd->groups[field] = group > 0 ? group : 0;
         }
     }
     
@@ -113,14 +147,77 @@ void client_command_parser_free()
 }
 
 
-bool try_parse_message(message_t *message, command_regex_t *regex, command_match_t *match)
+static void clear_fields(command_match_t *match)
+{
+    for (int field = 0; field < COMMAND_FIELD_COUNT; field++)
+    {
+        match->fields[field] = (command_span_t){ .offset = -1, .len = 0 };
+    }
+}
+
+// Размер стека JIT: выражениям команд хватает начального, максимум - с запасом
+#define JIT_STACK_START (32 * 1024)
+#define JIT_STACK_MAX (512 * 1024)
+
+bool command_regex_context_init(command_regex_context_t *context)
+{
+    assert(init_done);
+    memset(context, 0, sizeof(*context));
+
+    context->match_context = pcre2_match_context_create(NULL);
+    context->jit_stack = pcre2_jit_stack_create(JIT_STACK_START, JIT_STACK_MAX, NULL);
+    if (!context->match_context || !context->jit_stack)
+    {
+        command_regex_context_free(context);
+        return false;
+    }
+    pcre2_jit_stack_assign(context->match_context, NULL, context->jit_stack);
+
+    int n = ARRAYNUM(client_commands);
+    for (int i = 0; i < n; i++)
+    {
+        context->match_data[i] = pcre2_match_data_create_from_pattern(client_commands[i].re, NULL);
+        if (!context->match_data[i])
+        {
+            command_regex_context_free(context);
+            return false;
+        }
+    }
+    return true;
+}
+
+void command_regex_context_free(command_regex_context_t *context)
+{
+    int n = ARRAYNUM(client_commands);
+    for (int i = 0; i < n; i++)
+    {
+        pcre2_match_data_free(context->match_data[i]);
+        context->match_data[i] = NULL;
+    }
+    pcre2_match_context_free(context->match_context);
+    pcre2_jit_stack_free(context->jit_stack);
+    context->match_context = NULL;
+    context->jit_stack = NULL;
+}
+
+bool try_parse_message(message_t *message, command_regex_t *regex, command_regex_context_t *context,
+        command_match_t *match)
 {
     assert(message && regex && match);
-    assert(!match->match_data);
-    pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(regex->re, NULL); 
+    pcre2_match_data *match_data;
+    pcre2_match_context *match_context = NULL;
+    if (context)
+    {
+        match_data = context->match_data[regex - client_commands];
+        match_context = context->match_context;
+    }
+    else
+    {
+        match_data = pcre2_match_data_create_from_pattern(regex->re, NULL); 
+    }
     
     int result = pcre2_match(regex->re, (PCRE2_SPTR)message->text, message->len,
-            0, 0, match_data, NULL);
+            0, 0, match_data, match_context);
 
     if (result < 0)
     {
@@ -131,67 +228,151 @@ bool try_parse_message(message_t *message, command_regex_t *regex, command_match
             pcre2_get_error_message(result, (PCRE2_UCHAR*)buf, 1024);
             printf("PCRE2 ERROR: %s\n", buf);
         }
-        pcre2_match_data_free(match_data);
-        match->match_data = NULL;
+        if (!context)
+        {
+            pcre2_match_data_free(match_data);
+        }
         match->command = CLIENT_UNKNOWN_COMMAND;
         return false;
     }
     
-    match->match_data = match_data;
+    // Переносим группы в поля, после чего данные совпадения не нужны
+    PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
+    clear_fields(match);
+    for (int field = 0; field < COMMAND_FIELD_COUNT; field++)
+    {
+        int group = regex->groups[field];
+        if (group > 0 && group < result && ovector[2 * group] != PCRE2_UNSET)
+        {
+            match->fields[field].offset = ovector[2 * group];
+            match->fields[field].len = ovector[2 * group + 1] - ovector[2 * group];
+        }
+    }
+    if (!context)
+    {
+        pcre2_match_data_free(match_data);
+    }
+
+    match->text = message->text;
     match->command = regex->command;
 
     return true; 
 } 
 
-command_match_t client_command_parse_message(message_t *message)
+// Выражения команд привязаны к началу строки и начинаются с глагола,
+// поэтому строке может соответствовать только одно из них
+static enum smtp_client_command command_by_verb(message_t *message)
+{
+    if (message->len < 1)
+    {
+        return CLIENT_UNKNOWN_COMMAND;
+    }
+    switch (message->text[0])
+    {
+    case 'H': case 'h': return CLIENT_HELO;
+    case 'E': case 'e': return CLIENT_EHLO;
+    case 'V': case 'v': return CLIENT_VRFY;
+    case 'Q': case 'q': return CLIENT_QUIT;
+    case 'M': case 'm': return CLIENT_MAILFROM;
+    case 'D': case 'd': return CLIENT_DATA;
+    case '.': return CLIENT_ENDDATA;
+    case 'R': case 'r':
+        if (message->len > 1 && (message->text[1] == 'S' || message->text[1] == 's'))
+        {
+            return CLIENT_RSET;
+        }
+        return CLIENT_RCPTTO;
+    default:
+        return CLIENT_UNKNOWN_COMMAND;
+    }
+}
+
+command_match_t client_command_parse_message_regex(message_t *message, command_regex_context_t *context)
 {
     command_match_t match = {0}; 
+    match.command = CLIENT_UNKNOWN_COMMAND;
+    clear_fields(&match);
 
+    enum smtp_client_command candidate = command_by_verb(message);
     int n = ARRAYNUM(client_commands);
-    for (int i = 0; i < n; i++)
+    for (int i = 0; i < n && candidate != CLIENT_UNKNOWN_COMMAND; i++)
     {
         command_regex_t *command = client_commands + i;
-        bool success = try_parse_message(message, command, &match);
-
-        if (success)
+        if (command->command == candidate)
         {
-            return match;
+            try_parse_message(message, command, context, &match);
+            break;
         }
     }
 
-    match.command = CLIENT_UNKNOWN_COMMAND;
-    match.match_data = NULL;
     return match;
 }
 
+command_match_t client_command_parse_message(message_t *message, command_regex_context_t *context)
+{
+#ifdef USE_PCRE_PARSER
+    return client_command_parse_message_regex(message, context);
+#else
+    (void)context;
+    command_match_t match;
+    command_parse_line(message->text, message->len, &match);
+    return match;
+#endif
+}
+
+static int find_field(const char *name)
+{
+    for (int field = 0; field < COMMAND_FIELD_COUNT; field++)
+    {
+        if (strcmp(field_names[field], name) == 0)
+        {
+            return field;
+        }
+    }
+    return -1;
+}
+
+bool command_get_field(command_match_t *match, enum command_field field, const char **str, int *len)
+{
+    command_span_t span = match->fields[field];
+    if (match->command == CLIENT_UNKNOWN_COMMAND || span.offset < 0)
+    {
+        return false;
+    }
+    *str = match->text + span.offset;
+    *len = span.len;
+    return true;
+}
+
 bool command_has_substring(command_match_t *match, const char *name)
 {
-    PCRE2_SIZE size;
-    int result = pcre2_substring_length_byname(match->match_data, (PCRE2_SPTR)name, &size);
-    return result >= 0 && size > 0;
+    const char *str;
+    int len;
+    int field = find_field(name);
+    return field >= 0 && command_get_field(match, field, &str, &len) && len > 0;
 }
 
 bool command_get_substring(command_match_t *match, const char *name, char **buffer, int *buflen)
 {
-    PCRE2_SIZE size;
-    int result = pcre2_substring_get_byname(match->match_data, (PCRE2_SPTR)name, (PCRE2_UCHAR**)buffer, &size);
-    if (result < 0)
+    const char *str;
+    int len;
+    int field = find_field(name);
+    if (field < 0 || !command_get_field(match, field, &str, &len))
     {
         return false;
     }
-    *buflen = size;
+    *buffer = strndup(str, len);
+    *buflen = len;
     return true;
 }
 
 void command_free_substring(const char *substring)
 {
-    pcre2_substring_free((PCRE2_UCHAR*)substring);
+    free((char*)substring);
 }
 
 
 void command_match_free(command_match_t *match)
 {
     match->command = CLIENT_UNKNOWN_COMMAND;
-    pcre2_match_data_free(match->match_data);
-    match->match_data = NULL;
-}
\ No newline at end of file
+}
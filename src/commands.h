@@ -32,6 +32,43 @@ typedef enum smtp_client_command
     CLIENT_COMMAND_COUNT
 } smtp_client_command;
 
+/**
+ * Поля, которые можно извлечь из команды клиента.
+ * Имена полей совпадают с именами групп в регулярных выражениях.
+ */
+enum command_field
+{
+    COMMAND_FIELD_DOMAIN,
+    COMMAND_FIELD_IPV4,
+    COMMAND_FIELD_IPV6_LITERAL,
+    COMMAND_FIELD_IPV6,
+    COMMAND_FIELD_LOCALPART,
+    COMMAND_FIELD_SENDER,
+    COMMAND_FIELD_EMPTYRPATH,
+    COMMAND_FIELD_RPATH,
+    COMMAND_FIELD_RECEPIENT,
+    COMMAND_FIELD_THISPOSTMASTER,
+    COMMAND_FIELD_OTHERPOSTMASTER,
+    COMMAND_FIELD_FPATH,
+    COMMAND_FIELD_SIZE,
+    COMMAND_FIELD_COUNT
+};
+
+/**
+ * Положение поля в строке команды
+ */
+typedef struct command_span_t
+{
+    /**
+     * Смещение от начала строки, -1 если поля нет
+     */
+    int offset;
+    /**
+     * Длина поля
+     */
+    int len;
+} command_span_t;
+
 /**
  * Описание одной команды
  */
@@ -53,12 +90,39 @@ typedef struct command_regex_t
      * Скомпилированный код выражения
      */
     pcre2_code *re;
+    /**
+     * Номера групп выражения для каждого #command_field (0 - группы нет)
+     */
+    int groups[COMMAND_FIELD_COUNT];
 } command_regex_t;
 
 
 /**
- * "Совпадение" строчки по регулярному выражению.
- * Позволяет вытащить нужную информацию в подстроку.
+ * Ресурсы регулярных выражений одного потока: стек JIT и заранее
+ * созданные блоки данных совпадения. PCRE2 не позволяет использовать их
+ * из нескольких потоков одновременно, поэтому у каждого рабочего потока
+ * свой контекст.
+ */
+typedef struct command_regex_context_t
+{
+    /**
+     * Стек для JIT-кода выражений
+     */
+    pcre2_jit_stack *jit_stack;
+    /**
+     * Контекст сопоставления, к которому привязан @a jit_stack
+     */
+    pcre2_match_context *match_context;
+    /**
+     * Данные совпадения для каждого выражения команды
+     */
+    pcre2_match_data *match_data[CLIENT_COMMAND_COUNT];
+} command_regex_context_t;
+
+/**
+ * Результат разбора строки команды.
+ * Поля хранятся как смещения в исходной строке и действительны, пока
+ * жива строка.
  */
 typedef struct command_match_t
 {
@@ -67,9 +131,13 @@ typedef struct command_match_t
      */
     enum smtp_client_command command;
     /**
-     * Данные о совпадении
+     * Разобранная строка
+     */
+    const char *text;
+    /**
+     * Положения полей команды, по #command_field
      */
-    pcre2_match_data *match_data;
+    command_span_t fields[COMMAND_FIELD_COUNT];
 } command_match_t;
 
 
@@ -81,22 +149,47 @@ bool client_command_parser_init();
  * Деинициализации стуктуры парсинга команд клиента
  */
 void client_command_parser_free();
+/**
+ * Создаёт ресурсы регулярных выражений для текущего потока.
+ * Вызывается после #client_command_parser_init.
+ */
+bool command_regex_context_init(command_regex_context_t *context);
+/**
+ * Освобождает ресурсы, созданные #command_regex_context_init
+ */
+void command_regex_context_free(command_regex_context_t *context);
 /**
  * Попытка распарсить сообщение \p message с помощью описания
  * команды \p regex с записью результата в \p match.
+ * Если \p context равен NULL, данные совпадения создаются на время вызова.
  * В случае успеха \p match нужно освободить с помощью
  * #command_match_free
  * \returns true, если команда совпала, false иначе.
  */
 bool try_parse_message(message_t *message, command_regex_t *regex, 
-        command_match_t *match);
+        command_regex_context_t *context, command_match_t *match);
 /**
  * Парсинг сообщения \p message, полученного от клиента.
+ * По умолчанию используется рукописный разборщик (#command_parse_line),
+ * при сборке с USE_PCRE_PARSER=y - регулярные выражения.
  * \returns совпадение с установленным типом команды.
  * В случае неудачи тип будет #CLIENT_UNKNOWN_COMMAND 
  * Возвращённое значение следует освободить с помощью #command_match_free.
  */
-command_match_t client_command_parse_message(message_t *message);
+command_match_t client_command_parse_message(message_t *message, command_regex_context_t *context);
+/**
+ * Парсинг сообщения \p message регулярными выражениями. По первым
+ * символам глагола выбирается единственное выражение, которое может
+ * совпасть. \p context - ресурсы потока или NULL.
+ */
+command_match_t client_command_parse_message_regex(message_t *message, command_regex_context_t *context);
+/**
+ * Разбор строки \p text длины \p len рукописным разборщиком грамматики
+ * RFC 5321. Не выделяет память. Принимает ровно те же строки и выделяет
+ * те же поля, что и регулярные выражения команд.
+ * \returns true, если команда распознана
+ */
+bool command_parse_line(const char *text, int len, command_match_t *match);
 /**
  * Освобождение данных совпадения.
  */
@@ -105,6 +198,11 @@ void command_match_free(command_match_t *match);
  * Проверка, есть ли в совпадении \p match группа с именем \p name
  */
 bool command_has_substring(command_match_t *match, const char *name);
+/**
+ * Получение поля \p field совпадения \p match без копирования.
+ * \returns true, если поле есть; \p str указывает в разобранную строку
+ */
+bool command_get_field(command_match_t *match, enum command_field field, const char **str, int *len);
 /**
  * Получение подстроки в совпадении \p match с именем \name
  * \param buffer Возвращённый буфер
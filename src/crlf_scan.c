@@ -0,0 +1,24 @@
+#include "crlf_scan.h"
+#include <string.h>
+
+int crlf_find(const char *data, int from, int len)
+{
+    // Одиночные '\n' в почте редки, поэтому проверка предыдущего символа
+    // почти всегда срабатывает с первого раза
+    int pos = from + 1;
+    while (pos < len)
+    {
+        const char *lf = memchr(data + pos, '\n', len - pos);
+        if (!lf)
+        {
+            return -1;
+        }
+        pos = lf - data;
+        if (data[pos - 1] == '\r')
+        {
+            return pos - 1;
+        }
+        pos++;
+    }
+    return -1;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+/**
+ * @file
+ * @brief Поиск конца строки "\r\n" в приёмном буфере
+ *
+ * Ищется '\n' через memchr, затем проверяется предыдущий символ: glibc
+ * уже выбирает векторную реализацию memchr под процессор, и на
+ * bench/crlf_bench собственные SSE2/AVX2-циклы её не обгоняли.
+ */
+
+/**
+ * Ищет первую пару "\r\n", начинающуюся в \p data не раньше \p from.
+ * \param len Длина буфера \p data
+ * \returns индекс '\r' найденной пары или -1
+ */
+int crlf_find(const char *data, int from, int len);
@@ -0,0 +1,67 @@
+#include "data_stream.h"
+#include <string.h>
+#include "crlf_scan.h"
+
+
+void data_stream_reset(data_stream_t *stream)
+{
+    // Тело начинается сразу после "DATA\r\n"
+    stream->line_start = true;
+}
+
+int data_stream_decode(data_stream_t *stream, char *data, int len, int *consumed, bool *finished)
+{
+    int in = 0;
+    int out = 0;
+    *finished = false;
+
+    while (in < len)
+    {
+        if (stream->line_start && data[in] == '.')
+        {
+            // Чтобы отличить конец письма от экранированной строки,
+            // нужно видеть ещё два байта
+            if (in + 1 >= len || (data[in + 1] == '\r' && in + 2 >= len))
+            {
+                break;
+            }
+            if (data[in + 1] == '\r' && data[in + 2] == '\n')
+            {
+                in += 3;
+                *finished = true;
+                break;
+            }
+            // Точка в начале строки экранирующая, отбрасываем её
+            in++;
+        }
+        stream->line_start = false;
+
+        // Копируем до конца строки целиком
+        int end;
+        int cr = crlf_find(data, in, len);
+        if (cr >= 0)
+        {
+            end = cr + 2;
+            stream->line_start = true;
+        }
+        else
+        {
+            // '\r' в конце может оказаться началом "\r\n"
+            end = data[len - 1] == '\r' ? len - 1 : len;
+            if (end == in)
+            {
+                break;
+            }
+        }
+
+        if (out != in)
+        {
+            memmove(data + out, data + in, end - in);
+        }
+        out += end - in;
+        in = end;
+    }
+
+    *consumed = in;
+    return out;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdbool.h>
+
+/**
+ * @file
+ * @brief Потоковый приём тела письма после DATA
+ *
+ * Тело не разбивается на строки: принятые байты целиком передаются
+ * в файл письма. По пути снимается экранирование точкой (RFC 5321, 4.5.2)
+ * и ищется завершающая последовательность "\r\n.\r\n". Обе могут быть
+ * разрезаны границей чтения.
+ */
+
+/**
+ * Состояние разбора тела письма
+ */
+typedef struct data_stream_t
+{
+    /**
+     * Следующий байт начинает новую строку
+     */
+    bool line_start;
+} data_stream_t;
+
+/**
+ * Готовит \p stream к приёму нового письма
+ */
+void data_stream_reset(data_stream_t *stream);
+
+/**
+ * Разбирает \p len байт тела письма в \p data на месте: тело без
+ * экранирующих точек записывается в начало \p data.
+ *
+ * Незавершённый хвост (одиночные '\r', "." или ".\r" в начале строки)
+ * не потребляется: его нужно передать повторно вместе со следующими байтами.
+ *
+ * \param consumed Сюда записывается количество потреблённых байт
+ * (вместе с завершающей точкой, если она найдена)
+ * \param finished Сюда записывается true, если найден конец письма
+ * \returns длина разобранного тела в начале \p data
+ */
+int data_stream_decode(data_stream_t *stream, char *data, int len, int *consumed, bool *finished);
@@ -21,8 +21,8 @@ void dynamic_vector_copy_elem_back(dynamic_vector_t *vector, const void *data)
 
 void dynamic_vector_copy_back(dynamic_vector_t *vector, const void *data, int size)
 {
-    int vec_capacity = vector->capacity;
-    while (vec_capacity-size < size)
+    int vec_capacity = vector->capacity > 0 ? vector->capacity : 1;
+    while (vec_capacity - vector->size < size)
     {
         vec_capacity *= 2;
     }
@@ -0,0 +1,706 @@
+#include "log_binary.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "logger.h"
+
+static const char *level_names[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR" };
+
+enum arg_kind
+{
+    ARG_NONE,
+    ARG_SIGNED,
+    ARG_UNSIGNED,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+};
+
+enum arg_length
+{
+    LENGTH_DEFAULT,
+    LENGTH_CHAR,
+    LENGTH_SHORT,
+    LENGTH_LONG,
+    LENGTH_LONG_LONG,
+    LENGTH_SIZE,
+    LENGTH_PTRDIFF,
+    LENGTH_LONG_DOUBLE,
+};
+
+/**
+ * Преобразование строки формата: %[флаги][ширина][.точность][длина]символ
+ */
+typedef struct conversion_t
+{
+    /**
+     * '%' преобразования или конец строки, если преобразований больше нет
+     */
+    const char *start;
+    char flags[8];
+    /**
+     * -1 - не задана
+     */
+    int width;
+    bool width_star;
+    int precision;
+    bool precision_star;
+    enum arg_length length;
+    char symbol;
+    enum arg_kind kind;
+} conversion_t;
+
+const char *log_level_name(int level)
+{
+    if (level < LOG_LEVEL_TRACE || level > LOG_LEVEL_ERROR)
+    {
+        return "?";
+    }
+    return level_names[level];
+}
+
+int log_format_prefix(char *out, int size, const char *thread, const char *timestamp,
+        int level, const char *file, int line)
+{
+    return snprintf(out, size, "[%s] %s %s %s:%d ", thread, timestamp, log_level_name(level), file, line);
+}
+
+static int parse_number(const char **p)
+{
+    int value = 0;
+    while (**p >= '0' && **p <= '9')
+    {
+        value = value * 10 + (**p - '0');
+        (*p)++;
+    }
+    return value;
+}
+
+// Находит следующее преобразование, возвращает указатель за ним
+static const char *next_conversion(const char *p, conversion_t *conv)
+{
+    *conv = (conversion_t){ .width = -1, .precision = -1 };
+    p = strchrnul(p, '%');
+    conv->start = p;
+    if (*p == '\0')
+    {
+        return p;
+    }
+    p++;
+
+    int flags = 0;
+    while (*p && strchr("-+ #0'", *p) && flags < (int)sizeof(conv->flags) - 1)
+    {
+        conv->flags[flags++] = *p++;
+    }
+
+    if (*p == '*')
+    {
+        conv->width_star = true;
+        p++;
+    }
+    else if (*p >= '0' && *p <= '9')
+    {
+        conv->width = parse_number(&p);
+    }
+
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            conv->precision_star = true;
+            p++;
+        }
+        else
+        {
+            conv->precision = parse_number(&p);
+        }
+    }
+
+    switch (*p)
+    {
+    case 'h':
+        p++;
+        conv->length = LENGTH_SHORT;
+        if (*p == 'h')
+        {
+            p++;
+            conv->length = LENGTH_CHAR;
+        }
+        break;
+    case 'l':
+        p++;
+        conv->length = LENGTH_LONG;
+        if (*p == 'l')
+        {
+            p++;
+            conv->length = LENGTH_LONG_LONG;
+        }
+        break;
+    case 'q':
+    case 'j':
+        p++;
+        conv->length = LENGTH_LONG_LONG;
+        break;
+    case 'z':
+        p++;
+        conv->length = LENGTH_SIZE;
+        break;
+    case 't':
+        p++;
+        conv->length = LENGTH_PTRDIFF;
+        break;
+    case 'L':
+        p++;
+        conv->length = LENGTH_LONG_DOUBLE;
+        break;
+    default:
+        break;
+    }
+
+    conv->symbol = *p;
+    switch (*p)
+    {
+    case 'd':
+    case 'i':
+    case 'c':
+        conv->kind = ARG_SIGNED;
+        break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        conv->kind = ARG_UNSIGNED;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        conv->kind = ARG_DOUBLE;
+        break;
+    case 's':
+        conv->kind = ARG_STRING;
+        break;
+    case 'p':
+        conv->kind = ARG_POINTER;
+        break;
+    default:
+        // "%%" и неизвестные преобразования аргументов не берут
+        conv->kind = ARG_NONE;
+        break;
+    }
+
+    return *p ? p + 1 : p;
+}
+
+typedef struct writer_t
+{
+    char *out;
+    int size;
+    int pos;
+} writer_t;
+
+static bool put(writer_t *w, const void *data, int len)
+{
+    if (w->pos + len > w->size)
+    {
+        return false;
+    }
+    memcpy(w->out + w->pos, data, len);
+    w->pos += len;
+    return true;
+}
+
+static bool put_int(writer_t *w, int64_t value)
+{
+    return put(w, &value, sizeof(value));
+}
+
+static int64_t take_signed(enum arg_length length, va_list *args)
+{
+    switch (length)
+    {
+    case LENGTH_CHAR:
+        return (signed char)va_arg(*args, int);
+    case LENGTH_SHORT:
+        return (short)va_arg(*args, int);
+    case LENGTH_LONG:
+        return va_arg(*args, long);
+    case LENGTH_LONG_LONG:
+        return va_arg(*args, long long);
+    case LENGTH_SIZE:
+        return va_arg(*args, ssize_t);
+    case LENGTH_PTRDIFF:
+        return va_arg(*args, ptrdiff_t);
+    default:
+        return va_arg(*args, int);
+    }
+}
+
+static uint64_t take_unsigned(enum arg_length length, va_list *args)
+{
+    switch (length)
+    {
+    case LENGTH_CHAR:
+        return (unsigned char)va_arg(*args, unsigned int);
+    case LENGTH_SHORT:
+        return (unsigned short)va_arg(*args, unsigned int);
+    case LENGTH_LONG:
+        return va_arg(*args, unsigned long);
+    case LENGTH_LONG_LONG:
+        return va_arg(*args, unsigned long long);
+    case LENGTH_SIZE:
+        return va_arg(*args, size_t);
+    case LENGTH_PTRDIFF:
+        return va_arg(*args, ptrdiff_t);
+    default:
+        return va_arg(*args, unsigned int);
+    }
+}
+
+static bool put_string(writer_t *w, const char *s, int precision)
+{
+    uint16_t len = LOG_NULL_STRING;
+    if (!s)
+    {
+        return put(w, &len, sizeof(len));
+    }
+
+    size_t full = precision >= 0 ? strnlen(s, precision) : strlen(s);
+    int space = w->size - w->pos - (int)sizeof(len);
+    if (space < 0)
+    {
+        return false;
+    }
+    if (full > (size_t)space)
+    {
+        full = space;
+    }
+    if (full >= LOG_NULL_STRING)
+    {
+        full = LOG_NULL_STRING - 1;
+    }
+    len = full;
+    return put(w, &len, sizeof(len)) && put(w, s, len);
+}
+
+static bool put_argument(writer_t *w, conversion_t *conv, va_list *args)
+{
+    if (conv->width_star && !put_int(w, va_arg(*args, int)))
+    {
+        return false;
+    }
+    if (conv->precision_star)
+    {
+        conv->precision = va_arg(*args, int);
+        if (!put_int(w, conv->precision))
+        {
+            return false;
+        }
+    }
+
+    switch (conv->kind)
+    {
+    case ARG_SIGNED:
+        return put_int(w, take_signed(conv->length, args));
+    case ARG_UNSIGNED:
+        return put_int(w, take_unsigned(conv->length, args));
+    case ARG_DOUBLE:
+    {
+        double value = conv->length == LENGTH_LONG_DOUBLE ? (double)va_arg(*args, long double)
+                                                          : va_arg(*args, double);
+        return put(w, &value, sizeof(value));
+    }
+    case ARG_POINTER:
+        return put_int(w, (uintptr_t)va_arg(*args, void*));
+    case ARG_STRING:
+        return put_string(w, va_arg(*args, const char*), conv->precision);
+    default:
+        return true;
+    }
+}
+
+static int encode(char *out, int size, uint16_t event, uint16_t thread, uint64_t timestamp,
+        const char *format, va_list *args)
+{
+    log_record_header_t header = { .event = event, .thread = thread, .timestamp = timestamp };
+    writer_t w = { .out = out, .size = size < UINT16_MAX ? size : UINT16_MAX, .pos = sizeof(header) };
+
+    const char *p = format;
+    conversion_t conv;
+    while (true)
+    {
+        p = next_conversion(p, &conv);
+        if (conv.start[0] == '\0' || !put_argument(&w, &conv, args))
+        {
+            break;
+        }
+    }
+
+    header.size = w.pos;
+    memcpy(out, &header, sizeof(header));
+    return w.pos;
+}
+
+int log_encode_record(char *out, int size, uint16_t event, uint16_t thread, uint64_t timestamp,
+        const char *format, va_list args)
+{
+    va_list copy;
+    va_copy(copy, args);
+    int len = encode(out, size, event, thread, timestamp, format, &copy);
+    va_end(copy);
+    return len;
+}
+
+int log_encode_special(char *out, int size, uint16_t event, uint16_t thread, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = encode(out, size, event, thread, 0, format, &args);
+    va_end(args);
+    return len;
+}
+
+typedef struct reader_t
+{
+    const char *data;
+    int len;
+    int pos;
+} reader_t;
+
+static bool take(reader_t *r, void *value, int len)
+{
+    if (r->pos + len > r->len)
+    {
+        return false;
+    }
+    memcpy(value, r->data + r->pos, len);
+    r->pos += len;
+    return true;
+}
+
+static bool take_int(reader_t *r, int64_t *value)
+{
+    return take(r, value, sizeof(*value));
+}
+
+// Строка аргумента: указатель в запись, NULL для LOG_NULL_STRING
+static bool take_string(reader_t *r, const char **s, int *len)
+{
+    uint16_t l;
+    if (!take(r, &l, sizeof(l)))
+    {
+        return false;
+    }
+    if (l == LOG_NULL_STRING)
+    {
+        *s = NULL;
+        *len = 0;
+        return true;
+    }
+    if (r->pos + l > r->len)
+    {
+        return false;
+    }
+    *s = r->data + r->pos;
+    *len = l;
+    r->pos += l;
+    return true;
+}
+
+typedef struct text_t
+{
+    char *out;
+    int size;
+    int len;
+} text_t;
+
+static void append(text_t *t, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(text_t *t, const char *format, ...)
+{
+    if (t->len >= t->size - 1)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(t->out + t->len, t->size - t->len, format, args);
+    va_end(args);
+    t->len += n < t->size - t->len ? n : t->size - t->len - 1;
+}
+
+// Собирает преобразование заново: звёздочки уже вычислены, длина своя
+static void build_spec(char *spec, int size, const conversion_t *conv, int64_t width, int64_t precision,
+        const char *length, char symbol)
+{
+    int n = snprintf(spec, size, "%%%s", conv->flags);
+    // Отрицательная ширина из '*' даёт флаг '-', как у printf
+    if (width >= 0 || conv->width_star)
+    {
+        n += snprintf(spec + n, size - n, "%d", (int)width);
+    }
+    if (precision >= 0)
+    {
+        n += snprintf(spec + n, size - n, ".%d", (int)precision);
+    }
+    snprintf(spec + n, size - n, "%s%c", length, symbol);
+}
+
+static bool render_argument(text_t *t, const conversion_t *conv, reader_t *r)
+{
+    int64_t width = conv->width;
+    int64_t precision = conv->precision;
+    if (conv->width_star && !take_int(r, &width))
+    {
+        return false;
+    }
+    if (conv->precision_star && !take_int(r, &precision))
+    {
+        return false;
+    }
+
+    char spec[32];
+    switch (conv->kind)
+    {
+    case ARG_SIGNED:
+    case ARG_UNSIGNED:
+    {
+        int64_t value;
+        if (!take_int(r, &value))
+        {
+            return false;
+        }
+        if (conv->symbol == 'c')
+        {
+            build_spec(spec, sizeof(spec), conv, width, -1, "", 'c');
+            append(t, spec, (int)value);
+        }
+        else
+        {
+            build_spec(spec, sizeof(spec), conv, width, precision, "ll", conv->symbol);
+            if (conv->kind == ARG_SIGNED)
+            {
+                append(t, spec, (long long)value);
+            }
+            else
+            {
+                append(t, spec, (unsigned long long)value);
+            }
+        }
+        return true;
+    }
+    case ARG_DOUBLE:
+    {
+        double value;
+        if (!take(r, &value, sizeof(value)))
+        {
+            return false;
+        }
+        build_spec(spec, sizeof(spec), conv, width, precision, "", conv->symbol);
+        append(t, spec, value);
+        return true;
+    }
+    case ARG_POINTER:
+    {
+        int64_t value;
+        if (!take_int(r, &value))
+        {
+            return false;
+        }
+        build_spec(spec, sizeof(spec), conv, width, -1, "", 'p');
+        append(t, spec, (void*)(uintptr_t)value);
+        return true;
+    }
+    case ARG_STRING:
+    {
+        const char *s;
+        int len;
+        if (!take_string(r, &s, &len))
+        {
+            return false;
+        }
+        // Строка уже обрезана точностью при записи
+        build_spec(spec, sizeof(spec), conv, width, -1, ".*", 's');
+        append(t, spec, s ? len : (precision < 0 || precision >= 6 ? 6 : 0), s ? s : "(null)");
+        return true;
+    }
+    default:
+        if (conv->symbol == '%')
+        {
+            append(t, "%%");
+        }
+        return true;
+    }
+}
+
+static void render(text_t *t, const char *format, reader_t *r)
+{
+    const char *p = format;
+    conversion_t conv;
+    while (true)
+    {
+        const char *next = next_conversion(p, &conv);
+        append(t, "%.*s", (int)(conv.start - p), p);
+        if (conv.start[0] == '\0' || !render_argument(t, &conv, r))
+        {
+            return;
+        }
+        p = next;
+    }
+}
+
+void log_decoder_init(log_decoder_t *decoder)
+{
+    decoder->events = dynamic_vector_create(sizeof(log_event_t), 64);
+    decoder->threads = dynamic_vector_create(16, 16);
+    decoder->microseconds = false;
+}
+
+static void forget_events(log_decoder_t *decoder)
+{
+    log_event_t *events = decoder->events.data;
+    for (int i = 0; i < decoder->events.size; i++)
+    {
+        free((char*)events[i].file);
+        free((char*)events[i].format);
+    }
+    dynamic_vector_clear(&decoder->events);
+    dynamic_vector_clear(&decoder->threads);
+}
+
+void log_decoder_close(log_decoder_t *decoder)
+{
+    forget_events(decoder);
+    dynamic_vector_close(&decoder->events);
+    dynamic_vector_close(&decoder->threads);
+}
+
+static void describe_event(log_decoder_t *decoder, reader_t *r)
+{
+    int64_t id, level, line;
+    const char *file, *format;
+    int file_len, format_len;
+    if (!take_int(r, &id) || !take_int(r, &level) || !take_int(r, &line)
+            || !take_string(r, &file, &file_len) || !take_string(r, &format, &format_len)
+            || !file || !format || id < 0 || id >= LOG_EVENT_START)
+    {
+        return;
+    }
+
+    log_event_t empty = {};
+    while (decoder->events.size <= id)
+    {
+        dynamic_vector_copy_elem_back(&decoder->events, &empty);
+    }
+    log_event_t *event = (log_event_t*)decoder->events.data + id;
+    free((char*)event->file);
+    free((char*)event->format);
+    event->file = strndup(file, file_len);
+    event->format = strndup(format, format_len);
+    event->line = line;
+    event->level = level;
+}
+
+static void name_thread(log_decoder_t *decoder, int thread, reader_t *r)
+{
+    const char *name;
+    int len;
+    if (!take_string(r, &name, &len) || !name)
+    {
+        return;
+    }
+
+    char empty[16] = "?";
+    while (decoder->threads.size <= thread)
+    {
+        dynamic_vector_copy_elem_back(&decoder->threads, empty);
+    }
+    char *slot = (char*)decoder->threads.data + thread * 16;
+    snprintf(slot, 16, "%.*s", len, name);
+}
+
+int log_decode_record(log_decoder_t *decoder, const char *data, int len, char *out, int size,
+        int *out_len)
+{
+    log_record_header_t header;
+    if (len < (int)sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.size < sizeof(header))
+    {
+        return -1;
+    }
+    if (header.size > len)
+    {
+        return 0;
+    }
+
+    reader_t r = { .data = data, .len = header.size, .pos = sizeof(header) };
+    // Последний байт оставлен под перевод строки
+    text_t t = { .out = out, .size = size - 1, .len = 0 };
+    *out_len = 0;
+
+    switch (header.event)
+    {
+    case LOG_EVENT_START:
+        forget_events(decoder);
+        return header.size;
+    case LOG_EVENT_DESCRIPTION:
+        describe_event(decoder, &r);
+        return header.size;
+    case LOG_EVENT_THREAD_NAME:
+        name_thread(decoder, header.thread, &r);
+        return header.size;
+    case LOG_EVENT_DROPPED:
+        render(&t, LOG_DROPPED_FORMAT, &r);
+        *out_len = t.len;
+        return header.size;
+    default:
+        break;
+    }
+
+    const char *thread = header.thread < decoder->threads.size
+        ? (char*)decoder->threads.data + header.thread * 16 : "?";
+
+    char timebuf[32];
+    struct tm tm;
+    time_t seconds = header.timestamp / 1000000000ULL;
+    int time_len = strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm));
+    if (decoder->microseconds)
+    {
+        snprintf(timebuf + time_len, sizeof(timebuf) - time_len, ".%06d",
+            (int)(header.timestamp % 1000000000ULL / 1000));
+    }
+
+    log_event_t *event = header.event < decoder->events.size
+        ? (log_event_t*)decoder->events.data + header.event : NULL;
+    if (!event || !event->format)
+    {
+        append(&t, "[%s] %s ? ?:0 UNKNOWN EVENT %d", thread, timebuf, (int)header.event);
+    }
+    else
+    {
+        t.len = log_format_prefix(out, t.size, thread, timebuf, event->level, event->file, event->line);
+        if (t.len >= t.size)
+        {
+            t.len = t.size - 1;
+        }
+        render(&t, event->format, &r);
+    }
+
+    out[t.len++] = '\n';
+    *out_len = t.len;
+    return header.size;
+}
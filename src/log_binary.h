@@ -0,0 +1,147 @@
+#pragma once
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dynamic_vector.h"
+
+/**
+ * @file
+ * @brief Двоичный формат журнала
+ *
+ * В двоичном режиме поток не форматирует текст записи, а пишет номер
+ * события и сырые аргументы. Текст по ним восстанавливает утилита
+ * smtplogdump в том же виде, в каком его пишет текстовый режим.
+ *
+ * Файл - последовательность записей: #log_record_header_t и аргументы.
+ * Каждый вызов LOG_* в программе - статическое описание события
+ * #log_event_t, указатели на описания собраны в отдельной секции, номер
+ * события - место указателя в ней.
+ * Процесс журнала при запуске дописывает в файл #LOG_EVENT_START и
+ * описания всех событий, поэтому файл читается без самой программы,
+ * даже если в него писали разные её сборки.
+ *
+ * Аргументы идут в порядке строки формата, без выравнивания:
+ * - целые и указатели - 8 байт, со знаком или без по преобразованию;
+ * - вещественные - double;
+ * - ширина и точность, заданные '*', - 8 байт перед значением;
+ * - строки - 2 байта длины и байты без завершающего нуля, уже обрезанные
+ *   точностью; длина #LOG_NULL_STRING - NULL.
+ */
+
+/**
+ * Описание места вызова LOG_*
+ */
+typedef struct log_event_t
+{
+    const char *file;
+    const char *format;
+    int line;
+    int level;
+} log_event_t;
+
+/**
+ * Служебные события
+ */
+enum log_special_event
+{
+    /**
+     * Начало записи процессом журнала, прежние описания событий больше
+     * не действуют. Аргументов нет
+     */
+    LOG_EVENT_START = 0xFFFC,
+    /**
+     * Описание события: номер, уровень, строка, файл, формат
+     */
+    LOG_EVENT_DESCRIPTION = 0xFFFD,
+    /**
+     * Имя потока, номер потока в заголовке
+     */
+    LOG_EVENT_THREAD_NAME = 0xFFFE,
+    /**
+     * Процесс журнала отбросил записи: их количество и номер кольца
+     */
+    LOG_EVENT_DROPPED = 0xFFFF,
+};
+
+#define LOG_NULL_STRING 0xFFFF
+
+/**
+ * Текст записи об отброшенных записях, одинаковый в обоих режимах
+ */
+#define LOG_DROPPED_FORMAT "LOG: %llu RECORDS DROPPED FROM RING %d\n"
+
+/**
+ * Аргументы служебных записей
+ */
+#define LOG_DESCRIPTION_FORMAT "%d %d %d %s %s"
+#define LOG_THREAD_NAME_FORMAT "%s"
+
+typedef struct log_record_header_t
+{
+    /**
+     * Длина записи вместе с заголовком
+     */
+    uint16_t size;
+    uint16_t event;
+    uint16_t thread;
+    uint16_t reserved;
+    /**
+     * Наносекунды с начала эпохи
+     */
+    uint64_t timestamp;
+} log_record_header_t;
+
+/**
+ * Начало записи в текстовом виде: "[поток] время УРОВЕНЬ файл:строка "
+ */
+int log_format_prefix(char *out, int size, const char *thread, const char *timestamp,
+        int level, const char *file, int line);
+
+const char *log_level_name(int level);
+
+/**
+ * Кодирует запись с аргументами @a args по строке @a format. Не поместившиеся
+ * в @a size строки обрезаются, остальные аргументы отбрасываются
+ *
+ * @return длина записи
+ */
+int log_encode_record(char *out, int size, uint16_t event, uint16_t thread, uint64_t timestamp,
+        const char *format, va_list args);
+
+/**
+ * Кодирует служебную запись, время в ней не указывается
+ */
+int log_encode_special(char *out, int size, uint16_t event, uint16_t thread, const char *format, ...);
+
+/**
+ * Описания событий и имена потоков, прочитанные из файла
+ */
+typedef struct log_decoder_t
+{
+    /**
+     * log_event_t по номерам событий, строки принадлежат декодеру
+     */
+    dynamic_vector_t events;
+    /**
+     * char[16] по номерам потоков
+     */
+    dynamic_vector_t threads;
+    /**
+     * Печатать время с микросекундами
+     */
+    bool microseconds;
+} log_decoder_t;
+
+void log_decoder_init(log_decoder_t *decoder);
+void log_decoder_close(log_decoder_t *decoder);
+
+/**
+ * Разбирает запись в начале @a data и пишет её текст в @a out. У служебных
+ * записей, кроме #LOG_EVENT_DROPPED, текста нет
+ *
+ * @return длина разобранной записи, 0 если запись пришла не целиком,
+ * -1 если это не запись журнала
+ */
+int log_decode_record(log_decoder_t *decoder, const char *data, int len, char *out, int size,
+        int *out_len);
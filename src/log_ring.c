@@ -0,0 +1,72 @@
+#include "log_ring.h"
+#include <string.h>
+
+
+uint64_t log_ring_size(uint32_t capacity)
+{
+    return sizeof(log_ring_t) + capacity;
+}
+
+void log_ring_init(log_ring_t *ring, uint32_t capacity)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->reported_drops = 0;
+    ring->capacity = capacity;
+}
+
+bool log_ring_push(log_ring_t *ring, const char *data, int len)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if ((uint64_t)len > ring->capacity - (head - tail))
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    uint32_t start = head & (ring->capacity - 1);
+    uint32_t first = ring->capacity - start < (uint32_t)len ? ring->capacity - start : (uint32_t)len;
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, data + first, len - first);
+    // Читатель видит новый head только вместе с данными записи
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+    return true;
+}
+
+int log_ring_peek(log_ring_t *ring, struct iovec iov[2], uint64_t *end)
+{
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    *end = head;
+    if (head == tail)
+    {
+        return 0;
+    }
+
+    uint32_t start = tail & (ring->capacity - 1);
+    uint64_t len = head - tail;
+    uint32_t first = ring->capacity - start < len ? ring->capacity - start : len;
+    iov[0] = (struct iovec){ .iov_base = ring->data + start, .iov_len = first };
+    if (first == len)
+    {
+        return 1;
+    }
+    iov[1] = (struct iovec){ .iov_base = ring->data, .iov_len = len - first };
+    return 2;
+}
+
+void log_ring_consume(log_ring_t *ring, uint64_t end)
+{
+    // Писатель перезапишет место только после того, как данные прочитаны
+    atomic_store_explicit(&ring->tail, end, memory_order_release);
+}
+
+uint64_t log_ring_take_drops(log_ring_t *ring)
+{
+    uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    uint64_t fresh = dropped - ring->reported_drops;
+    ring->reported_drops = dropped;
+    return fresh;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/**
+ * @file
+ * @brief Кольцевой буфер записей журнала
+ *
+ * У каждого потока сервера своё кольцо: поток - единственный писатель,
+ * процесс журнала - единственный читатель, поэтому хватает двух счётчиков
+ * без блокировок. Кольца лежат в общей памяти, созданной до fork(), и
+ * процесс журнала пишет их содержимое в файл прямо из неё, одним writev
+ * на все кольца.
+ *
+ * Записи - готовые строки журнала, идущие подряд. Запись, не поместившаяся
+ * целиком, отбрасывается: поток не ждёт процесс журнала, а считает
+ * потерянные записи.
+ */
+
+/**
+ * Кольцо записей. Размещается в памяти размером #log_ring_size
+ */
+typedef struct log_ring_t
+{
+    /**
+     * Записано байт за всё время, меняет только писатель
+     */
+    _Atomic uint64_t head;
+    char head_padding[56];
+    /**
+     * Прочитано байт за всё время, меняет только читатель
+     */
+    _Atomic uint64_t tail;
+    char tail_padding[56];
+    /**
+     * Отброшено записей за всё время, меняет только писатель
+     */
+    _Atomic uint64_t dropped;
+    /**
+     * Сколько из @a dropped читатель уже учёл
+     */
+    uint64_t reported_drops;
+    /**
+     * Размер данных, степень двойки
+     */
+    uint32_t capacity;
+    char data[];
+} log_ring_t;
+
+/**
+ * Сколько памяти занимает кольцо с @a capacity байт данных
+ */
+uint64_t log_ring_size(uint32_t capacity);
+
+/**
+ * Готовит пустое кольцо
+ *
+ * @param capacity - размер данных, степень двойки
+ */
+void log_ring_init(log_ring_t *ring, uint32_t capacity);
+
+/**
+ * Дописывает запись целиком. Только для писателя
+ *
+ * @return false, если места не хватило: запись отброшена и учтена в @a dropped
+ */
+bool log_ring_push(log_ring_t *ring, const char *data, int len);
+
+/**
+ * Непрочитанные данные, не больше двух кусков: до конца буфера и с его
+ * начала. Только для читателя
+ *
+ * @param end - позиция, до которой данные описаны; передаётся в #log_ring_consume
+ * @return количество заполненных @a iov
+ */
+int log_ring_peek(log_ring_t *ring, struct iovec iov[2], uint64_t *end);
+
+/**
+ * Освобождает место до позиции @a end, полученной от #log_ring_peek
+ */
+void log_ring_consume(log_ring_t *ring, uint64_t end);
+
+/**
+ * Сколько записей отброшено с прошлого вызова. Только для читателя
+ */
+uint64_t log_ring_take_drops(log_ring_t *ring);
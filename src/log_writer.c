@@ -0,0 +1,326 @@
+#include "log_writer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+
+/**
+ * Запись с именем потока, запомненная для начала следующего файла
+ */
+typedef struct log_thread_name_t
+{
+    int len;
+    char record[48];
+} log_thread_name_t;
+
+static bool write_all(int fd, const char *data, long long len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+// Начало двоичного файла: описания событий и имена потоков
+static void write_file_start(log_writer_t *writer)
+{
+    char record[LOG_RECORD_MAX];
+    int len = log_encode_special(record, sizeof(record), LOG_EVENT_START, 0, "");
+    write_all(writer->fd, record, len);
+    writer->file_size += len;
+
+    for (int i = 0; i < writer->event_count; i++)
+    {
+        const log_event_t *event = writer->events[i];
+        len = log_encode_special(record, sizeof(record), LOG_EVENT_DESCRIPTION, 0, LOG_DESCRIPTION_FORMAT,
+            i, event->level, event->line, event->file, event->format);
+        write_all(writer->fd, record, len);
+        writer->file_size += len;
+    }
+
+    log_thread_name_t *names = writer->thread_names.data;
+    for (int i = 0; i < writer->thread_names.size; i++)
+    {
+        write_all(writer->fd, names[i].record, names[i].len);
+        writer->file_size += names[i].len;
+    }
+}
+
+static bool open_file(log_writer_t *writer)
+{
+    writer->file_size = 0;
+    writer->header_size = 0;
+    writer->fd = open(writer->path, O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+    if (writer->fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    writer->file_size = fstat(writer->fd, &st) == 0 ? st.st_size : 0;
+    if (writer->binary)
+    {
+        write_file_start(writer);
+        writer->header_size = writer->file_size;
+    }
+    return true;
+}
+
+// "<файл>.n" -> "<файл>.n+1", самый старый вытесняется, сам файл становится "<файл>.1".
+// false, если файл не убрался с места или новый не открылся
+static bool rotate(log_writer_t *writer)
+{
+    close(writer->fd);
+    writer->fd = -1;
+
+    bool moved;
+    if (writer->keep_files == 0)
+    {
+        moved = unlink(writer->path) == 0;
+    }
+    else
+    {
+        char from[PATH_MAX];
+        char to[PATH_MAX];
+        for (int i = writer->keep_files - 1; i >= 1; i--)
+        {
+            snprintf(from, sizeof(from), "%s.%d", writer->path, i);
+            snprintf(to, sizeof(to), "%s.%d", writer->path, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, sizeof(to), "%s.1", writer->path);
+        moved = rename(writer->path, to) == 0;
+    }
+
+    // Файл, который не удалось убрать, откроется снова и будет дописываться
+    return open_file(writer) && moved;
+}
+
+static void remember_thread_names(log_writer_t *writer, const char *data, int len)
+{
+    log_record_header_t header;
+    for (int pos = 0; pos + (int)sizeof(header) <= len; pos += header.size)
+    {
+        memcpy(&header, data + pos, sizeof(header));
+        if (header.size < sizeof(header))
+        {
+            return;
+        }
+        if (header.event != LOG_EVENT_THREAD_NAME || header.size > sizeof(((log_thread_name_t*)0)->record))
+        {
+            continue;
+        }
+
+        log_thread_name_t empty = {};
+        while (writer->thread_names.size <= header.thread)
+        {
+            dynamic_vector_copy_elem_back(&writer->thread_names, &empty);
+        }
+        log_thread_name_t *name = (log_thread_name_t*)writer->thread_names.data + header.thread;
+        name->len = header.size;
+        memcpy(name->record, data + pos, header.size);
+    }
+}
+
+bool log_writer_open(log_writer_t *writer, const char *path, long long rotate_size, int keep_files,
+        bool binary, const log_event_t *const *events, int event_count)
+{
+    writer->path = strdup(path);
+    writer->rotate_size = rotate_size;
+    writer->keep_files = keep_files;
+    writer->buffer = malloc(LOG_OUTPUT_BUFFER);
+    writer->used = 0;
+    writer->binary = binary;
+    writer->events = events;
+    writer->event_count = event_count;
+    writer->thread_names = dynamic_vector_create(sizeof(log_thread_name_t), 16);
+    return open_file(writer);
+}
+
+// Сколько первых байт @a data помещается в @a room, не разрывая записей
+static int fit_records(const log_writer_t *writer, const char *data, int len, long long room)
+{
+    if (room >= len)
+    {
+        return len;
+    }
+
+    if (!writer->binary)
+    {
+        const char *end = room > 0 ? memrchr(data, '\n', room) : NULL;
+        return end ? end - data + 1 : 0;
+    }
+
+    int fit = 0;
+    log_record_header_t header;
+    while (fit + (int)sizeof(header) <= len)
+    {
+        memcpy(&header, data + fit, sizeof(header));
+        if (header.size < sizeof(header) || fit + header.size > room)
+        {
+            break;
+        }
+        fit += header.size;
+    }
+    return fit;
+}
+
+static int first_record(const log_writer_t *writer, const char *data, int len)
+{
+    if (!writer->binary)
+    {
+        const char *end = memchr(data, '\n', len);
+        return end ? end - data + 1 : len;
+    }
+
+    log_record_header_t header;
+    memcpy(&header, data, sizeof(header));
+    return header.size >= sizeof(header) && header.size <= len ? header.size : len;
+}
+
+bool log_writer_flush(log_writer_t *writer)
+{
+    bool ok = true;
+    int pos = 0;
+    // Файл не открылся при прошлой смене: открываем его ещё раз, не сменяя
+    if (writer->fd < 0 && writer->used > 0)
+    {
+        open_file(writer);
+    }
+
+    bool rotating = writer->rotate_size > 0;
+    while (pos < writer->used)
+    {
+        int len = writer->used - pos;
+        if (rotating)
+        {
+            len = fit_records(writer, writer->buffer + pos, len, writer->rotate_size - writer->file_size);
+            if (len == 0 && writer->file_size > writer->header_size)
+            {
+                // Если сменить файл не вышло, до следующего сброса записи идут
+                // сверх размера в тот файл, что открыт, или теряются
+                if (!rotate(writer))
+                {
+                    rotating = false;
+                    ok = false;
+                }
+                continue;
+            }
+            if (len == 0)
+            {
+                // Запись больше всего файла: пусть занимает его одна
+                len = first_record(writer, writer->buffer + pos, writer->used - pos);
+            }
+        }
+
+        ok = writer->fd >= 0 && write_all(writer->fd, writer->buffer + pos, len) && ok;
+        writer->file_size += len;
+        pos += len;
+    }
+    writer->used = 0;
+    return ok;
+}
+
+void log_writer_append(log_writer_t *writer, const struct iovec *iov, int count)
+{
+    int total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    if (total == 0)
+    {
+        return;
+    }
+
+    if (writer->used + total > LOG_OUTPUT_BUFFER)
+    {
+        log_writer_flush(writer);
+    }
+    if (total > LOG_OUTPUT_BUFFER)
+    {
+        // Больше буфера не бывает при кольцах меньше буфера, но на всякий
+        // случай такие данные идут в файл сразу
+        for (int i = 0; i < count; i++)
+        {
+            write_all(writer->fd, iov[i].iov_base, iov[i].iov_len);
+        }
+        writer->file_size += total;
+        return;
+    }
+
+    if (writer->used == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &writer->pending_since);
+    }
+
+    int start = writer->used;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(writer->buffer + writer->used, iov[i].iov_base, iov[i].iov_len);
+        writer->used += iov[i].iov_len;
+    }
+    if (writer->binary)
+    {
+        remember_thread_names(writer, writer->buffer + start, total);
+    }
+
+    if (writer->used >= LOG_FLUSH_BYTES)
+    {
+        log_writer_flush(writer);
+    }
+}
+
+void log_writer_tick(log_writer_t *writer, struct timespec now)
+{
+    if (writer->used == 0)
+    {
+        return;
+    }
+
+    long long waited_ms = (now.tv_sec - writer->pending_since.tv_sec) * 1000LL
+        + (now.tv_nsec - writer->pending_since.tv_nsec) / 1000000;
+    if (waited_ms >= LOG_FLUSH_INTERVAL_MS)
+    {
+        log_writer_flush(writer);
+    }
+}
+
+bool log_writer_reopen(log_writer_t *writer)
+{
+    log_writer_flush(writer);
+    if (writer->fd >= 0)
+    {
+        close(writer->fd);
+    }
+    return open_file(writer);
+}
+
+void log_writer_close(log_writer_t *writer)
+{
+    log_writer_flush(writer);
+    if (writer->fd >= 0)
+    {
+        close(writer->fd);
+    }
+    free(writer->buffer);
+    free(writer->path);
+    dynamic_vector_close(&writer->thread_names);
+}
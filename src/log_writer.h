@@ -0,0 +1,119 @@
+#pragma once
+#include <stdbool.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "dynamic_vector.h"
+#include "log_binary.h"
+
+/**
+ * @file
+ * @brief Запись журнала в файл процессом журнала
+ *
+ * Записи копятся в большом буфере и уходят в файл одним write, когда
+ * буфер заполнен на #LOG_FLUSH_BYTES или самые старые записи ждут дольше
+ * #LOG_FLUSH_INTERVAL_MS.
+ *
+ * Когда файл дорастает до заданного размера, он переименовывается в
+ * "<файл>.1", прежний "<файл>.1" - в "<файл>.2" и так далее; хранится
+ * заданное число старых файлов. Файлы меняются только между записями.
+ * Двоичный журнал в каждом новом файле начинается заново: с описаний
+ * событий и имён известных потоков, поэтому любой файл читается отдельно.
+ */
+
+/**
+ * Размер буфера
+ */
+#define LOG_OUTPUT_BUFFER (1024 * 1024)
+
+/**
+ * Сколько накопить, чтобы записать, не дожидаясь времени
+ */
+#define LOG_FLUSH_BYTES (256 * 1024)
+
+/**
+ * Сколько записи могут ждать в буфере
+ */
+#define LOG_FLUSH_INTERVAL_MS 500
+
+/**
+ * Старых файлов по умолчанию
+ */
+#define LOG_DEFAULT_KEEP_FILES 5
+
+typedef struct log_writer_t
+{
+    char *path;
+    int fd;
+    /**
+     * Размер текущего файла вместе с уже записанными данными
+     */
+    long long file_size;
+    /**
+     * Размер начала, записанного при открытии: файл, где кроме него
+     * ничего нет, не сменяется
+     */
+    long long header_size;
+    /**
+     * Размер, после которого файл сменяется, 0 - не сменяется
+     */
+    long long rotate_size;
+    /**
+     * Сколько старых файлов хранить
+     */
+    int keep_files;
+
+    char *buffer;
+    int used;
+    /**
+     * Когда в пустой буфер пришла первая запись (CLOCK_MONOTONIC)
+     */
+    struct timespec pending_since;
+
+    bool binary;
+    /**
+     * Описания событий для начала двоичного файла
+     */
+    const log_event_t *const *events;
+    int event_count;
+    /**
+     * Последняя запись #LOG_EVENT_THREAD_NAME каждого потока, log_thread_name_t
+     */
+    dynamic_vector_t thread_names;
+} log_writer_t;
+
+/**
+ * Открывает файл журнала на дозапись
+ *
+ * @param events - описания событий, нужны только двоичному журналу
+ */
+bool log_writer_open(log_writer_t *writer, const char *path, long long rotate_size, int keep_files,
+        bool binary, const log_event_t *const *events, int event_count);
+
+/**
+ * Добавляет целые записи, разложенные по кускам @a iov
+ */
+void log_writer_append(log_writer_t *writer, const struct iovec *iov, int count);
+
+/**
+ * Пишет буфер в файл, если пора по размеру или по времени @a now
+ */
+void log_writer_tick(log_writer_t *writer, struct timespec now);
+
+/**
+ * Пишет буфер в файл, при необходимости сменив файл. Если файл не
+ * сменился или не открылся, возвращает false; следующая попытка - при
+ * следующем сбросе
+ */
+bool log_writer_flush(log_writer_t *writer);
+
+/**
+ * Записывает буфер и заново открывает файл по тому же пути: после того,
+ * как файл переименовали или удалили снаружи
+ */
+bool log_writer_reopen(log_writer_t *writer);
+
+/**
+ * Записывает буфер и закрывает файл
+ */
+void log_writer_close(log_writer_t *writer);
@@ -3,95 +3,410 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
-#include "dynamic_vector.h"
+#include "log_ring.h"
+#include "log_writer.h"
 
 static int G_logsocket;
+int G_log_level = LOG_DEFAULT_LEVEL;
+static bool G_log_binary;
+
+/**
+ * Описания событий всех вызовов LOG_*, границы секции задаёт компоновщик
+ */
+extern const log_event_t *const __start_log_events[] __attribute__((weak));
+extern const log_event_t *const __stop_log_events[] __attribute__((weak));
+
+/**
+ * Общая с процессом журнала память колец, NULL - колец нет
+ */
+static char *G_rings;
+static uint64_t G_ring_stride;
+/**
+ * Сколько потоков уже писало в журнал. Номер потока - номер его кольца
+ */
+static atomic_int G_threads;
+
+/**
+ * Кольцо потока, NULL - колец нет или не досталось
+ */
+static __thread log_ring_t *T_ring;
+static __thread bool T_registered;
+static __thread int T_thread;
+static __thread char T_name[16];
+/**
+ * Запись формируется здесь
+ */
+static __thread char T_record[LOG_RECORD_MAX];
+
+static bool G_log_microseconds;
+static long long G_rotate_size;
+static int G_keep_files = LOG_DEFAULT_KEEP_FILES;
+
+/**
+ * Часы потока, NULL - читать CLOCK_MONOTONIC самому
+ */
+static __thread const struct timespec *T_clock;
+/**
+ * Разница между настенным временем и CLOCK_MONOTONIC. Обновляется
+ * раз в секунду, вместе с текстом времени
+ */
+static __thread struct timespec T_clock_offset;
+/**
+ * Секунда, для которой отформатировано T_timebuf, -1 - ни для какой
+ */
+static __thread time_t T_second = -1;
+static __thread char T_timebuf[32];
+static __thread int T_timebuf_len;
 
 void set_log_socket(int socket)
 {
     G_logsocket = socket;
 }
 
-static char *write_message(const char *file, int line, const char *format, va_list args, va_list args2)
-{   
-    char timebuf[20];
-    time_t now = time(NULL);
-    strftime(timebuf, 20, "%Y-%m-%d %H:%M:%S", localtime(&now));
-    
-    int len = vsnprintf(NULL, 0, format, args);
-    char *buff = malloc(len + 1);
-    vsnprintf(buff, len + 1, format, args2);
-    
-    char name[16];
-    pthread_getname_np(pthread_self(), name, 16);
-    
-    len = snprintf(NULL, 0, "[%s] %s %s:%d %s\n", name, timebuf, file, line, buff);
-    char *final_buff = malloc(len + 1);
-    snprintf(final_buff, len + 1, "[%s] %s %s:%d %s\n", name, timebuf, file, line, buff);
-    
-    free(buff);
-    return final_buff;
-}
-
-void write_to_log(const char *file, int line, const char *format, ...)
-{
-    va_list args, args2;
+void set_log_level(int level)
+{
+    G_log_level = level;
+}
+
+void set_log_binary(bool binary)
+{
+    G_log_binary = binary;
+}
+
+void set_log_microseconds(bool microseconds)
+{
+    G_log_microseconds = microseconds;
+}
+
+void set_log_rotation(long long rotate_size, int keep_files)
+{
+    G_rotate_size = rotate_size;
+    G_keep_files = keep_files;
+}
+
+void set_log_clock(const struct timespec *now)
+{
+    T_clock = now;
+}
+
+int parse_log_level(const char *name)
+{
+    for (int i = LOG_LEVEL_TRACE; i <= LOG_LEVEL_ERROR; i++)
+    {
+        if (strcasecmp(name, log_level_name(i)) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static log_ring_t *get_ring(int index)
+{
+    return (log_ring_t*)(G_rings + index * G_ring_stride);
+}
+
+bool create_log_rings()
+{
+    // Начало каждого кольца выровнено на линию кэша, как и его счётчики
+    G_ring_stride = (log_ring_size(LOG_RING_CAPACITY) + 63) & ~63ULL;
+    char *rings = mmap(NULL, G_ring_stride * LOG_RING_COUNT, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rings == MAP_FAILED)
+    {
+        return false;
+    }
+
+    G_rings = rings;
+    for (int i = 0; i < LOG_RING_COUNT; i++)
+    {
+        log_ring_init(get_ring(i), LOG_RING_CAPACITY);
+    }
+    return true;
+}
+
+static void send_record(const char *record, int len)
+{
+    if (T_ring)
+    {
+        // Переполненное кольцо не ждём: запись отбрасывается и учитывается
+        log_ring_push(T_ring, record, len);
+        return;
+    }
+
+    // Одна датаграмма - одна запись
+    send(G_logsocket, record, len, 0);
+}
+
+// Первая запись потока занимает для него кольцо и запоминает его имя
+static void register_thread()
+{
+    T_registered = true;
+    pthread_getname_np(pthread_self(), T_name, sizeof(T_name));
+
+    T_thread = atomic_fetch_add(&G_threads, 1);
+    if (G_rings && T_thread < LOG_RING_COUNT)
+    {
+        T_ring = get_ring(T_thread);
+    }
+
+    if (G_log_binary)
+    {
+        int len = log_encode_special(T_record, LOG_RECORD_MAX, LOG_EVENT_THREAD_NAME,
+            T_thread, LOG_THREAD_NAME_FORMAT, T_name);
+        send_record(T_record, len);
+    }
+}
+
+static struct timespec add_offset(struct timespec monotonic)
+{
+    struct timespec wall = {
+        .tv_sec = monotonic.tv_sec + T_clock_offset.tv_sec,
+        .tv_nsec = monotonic.tv_nsec + T_clock_offset.tv_nsec
+    };
+    if (wall.tv_nsec >= 1000000000L)
+    {
+        wall.tv_sec++;
+        wall.tv_nsec -= 1000000000L;
+    }
+    return wall;
+}
+
+// Настенное время записи. Доли секунды идут от CLOCK_MONOTONIC, поэтому
+// записи одного потока внутри секунды не перемешиваются при переводе часов
+static struct timespec log_time()
+{
+    struct timespec monotonic;
+    if (T_clock)
+    {
+        monotonic = *T_clock;
+    }
+    else
+    {
+        clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    }
+
+    struct timespec wall = add_offset(monotonic);
+    if (wall.tv_sec == T_second)
+    {
+        return wall;
+    }
+
+    // Новая секунда: сверяемся с настенными часами и форматируем её один раз
+    struct timespec realtime, now;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    T_clock_offset.tv_sec = realtime.tv_sec - now.tv_sec;
+    T_clock_offset.tv_nsec = realtime.tv_nsec - now.tv_nsec;
+    if (T_clock_offset.tv_nsec < 0)
+    {
+        T_clock_offset.tv_sec--;
+        T_clock_offset.tv_nsec += 1000000000L;
+    }
+
+    wall = add_offset(monotonic);
+    struct tm tm;
+    T_second = wall.tv_sec;
+    T_timebuf_len = strftime(T_timebuf, sizeof(T_timebuf), "%Y-%m-%d %H:%M:%S", localtime_r(&T_second, &tm));
+    return wall;
+}
+
+// Текст времени из кэша потока, с микросекундами если они включены
+static const char *format_time(struct timespec wall)
+{
+    T_timebuf[T_timebuf_len] = '\0';
+    if (G_log_microseconds)
+    {
+        char *p = T_timebuf + T_timebuf_len;
+        long usec = wall.tv_nsec / 1000;
+        *p++ = '.';
+        for (int i = 5; i >= 0; i--)
+        {
+            p[i] = '0' + usec % 10;
+            usec /= 10;
+        }
+        p[6] = '\0';
+    }
+    return T_timebuf;
+}
+
+static int format_record(char *record, const log_event_t *event, va_list args)
+{
+    const char *timebuf = format_time(log_time());
+    int len = log_format_prefix(record, LOG_RECORD_MAX, T_name, timebuf, event->level, event->file, event->line);
+    if (len >= LOG_RECORD_MAX - 1)
+    {
+        len = LOG_RECORD_MAX - 2;
+    }
+
+    // Последний байт оставлен под перевод строки
+    int space = LOG_RECORD_MAX - 1 - len;
+    int message_len = vsnprintf(record + len, space, event->format, args);
+    len += message_len < space ? message_len : space - 1;
+    record[len++] = '\n';
+    return len;
+}
+
+// Двоичная запись: номер события, поток, время и сырые аргументы
+static int encode_record(char *record, const log_event_t *const *slot, va_list args)
+{
+    struct timespec now = log_time();
+    uint64_t timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    return log_encode_record(record, LOG_RECORD_MAX, slot - __start_log_events, T_thread, timestamp,
+        (*slot)->format, args);
+}
+
+void write_to_log(const log_event_t *const *event, const char *format, ...)
+{
+    if (!T_registered)
+    {
+        register_thread();
+    }
+
+    va_list args;
     va_start(args, format);
-    va_start(args2, format);
-    char *buff = write_message(file, line, format, args, args2);
-    va_end(args2);
+    char *record = T_record;
+    int len = G_log_binary ? encode_record(record, event, args) : format_record(record, *event, args);
     va_end(args);
 
-    int l = strlen(buff);
-    write(G_logsocket, &l, sizeof(int));
-    write(G_logsocket, buff, l);
-    free(buff);
+    send_record(record, len);
 }
 
 void send_stop_log()
 {
-    int stopSignal = -1;
-    write(G_logsocket, &stopSignal, sizeof(int));
+    // Пустая датаграмма: записей такой длины не бывает
+    send(G_logsocket, "", 0, 0);
     close(G_logsocket);
 }
 
+// Забирает всё накопленное в кольцах в буфер записи
+static int drain_rings(log_writer_t *writer)
+{
+    if (!G_rings)
+    {
+        return 0;
+    }
+
+    int drained = 0;
+    for (int i = 0; i < LOG_RING_COUNT; i++)
+    {
+        log_ring_t *ring = get_ring(i);
+        uint64_t dropped = log_ring_take_drops(ring);
+        if (dropped > 0)
+        {
+            char notice[64];
+            int len = G_log_binary
+                ? log_encode_special(notice, sizeof(notice), LOG_EVENT_DROPPED, i, LOG_DROPPED_FORMAT,
+                    (unsigned long long)dropped, i)
+                : snprintf(notice, sizeof(notice), LOG_DROPPED_FORMAT, (unsigned long long)dropped, i);
+            struct iovec iov = { .iov_base = notice, .iov_len = len };
+            log_writer_append(writer, &iov, 1);
+        }
+
+        struct iovec iov[2];
+        uint64_t end;
+        int count = log_ring_peek(ring, iov, &end);
+        if (count > 0)
+        {
+            log_writer_append(writer, iov, count);
+            log_ring_consume(ring, end);
+            drained++;
+        }
+    }
+    return drained;
+}
+
+// Записи, пришедшие по сокету, по одной на датаграмму. false - пора заканчивать
+static bool receive_socket_records(int socket, log_writer_t *writer)
+{
+    static char records[LOG_SOCKET_BATCH][LOG_RECORD_MAX];
+    struct mmsghdr messages[LOG_SOCKET_BATCH];
+    struct iovec iov[LOG_SOCKET_BATCH];
+    for (int i = 0; i < LOG_SOCKET_BATCH; i++)
+    {
+        iov[i] = (struct iovec){ .iov_base = records[i], .iov_len = LOG_RECORD_MAX };
+        messages[i] = (struct mmsghdr){ .msg_hdr = { .msg_iov = &iov[i], .msg_iovlen = 1 } };
+    }
+
+    int received = recvmmsg(socket, messages, LOG_SOCKET_BATCH, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < received; i++)
+    {
+        if (messages[i].msg_len == 0)
+        {
+            return false;
+        }
+        struct iovec record = { .iov_base = records[i], .iov_len = messages[i].msg_len };
+        log_writer_append(writer, &record, 1);
+    }
+    return true;
+}
+
+static volatile sig_atomic_t G_reopen_log;
+
+static void sighup_handler(int signum)
+{
+    G_reopen_log = 1;
+}
 
 void log_loop(int socket, char *filename)
 {
-    dynamic_vector_t buffer = dynamic_vector_create(sizeof(char), 256);
-    int logfile = open(filename, O_CREAT | O_WRONLY | O_APPEND, 0644);
-    while(1)
-    {      
-        int len = 0;
-        int read_bytes = read(socket, &len, sizeof(int));
-        if (read_bytes == 0 || len <= 0)
+    // Процесс журнала заканчивает работу последним, по команде сервера:
+    // Ctrl-C и SIGTERM группе процессов не должны терять хвост журнала
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    struct sigaction sa = {};
+    sa.sa_handler = &sighup_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+
+    pid_t server = getppid();
+    log_writer_t writer;
+    log_writer_open(&writer, filename, G_rotate_size, G_keep_files, G_log_binary,
+        __start_log_events, __stop_log_events - __start_log_events);
+
+    bool running = true;
+    while (running)
+    {
+        if (G_reopen_log)
         {
-            break;
+            G_reopen_log = 0;
+            log_writer_reopen(&writer);
         }
 
-        if (buffer.capacity < len)
+        // Пока кольца не пусты, забираем их без ожидания
+        int timeout = drain_rings(&writer) > 0 ? 0 : LOG_DRAIN_INTERVAL_MS;
+        struct pollfd pfd = { .fd = socket, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) > 0)
         {
-            dynamic_vector_reserve_at_least(&buffer, len);
+            running = receive_socket_records(socket, &writer);
         }
 
-        read_bytes = read(socket, buffer.data, len);
-        if (read_bytes != len)
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        log_writer_tick(&writer, now);
+
+        // Сервер завершился, не остановив журнал
+        if (getppid() != server)
         {
-            const char *error_str = "LOG: COULD NOT READ FROM SOCKET\n";
-            write(logfile, error_str, strlen(error_str));
-            break;
+            running = false;
         }
-        
-        write(logfile, buffer.data, len);
     }
-    
-    close(logfile);
-    dynamic_vector_close(&buffer);
+
+    // Потоки уже остановлены: остаток колец последний
+    drain_rings(&writer);
+    log_writer_close(&writer);
     exit(0);
 }
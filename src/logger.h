@@ -1,13 +1,163 @@
 #pragma once
+#include <stdbool.h>
+#include <time.h>
+
+#include "log_binary.h"
 
 /**
  * @file
  * @brief Логгирование в программе
+ *
+ * Записи журнала пишет отдельный процесс. Каждый поток сервера
+ * складывает готовые строки в своё кольцо (см. log_ring.h) в общей с ним
+ * памяти, процесс журнала периодически забирает их пачкой. Если кольца
+ * не созданы или закончились, запись уходит по сокету, как раньше.
+ *
+ * Записи, не попавшие в кольца, идут по сокету, по записи на датаграмму;
+ * процесс журнала забирает их пачками через recvmmsg. В файл записи
+ * пишутся через буфер (см. log_writer.h), при SIGHUP файл открывается
+ * заново.
+ *
+ * Записи пишутся текстом или, с set_log_binary(), в двоичном формате
+ * (см. log_binary.h).
+ */
+
+/**
+ * Уровни записей журнала, по возрастанию важности
+ */
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+
+/**
+ * Записи ниже этого уровня не попадают в программу вовсе: вызов
+ * не вычисляет даже аргументы. Задаётся при сборке (LOG_MIN_LEVEL=...
+ * для make), по умолчанию в программе есть все уровни
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_TRACE
+#endif
+
+/**
+ * Уровень по умолчанию для записей, оставшихся в программе
+ */
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+
+/**
+ * Записи ниже этого уровня отбрасываются до форматирования
  */
+extern int G_log_level;
 
-#define LOG(...) write_to_log(__FILE__, __LINE__, __VA_ARGS__)
+#define LOG_FORMAT_(FORMAT, ...) FORMAT
 
-void write_to_log(const char *file, int line, const char *format, ...);
+/**
+ * Каждый вызов оставляет описание события и указатель на него в секции
+ * log_events. Номер события - место указателя в секции: указатели, в отличие
+ * от самих описаний, компоновщик кладёт вплотную
+ */
+#define LOG_AT(LEVEL, ...) \
+    do \
+    { \
+        static const log_event_t log_event_ = \
+            { .file = __FILE__, .format = LOG_FORMAT_(__VA_ARGS__, ""), .line = __LINE__, .level = (LEVEL) }; \
+        static const log_event_t *const log_event_slot_ __attribute__((section("log_events"), used)) = &log_event_; \
+        if ((LEVEL) >= G_log_level) \
+        { \
+            write_to_log(&log_event_slot_, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) do { } while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do { } while (0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do { } while (0)
+#endif
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/**
+ * Сколько потоков могут получить своё кольцо
+ */
+#define LOG_RING_COUNT 64
+
+/**
+ * Размер кольца одного потока
+ */
+#define LOG_RING_CAPACITY (256 * 1024)
+
+/**
+ * Наибольшая длина записи, более длинные обрезаются
+ */
+#define LOG_RECORD_MAX 4096
+
+/**
+ * Как часто процесс журнала проверяет кольца, когда они пусты
+ */
+#define LOG_DRAIN_INTERVAL_MS 10
+
+/**
+ * Сколько записей процесс журнала забирает из сокета за один вызов
+ */
+#define LOG_SOCKET_BATCH 32
+
+void write_to_log(const log_event_t *const *event, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
 void log_loop(int socket, char *filename);
 void send_stop_log();
 void set_log_socket(int socket);
+void set_log_level(int level);
+/**
+ * Двоичный формат записей. Задаётся до запуска процесса журнала
+ */
+void set_log_binary(bool binary);
+/**
+ * Смена файла журнала, когда он дорастает до @a rotate_size байт (0 - не
+ * менять), с хранением @a keep_files старых файлов. Задаётся до запуска
+ * процесса журнала
+ */
+void set_log_rotation(long long rotate_size, int keep_files);
+/**
+ * Доли секунды (микросекунды) во времени записей
+ */
+void set_log_microseconds(bool microseconds);
+
+/**
+ * Время записей потока берётся из @a now (CLOCK_MONOTONIC), которое
+ * поток и так обновляет на каждой итерации, вместо чтения часов
+ * на каждую запись. Указатель должен быть действителен, пока поток пишет
+ * в журнал
+ */
+void set_log_clock(const struct timespec *now);
+
+/**
+ * Уровень по имени: trace, debug, info, warn или error
+ *
+ * @return уровень или -1, если имя неизвестно
+ */
+int parse_log_level(const char *name);
+
+/**
+ * Создаёт кольца потоков в общей памяти. Вызывается до запуска процесса
+ * журнала, чтобы он унаследовал отображение
+ */
+bool create_log_rings();
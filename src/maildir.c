@@ -1,4 +1,5 @@
 #include "maildir.h"
+#include "sha256.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
 
 DIR *open_or_create_directory(const char *path, int *error)
 {
@@ -52,6 +55,19 @@ char *open_subdirectory(const char *root_dir, const char *subdir_name, int *erro
     return NULL;
 }
 
+static int open_directory_fd(const char *path, int *error)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    *error = (fd < 0) ? errno : 0;
+    return fd;
+}
+
+static void close_directory_fd(int fd)
+{
+    if (fd >= 0)
+        close(fd);
+}
+
 void maildir_close(maildir_t *maildir)
 {
     if (maildir->root_path)
@@ -62,12 +78,46 @@ void maildir_close(maildir_t *maildir)
         free(maildir->relay_path);
     if (maildir->tmp_path)
         free(maildir->tmp_path);
+    close_directory_fd(maildir->root_fd);
+    close_directory_fd(maildir->tmp_fd);
+    close_directory_fd(maildir->cur_fd);
+    close_directory_fd(maildir->relay_fd);
+    close_directory_fd(maildir->segments_fd);
+    close_directory_fd(maildir->blobs_fd);
     *maildir = (maildir_t){0};
+    maildir->root_fd = maildir->tmp_fd = maildir->cur_fd = maildir->relay_fd = maildir->segments_fd = -1;
+    maildir->blobs_fd = -1;
+}
+
+#define LAYOUT_FILE "layout"
+
+// Разбиение, записанное в корне maildir. Файла нет - maildir не разбит
+static int read_layout(maildir_t *maildir)
+{
+    int fd = openat(maildir->root_fd, LAYOUT_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : errno;
+
+    char buf[64];
+    int len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len < 0)
+        return errno;
+    buf[len] = '\0';
+
+    int fanout;
+    if (sscanf(buf, "shards %d", &fanout) != 1 || fanout < 2 || fanout > MAILDIR_MAX_SHARD_FANOUT)
+        return EINVAL;
+
+    maildir->shard_fanout = fanout;
+    return 0;
 }
 
 maildir_t maildir_open(const char *root_path, int *error)
 {
     maildir_t mail = {0};
+    mail.root_fd = mail.tmp_fd = mail.cur_fd = mail.relay_fd = mail.segments_fd = -1;
+    mail.blobs_fd = -1;
 
     mail.root_path = open_subdirectory(root_path, "", error);
     if (*error != 0)
@@ -97,44 +147,405 @@ maildir_t maildir_open(const char *root_path, int *error)
         return mail;
     }
 
+    const char *paths[] = { mail.root_path, mail.tmp_path, mail.cur_path, mail.relay_path };
+    int *fds[] = { &mail.root_fd, &mail.tmp_fd, &mail.cur_fd, &mail.relay_fd };
+    for (int i = 0; i < 4; i++)
+    {
+        *fds[i] = open_directory_fd(paths[i], error);
+        if (*error != 0)
+        {
+            maildir_close(&mail);
+            return mail;
+        }
+    }
+
+    *error = read_layout(&mail);
+    if (*error != 0)
+    {
+        maildir_close(&mail);
+        return mail;
+    }
+
     return mail;
 }
 
-int maildir_create_in_tmp(maildir_t *m, char *name)
+// Даёт имя безымянному файлу. AT_EMPTY_PATH требует CAP_DAC_READ_SEARCH,
+// без неё ссылаемся на файл через /proc
+static bool link_tmpfile(int fd, int dirfd, const char *filename)
+{
+    if (linkat(fd, "", dirfd, filename, AT_EMPTY_PATH) == 0)
+        return true;
+
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    return linkat(AT_FDCWD, proc_path, dirfd, filename, AT_SYMLINK_FOLLOW) == 0;
+}
+
+bool maildir_enable_tmpfile(maildir_t *maildir)
 {
-    int dirfd = open(m->tmp_path, O_RDONLY, 0644);
-    int fd = openat(dirfd, name, O_CREAT | O_WRONLY, 0644);
-    close(dirfd);
+    // Проверяем весь путь доставки: и создание, и последующий linkat
+    int fd = openat(maildir->tmp_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    char probe_name[64];
+    snprintf(probe_name, sizeof(probe_name), ".tmpfile-probe.%d", (int)getpid());
+    bool linked = link_tmpfile(fd, maildir->tmp_fd, probe_name);
+    close(fd);
+    if (linked)
+        unlinkat(maildir->tmp_fd, probe_name, 0);
+
+    maildir->use_tmpfile = linked;
+    return linked;
+}
+
+bool maildir_set_sharding(maildir_t *maildir, int fanout)
+{
+    if (fanout == maildir->shard_fanout)
+        return true;
+
+    // Письма уже разложены по подпапкам другого размера
+    if (maildir->shard_fanout > 0 || fanout < 2 || fanout > MAILDIR_MAX_SHARD_FANOUT)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    char layout[32];
+    int len = snprintf(layout, sizeof(layout), "shards %d\n", fanout);
+    int fd = openat(maildir->root_fd, LAYOUT_FILE ".tmp", O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    bool written = write(fd, layout, len) == len && fsync(fd) == 0;
+    close(fd);
+    if (!written || renameat(maildir->root_fd, LAYOUT_FILE ".tmp", maildir->root_fd, LAYOUT_FILE) != 0
+            || fsync(maildir->root_fd) != 0)
+        return false;
+
+    maildir->shard_fanout = fanout;
+    return true;
+}
+
+bool maildir_is_sharded(maildir_t *maildir, enum maildir_folder folder)
+{
+    return maildir->shard_fanout > 0 && folder != MAILDIR_TMP;
+}
+
+// Подпапка письма: уровни - цифры хеша имени в системе счисления fanout
+static void shard_path(maildir_t *maildir, const char *filename, char *path, int len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const char *c = filename; *c; c++)
+    {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+
+    int width = maildir->shard_fanout > 256 ? 3 : 2;
+    int written = 0;
+    for (int level = 0; level < MAILDIR_SHARD_LEVELS; level++)
+    {
+        written += snprintf(path + written, len - written, level == 0 ? "%0*x" : "/%0*x",
+                width, hash % maildir->shard_fanout);
+        hash /= maildir->shard_fanout;
+    }
+}
+
+// Сбрасывает на диск папку, в которой лежит подпапка @a path
+static bool sync_parent(int dirfd, char *path)
+{
+    char *slash = strrchr(path, '/');
+    if (!slash)
+        return fsync(dirfd) == 0;
+
+    *slash = '\0';
+    int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    *slash = '/';
+    if (fd < 0)
+        return false;
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+// Создаёт недостающие уровни подпапки. Запись о новой подпапке сразу
+// сбрасывается в родительскую: иначе сброс письма в ней ничего не гарантирует
+static bool create_shard(int dirfd, const char *shard)
+{
+    char path[32];
+    int len = snprintf(path, sizeof(path), "%s", shard);
+    for (int i = 1; i <= len; i++)
+    {
+        if (path[i] != '/' && path[i] != '\0')
+            continue;
+
+        path[i] = '\0';
+        if (mkdirat(dirfd, path, 0777) == 0)
+        {
+            if (!sync_parent(dirfd, path))
+                return false;
+        }
+        else if (errno != EEXIST)
+        {
+            return false;
+        }
+        if (i < len)
+            path[i] = '/';
+    }
+    return true;
+}
+
+int maildir_open_shard(maildir_t *maildir, enum maildir_folder folder, const char *filename)
+{
+    char shard[32];
+    shard_path(maildir, filename, shard, sizeof(shard));
+    int dirfd = maildir_folder_fd(maildir, folder);
+
+    int fd = openat(dirfd, shard, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && create_shard(dirfd, shard))
+        fd = openat(dirfd, shard, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
     return fd;
 }
 
-void maildir_move_to_cur(maildir_t *m, char *filename)
+bool maildir_open_segments(maildir_t *maildir)
 {
-    int tmpdirfd = open(m->tmp_path, O_RDONLY, 0644);
-    int curdirfd = open(m->cur_path, O_RDONLY, 0644);
-    
-    renameat(tmpdirfd, filename, curdirfd, filename);
-    
-    close(tmpdirfd);
-    close(curdirfd);
+    if (mkdirat(maildir->root_fd, "segments", 0777) != 0 && errno != EEXIST)
+        return false;
+
+    maildir->segments_fd = openat(maildir->root_fd, "segments", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return maildir->segments_fd >= 0;
 }
 
-void maildir_move_to_relay(maildir_t *m, char *filename)
+bool maildir_open_blobs(maildir_t *maildir)
 {
-    int tmpdirfd = open(m->tmp_path, O_RDONLY, 0644);
-    int relaydirfd = open(m->relay_path, O_RDONLY, 0644);
-    
-    renameat(tmpdirfd, filename, relaydirfd, filename);
-    
-    close(tmpdirfd);
-    close(relaydirfd);
+    if (mkdirat(maildir->root_fd, "blobs", 0777) != 0 && errno != EEXIST)
+        return false;
+
+    maildir->blobs_fd = openat(maildir->root_fd, "blobs", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return maildir->blobs_fd >= 0;
+}
+
+int maildir_create_in_tmp(maildir_t *m, char *name)
+{
+    if (m->use_tmpfile)
+        return openat(m->tmp_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+
+    return openat(m->tmp_fd, name, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+}
+
+static bool link_from_tmp(maildir_t *m, int fd, const char *filename, int dirfd, const char *path)
+{
+    if (m->use_tmpfile)
+        return link_tmpfile(fd, dirfd, path);
+
+    return renameat(m->tmp_fd, filename, dirfd, path) == 0;
+}
+
+// Путь письма @a filename от папки @a folder с учётом подпапки
+static void entry_path(maildir_t *m, enum maildir_folder folder, const char *filename, char *path, int len)
+{
+    if (!maildir_is_sharded(m, folder))
+    {
+        snprintf(path, len, "%s", filename);
+        return;
+    }
+
+    char shard[32];
+    shard_path(m, filename, shard, sizeof(shard));
+    snprintf(path, len, "%s/%s", shard, filename);
+}
+
+// Подпапку создаём, только если её ещё нет: сначала просто пробуем
+static bool create_missing_shard(maildir_t *m, enum maildir_folder folder, const char *filename)
+{
+    if (errno != ENOENT || !maildir_is_sharded(m, folder))
+        return false;
+
+    char shard[32];
+    shard_path(m, filename, shard, sizeof(shard));
+    return create_shard(maildir_folder_fd(m, folder), shard);
+}
+
+static bool move_from_tmp(maildir_t *m, int fd, const char *filename, enum maildir_folder folder)
+{
+    int dirfd = maildir_folder_fd(m, folder);
+    char path[PATH_MAX];
+    entry_path(m, folder, filename, path, sizeof(path));
+
+    if (link_from_tmp(m, fd, filename, dirfd, path))
+        return true;
+    return create_missing_shard(m, folder, filename) && link_from_tmp(m, fd, filename, dirfd, path);
+}
+
+bool maildir_move_to_cur(maildir_t *m, int fd, char *filename)
+{
+    return move_from_tmp(m, fd, filename, MAILDIR_CUR);
+}
+
+bool maildir_move_to_relay(maildir_t *m, int fd, char *filename)
+{
+    return move_from_tmp(m, fd, filename, MAILDIR_RELAY);
+}
+
+bool maildir_link_delivered(maildir_t *m, enum maildir_folder src_folder, const char *src_name,
+        enum maildir_folder folder, const char *name)
+{
+    char src_path[PATH_MAX];
+    char path[PATH_MAX];
+    entry_path(m, src_folder, src_name, src_path, sizeof(src_path));
+    entry_path(m, folder, name, path, sizeof(path));
+    int src_fd = maildir_folder_fd(m, src_folder);
+    int dirfd = maildir_folder_fd(m, folder);
+
+    if (linkat(src_fd, src_path, dirfd, path, 0) == 0)
+        return true;
+    return create_missing_shard(m, folder, name) && linkat(src_fd, src_path, dirfd, path, 0) == 0;
+}
+
+bool maildir_deduplicate(maildir_t *m, enum maildir_folder folder, const char *filename,
+        const char *digest)
+{
+    // Тела раскладываются по подпапкам первого байта хеша
+    char blob[SHA256_HEX_SIZE + 4];
+    snprintf(blob, sizeof(blob), "%.2s/%s", digest, digest);
+    char path[PATH_MAX];
+    entry_path(m, folder, filename, path, sizeof(path));
+    int dirfd = maildir_folder_fd(m, folder);
+
+    // Тело уже есть: ссылка на него появляется в tmp и атомарно
+    // занимает место письма
+    char link_name[PATH_MAX];
+    snprintf(link_name, sizeof(link_name), "%s.blob", filename);
+    if (linkat(m->blobs_fd, blob, m->tmp_fd, link_name, 0) == 0)
+    {
+        if (renameat(m->tmp_fd, link_name, dirfd, path) == 0)
+            return true;
+        unlinkat(m->tmp_fd, link_name, 0);
+        return false;
+    }
+    if (errno != ENOENT)
+        return false;
+
+    // Тела ещё нет: им становится само письмо. Запись в blobs не
+    // сбрасывается на диск - после сбоя теряется только возможность
+    // сослаться на это тело, письмо остаётся в своей папке
+    if (linkat(dirfd, path, m->blobs_fd, blob, 0) == 0)
+        return true;
+    if (errno == ENOENT)
+    {
+        blob[2] = '\0';
+        if (mkdirat(m->blobs_fd, blob, 0777) != 0 && errno != EEXIST)
+            return false;
+        blob[2] = '/';
+        if (linkat(dirfd, path, m->blobs_fd, blob, 0) == 0)
+            return true;
+    }
+    // Другой поток только что записал такое же тело: это письмо
+    // останется отдельным файлом
+    return errno == EEXIST;
+}
+
+// Удаляет в подпапке blobs тела, на которые ссылается только она сама
+static int collect_blob_dir(int dirfd)
+{
+    DIR *dir = fdopendir(dirfd);
+    if (!dir)
+    {
+        close(dirfd);
+        return -1;
+    }
+
+    int removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if (entry->d_name[0] == '.' || fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0
+                || !S_ISREG(st.st_mode) || st.st_nlink > 1)
+            continue;
+        if (unlinkat(dirfd, entry->d_name, 0) == 0)
+            removed++;
+    }
+    closedir(dir);
+    return removed;
+}
+
+int maildir_collect_blobs(maildir_t *maildir)
+{
+    int fd = dup(maildir->blobs_fd);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    rewinddir(dir);
+
+    int removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        int subdir = openat(maildir->blobs_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int count = subdir >= 0 ? collect_blob_dir(subdir) : -1;
+        if (count < 0)
+        {
+            removed = -1;
+            break;
+        }
+        removed += count;
+    }
+    closedir(dir);
+    return removed;
+}
+
+bool maildir_keep_in_tmp(maildir_t *m, int fd, char *filename)
+{
+    if (!m->use_tmpfile)
+        return true;
+
+    return link_tmpfile(fd, m->tmp_fd, filename);
+}
+
+void maildir_remove_from_tmp(maildir_t *m, const char *filename)
+{
+    if (!m->use_tmpfile)
+        unlinkat(m->tmp_fd, filename, 0);
+}
+
+int maildir_folder_fd(maildir_t *m, enum maildir_folder folder)
+{
+    int fds[MAILDIR_FOLDER_COUNT] = { m->tmp_fd, m->cur_fd, m->relay_fd };
+    return fds[folder];
+}
+
+bool maildir_sync_folder(maildir_t *m, enum maildir_folder folder)
+{
+    return fsync(maildir_folder_fd(m, folder)) == 0;
+}
+
+bool maildir_sync_entry(maildir_t *m, enum maildir_folder folder, const char *filename)
+{
+    if (!maildir_is_sharded(m, folder))
+        return maildir_sync_folder(m, folder);
+
+    int fd = maildir_open_shard(m, folder, filename);
+    if (fd < 0)
+        return false;
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
 }
 
 void generate_filename(char *buf, int len,
-        struct timespec time, int random_number, int pid, int worker_id, int deliveries, char *hostname)
+        struct timespec time, unsigned long long random_number, int pid, int worker_id,
+        unsigned long long deliveries, char *hostname)
 
 {
-    snprintf(buf, len, "%ld.R%dM%dP%dT%dQ%d.%s", (long int)time.tv_sec,
+    snprintf(buf, len, "%ld.R%016llxM%dP%dT%dQ%llu.%s", (long int)time.tv_sec,
              random_number, (int)(time.tv_nsec / 1000), pid, worker_id, deliveries,
              hostname); 
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <time.h>
 
 /**
@@ -15,6 +16,26 @@
  */
 
 
+/**
+ * @brief Папки maildir, в которые попадает письмо
+ */
+enum maildir_folder
+{
+    MAILDIR_TMP,
+    MAILDIR_CUR,
+    MAILDIR_RELAY,
+    MAILDIR_FOLDER_COUNT
+};
+
+/**
+ * @brief Уровни вложенности подпапок cur и relay при разбиении
+ */
+#define MAILDIR_SHARD_LEVELS 2
+/**
+ * @brief Наибольшее число подпапок на уровне
+ */
+#define MAILDIR_MAX_SHARD_FANOUT 4096
+
 /**
  * @brief Стркутура папки maildir
  */
@@ -38,6 +59,32 @@ typedef struct maildir_t
      * подхватить SMTP-клиент и отправить дальше.
      */
     char *relay_path;
+    /**
+     * Открытые дескрипторы папок. Держатся всё время работы сервера,
+     * чтобы создание и перенос письма не разрешали пути заново.
+     */
+    int root_fd;
+    int tmp_fd;
+    int cur_fd;
+    int relay_fd;
+    /**
+     * Папка сегментов, -1 пока не открыта. См. #maildir_open_segments
+     */
+    int segments_fd;
+    /**
+     * Папка тел писем по хешу, -1 пока не открыта. См. #maildir_open_blobs
+     */
+    int blobs_fd;
+    /**
+     * Число подпапок на каждом из #MAILDIR_SHARD_LEVELS уровней cur и relay,
+     * 0 - письма лежат прямо в папке. См. #maildir_set_sharding
+     */
+    int shard_fanout;
+    /**
+     * Письма создаются безымянными (O_TMPFILE) и получают имя только
+     * при переносе в cur или relay. См. #maildir_enable_tmpfile
+     */
+    bool use_tmpfile;
 } maildir_t;
 
 /**
@@ -63,12 +110,100 @@ maildir_t maildir_open(const char *root_path, int *error);
  */
 void maildir_close(maildir_t *maildir);
 
+/**
+ * @brief Включает доставку через безымянные файлы
+ *
+ * Письмо создаётся в tmp с флагом O_TMPFILE и появляется в папке только
+ * при переносе, через linkat. Незаконченные письма не видны в tmp,
+ * а оборванные сессии ничего после себя не оставляют.
+ *
+ * @return @c false, если ядро или файловая система не поддерживают
+ * O_TMPFILE. Тогда письма по-прежнему создаются в tmp под своим именем.
+ */
+bool maildir_enable_tmpfile(maildir_t *maildir);
+
+/**
+ * @brief Включает разбиение cur и relay на подпапки
+ *
+ * Письмо попадает в подпапку, выбранную по хешу имени файла, например
+ * cur/3f/a0/. Подпапки создаются при первом письме в них. Разбиение
+ * записывается в файл layout в корне maildir, и #maildir_open в следующий
+ * раз берёт его оттуда.
+ *
+ * @param fanout - число подпапок на уровне, 0 - без разбиения
+ * @return @c false, если maildir уже разбит иначе или файл layout
+ * не удалось записать
+ */
+bool maildir_set_sharding(maildir_t *maildir, int fanout);
 
 /**
- * Генерирует случайное имя для файла почты
+ * @brief Разбита ли папка @a folder на подпапки
+ */
+bool maildir_is_sharded(maildir_t *maildir, enum maildir_folder folder);
+
+/**
+ * @brief Открывает подпапку разбитой папки @a folder, в которую попадёт
+ * письмо @a filename, при необходимости создаёт её
+ *
+ * @return дескриптор, который нужно закрыть, или -1 при ошибке
+ */
+int maildir_open_shard(maildir_t *maildir, enum maildir_folder folder, const char *filename);
+
+/**
+ * @brief Открывает папку segments для хранения писем в сегментах,
+ * при необходимости создаёт её
+ *
+ * @return @c false, если папку не удалось создать или открыть
+ */
+bool maildir_open_segments(maildir_t *maildir);
+
+/**
+ * @brief Открывает папку blobs для хранения одинаковых тел писем один раз,
+ * при необходимости создаёт её
+ *
+ * Тело лежит в blobs/ab/abcd..., где abcd... - SHA-256 тела в
+ * шестнадцатеричной записи, а письма в cur и relay - жёсткие ссылки на
+ * него. Число ссылок на тело - это число ссылок на его inode: запись в
+ * blobs плюс по одной на каждое письмо. Отдельного счётчика, который
+ * нужно было бы сбрасывать на диск вместе с письмом, нет.
+ *
+ * @return @c false, если папку не удалось создать или открыть
+ */
+bool maildir_open_blobs(maildir_t *maildir);
+
+/**
+ * @brief Делает доставленное письмо @a filename в папке @a folder ссылкой
+ * на тело с хешем @a digest
+ *
+ * Если такое тело уже есть, письмо заменяется ссылкой на него, и его
+ * собственная копия освобождается. Если нет, письмо само становится
+ * этим телом. Запись о письме меняется атомарно: читатель видит либо
+ * старый файл, либо тело с тем же содержимым.
+ *
+ * @return @c false при ошибке; письмо при этом остаётся на месте
+ */
+bool maildir_deduplicate(maildir_t *maildir, enum maildir_folder folder, const char *filename,
+        const char *digest);
+
+/**
+ * @brief Удаляет тела, на которые не ссылается ни одно письмо
+ *
+ * Одновременная доставка не мешает: письмо, не успевшее сослаться на
+ * удалённое тело, остаётся отдельным файлом.
+ *
+ * @return количество удалённых тел или -1 при ошибке
+ */
+int maildir_collect_blobs(maildir_t *maildir);
+
+/**
+ * Генерирует имя для файла почты
+ *
+ * @param random_number - случайная часть имени, см. #unique_id_next
+ * @param deliveries - номер письма у рабочего потока
  */
 void generate_filename(char *buf, int len,
-        struct timespec time, int random_number, int pid, int worker_id, int deliveries, char *hostname);
+        struct timespec time, unsigned long long random_number, int pid, int worker_id,
+        unsigned long long deliveries, char *hostname);
 
 /**
  * Создаёт файл письма в папке tmp
@@ -77,13 +212,55 @@ int maildir_create_in_tmp(maildir_t *m, char *name);
 
 /**
  * Переносит файл из tmp в cur
+ *
+ * @param fd - дескриптор, полученный от #maildir_create_in_tmp
  */
-void maildir_move_to_cur(maildir_t *m, char *filename);
+bool maildir_move_to_cur(maildir_t *m, int fd, char *filename);
 
 /**
  * Переносит файл из tmp в relay
+ *
+ * @param fd - дескриптор, полученный от #maildir_create_in_tmp
+ */
+bool maildir_move_to_relay(maildir_t *m, int fd, char *filename);
+
+/**
+ * Добавляет уже доставленному письму @a src_name из папки @a src_folder
+ * ещё одно имя @a name в папке @a folder - жёсткую ссылку на тот же файл.
+ * Так письмо нескольким получателям пишется на диск один раз.
+ */
+bool maildir_link_delivered(maildir_t *m, enum maildir_folder src_folder, const char *src_name,
+        enum maildir_folder folder, const char *name);
+
+/**
+ * Оставляет файл в tmp под именем @a filename. Нужно только безымянному
+ * файлу, иначе он пропадёт при закрытии дескриптора.
+ */
+bool maildir_keep_in_tmp(maildir_t *m, int fd, char *filename);
+
+/**
+ * Удаляет из tmp незаконченное письмо @a filename. Безымянному файлу
+ * это не нужно: он пропадёт при закрытии дескриптора
+ */
+void maildir_remove_from_tmp(maildir_t *m, const char *filename);
+
+/**
+ * Дескриптор папки @a folder
+ */
+int maildir_folder_fd(maildir_t *m, enum maildir_folder folder);
+
+/**
+ * Сбрасывает на диск записи папки @a folder: после этого перенесённые
+ * в неё письма переживут сбой питания. Для разбитой папки сбрасывает
+ * только её саму, а не подпапки: см. #maildir_sync_entry
+ */
+bool maildir_sync_folder(maildir_t *m, enum maildir_folder folder);
+
+/**
+ * Сбрасывает на диск запись о письме @a filename в папке @a folder,
+ * с учётом разбиения на подпапки
  */
-void maildir_move_to_relay(maildir_t *m, char *filename);
+bool maildir_sync_entry(maildir_t *m, enum maildir_folder folder, const char *filename);
 
 /*
  * @}
@@ -2,77 +2,228 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include "crlf_scan.h"
 
 
 message_builder_t create_message_builder()
 {
     message_builder_t result;
-    result.unparsed_message_buffer = dynamic_vector_create(sizeof(char), 256);
-    result.parsed_message_buffer = dynamic_vector_create(sizeof(message_t), 16);
+    result.buffer = dynamic_vector_create(sizeof(char), 256);
+    result.lines = dynamic_vector_create(sizeof(message_span_t), 16);
+    result.lines_head = 0;
+    result.lines_count = 0;
+    result.unparsed_start = 0;
+    result.scanned = 0;
+    result.held = 0;
+    result.raw = false;
 
     return result;
 }
 
-void message_builder_add_string(message_builder_t *builder, const char *str, int len)
+static message_span_t *line_at(message_builder_t *builder, int i)
+{
+    // Ёмкость очереди - степень двойки
+    int pos = (builder->lines_head + i) & (builder->lines.capacity - 1);
+    return (message_span_t*)builder->lines.data + pos;
+}
+
+static void push_line(message_builder_t *builder, message_span_t span)
+{
+    if (builder->lines_count == builder->lines.capacity)
+    {
+        // Очередь заполнена: удваиваем и разворачиваем хвост, переехавший
+        // в начало, за старую границу
+        int old_capacity = builder->lines.capacity;
+        dynamic_vector_reserve_at_least(&builder->lines, old_capacity * 2);
+        message_span_t *lines = builder->lines.data;
+        memcpy(lines + old_capacity, lines, builder->lines_head * sizeof(message_span_t));
+    }
+    *line_at(builder, builder->lines_count) = span;
+    builder->lines_count++;
+}
+
+static message_span_t pop_line(message_builder_t *builder)
+{
+    assert(builder->lines_count > 0);
+    message_span_t span = *line_at(builder, 0);
+    builder->lines_head = (builder->lines_head + 1) & (builder->lines.capacity - 1);
+    builder->lines_count--;
+    return span;
+}
+
+// Сдвигает в начало буфера всё, что ещё не выдано, отбрасывая
+// освобождённые строки
+static void compact(message_builder_t *builder)
+{
+    int base = builder->lines_count > 0 ? line_at(builder, 0)->offset : builder->unparsed_start;
+    if (base == 0)
+    {
+        return;
+    }
+
+    memmove(builder->buffer.data, builder->buffer.data + base, builder->buffer.size - base);
+    builder->buffer.size -= base;
+
+    for (int i = 0; i < builder->lines_count; i++)
+    {
+        line_at(builder, i)->offset -= base;
+    }
+    builder->unparsed_start -= base;
+    builder->scanned -= base;
+}
+
+static void frame_lines(message_builder_t *builder)
+{
+    // Поиск продолжается с места, где остановился в прошлый раз, поэтому
+    // длинная строка, пришедшая по частям, просматривается один раз
+    const char *data = builder->buffer.data;
+    int size = builder->buffer.size;
+    int cr;
+    while ((cr = crlf_find(data, builder->scanned, size)) >= 0)
+    {
+        // \r\n в строку не включаем
+        message_span_t span = { .offset = builder->unparsed_start, .len = cr - builder->unparsed_start };
+        push_line(builder, span);
+
+        builder->unparsed_start = cr + 2;
+        builder->scanned = cr + 2;
+    }
+    // Последний '\r' может оказаться началом "\r\n" из следующего чанка
+    builder->scanned = size - 1 > builder->unparsed_start ? size - 1 : builder->unparsed_start;
+}
+
+char *message_builder_reserve(message_builder_t *builder, int len)
 {
     assert(builder);
     assert(len > 0);
+    // Буфер может переехать, выданные строки стали бы недействительными
+    assert(builder->held == 0);
 
-    dynamic_vector_copy_back(&builder->unparsed_message_buffer, str, len * sizeof(char));
+    compact(builder);
 
-    const char *data = builder->unparsed_message_buffer.data;
-    int message_start = 0;
-    for (int i = 0; i < builder->unparsed_message_buffer.size - 1; i++)
+    int capacity = builder->buffer.capacity > 0 ? builder->buffer.capacity : 1;
+    while (capacity - builder->buffer.size < len)
     {
-        if (data[i] == '\r' && data[i + 1] == '\n')
-        {
-            int message_end = i+1;
-            int message_len = message_end - message_start + 1 - 2; // не копируем \r\n
+        capacity *= 2;
+    }
+    dynamic_vector_reserve_at_least(&builder->buffer, capacity);
 
-            char *str = malloc(message_len + 1);
-            memcpy(str, data + message_start, message_len);
-            str[message_len] = '\0';
+    return (char*)builder->buffer.data + builder->buffer.size;
+}
 
-            message_t message = { .len = message_len, .text = str };
-            dynamic_vector_copy_elem_back(&builder->parsed_message_buffer, &message);
+void message_builder_commit(message_builder_t *builder, int len)
+{
+    assert(builder);
+    assert(len >= 0 && builder->buffer.size + len <= builder->buffer.capacity);
 
-            message_start = i + 2;
-            i++;
-        }
+    builder->buffer.size += len;
+    if (!builder->raw)
+    {
+        frame_lines(builder);
     }
+}
 
-    int unparsed_data_left = builder->unparsed_message_buffer.size - message_start;
-    memmove(builder->unparsed_message_buffer.data,
-            builder->unparsed_message_buffer.data + message_start,
-            unparsed_data_left);
-    builder->unparsed_message_buffer.size = unparsed_data_left;
+void message_builder_add_string(message_builder_t *builder, const char *str, int len)
+{
+    assert(builder);
+    assert(len > 0);
 
+    memcpy(message_builder_reserve(builder, len), str, len * sizeof(char));
+    message_builder_commit(builder, len);
 }
 
 void message_builder_close(message_builder_t *builder)
 {
-    dynamic_vector_close(&builder->unparsed_message_buffer);
-    dynamic_vector_close(&builder->parsed_message_buffer);
+    dynamic_vector_close(&builder->buffer);
+    dynamic_vector_close(&builder->lines);
 }
 
 int message_builder_ready_message_count(message_builder_t *builder)
 {
-    return builder->parsed_message_buffer.size;
+    return builder->lines_count;
+}
+
+bool message_builder_next_line(message_builder_t *builder, message_t *line)
+{
+    return message_builder_take_lines(builder, line, 1) == 1;
+}
+
+int message_builder_take_lines(message_builder_t *builder, message_t *lines, int max)
+{
+    int count = builder->lines_count < max ? builder->lines_count : max;
+    for (int i = 0; i < count; i++)
+    {
+        message_span_t span = pop_line(builder);
+        lines[i].text = (char*)builder->buffer.data + span.offset;
+        lines[i].len = span.len;
+    }
+
+    builder->held += count;
+    return count;
+}
+
+void message_builder_release_lines(message_builder_t *builder)
+{
+    builder->held = 0;
+}
+
+void message_builder_enter_raw(message_builder_t *builder, const char *from)
+{
+    int offset = from - (const char*)builder->buffer.data;
+    assert(offset >= 0 && offset <= builder->buffer.size);
+
+    // Строки после from уже выделены, но ещё не обработаны: возвращаем их
+    // в необработанные байты
+    builder->lines_head = 0;
+    builder->lines_count = 0;
+    builder->unparsed_start = offset;
+    builder->scanned = offset;
+    builder->raw = true;
+}
+
+char *message_builder_raw_data(message_builder_t *builder, int *len)
+{
+    assert(builder->raw);
+    *len = builder->buffer.size - builder->unparsed_start;
+    return (char*)builder->buffer.data + builder->unparsed_start;
+}
+
+void message_builder_consume_raw(message_builder_t *builder, int len)
+{
+    assert(builder->raw);
+    assert(len >= 0 && builder->unparsed_start + len <= builder->buffer.size);
+    builder->unparsed_start += len;
+    builder->scanned = builder->unparsed_start;
+}
+
+void message_builder_leave_raw(message_builder_t *builder)
+{
+    assert(builder->raw);
+    builder->raw = false;
+    frame_lines(builder);
+}
+
+const char *message_builder_unparsed(message_builder_t *builder, int *len)
+{
+    *len = builder->buffer.size - builder->unparsed_start;
+    return (const char*)builder->buffer.data + builder->unparsed_start;
 }
 
-// TODO: отдавать все сообщения, а не по одному? Позволит избежать
-// лишних операций с буфером сообщений. Возможно стоит использовать
-// кольцевой буфер вместо линейного
 message_t message_builder_get_message(message_builder_t *builder)
 {
-    if (builder->parsed_message_buffer.size < 1)
+    message_t line;
+    if (!message_builder_next_line(builder, &line))
     {
         return (message_t){0,0};
     }
 
-    message_t result = *((message_t*)builder->parsed_message_buffer.data);
-    // Используем стабильное удаление, так как нам важен порядок элементов
-    dynamic_vector_stable_delete_at(&builder->parsed_message_buffer, 0);
+    // Копия не ссылается на буфер, поэтому строку сразу считаем освобождённой
+    message_t result;
+    result.len = line.len;
+    result.text = malloc(line.len + 1);
+    memcpy(result.text, line.text, line.len);
+    result.text[line.len] = '\0';
+    builder->held--;
 
     return result;
 }
@@ -14,20 +14,62 @@
  * Например, в одном пакете придёт "ABC", а во втором "DEF\r\nGHIJ\r\n".
  * С помощью #message_builder_add_string и #message_builder_get_message можно
  * получить два сообщения: "ABCDEF\r\n" и "GHIJ\r\n".
+ *
+ * Данные хранятся в одном приёмном буфере, строки запоминаются как смещения
+ * в нём. #message_builder_next_line выдаёт строку без копирования и
+ * выделения памяти; место в буфере освобождается только после
+ * #message_builder_release_lines.
  */
 typedef struct message_builder_t
 {
     /**
-     * Буфер символов, в котором хранится необработанное сообщение
+     * Приёмный буфер символов. Содержит выданные, но ещё не освобождённые
+     * строки, готовые строки и необработанный хвост.
      */
-    dynamic_vector_t unparsed_message_buffer;
+    dynamic_vector_t buffer;
     /**
-     * Вектор #message_t, в котором хранятся готовые сообщения
+     * Кольцевая очередь #message_span_t с границами готовых строк в буфере.
+     * Ёмкость - степень двойки, растёт только при переполнении.
      */
-    dynamic_vector_t parsed_message_buffer;
+    dynamic_vector_t lines;
+    /**
+     * Индекс в @a lines следующей строки для выдачи
+     */
+    int lines_head;
+    /**
+     * Количество строк в очереди
+     */
+    int lines_count;
+    /**
+     * Начало необработанного хвоста (после последнего "\r\n")
+     */
+    int unparsed_start;
+    /**
+     * Позиция, с которой продолжится поиск "\r\n"
+     */
+    int scanned;
+    /**
+     * Количество выданных и не освобождённых строк
+     */
+    int held;
+    /**
+     * Режим сырых данных: строки не выделяются, байты после
+     * @a unparsed_start забирает потребитель (тело письма)
+     */
+    bool raw;
 } message_builder_t;
 
 
+/**
+ * Границы готовой строки в приёмном буфере
+ */
+typedef struct message_span_t
+{
+    int offset;
+    int len;
+} message_span_t;
+
+
 /**
  * Полное сообщение (строка, оканчивающаяся "\r\n")
  */
@@ -38,7 +80,8 @@ typedef struct message_t
      */
     int len;
     /**
-     * Текст сообщения.
+     * Текст сообщения. Строки, полученные через #message_builder_next_line,
+     * не оканчиваются нулём.
      */
     char *text;
 } message_t;
@@ -54,6 +97,22 @@ message_builder_t create_message_builder();
  */
 void message_builder_add_string(message_builder_t *builder, const char *str, int len);
 
+/**
+ * Возвращает место в приёмном буфере, куда можно записать до \p len байт
+ * (например, прочитать из сокета). Записанные байты нужно подтвердить
+ * с помощью #message_builder_commit.
+ *
+ * Может переместить буфер, поэтому вызывается только когда нет выданных
+ * строк.
+ */
+char *message_builder_reserve(message_builder_t *builder, int len);
+
+/**
+ * Подтверждает \p len байт, записанных после #message_builder_reserve,
+ * и выделяет из них готовые строки.
+ */
+void message_builder_commit(message_builder_t *builder, int len);
+
 /**
  * Закрывает #message_builder_t и освобождает всю связанную с ним память.
  */
@@ -64,6 +123,58 @@ void message_builder_close(message_builder_t *builder);
  */
 int message_builder_ready_message_count(message_builder_t *builder);
 
+/**
+ * Выдаёт следующую готовую строку в \p line без копирования.
+ * Строка указывает в приёмный буфер и остаётся действительной до вызова
+ * #message_builder_release_lines.
+ * \returns false, если готовых строк нет
+ */
+bool message_builder_next_line(message_builder_t *builder, message_t *line);
+
+/**
+ * Выдаёт сразу все готовые строки, но не больше \p max, в массив \p lines.
+ * Строки остаются действительными до вызова #message_builder_release_lines.
+ * \returns количество выданных строк
+ */
+int message_builder_take_lines(message_builder_t *builder, message_t *lines, int max);
+
+/**
+ * Освобождает все строки, выданные #message_builder_next_line и
+ * #message_builder_take_lines.
+ * Занятое ими место будет переиспользовано при следующем чтении.
+ */
+void message_builder_release_lines(message_builder_t *builder);
+
+/**
+ * Переключает сборщик в режим сырых данных начиная с байта \p from
+ * приёмного буфера (обычно сразу за выданной строкой). Готовые, но ещё
+ * не выданные строки отбрасываются, их байты снова считаются
+ * необработанными.
+ */
+void message_builder_enter_raw(message_builder_t *builder, const char *from);
+
+/**
+ * Возвращает необработанные байты в режиме сырых данных и записывает их
+ * количество в \p len. Потребитель может менять их на месте.
+ */
+char *message_builder_raw_data(message_builder_t *builder, int *len);
+
+/**
+ * Отмечает первые \p len байт из #message_builder_raw_data потреблёнными
+ */
+void message_builder_consume_raw(message_builder_t *builder, int len);
+
+/**
+ * Возвращается к выделению строк из оставшихся байт
+ */
+void message_builder_leave_raw(message_builder_t *builder);
+
+/**
+ * Возвращает необработанный хвост буфера (начало незавершённой строки)
+ * и записывает его длину в \p len.
+ */
+const char *message_builder_unparsed(message_builder_t *builder, int *len);
+
 /**
  * Извлекает сообщение из #message_builder_t.
  * 
@@ -74,4 +185,4 @@ message_t message_builder_get_message(message_builder_t *builder);
 /**
  * Освобождает сообщение, полученное из #message_builder_get_message.
  */
-void message_free(message_t *message);
\ No newline at end of file
+void message_free(message_t *message);
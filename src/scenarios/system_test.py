@@ -8,14 +8,14 @@ import shutil
 import filecmp
 
 
-def start_server(port, logfile, maildir):
+def start_server(port, logfile, maildir, extra_args=[]):
     return subprocess.Popen(['../smtpserver', '-d', '127.0.0.1', '-p', str(port), '-l', logfile, '-m', maildir, '-r',
-                             '-n', 'mysmtp.pvs.bmstu'])
+                             '-n', 'mysmtp.pvs.bmstu'] + extra_args)
 
 
-def start_server_valgrind(port, logfile, maildir):
+def start_server_valgrind(port, logfile, maildir, extra_args=[]):
     return subprocess.Popen(['valgrind', '--leak-check=full', '--child-silent-after-fork=yes', '--error-exitcode=77', '../smtpserver', '-d', '127.0.0.1', '-p', str(port), '-l', logfile, '-m', maildir, '-r',
-                             '-n', 'mysmtp.pvs.bmstu'])
+                             '-n', 'mysmtp.pvs.bmstu'] + extra_args)
 
 
 def stop_server(server):
@@ -63,13 +63,13 @@ def server_reader(s):
     return buf
 
 
-def exec_test(filename, logfile, maildir, ipv6=False, valgrind=False):
+def exec_test(filename, logfile, maildir, ipv6=False, valgrind=False, extra_args=[]):
     port = 7548
     if valgrind:
-        server = start_server_valgrind(port, logfile, maildir)
+        server = start_server_valgrind(port, logfile, maildir, extra_args)
         sleep(1)
     else:
-        server = start_server(port, logfile, maildir)
+        server = start_server(port, logfile, maildir, extra_args)
         sleep(0.1)
 
 
@@ -148,13 +148,58 @@ def are_dir_trees_equal(dir1, dir2):
     return True
 
 
+def maildir_letters(maildir):
+    """
+    Letters of a maildir by folder and content, ignoring file names and shard subdirectories.
+    """
+    letters = []
+    for folder in ['cur', 'relay', 'tmp']:
+        for path, _, names in os.walk(os.path.join(maildir, folder)):
+            for name in names:
+                if name == 'gitstub':
+                    continue
+                with open(os.path.join(path, name), 'rb') as f:
+                    letters.append((folder, f.read()))
+    return sorted(letters)
+
+
+def letters_share_blobs(maildir):
+    """
+    Check that every delivered letter is a hard link to a body in blobs/.
+    """
+    blobs = set()
+    for path, _, names in os.walk(os.path.join(maildir, 'blobs')):
+        blobs.update(os.stat(os.path.join(path, name)).st_ino for name in names)
+    for folder in ['cur', 'relay']:
+        for path, _, names in os.walk(os.path.join(maildir, folder)):
+            for name in names:
+                if os.stat(os.path.join(path, name)).st_ino not in blobs:
+                    return False
+    return True
+
+
+def export_segments(maildir):
+    """
+    Export every segment of a maildir with segment_export and remove the segments.
+    """
+    segments = os.path.join(maildir, 'segments')
+    for name in sorted(os.listdir(segments)):
+        path = os.path.join(segments, name)
+        if subprocess.call(['../tools/segment_export', path, maildir], stdout=subprocess.DEVNULL) != 0:
+            return False
+        os.remove(path)
+    os.rmdir(segments)
+    return True
+
+
 class SystemTest(object):
-    def __init__(self, scenario_name, reference_dir=None):
+    def __init__(self, scenario_name, reference_dir=None, server_args=[]):
         self.scenario_name = scenario_name
         self.reference_dir = reference_dir
+        self.server_args = server_args
         self.result = False
 
-    def run(self, ipv6=False, valgrind=False):
+    def run(self, ipv6=False, valgrind=False, extra_args=[], segments=False, sharded=False, deduplicated=False):
         print('SCENARIO {}: START'.format(self.scenario_name))
 
         logfile = "./{}-log".format(self.scenario_name)
@@ -165,14 +210,31 @@ class SystemTest(object):
         if os.path.exists(maildir):
             shutil.rmtree(maildir)
 
-        self.result = exec_test(self.scenario_name, logfile, maildir, ipv6=ipv6, valgrind=valgrind)
+        self.result = exec_test(self.scenario_name, logfile, maildir, ipv6=ipv6, valgrind=valgrind,
+                                extra_args=extra_args + self.server_args)
         if self.result:
             pass
             #print('SCENARIO {}: COMMAND SUCCESS'.format(self.scenario_name))
         else:
             print('SCENARIO {}: COMMAND FAIL'.format(self.scenario_name))
 
-        if self.result and self.reference_dir is not None:
+        if self.result and segments:
+            # Exported letters are named after the segment, not the delivery number
+            self.result = export_segments(maildir) and (self.reference_dir is None
+                    or maildir_letters(maildir) == maildir_letters(self.reference_dir))
+            if not self.result:
+                print('SCENARIO {}: SEGMENT EXPORT FAIL'.format(self.scenario_name))
+        elif self.result and sharded and self.reference_dir is not None:
+            self.result = (os.path.exists(os.path.join(maildir, 'layout'))
+                    and maildir_letters(maildir) == maildir_letters(self.reference_dir))
+            if not self.result:
+                print('SCENARIO {}: SHARDED DIRECTORY COMPARISON FAIL'.format(self.scenario_name))
+        elif self.result and deduplicated and self.reference_dir is not None:
+            self.result = (letters_share_blobs(maildir)
+                    and maildir_letters(maildir) == maildir_letters(self.reference_dir))
+            if not self.result:
+                print('SCENARIO {}: DEDUPLICATED DIRECTORY COMPARISON FAIL'.format(self.scenario_name))
+        elif self.result and self.reference_dir is not None:
             self.result = are_dir_trees_equal(maildir, self.reference_dir)
             if self.result:
                 pass
@@ -199,10 +261,14 @@ def test_suite():
         SystemTest('letter_to_this_server', 'letter_to_this_server-expected'),
         SystemTest('letter_to_other_server', 'letter_to_other_server-expected'),
         SystemTest('two_mails', 'two_mails-expected'),
+        SystemTest('multiple_recepients', 'multiple_recepients-expected'),
         SystemTest('unrecognized_command'),
         SystemTest('rcpt_before_mailto', 'letter_to_this_server-expected'),
         SystemTest('rset_resets', 'letter_to_this_server-expected'),
         SystemTest('vrfy_fails'),
+        SystemTest('pipelining', 'letter_to_this_server-expected'),
+        SystemTest('size_declared_too_big', 'letter_to_this_server-expected'),
+        SystemTest('size_exceeded', 'size_exceeded-expected', server_args=['-M', '16']),
     ]
 
 
@@ -233,6 +299,47 @@ def ipv6_tests():
     print('-'*24)
     return run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=True))
 
+def reuseport_tests():
+    print('REUSEPORT')
+    print('-'*24)
+    return run_tests_and_report_results(test_suite(),
+                                        lambda x: x.run(ipv6=False, extra_args=['-u', '-t', '2']))
+
+def tmpfile_tests():
+    print('TMPFILE')
+    print('-'*24)
+    return run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-o']))
+
+def durability_tests():
+    print('DURABILITY')
+    print('-'*24)
+    return (run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-f', 'message']))
+            and run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-f', 'group', '-o'])))
+
+def async_spool_tests():
+    print('ASYNC SPOOL')
+    print('-'*24)
+    return (run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-a', 'uring', '-f', 'message']))
+            and run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-a', 'threads', '-o'])))
+
+def segment_tests():
+    print('SEGMENTS')
+    print('-'*24)
+    return (run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-S', '65536'], segments=True))
+            and run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-S', '65536', '-f', 'group'], segments=True)))
+
+def sharding_tests():
+    print('SHARDING')
+    print('-'*24)
+    return (run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-H', '256', '-f', 'group'], sharded=True))
+            and run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-H', '16', '-a', 'threads', '-o'], sharded=True)))
+
+def dedup_tests():
+    print('DEDUP')
+    print('-'*24)
+    return (run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-D', '-f', 'group'], deduplicated=True))
+            and run_tests_and_report_results(test_suite(), lambda x: x.run(ipv6=False, extra_args=['-D', '-H', '16', '-a', 'threads', '-o'], deduplicated=True)))
+
 def exec_valgrind():
     print('Valgrind')
     print('-'*24)
@@ -247,6 +354,20 @@ if __name__ == '__main__':
         result = ipv4_tests() and result
     if 'ipv6' in sys.argv:
         result = ipv6_tests() and result
+    if 'reuseport' in sys.argv:
+        result = reuseport_tests() and result
+    if 'tmpfile' in sys.argv:
+        result = tmpfile_tests() and result
+    if 'durability' in sys.argv:
+        result = durability_tests() and result
+    if 'async' in sys.argv:
+        result = async_spool_tests() and result
+    if 'segments' in sys.argv:
+        result = segment_tests() and result
+    if 'sharding' in sys.argv:
+        result = sharding_tests() and result
+    if 'dedup' in sys.argv:
+        result = dedup_tests() and result
     if 'valgrind' in sys.argv:
         result = exec_valgrind() and result
 
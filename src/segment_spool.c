@@ -0,0 +1,412 @@
+#include "segment_spool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "logger.h"
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+
+static segment_index_entry_t *entry_at(segment_t *segment, int index)
+{
+    return (segment_index_entry_t*)(segment->base + segment->capacity)  - (index + 1);
+}
+
+// Хватит ли места под запись письма и ещё одну запись индекса
+static bool segment_fits(segment_t *segment, uint64_t record_size)
+{
+    uint64_t index_start = segment->capacity - (uint64_t)(segment->count + 1) * sizeof(segment_index_entry_t);
+    return segment->data_end + record_size <= index_start;
+}
+
+static void close_segment(segment_t *segment)
+{
+    if (segment->base)
+        munmap(segment->base, segment->capacity);
+    if (segment->fd >= 0)
+        close(segment->fd);
+    memset(segment, 0, sizeof(*segment));
+    segment->fd = -1;
+}
+
+// Сбрасывает на диск байты [from, to) отображения
+static bool sync_range(segment_t *segment, uint64_t from, uint64_t to)
+{
+    if (from >= to)
+    {
+        return true;
+    }
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = from & ~(page - 1);
+    return msync(segment->base + start, to - start, MS_SYNC) == 0;
+}
+
+static bool create_segment(segment_spool_t *spool, uint64_t capacity)
+{
+    segment_t *segment = &spool->current;
+    int fd = -1;
+    char name[64];
+    // Сегменты прошлых запусков с тем же временем не перезаписываем
+    for (int attempt = 0; fd < 0 && attempt < 1000; attempt++)
+    {
+        snprintf(name, sizeof(name), "%ld-W%d-%d.seg", spool->started, spool->worker_id, spool->sequence++);
+        fd = openat(spool->dir_fd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0 && errno != EEXIST)
+        {
+            break;
+        }
+    }
+    if (fd < 0)
+    {
+        LOG_ERROR("Could not create segment: %d", errno);
+        return false;
+    }
+
+    // Место выделяем сразу, чтобы запись в отображение не упиралась
+    // в нехватку места на диске
+    if (fallocate(fd, 0, 0, capacity) != 0 && ftruncate(fd, capacity) != 0)
+    {
+        LOG_ERROR("Could not allocate segment %s: %d", name, errno);
+        close(fd);
+        unlinkat(spool->dir_fd, name, 0);
+        return false;
+    }
+
+    char *base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        LOG_ERROR("Could not map segment %s: %d", name, errno);
+        close(fd);
+        unlinkat(spool->dir_fd, name, 0);
+        return false;
+    }
+
+    segment_header_t *header = (segment_header_t*)base;
+    memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+    header->version = SEGMENT_VERSION;
+    header->worker_id = spool->worker_id;
+    header->capacity = capacity;
+
+    segment->fd = fd;
+    segment->base = base;
+    segment->capacity = capacity;
+    segment->data_end = sizeof(segment_header_t);
+    segment->count = 0;
+    spool->synced_end = 0;
+    spool->synced_count = 0;
+    spool->last_body_len = -1;
+    return true;
+}
+
+void segment_spool_init(segment_spool_t *spool, int dir_fd, int worker_id, uint64_t segment_size,
+        long started, bool durable)
+{
+    memset(spool, 0, sizeof(*spool));
+    spool->dir_fd = dir_fd;
+    spool->worker_id = worker_id;
+    spool->segment_size = segment_size;
+    spool->started = started;
+    spool->durable = durable;
+    spool->current.fd = -1;
+    spool->last_body_len = -1;
+}
+
+void segment_spool_close(segment_spool_t *spool)
+{
+    if (spool->current.fd >= 0)
+    {
+        segment_spool_sync(spool);
+        close_segment(&spool->current);
+    }
+}
+
+bool segment_spool_append(segment_spool_t *spool, const char *from, int from_len,
+        const char *rcpt, int rcpt_len, const char *body, int body_len, enum maildir_folder folder,
+        bool same_body)
+{
+    // Длины адресов в индексе 16-битные: обрезанная длина сдвинула бы тело
+    if (from_len > UINT16_MAX || rcpt_len > UINT16_MAX)
+    {
+        LOG_ERROR("Segment record address is too long: %d, %d", from_len, rcpt_len);
+        return false;
+    }
+
+    // Тело предыдущего получателя можно переиспользовать, только пока
+    // оно в текущем сегменте
+    bool share = same_body && spool->current.fd >= 0 && spool->last_body_len == body_len
+        && segment_fits(&spool->current, ALIGN8((uint64_t)from_len + rcpt_len));
+    uint64_t record_size = ALIGN8((uint64_t)from_len + rcpt_len + (share ? 0 : body_len));
+    if (spool->current.fd < 0 || !segment_fits(&spool->current, record_size))
+    {
+        // Несброшенные письма закрываемого сегмента должны успеть на диск
+        if (spool->current.fd >= 0 && !segment_spool_sync(spool))
+        {
+            return false;
+        }
+        close_segment(&spool->current);
+
+        uint64_t needed = sizeof(segment_header_t) + record_size + sizeof(segment_index_entry_t);
+        uint64_t capacity = spool->segment_size;
+        while (capacity < needed)
+        {
+            capacity *= 2;
+        }
+        if (!create_segment(spool, capacity))
+        {
+            return false;
+        }
+    }
+
+    segment_t *segment = &spool->current;
+    char *record = segment->base + segment->data_end;
+    memcpy(record, from, from_len);
+    memcpy(record + from_len, rcpt, rcpt_len);
+    if (!share)
+    {
+        memcpy(record + from_len + rcpt_len, body, body_len);
+        spool->last_body_offset = segment->data_end + from_len + rcpt_len;
+        spool->last_body_len = body_len;
+    }
+
+    segment_index_entry_t *entry = entry_at(segment, segment->count);
+    entry->offset = segment->data_end;
+    entry->body_offset = spool->last_body_offset;
+    entry->body_len = body_len;
+    entry->from_len = from_len;
+    entry->rcpt_len = rcpt_len;
+    entry->folder = folder;
+    entry->state = spool->durable ? SEGMENT_ENTRY_WRITTEN : SEGMENT_ENTRY_COMMITTED;
+
+    segment->data_end += record_size;
+    segment->count++;
+    return true;
+}
+
+bool segment_spool_sync(segment_spool_t *spool)
+{
+    segment_t *segment = &spool->current;
+    if (segment->fd < 0 || spool->synced_count == segment->count)
+    {
+        return true;
+    }
+
+    // Данные писем, затем индекс с отметками о приёме
+    if (!sync_range(segment, spool->synced_end, segment->data_end))
+    {
+        LOG_ERROR("Could not sync segment data: %d", errno);
+        return false;
+    }
+
+    if (spool->durable)
+    {
+        for (int i = spool->synced_count; i < segment->count; i++)
+        {
+            entry_at(segment, i)->state = SEGMENT_ENTRY_COMMITTED;
+        }
+    }
+    uint64_t index_start = (char*)entry_at(segment, segment->count - 1) - segment->base;
+    uint64_t index_end = (char*)entry_at(segment, spool->synced_count) - segment->base + sizeof(segment_index_entry_t);
+    if (!sync_range(segment, index_start, index_end))
+    {
+        LOG_ERROR("Could not sync segment index: %d", errno);
+        return false;
+    }
+
+    spool->synced_end = segment->data_end;
+    spool->synced_count = segment->count;
+    return true;
+}
+
+bool segment_map(const char *path, bool writable, segment_t *segment)
+{
+    memset(segment, 0, sizeof(*segment));
+    segment->fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (segment->fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(segment->fd, &st) != 0 || (uint64_t)st.st_size < sizeof(segment_header_t))
+    {
+        close_segment(segment);
+        return false;
+    }
+
+    segment->capacity = st.st_size;
+    segment->base = mmap(NULL, segment->capacity, PROT_READ | (writable ? PROT_WRITE : 0),
+            MAP_SHARED, segment->fd, 0);
+    if (segment->base == MAP_FAILED)
+    {
+        segment->base = NULL;
+        close_segment(segment);
+        return false;
+    }
+
+    segment_header_t *header = (segment_header_t*)segment->base;
+    if (memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) != 0
+            || header->version != SEGMENT_VERSION || header->capacity != segment->capacity)
+    {
+        close_segment(segment);
+        errno = EINVAL;
+        return false;
+    }
+
+    // Индекс заканчивается первой свободной записью
+    segment->data_end = sizeof(segment_header_t);
+    uint64_t max_entries = (segment->capacity - sizeof(segment_header_t)) / sizeof(segment_index_entry_t);
+    while ((uint64_t)segment->count < max_entries && entry_at(segment, segment->count)->state != SEGMENT_ENTRY_FREE)
+    {
+        segment_index_entry_t *entry = entry_at(segment, segment->count);
+        uint64_t end = entry->offset + entry->from_len + entry->rcpt_len;
+        if (entry->body_offset + entry->body_len > end)
+        {
+            end = entry->body_offset + entry->body_len;
+        }
+        if (ALIGN8(end) > segment->data_end)
+        {
+            segment->data_end = ALIGN8(end);
+        }
+        segment->count++;
+    }
+    return true;
+}
+
+void segment_unmap(segment_t *segment)
+{
+    close_segment(segment);
+}
+
+bool segment_get_record(segment_t *segment, int index, segment_record_t *record)
+{
+    if (index < 0 || index >= segment->count)
+    {
+        return false;
+    }
+
+    segment_index_entry_t *entry = entry_at(segment, index);
+    uint64_t index_start = segment->capacity - (uint64_t)segment->count * sizeof(segment_index_entry_t);
+    if (entry->offset + (uint64_t)entry->from_len + entry->rcpt_len > index_start
+            || entry->body_offset + entry->body_len > index_start)
+    {
+        return false;
+    }
+
+    const char *data = segment->base + entry->offset;
+    record->from = data;
+    record->from_len = entry->from_len;
+    record->rcpt = data + entry->from_len;
+    record->rcpt_len = entry->rcpt_len;
+    record->body = segment->base + entry->body_offset;
+    record->body_len = entry->body_len;
+    record->folder = entry->folder;
+    record->state = entry->state;
+    return true;
+}
+
+void segment_set_state(segment_t *segment, int index, enum segment_entry_state state)
+{
+    entry_at(segment, index)->state = state;
+}
+
+static bool write_all(int fd, const char *data, int len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+int segment_export(segment_t *segment, maildir_t *maildir, const char *prefix)
+{
+    int exported = 0;
+    bool touched[MAILDIR_FOLDER_COUNT] = { false };
+    for (int i = 0; i < segment->count; i++)
+    {
+        segment_record_t record;
+        if (!segment_get_record(segment, i, &record))
+        {
+            return -1;
+        }
+        if (record.state != SEGMENT_ENTRY_COMMITTED)
+        {
+            continue;
+        }
+
+        char name[256];
+        snprintf(name, sizeof(name), "%s.%d", prefix, i);
+        int fd = maildir_create_in_tmp(maildir, name);
+        if (fd < 0)
+        {
+            return -1;
+        }
+
+        bool stored = write_all(fd, record.body, record.body_len) && fdatasync(fd) == 0;
+        if (stored)
+        {
+            switch (record.folder)
+            {
+            case MAILDIR_CUR:
+                stored = maildir_move_to_cur(maildir, fd, name);
+                break;
+            case MAILDIR_RELAY:
+                stored = maildir_move_to_relay(maildir, fd, name);
+                break;
+            default:
+                stored = maildir_keep_in_tmp(maildir, fd, name);
+                break;
+            }
+        }
+        close(fd);
+        if (!stored)
+        {
+            return -1;
+        }
+
+        // Подпапку сбрасываем сразу, целые папки - один раз в конце
+        if (maildir_is_sharded(maildir, record.folder))
+        {
+            if (!maildir_sync_entry(maildir, record.folder, name))
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            touched[record.folder] = true;
+        }
+        exported++;
+    }
+
+    for (int folder = 0; folder < MAILDIR_FOLDER_COUNT; folder++)
+    {
+        if (touched[folder] && !maildir_sync_folder(maildir, folder))
+        {
+            return -1;
+        }
+    }
+
+    // Письма помечаются выгруженными, только когда они уже на диске
+    for (int i = 0; i < segment->count; i++)
+    {
+        if (entry_at(segment, i)->state == SEGMENT_ENTRY_COMMITTED)
+        {
+            segment_set_state(segment, i, SEGMENT_ENTRY_EXPORTED);
+        }
+    }
+    return exported;
+}
@@ -0,0 +1,238 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file
+ * @brief Хранение писем в файлах-сегментах
+ *
+ * Вместо файла на каждое письмо рабочий поток дописывает письма в свой
+ * сегмент: заранее выделенный файл, отображённый в память. Письмо - это
+ * одно копирование в отображение, без создания inode и переноса между
+ * папками maildir.
+ *
+ * Формат сегмента:
+ * - #segment_header_t в начале файла;
+ * - записи писем (отправитель, получатель, тело) растут от заголовка
+ *   к концу файла, каждая выровнена на 8 байт. Запись следующего
+ *   получателя того же письма содержит только отправителя и получателя,
+ *   а тело берёт из записи первого;
+ * - индекс #segment_index_entry_t растёт от конца файла к началу:
+ *   запись i лежит по смещению capacity - (i + 1) * sizeof(entry).
+ *   Индекс заканчивается первой записью в состоянии #SEGMENT_ENTRY_FREE.
+ *
+ * Письмо становится видимым, когда его запись индекса переходит
+ * в #SEGMENT_ENTRY_COMMITTED. В режимах со сбросом на диск это происходит
+ * только после того, как данные письма уже сброшены. Когда место
+ * кончается, начинается новый сегмент. Утилита segment_export выгружает сегмент в обычный maildir.
+ */
+
+#include "maildir.h"
+
+#define SEGMENT_MAGIC "SMTPSEG1"
+#define SEGMENT_VERSION 2
+
+/**
+ * Размер сегмента по умолчанию
+ */
+#define SEGMENT_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/**
+ * Состояние письма в индексе
+ */
+enum segment_entry_state
+{
+    /**
+     * Запись не занята: здесь индекс заканчивается
+     */
+    SEGMENT_ENTRY_FREE = 0,
+    /**
+     * Письмо скопировано, но ещё не сброшено на диск. После сбоя такие
+     * письма не считаются принятыми: ответ 250 на них ещё не отправлен
+     */
+    SEGMENT_ENTRY_WRITTEN = 1,
+    /**
+     * Письмо принято
+     */
+    SEGMENT_ENTRY_COMMITTED = 2,
+    /**
+     * Письмо выгружено в maildir
+     */
+    SEGMENT_ENTRY_EXPORTED = 3,
+};
+
+/**
+ * Заголовок сегмента
+ */
+typedef struct segment_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t worker_id;
+    uint64_t capacity;
+    uint64_t reserved[5];
+} segment_header_t;
+
+/**
+ * Запись индекса: где лежит письмо и куда оно адресовано
+ */
+typedef struct segment_index_entry_t
+{
+    /**
+     * Смещение записи письма от начала файла
+     */
+    uint64_t offset;
+    /**
+     * Смещение тела: сразу за получателем или в записи первого получателя
+     */
+    uint64_t body_offset;
+    uint32_t body_len;
+    uint16_t from_len;
+    uint16_t rcpt_len;
+    /**
+     * #segment_entry_state
+     */
+    uint8_t state;
+    /**
+     * #maildir_folder, в которую письмо попало бы в maildir
+     */
+    uint8_t folder;
+    uint8_t reserved[6];
+} segment_index_entry_t;
+
+/**
+ * Отображённый в память сегмент
+ */
+typedef struct segment_t
+{
+    int fd;
+    char *base;
+    uint64_t capacity;
+    /**
+     * Конец последней записи письма
+     */
+    uint64_t data_end;
+    /**
+     * Занятые записи индекса
+     */
+    int count;
+} segment_t;
+
+/**
+ * Письмо в сегменте. Указатели смотрят в отображение сегмента
+ */
+typedef struct segment_record_t
+{
+    const char *from;
+    int from_len;
+    const char *rcpt;
+    int rcpt_len;
+    const char *body;
+    int body_len;
+    enum maildir_folder folder;
+    enum segment_entry_state state;
+} segment_record_t;
+
+/**
+ * Сегменты рабочего потока
+ */
+typedef struct segment_spool_t
+{
+    /**
+     * Папка сегментов
+     */
+    int dir_fd;
+    int worker_id;
+    /**
+     * Размер новых сегментов
+     */
+    uint64_t segment_size;
+    /**
+     * Номер следующего сегмента
+     */
+    int sequence;
+    /**
+     * Время запуска в имени сегментов: номера начинаются заново
+     * при каждом запуске
+     */
+    long started;
+    /**
+     * Письма принимаются только в #segment_spool_sync, после сброса данных
+     */
+    bool durable;
+    /**
+     * Текущий сегмент, fd < 0 если ещё не открыт
+     */
+    segment_t current;
+    /**
+     * Начало ещё не сброшенных на диск данных текущего сегмента
+     */
+    uint64_t synced_end;
+    int synced_count;
+    /**
+     * Тело последнего письма в текущем сегменте, body_len < 0 - его нет
+     */
+    uint64_t last_body_offset;
+    int64_t last_body_len;
+} segment_spool_t;
+
+/**
+ * Готовит сегменты потока @a worker_id в папке @a dir_fd. Первый сегмент
+ * создаётся при первом письме
+ */
+void segment_spool_init(segment_spool_t *spool, int dir_fd, int worker_id, uint64_t segment_size,
+        long started, bool durable);
+
+/**
+ * Закрывает текущий сегмент
+ */
+void segment_spool_close(segment_spool_t *spool);
+
+/**
+ * Дописывает письмо в текущий сегмент, при нехватке места начинает новый
+ *
+ * @param same_body - письмо другому получателю с тем же телом, что
+ * и у предыдущего вызова: тело не копируется, если оно в текущем сегменте
+ * @return false, если сегмент не удалось создать или отправитель либо
+ * получатель длиннее UINT16_MAX
+ */
+bool segment_spool_append(segment_spool_t *spool, const char *from, int from_len,
+        const char *rcpt, int rcpt_len, const char *body, int body_len, enum maildir_folder folder,
+        bool same_body);
+
+/**
+ * Сбрасывает на диск письма, дописанные после прошлого вызова: сначала
+ * данные, затем, для надёжного режима, отметки о приёме в индексе
+ */
+bool segment_spool_sync(segment_spool_t *spool);
+
+/**
+ * Отображает в память готовый сегмент для чтения или, при @a writable,
+ * для смены состояний писем
+ */
+bool segment_map(const char *path, bool writable, segment_t *segment);
+
+/**
+ * Снимает отображение и закрывает файл
+ */
+void segment_unmap(segment_t *segment);
+
+/**
+ * Читает письмо номер @a index
+ */
+bool segment_get_record(segment_t *segment, int index, segment_record_t *record);
+
+/**
+ * Меняет состояние письма номер @a index
+ */
+void segment_set_state(segment_t *segment, int index, enum segment_entry_state state);
+
+/**
+ * Выгружает принятые письма сегмента в @a maildir, в ту папку, куда их
+ * положил бы сервер, под именами "<prefix>.<номер>", и помечает их
+ * выгруженными. Уже выгруженные письма пропускаются. Письма и записи
+ * о них в папках сбрасываются на диск раньше, чем меняется их состояние.
+ *
+ * @return количество выгруженных писем или -1 при ошибке
+ */
+int segment_export(segment_t *segment, maildir_t *maildir, const char *prefix);
@@ -10,10 +10,12 @@ smtp_reply replies[] = {
     REPLY(251, "User not local; will proceed to %s"),
     REPLY(354, "Start mail input; end with <CLRF>.<CLRF>"),
     REPLY(451, "Requested action aborted: error in processing"),
+    REPLY(452, "Too many recipients"),
     REPLY(500, "Syntax error, command unrecognized"),
     REPLY(501, "Syntax error in parameters or arguments"),
     REPLY(502, "Command not implemented"),
     REPLY(503, "Bad sequence of commands"),
+    REPLY(552, "Message size exceeds fixed maximum message size"),
 };
 
 
@@ -16,6 +16,8 @@ enum smtp_reply_code
     REPLY_USER_NOT_LOCAL = 251,
     REPLY_START_INPUT = 354,
     REPLY_ACTION_ABORTED = 451,
+    REPLY_TOO_MANY_RECIPIENTS = 452,
+    REPLY_MESSAGE_TOO_BIG = 552,
     REPLY_UNKNOWN_COMMAND = 500,
     REPLY_SYNTAX_ERROR_IN_PARAMS = 501,
     REPLY_COMMAND_NOT_IMPLEMENTED = 502,
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdint.h>
+
+/**
+ * @file
+ * @brief SHA-256 (FIPS 180-4)
+ *
+ * Хеш считается по частям, по мере поступления данных: тело письма
+ * хешируется, пока принимается, и к концу DATA его адрес уже известен.
+ */
+
+/**
+ * Размер хеша в байтах
+ */
+#define SHA256_DIGEST_SIZE 32
+/**
+ * Длина хеша в шестнадцатеричной записи, без завершающего нуля
+ */
+#define SHA256_HEX_SIZE (SHA256_DIGEST_SIZE * 2)
+
+/**
+ * Состояние подсчёта хеша
+ */
+typedef struct sha256_t
+{
+    uint32_t state[8];
+    /**
+     * Обработано байт
+     */
+    uint64_t length;
+    /**
+     * Неполный блок
+     */
+    uint8_t block[64];
+} sha256_t;
+
+/**
+ * Начинает подсчёт хеша
+ */
+void sha256_init(sha256_t *sha);
+
+/**
+ * Добавляет к хешу @a len байт
+ */
+void sha256_update(sha256_t *sha, const void *data, int len);
+
+/**
+ * Заканчивает подсчёт и записывает хеш в @a digest
+ */
+void sha256_final(sha256_t *sha, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * Заканчивает подсчёт и записывает хеш строкой из строчных
+ * шестнадцатеричных цифр в @a hex
+ */
+void sha256_final_hex(sha256_t *sha, char hex[SHA256_HEX_SIZE + 1]);
@@ -22,6 +22,7 @@
 #include "smtp_sockets.h"
 #include "smtp_worker.h"
 #include "logger.h"
+#include "log_writer.h"
 
 
 typedef struct smtp_master_thread_state_t
@@ -37,6 +38,18 @@ typedef struct smtp_master_thread_state_t
     char *hostname;
     bool random_filenames;
     int timeout_secs;
+    bool reuse_port;
+    int listen_backlog;
+    int spool_buffer_size;
+    long long max_message_size;
+    enum smtp_durability durability;
+    enum spool_io_backend spool_backend;
+    uint64_t segment_size;
+    bool deduplicate;
+    /**
+     * Счётчик писем для имён файлов с -r, когда имена не случайные
+     */
+    atomic_int deliveries;
 } smtp_master_thread_state_t;
 
 typedef struct smtp_options_t
@@ -49,12 +62,40 @@ typedef struct smtp_options_t
     char *hostname;
     bool random_filenames;
     int timeout_secs;
+    bool reuse_port;
+    int listen_backlog;
+    bool use_tmpfile;
+    int spool_buffer_size;
+    long long max_message_size;
+    enum smtp_durability durability;
+    enum spool_io_backend spool_backend;
+    uint64_t segment_size;
+    int shard_fanout;
+    bool deduplicate;
+    int log_level;
+    bool binary_log;
+    bool log_microseconds;
+    long long log_rotate_size;
+    int log_keep_files;
 } smtp_options_t;
 
 
-// RFC 5321: 4.5.3.2.7. Server Timeout
-// По крайней мере 5 минут
-static const time_t default_timeout = 60 * 5;
+// RFC 5321: 4.5.3.2. Тайм-ауты по фазам сессии. Задаются флагом -s
+// все сразу, иначе берутся отсюда.
+static const int default_phase_timeouts[TIMEOUT_PHASE_COUNT] =
+{
+    [TIMEOUT_GREETING] = 60 * 5,
+    [TIMEOUT_MAIL] = 60 * 5,
+    [TIMEOUT_RCPT] = 60 * 5,
+    [TIMEOUT_DATA_INIT] = 60 * 2,
+    [TIMEOUT_DATA_BLOCK] = 60 * 3,
+    [TIMEOUT_DATA_TERMINATION] = 60 * 10,
+    // RFC 5321: 4.5.3.2.7. Server Timeout
+    // По крайней мере 5 минут
+    [TIMEOUT_WRITE] = 60 * 5,
+};
+
+static const int listen_port = 7548;
 
 bool parse_options(int argc, char **argv, smtp_options_t *result)
 {
@@ -65,10 +106,25 @@ bool parse_options(int argc, char **argv, smtp_options_t *result)
     options.num_threads = 1;
     options.port = 8080;
     options.random_filenames = true;
-    options.timeout_secs = default_timeout;
+    options.timeout_secs = 0;
+    options.reuse_port = false;
+    options.listen_backlog = SOMAXCONN;
+    options.use_tmpfile = false;
+    options.spool_buffer_size = SPOOL_BUFFER_DEFAULT_SIZE;
+    options.max_message_size = SMTP_DEFAULT_MAX_MESSAGE_SIZE;
+    options.durability = DURABILITY_NONE;
+    options.spool_backend = SPOOL_IO_NONE;
+    options.segment_size = 0;
+    options.shard_fanout = -1;
+    options.deduplicate = false;
+    options.log_level = LOG_DEFAULT_LEVEL;
+    options.binary_log = false;
+    options.log_microseconds = false;
+    options.log_rotate_size = 0;
+    options.log_keep_files = LOG_DEFAULT_KEEP_FILES;
 
     int opt;
-    while ((opt = getopt(argc, argv, "t:m:p:d:rl:n:s:")) != -1)
+    while ((opt = getopt(argc, argv, "t:m:p:d:rl:n:s:ub:ow:f:a:S:H:DM:L:BUR:K:")) != -1)
     {
         switch(opt)
         {
@@ -118,6 +174,140 @@ bool parse_options(int argc, char **argv, smtp_options_t *result)
                 return false;
             }
             break;
+        case 'u':
+            options.reuse_port = true;
+            break;
+        case 'b':
+            options.listen_backlog = atoi(optarg);
+            if (options.listen_backlog < 1)
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
+        case 'o':
+            options.use_tmpfile = true;
+            break;
+        case 'w':
+            options.spool_buffer_size = atoi(optarg);
+            if (options.spool_buffer_size < 0)
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "none") == 0)
+            {
+                options.durability = DURABILITY_NONE;
+            }
+            else if (strcmp(optarg, "message") == 0)
+            {
+                options.durability = DURABILITY_MESSAGE;
+            }
+            else if (strcmp(optarg, "group") == 0)
+            {
+                options.durability = DURABILITY_GROUP;
+            }
+            else
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
+        case 'a':
+            if (strcmp(optarg, "uring") == 0)
+            {
+                options.spool_backend = SPOOL_IO_URING;
+            }
+            else if (strcmp(optarg, "threads") == 0)
+            {
+                options.spool_backend = SPOOL_IO_THREADS;
+            }
+            else
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
+        case 'S':
+            options.segment_size = strtoull(optarg, NULL, 10);
+            if (options.segment_size < 4096)
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
+        case 'H':
+            options.shard_fanout = atoi(optarg);
+            if (options.shard_fanout != 0
+                    && (options.shard_fanout < 2 || options.shard_fanout > MAILDIR_MAX_SHARD_FANOUT))
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
+        case 'D':
+            options.deduplicate = true;
+            break;
+        case 'M':
+            options.max_message_size = atoll(optarg);
+            if (options.max_message_size < 0)
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
+        case 'L':
+            options.log_level = parse_log_level(optarg);
+            if (options.log_level < 0)
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
+        case 'B':
+            options.binary_log = true;
+            break;
+        case 'U':
+            options.log_microseconds = true;
+            break;
+        case 'R':
+            options.log_rotate_size = atoll(optarg);
+            if (options.log_rotate_size < 0)
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
+        case 'K':
+            options.log_keep_files = atoi(optarg);
+            if (options.log_keep_files < 0)
+            {
+                free(options.maildir);
+                free(options.log);
+                free(options.dns);
+                return false;
+            }
+            break;
         default:
             break;
         }
@@ -145,6 +335,12 @@ bool parse_options(int argc, char **argv, smtp_options_t *result)
 void *worker_thread_fn(void *arg)
 {
     smtp_worker_thread_state_t *state = (smtp_worker_thread_state_t*)arg;
+
+    // Имя задаёт сам поток до первой записи в журнал: журнал запоминает его
+    char name[16];
+    snprintf(name, 16, "WORKER%d", state->id);
+    pthread_setname_np(pthread_self(), name);
+
     worker_loop(state);
     return NULL;
 }
@@ -166,7 +362,41 @@ bool spawn_worker_thread(int id, smtp_master_thread_state_t *master_state, smtp_
     state->hostname = strdup(master_state->hostname);
     state->random_filenames = master_state->random_filenames;
     state->deliveries = 0;
-    state->timeout_secs = master_state->timeout_secs;
+    state->shared_deliveries = &master_state->deliveries;
+    state->spool_buffer_size = master_state->spool_buffer_size;
+    state->max_message_size = master_state->max_message_size;
+    state->durability = master_state->durability;
+    state->spool_backend = master_state->spool_backend;
+    state->segment_size = master_state->segment_size;
+    state->deduplicate = master_state->deduplicate;
+    state->spool_stats = (spool_stats_t){0};
+    state->spool_stats_reported_flushes = 0;
+    for (int i = 0; i < TIMEOUT_PHASE_COUNT; i++)
+    {
+        state->timeouts[i] = master_state->timeout_secs > 0
+            ? master_state->timeout_secs : default_phase_timeouts[i];
+    }
+    state->listen_socket = -1;
+    state->listen_socket_v6 = -1;
+
+    // В режиме SO_REUSEPORT каждый рабочий поток слушает порт сам,
+    // и ядро распределяет соединения без участия главного потока
+    if (master_state->reuse_port)
+    {
+        if (!create_server_socket_ipv4("0.0.0.0", listen_port, true, &state->listen_socket)
+                || !create_server_socket_ipv6("::0", listen_port, true, &state->listen_socket_v6))
+        {
+            LOG_ERROR("Failed to open worker %d server sockets", id);
+            close(state->master_socket);
+            close(state->worker_socket);
+            return false;
+        }
+        set_socket_nonblocking(state->listen_socket, true);
+        set_socket_nonblocking(state->listen_socket_v6, true);
+        do_listen(state->listen_socket, master_state->listen_backlog);
+        do_listen(state->listen_socket_v6, master_state->listen_backlog);
+    }
+
     firedns_init(&state->dns_state);
 
     if (master_state->dns)
@@ -187,14 +417,10 @@ bool spawn_worker_thread(int id, smtp_master_thread_state_t *master_state, smtp_
         close(state->master_socket);
         close(state->worker_socket);
         dynamic_vector_close(&state->connection_states);
-        LOG("Error creating thread: %d\n", result);
+        LOG_ERROR("Error creating thread: %d\n", result);
         return false;
     }
 
-    char name[16];
-    snprintf(name, 16, "WORKER%d", id);
-    pthread_setname_np(state->thread_id, name);
-
     return true;
 }
 
@@ -205,6 +431,8 @@ bool spawn_log_process(smtp_master_thread_state_t *state, char *filename)
     create_local_socket_pair(sockets);
     state->log_socket = sockets[0];
 
+    bool rings = create_log_rings();
+
     pid_t logpid = fork();
     if (logpid == 0)
     {
@@ -212,7 +440,12 @@ bool spawn_log_process(smtp_master_thread_state_t *state, char *filename)
     }
     else
     {
+        state->log_process = logpid;
         set_log_socket(sockets[0]);
+        if (!rings)
+        {
+            LOG_WARN("Could not create log rings, logging through socket");
+        }
     }
 
     return true;
@@ -220,7 +453,7 @@ bool spawn_log_process(smtp_master_thread_state_t *state, char *filename)
 
 void stop_log_process(smtp_master_thread_state_t *state)
 {
-    LOG("Stopping log thread");
+    LOG_INFO("Stopping log thread");
     send_stop_log();
     int status;
     waitpid(state->log_process, &status, 0); 
@@ -260,7 +493,7 @@ void send_socket_to_worker(smtp_master_thread_state_t *state, int client_socket)
 
 void stop_all_workers(smtp_master_thread_state_t *state)
 {
-    LOG("Stopping all workers");
+    LOG_INFO("Stopping all workers");
     smtp_thread_command_t command =
     {
         .type = SMTP_THREAD_STOP,
@@ -281,13 +514,20 @@ void stop_all_workers(smtp_master_thread_state_t *state)
 }
 
 static atomic_bool G_ShouldRun;
+static pid_t G_LogProcess;
 
 void sigint_handler(int signum)
 {
-    LOG("Caught signal %d", signum);
+    LOG_INFO("Caught signal %d", signum);
     atomic_store(&G_ShouldRun, false);
 }
 
+// SIGHUP серверу - заново открыть файл журнала, это делает процесс журнала
+void sighup_handler(int signum)
+{
+    kill(G_LogProcess, SIGHUP);
+}
+
 void server_loop(smtp_master_thread_state_t *state)
 {
     atomic_store(&G_ShouldRun, true);
@@ -299,6 +539,13 @@ void server_loop(smtp_master_thread_state_t *state)
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
 
+    G_LogProcess = state->log_process;
+    struct sigaction hup = {};
+    hup.sa_handler = &sighup_handler;
+    hup.sa_flags = SA_RESTART;
+    sigemptyset(&hup.sa_mask);
+    sigaction(SIGHUP, &hup, NULL);
+
 
     // Блокируем SIGINT и SIGTERM, чтобы они не пришли не в то время
     sigset_t origset;
@@ -308,6 +555,8 @@ void server_loop(smtp_master_thread_state_t *state)
     sigaddset(&blockset, SIGTERM);
     pthread_sigmask(SIG_BLOCK, &blockset, &origset);
 
+    // В режиме SO_REUSEPORT слушающих сокетов у главного потока нет (-1),
+    // и pselect просто ждёт сигнала
     int ls = state->listen_socket;
     int ls6 = state->listen_socket_v6;
     fd_set read_fds;
@@ -315,8 +564,8 @@ void server_loop(smtp_master_thread_state_t *state)
     while (G_ShouldRun)
     {
         FD_ZERO(&read_fds);
-        FD_SET(ls, &read_fds);
-        FD_SET(ls6, &read_fds);
+        if (ls >= 0) FD_SET(ls, &read_fds);
+        if (ls6 >= 0) FD_SET(ls6, &read_fds);
 
         // Разблокируем сигналы на время pselect.
         // Если это были SIGINT или SIGTERM, то сработает соответствующий хэндлер.
@@ -325,24 +574,24 @@ void server_loop(smtp_master_thread_state_t *state)
         int ready = pselect(maxfd + 1, &read_fds, NULL, NULL, NULL, &origset);
         if (ready < 0 && errno == EINTR)
         {
-            LOG("Server select interrupted");
+            LOG_INFO("Server select interrupted");
             continue;
         }
 
         if (ready < 0)
         {
-            LOG("Server select error: %d", errno);
+            LOG_ERROR("Server select error: %d", errno);
             return;
         }
 
-        if (FD_ISSET(ls, &read_fds))
+        if (ls >= 0 && FD_ISSET(ls, &read_fds))
         {
             int client_socket = accept(ls, NULL, NULL);
             set_socket_nonblocking(client_socket, true);
             send_socket_to_worker(state, client_socket);
         }
 
-        if (FD_ISSET(ls6, &read_fds))
+        if (ls6 >= 0 && FD_ISSET(ls6, &read_fds))
         {
             int client_socket = accept(ls6, NULL, NULL);
             set_socket_nonblocking(client_socket, true);
@@ -359,13 +608,17 @@ int smtp(int argc, char **argv)
 
     if (!parse_options(argc, argv, &options))
     {
-        printf("Usage: %s [-p port] [-m maildir] [-l log_file] [-t threads] [-d dns] [-r] [-s timeout_secs] \n", argv[0]);
+        printf("Usage: %s [-p port] [-m maildir] [-l log_file] [-t threads] [-d dns] [-r] [-s timeout_secs] [-u] [-b backlog] [-o] [-w spool_buffer_bytes] [-f none|message|group] [-a uring|threads] [-S segment_bytes] [-H shard_fanout] [-D] [-M max_message_bytes] [-L trace|debug|info|warn|error] [-B] [-U] [-R log_rotate_bytes] [-K kept_log_files] \n", argv[0]);
         return -1;
     }
 
+    set_log_level(options.log_level);
+    set_log_binary(options.binary_log);
+    set_log_microseconds(options.log_microseconds);
+    set_log_rotation(options.log_rotate_size, options.log_keep_files);
     spawn_log_process(&state, options.log);
 
-    LOG("Starting SMTP server with %d threads on port %d, maildir %s, logfile %s and dns %s", (int)options.num_threads, (int)options.port,
+    LOG_INFO("Starting SMTP server with %d threads on port %d, maildir %s, logfile %s and dns %s", (int)options.num_threads, (int)options.port,
         options.maildir, options.log, options.dns);
 
     free(options.log);
@@ -373,11 +626,50 @@ int smtp(int argc, char **argv)
     maildir_t maildir = maildir_open(options.maildir, &error);
     if (error != 0)
     {
-        LOG("Maildir check failed: %d\n", error);
+        LOG_ERROR("Maildir check failed: %d\n", error);
         return error;
     }
     free(options.maildir);
 
+    if (options.use_tmpfile && !maildir_enable_tmpfile(&maildir))
+    {
+        LOG_WARN("O_TMPFILE is not supported by maildir, using named files in tmp");
+    }
+
+    // Без -H используется разбиение, записанное в maildir
+    if (options.shard_fanout >= 0 && !maildir_set_sharding(&maildir, options.shard_fanout))
+    {
+        LOG_ERROR("Could not shard maildir with fanout %d (recorded %d): %d", options.shard_fanout, maildir.shard_fanout, errno);
+        return -1;
+    }
+    if (options.segment_size > 0 && !maildir_open_segments(&maildir))
+    {
+        LOG_ERROR("Could not open segments folder: %d", errno);
+        return -1;
+    }
+    // Письмо для сегмента копится в памяти целиком
+    if (options.segment_size > 0 && options.max_message_size == 0)
+    {
+        LOG_ERROR("Segment spool needs a message size limit, -S cannot be used with -M 0");
+        return -1;
+    }
+    if (options.segment_size > 0 && options.spool_backend != SPOOL_IO_NONE)
+    {
+        LOG_WARN("Segment spool writes without asynchronous I/O, ignoring -a");
+        options.spool_backend = SPOOL_IO_NONE;
+    }
+    // Тела в сегменте и так общие у всех получателей письма
+    if (options.segment_size > 0 && options.deduplicate)
+    {
+        LOG_WARN("Segment spool does not deduplicate bodies, ignoring -D");
+        options.deduplicate = false;
+    }
+    if (options.deduplicate && !maildir_open_blobs(&maildir))
+    {
+        LOG_ERROR("Could not open blobs folder: %d", errno);
+        return -1;
+    }
+
     state.maildir = maildir;
     state.num_threads = options.num_threads;
     state.threads = malloc(sizeof(smtp_worker_thread_state_t) * state.num_threads);
@@ -385,10 +677,20 @@ int smtp(int argc, char **argv)
     state.hostname = options.hostname;
     state.random_filenames = options.random_filenames;
     state.timeout_secs = options.timeout_secs;
+    state.reuse_port = options.reuse_port;
+    state.listen_backlog = options.listen_backlog;
+    state.spool_buffer_size = options.spool_buffer_size;
+    state.max_message_size = options.max_message_size;
+    state.durability = options.durability;
+    state.spool_backend = options.spool_backend;
+    state.segment_size = options.segment_size;
+    state.deduplicate = options.deduplicate;
+    state.listen_socket = -1;
+    state.listen_socket_v6 = -1;
 
     if (!client_command_parser_init())
     {
-        LOG("Could not make command parser!");
+        LOG_ERROR("Could not make command parser!");
         return -1;
     }
 
@@ -404,32 +706,36 @@ int smtp(int argc, char **argv)
 
         if (!spawn_worker_thread(i + 1, &state, thread_state))
         {
-            LOG("Failed to spawn thread %d", i);
+            LOG_ERROR("Failed to spawn thread %d", i);
             return -1;
         }
     }
     pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
-    LOG("Spawned worker threads");
+    LOG_INFO("Spawned worker threads");
 
-    if (!create_server_socket_ipv4("0.0.0.0", 7548, &state.listen_socket))
+    if (!state.reuse_port)
     {
-        LOG("Failed to open server socket");
-        return -1;
-    }
-    do_listen(state.listen_socket, 8);
+        if (!create_server_socket_ipv4("0.0.0.0", listen_port, false, &state.listen_socket))
+        {
+            LOG_ERROR("Failed to open server socket");
+            return -1;
+        }
+        do_listen(state.listen_socket, state.listen_backlog);
 
-    if (!create_server_socket_ipv6("::0", 7548, &state.listen_socket_v6))
-    {
-        LOG("Failed to open IPV6 server socket");
-        return -1;
+        if (!create_server_socket_ipv6("::0", listen_port, false, &state.listen_socket_v6))
+        {
+            LOG_ERROR("Failed to open IPV6 server socket");
+            return -1;
+        }
+        do_listen(state.listen_socket_v6, state.listen_backlog);
     }
-    do_listen(state.listen_socket_v6, 8);
 
-    LOG("Starting server loop");
+    LOG_INFO("Starting server loop");
     server_loop(&state);
-    LOG("Finished server loop");
+    LOG_INFO("Finished server loop");
 
     stop_all_workers(&state);
+    maildir_close(&state.maildir);
     stop_log_process(&state);
     free(state.threads);
     free(state.dns);
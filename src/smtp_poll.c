@@ -0,0 +1,184 @@
+#include "smtp_poll.h"
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include "logger.h"
+
+#ifdef SMTP_POLL_EPOLL
+#include <sys/epoll.h>
+
+// Сколько событий забираем из ядра за один вызов epoll_wait
+#define SMTP_POLL_BATCH 256
+
+static unsigned int to_epoll_events(int interest)
+{
+    unsigned int events = 0;
+    if (interest & SMTP_POLL_READ) events |= EPOLLIN;
+    if (interest & SMTP_POLL_WRITE) events |= EPOLLOUT;
+    return events;
+}
+
+bool smtp_poll_init(smtp_poll_t *poll)
+{
+    poll->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poll->epoll_fd < 0)
+    {
+        LOG_ERROR("Error creating epoll: %d", errno);
+        return false;
+    }
+    poll->events = dynamic_vector_create(sizeof(smtp_poll_event_t), SMTP_POLL_BATCH);
+    return true;
+}
+
+void smtp_poll_close(smtp_poll_t *poll)
+{
+    close(poll->epoll_fd);
+    poll->epoll_fd = -1;
+    dynamic_vector_close(&poll->events);
+}
+
+static bool epoll_control(smtp_poll_t *poll, int op, int socket, int index, int interest)
+{
+    struct epoll_event ev = {0};
+    ev.events = to_epoll_events(interest);
+    ev.data.u64 = (uint64_t)(int64_t)index;
+    if (epoll_ctl(poll->epoll_fd, op, socket, &ev) != 0)
+    {
+        LOG_ERROR("Error in epoll_ctl %d for socket %d: %d", op, socket, errno);
+        return false;
+    }
+    return true;
+}
+
+bool smtp_poll_add(smtp_poll_t *poll, int socket, int index, int interest)
+{
+    return epoll_control(poll, EPOLL_CTL_ADD, socket, index, interest);
+}
+
+bool smtp_poll_modify(smtp_poll_t *poll, int socket, int index, int interest)
+{
+    return epoll_control(poll, EPOLL_CTL_MOD, socket, index, interest);
+}
+
+void smtp_poll_remove(smtp_poll_t *poll, int socket)
+{
+    epoll_ctl(poll->epoll_fd, EPOLL_CTL_DEL, socket, NULL);
+}
+
+int smtp_poll_wait(smtp_poll_t *poll, const struct timespec *timeout)
+{
+    struct epoll_event raw[SMTP_POLL_BATCH];
+    int timeout_ms = -1;
+    if (timeout)
+    {
+        timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000;
+    }
+
+    dynamic_vector_clear(&poll->events);
+    int ready = epoll_wait(poll->epoll_fd, raw, SMTP_POLL_BATCH, timeout_ms);
+    if (ready < 0)
+    {
+        return -1;
+    }
+
+    dynamic_vector_reserve_at_least(&poll->events, ready);
+    smtp_poll_event_t *events = poll->events.data;
+    for (int i = 0; i < ready; i++)
+    {
+        int mask = 0;
+        // Ошибку и разрыв отдаём как готовность: их заметит следующий read/send
+        if (raw[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) mask |= SMTP_POLL_READ;
+        if (raw[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) mask |= SMTP_POLL_WRITE;
+        events[i].index = (int)(int64_t)raw[i].data.u64;
+        events[i].events = mask;
+    }
+    poll->events.size = ready;
+
+    return ready;
+}
+
+#else // SMTP_POLL_EPOLL
+
+bool smtp_poll_init(smtp_poll_t *poll)
+{
+    memset(poll->interest, 0, sizeof(poll->interest));
+    poll->maxfd = -1;
+    poll->events = dynamic_vector_create(sizeof(smtp_poll_event_t), 32);
+    return true;
+}
+
+void smtp_poll_close(smtp_poll_t *poll)
+{
+    dynamic_vector_close(&poll->events);
+}
+
+bool smtp_poll_modify(smtp_poll_t *poll, int socket, int index, int interest)
+{
+    if (socket < 0 || socket >= FD_SETSIZE)
+    {
+        LOG_ERROR("Socket %d does not fit into FD_SETSIZE", socket);
+        return false;
+    }
+
+    poll->index[socket] = index;
+    poll->interest[socket] = (unsigned char)interest;
+    if (socket > poll->maxfd)
+    {
+        poll->maxfd = socket;
+    }
+    return true;
+}
+
+bool smtp_poll_add(smtp_poll_t *poll, int socket, int index, int interest)
+{
+    return smtp_poll_modify(poll, socket, index, interest);
+}
+
+void smtp_poll_remove(smtp_poll_t *poll, int socket)
+{
+    if (socket < 0 || socket >= FD_SETSIZE) return;
+
+    poll->interest[socket] = 0;
+    while (poll->maxfd >= 0 && poll->interest[poll->maxfd] == 0)
+    {
+        poll->maxfd--;
+    }
+}
+
+int smtp_poll_wait(smtp_poll_t *poll, const struct timespec *timeout)
+{
+    fd_set readfds;
+    fd_set writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+
+    for (int fd = 0; fd <= poll->maxfd; fd++)
+    {
+        if (poll->interest[fd] & SMTP_POLL_READ) FD_SET(fd, &readfds);
+        if (poll->interest[fd] & SMTP_POLL_WRITE) FD_SET(fd, &writefds);
+    }
+
+    dynamic_vector_clear(&poll->events);
+    int ready = pselect(poll->maxfd + 1, &readfds, &writefds, NULL, timeout, NULL);
+    if (ready <= 0)
+    {
+        return ready;
+    }
+
+    for (int fd = 0; fd <= poll->maxfd; fd++)
+    {
+        int mask = 0;
+        if (FD_ISSET(fd, &readfds)) mask |= SMTP_POLL_READ;
+        if (FD_ISSET(fd, &writefds)) mask |= SMTP_POLL_WRITE;
+        if (mask)
+        {
+            smtp_poll_event_t ev = { .index = poll->index[fd], .events = mask };
+            dynamic_vector_copy_elem_back(&poll->events, &ev);
+        }
+    }
+
+    return poll->events.size;
+}
+
+#endif // SMTP_POLL_EPOLL
@@ -0,0 +1,121 @@
+#pragma once
+#include <stdbool.h>
+#include <time.h>
+
+/**
+ * @file
+ * @brief Ожидание готовности сокетов рабочего потока
+ *
+ * По умолчанию на Linux используется epoll с постоянной регистрацией
+ * дескрипторов. При сборке с USE_SELECT=y используется старый путь через
+ * pselect, ограниченный FD_SETSIZE дескрипторами.
+ */
+
+#include "dynamic_vector.h"
+
+#if defined(__linux__) && !defined(USE_SELECT)
+#define SMTP_POLL_EPOLL
+#else
+#include <sys/select.h>
+#endif
+
+/**
+ * Индекс, под которым регистрируется сокет команд главного потока
+ */
+#define SMTP_POLL_MASTER_INDEX (-1)
+/**
+ * Индексы собственных слушающих сокетов рабочего потока (режим SO_REUSEPORT)
+ */
+#define SMTP_POLL_LISTEN_INDEX (-2)
+#define SMTP_POLL_LISTEN_V6_INDEX (-3)
+/**
+ * Индекс eventfd асинхронной записи писем
+ */
+#define SMTP_POLL_SPOOL_INDEX (-4)
+
+/**
+ * Интерес к событиям сокета
+ */
+enum smtp_poll_interest
+{
+    SMTP_POLL_READ = 1,
+    SMTP_POLL_WRITE = 2,
+};
+
+/**
+ * Готовность одного сокета
+ */
+typedef struct smtp_poll_event_t
+{
+    /**
+     * Индекс, с которым сокет был зарегистрирован
+     */
+    int index;
+    /**
+     * Маска #smtp_poll_interest с готовыми событиями
+     */
+    int events;
+} smtp_poll_event_t;
+
+/**
+ * Набор наблюдаемых сокетов
+ */
+typedef struct smtp_poll_t
+{
+#ifdef SMTP_POLL_EPOLL
+    /**
+     * Дескриптор epoll
+     */
+    int epoll_fd;
+#else
+    /**
+     * Индекс зарегистрированного сокета, по номеру дескриптора
+     */
+    int index[FD_SETSIZE];
+    /**
+     * Интерес зарегистрированного сокета (0 - не зарегистрирован)
+     */
+    unsigned char interest[FD_SETSIZE];
+    /**
+     * Максимальный зарегистрированный дескриптор
+     */
+    int maxfd;
+#endif
+    /**
+     * Вектор #smtp_poll_event_t, заполняемый #smtp_poll_wait
+     */
+    dynamic_vector_t events;
+} smtp_poll_t;
+
+/**
+ * Инициализирует набор. Возвращает false в случае ошибки.
+ */
+bool smtp_poll_init(smtp_poll_t *poll);
+
+/**
+ * Освобождает набор
+ */
+void smtp_poll_close(smtp_poll_t *poll);
+
+/**
+ * Начинает наблюдение за сокетом \p socket с интересом \p interest.
+ * \p index возвращается в #smtp_poll_event_t при готовности.
+ */
+bool smtp_poll_add(smtp_poll_t *poll, int socket, int index, int interest);
+
+/**
+ * Меняет индекс и интерес уже зарегистрированного сокета
+ */
+bool smtp_poll_modify(smtp_poll_t *poll, int socket, int index, int interest);
+
+/**
+ * Прекращает наблюдение за сокетом. Вызывать до close().
+ */
+void smtp_poll_remove(smtp_poll_t *poll, int socket);
+
+/**
+ * Ждёт готовности сокетов не дольше \p timeout.
+ * Готовые сокеты записываются в @a poll->events.
+ * \returns количество готовых сокетов или -1 с установленным errno
+ */
+int smtp_poll_wait(smtp_poll_t *poll, const struct timespec *timeout);
@@ -26,7 +26,19 @@ bool reuse_addr(int sock, bool enable)
     int option = (int)enable;
     if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(int)) < 0)
     {
-        LOG("Error reuse addr %d", errno);
+        LOG_ERROR("Error reuse addr %d", errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool reuse_port(int sock, bool enable)
+{
+    int option = (int)enable;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(int)) < 0)
+    {
+        LOG_ERROR("Error reuse port %d", errno);
         return false;
     }
 
@@ -38,19 +50,19 @@ bool v6_only(int sock, bool enable)
     int option = (int)enable;
     if (setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &option, sizeof(int)) < 0)
     {
-        LOG("Error setting v6 only %d", errno);
+        LOG_ERROR("Error setting v6 only %d", errno);
         return false;
     }
     
     return true;
 }
 
-bool create_server_socket_ipv4(char *host, int port, int *out_socket)
+bool create_server_socket_ipv4(char *host, int port, bool share_port, int *out_socket)
 {
     int result = socket(AF_INET, SOCK_STREAM, 0);
     if (result < 0)
     {
-        LOG("Error creating v4 server socket: %d", result);
+        LOG_ERROR("Error creating v4 server socket: %d", result);
         return false;
     }
 
@@ -62,7 +74,7 @@ bool create_server_socket_ipv4(char *host, int port, int *out_socket)
     int error = inet_aton(host, &server_address.sin_addr);
     if (error == 0)
     {
-        LOG("Could not parse v4 host");
+        LOG_ERROR("Could not parse v4 host");
         return false;
     }
 
@@ -71,10 +83,15 @@ bool create_server_socket_ipv4(char *host, int port, int *out_socket)
         return false;
     }
 
+    if (share_port && !reuse_port(result, true))
+    {
+        return false;
+    }
+
     error = bind(result, (struct sockaddr*)&server_address, sizeof(server_address));
     if (error != 0)
     {
-        LOG("Error binding v4: %d", errno);
+        LOG_ERROR("Error binding v4: %d", errno);
         return false;
     }
 
@@ -82,12 +99,12 @@ bool create_server_socket_ipv4(char *host, int port, int *out_socket)
     return true;    
 }
 
-bool create_server_socket_ipv6(char *host, int port, int *out_socket)
+bool create_server_socket_ipv6(char *host, int port, bool share_port, int *out_socket)
 {
     int result = socket(AF_INET6, SOCK_STREAM, 0);
     if (result < 0)
     {
-        LOG("Error creating v6 server socket: %d", result);
+        LOG_ERROR("Error creating v6 server socket: %d", result);
         return false;
     }
 
@@ -101,26 +118,32 @@ bool create_server_socket_ipv6(char *host, int port, int *out_socket)
     int error = inet_pton(AF_INET6, host, &server_address.sin6_addr);
     if (error == 0)
     {
-        LOG("Could not parse v6 host\n");
+        LOG_ERROR("Could not parse v6 host\n");
         return false;
     }
 
     if (!reuse_addr(result, true))
     {
-        LOG("Could not reuse v6 addr");
+        LOG_ERROR("Could not reuse v6 addr");
+        return false;
+    }
+
+    if (share_port && !reuse_port(result, true))
+    {
+        LOG_ERROR("Could not reuse v6 port");
         return false;
     }
 
     if (!v6_only(result, true))
     {
-        LOG("Could not set v6 only");
+        LOG_ERROR("Could not set v6 only");
         return false;
     }
 
     error = bind(result, (struct sockaddr*)&server_address, sizeof(server_address));
     if (error != 0)
     {
-        LOG("Error binding v6: %d", errno);
+        LOG_ERROR("Error binding v6: %d", errno);
         return false;
     }
 
@@ -171,7 +194,7 @@ int create_local_socket_pair(int *out_sockets)
     int result = socketpair(AF_LOCAL, SOCK_DGRAM, 0, out_sockets);
     if (result != 0)
     {
-        LOG("Error creating socket pair: %d", result);
+        LOG_ERROR("Error creating socket pair: %d", result);
         return false;
     }
     return true;
@@ -191,7 +214,9 @@ int read_from_socket(int socket, char *buf, int len)
     int err = recv(socket, buf, len, 0);
     if (err >= 0) return err;
     
-    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;    
+    // В отличие от send_to_socket, 0 здесь означает закрытое соединение,
+    // поэтому "данных больше нет" возвращаем отдельным кодом
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return -EAGAIN;
     return -errno;
 }
 
@@ -7,8 +7,10 @@
  */
 
 void set_socket_nonblocking(int socket, bool is_nonblocking);
-bool create_server_socket_ipv4(char *host, int port, int *out_socket);
-bool create_server_socket_ipv6(char *host, int port, int *out_socket);
+// share_port включает SO_REUSEPORT: несколько сокетов слушают один порт,
+// и ядро распределяет входящие соединения между ними
+bool create_server_socket_ipv4(char *host, int port, bool share_port, int *out_socket);
+bool create_server_socket_ipv6(char *host, int port, bool share_port, int *out_socket);
 int create_local_socket_pair(int *out_sockets);
 void do_listen(int socket, int backlog);
 int send_to_socket(int socket, char *buf, int len);
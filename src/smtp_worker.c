@@ -6,8 +6,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <limits.h>
-#include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <errno.h>
 #include <assert.h>
@@ -39,28 +39,86 @@ command_event_entry_t command_to_event_table[] =
 };
 
 
-time_t calculate_sleep_time(smtp_connection_state_t *connection_states, int num, time_t current_time)
+// Спим максимум 30 секунд. Мало ли что
+static const time_t max_sleep_time = 30;
+
+static enum smtp_poll_interest mode_interest(enum smtp_connection_mode mode)
 {
-    // Спим максимум 30 секунд. Мало ли что
-    time_t to_sleep = 30;
-    for (int i = 0; i < num; i++)
-    {
-        smtp_connection_state_t *state = connection_states + i;
-        if (state->mode != CONNECTION_READING) continue; // Нет таймаута на посылку данных
+    return mode == CONNECTION_WRITING ? SMTP_POLL_WRITE : SMTP_POLL_READ;
+}
 
-        if (state->timeout < current_time)
-        {
-            to_sleep = 0;
-            break;
-        }
+// Пока письмо пишется асинхронно, сокет снят с наблюдения
+static bool mode_watched(enum smtp_connection_mode mode)
+{
+    return mode != CONNECTION_SPOOLING && mode != CONNECTION_THROTTLED;
+}
 
-        if (state->timeout - current_time < to_sleep)
-        {
-            to_sleep = state->timeout - current_time;
-        }
+static smtp_connection_state_t *get_connection(smtp_worker_thread_state_t *thread_state, int index)
+{
+    assert(index >= 0 && index < thread_state->connection_states.size);
+    return (smtp_connection_state_t*)thread_state->connection_states.data + index;
+}
+
+// Максимум соединений, принимаемых с одного слушающего сокета за итерацию,
+// чтобы шквал подключений не задерживал обработку уже открытых
+#define ACCEPT_BATCH 64
+
+// Сколько места в приёмном буфере соединения готовим под один read
+#define READ_CHUNK 4096
+
+// Сколько готовых строк забираем из сборщика за раз
+#define MESSAGE_BATCH 64
+
+// Как часто счётчики записи тел писем попадают в журнал, секунд
+#define SPOOL_STATS_INTERVAL 60
+
+// Сколько читаем из сокета за одно пробуждение: остальное дочитаем
+// на следующем, сначала разобрав прочитанное
+#define READ_LIMIT (256 * 1024)
+
+// Сколько неотправленных ответов допускаем: клиент, который шлёт команды
+// и не забирает ответы, дальше не читается, пока ответы не уйдут
+#define WRITE_BACKLOG_LIMIT (64 * 1024)
+
+void add_connection(smtp_worker_thread_state_t *thread_state, int socket)
+{
+    int index = thread_state->connection_states.size;
+    if (!smtp_poll_add(&thread_state->poll, socket, index, SMTP_POLL_WRITE))
+    {
+        LOG_WARN("Could not watch new connection, dropping it");
+        close(socket);
+        atomic_fetch_sub(&thread_state->current_sockets, 1);
+        return;
+    }
+
+    smtp_connection_state_t new_connection = {0};
+    new_connection.is_receiving_data = false;
+    new_connection.state = FSM_ST_INIT;
+    new_connection.write_phase = TIMEOUT_WRITE;
+    new_connection.timer = timer_wheel_add(&thread_state->timers,
+            thread_state->current_time.tv_sec + thread_state->timeouts[TIMEOUT_WRITE], index);
+    new_connection.socket = socket;
+    new_connection.write_buffer = dynamic_vector_create(sizeof(char), 256);
+    new_connection.write_buffer_pos = 0;
+    new_connection.recepient_buffer = dynamic_vector_create(sizeof(char), 256);
+    new_connection.recepients = dynamic_vector_create(sizeof(smtp_recepient_t), 4);
+    new_connection.sender_buffer = dynamic_vector_create(sizeof(char), 256);
+    new_connection.body = dynamic_vector_create(sizeof(char), thread_state->segment_size > 0 ? 4096 : 0);
+    new_connection.mb = create_message_builder();
+    spool_buffer_init(&new_connection.spool, thread_state->spool_buffer_size);
+
+    const char *greeting = get_server_reply(REPLY_READY);
+    int len = snprintf(new_connection.write_buffer.data, new_connection.write_buffer.capacity, greeting, thread_state->hostname);
+    if (len >= new_connection.write_buffer.capacity)
+    {
+        dynamic_vector_reserve_at_least(&new_connection.write_buffer, len + 1);
+        snprintf(new_connection.write_buffer.data, new_connection.write_buffer.capacity, greeting, thread_state->hostname);
     }
 
-    return to_sleep;
+    new_connection.write_buffer.size = len;
+    new_connection.mode = CONNECTION_WRITING;
+    new_connection.registered_mode = CONNECTION_WRITING;
+    dynamic_vector_copy_elem_back(&thread_state->connection_states, &new_connection);
 }
 
 void handle_master_command(smtp_worker_thread_state_t *thread_state)
@@ -69,33 +127,12 @@ void handle_master_command(smtp_worker_thread_state_t *thread_state)
     size_t read_size = read(thread_state->worker_socket, &command, sizeof(smtp_thread_command_t));
     if (read_size == 0 || command.type == SMTP_THREAD_STOP) // соединение с мастер-тредом оборвалось
     {
-        LOG("Master sent stop command");
+        LOG_INFO("Master sent stop command");
         thread_state->should_run = false;
     }
     else if (command.type == SMTP_THREAD_ACCEPT)
     {
-        smtp_connection_state_t new_connection = {0};
-        new_connection.is_receiving_data = false;
-        new_connection.state = FSM_ST_INIT;
-        new_connection.timeout = thread_state->current_time.tv_sec + (time_t)thread_state->timeout_secs;
-        new_connection.socket = command.socket;
-        new_connection.write_buffer = dynamic_vector_create(sizeof(char), 256);
-        new_connection.write_buffer_pos = 0;
-        new_connection.read_buffer = dynamic_vector_create(sizeof(char), 256);
-        new_connection.recepient_buffer = dynamic_vector_create(sizeof(char), 256);
-        new_connection.mb = create_message_builder();
-
-        const char *greeting = get_server_reply(REPLY_READY);
-        int len = snprintf(new_connection.write_buffer.data, new_connection.write_buffer.capacity, greeting, thread_state->hostname);
-        if (len >= new_connection.write_buffer.capacity)
-        {
-            dynamic_vector_reserve_at_least(&new_connection.write_buffer, len + 1);
-            snprintf(new_connection.write_buffer.data, new_connection.write_buffer.capacity, greeting, thread_state->hostname);
-        }
-
-        new_connection.write_buffer.size = len;
-        new_connection.mode = CONNECTION_WRITING;
-        dynamic_vector_copy_elem_back(&thread_state->connection_states, &new_connection);
+        add_connection(thread_state, command.socket);
     }
     else
     {
@@ -103,25 +140,45 @@ void handle_master_command(smtp_worker_thread_state_t *thread_state)
     }
 }
 
-void close_connection_state(smtp_connection_state_t *state)
+void accept_connections(smtp_worker_thread_state_t *thread_state, int listen_socket)
 {
-    close(state->fd);
-    close(state->socket);
-    
-    if (state->recepient.match_data)
+    for (int i = 0; i < ACCEPT_BATCH; i++)
     {
-        command_match_free(&state->recepient);
+        int client_socket = accept4(listen_socket, NULL, NULL, SOCK_NONBLOCK);
+        if (client_socket < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOG_ERROR("Error accepting connection: %d", errno);
+            }
+            return;
+        }
+
+        atomic_fetch_add(&thread_state->current_sockets, 1);
+        add_connection(thread_state, client_socket);
     }
+}
+
+void close_connection_state(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
+{
+    close(state->socket);
 
-    if (state->from.match_data)
+    if (state->job)
     {
-        command_match_free(&state->from);
+        // Незаконченное письмо дописывается и закрывается без нас
+        spool_io_abandon(&thread_state->spool_io, state->job);
+        state->job = NULL;
     }
+    
+    command_match_free(&state->from);
 
     dynamic_vector_close(&state->write_buffer);
-    dynamic_vector_close(&state->read_buffer);
     dynamic_vector_close(&state->recepient_buffer);
+    dynamic_vector_close(&state->recepients);
+    dynamic_vector_close(&state->sender_buffer);
+    dynamic_vector_close(&state->body);
     message_builder_close(&state->mb);
+    spool_buffer_close(&state->spool);
 
     if (state->fd > 0)
     {
@@ -139,7 +196,7 @@ bool write_to_client(smtp_connection_state_t *connection_state)
     int sent_bytes = send_to_socket(connection_state->socket, msg, len);
     if (sent_bytes < 0)
     {
-        LOG("Error writing data");
+        LOG_ERROR("Error writing data");
         return false;
     }
     connection_state->write_buffer_pos += sent_bytes;
@@ -147,6 +204,7 @@ bool write_to_client(smtp_connection_state_t *connection_state)
     if (connection_state->write_buffer_pos == connection_state->write_buffer.size)
     {
         connection_state->mode = CONNECTION_READING;
+        connection_state->write_phase = TIMEOUT_WRITE;
         connection_state->write_buffer_pos = 0;
         dynamic_vector_clear(&connection_state->write_buffer);
     }
@@ -155,38 +213,118 @@ bool write_to_client(smtp_connection_state_t *connection_state)
 }
 
 
+// Читаем сокет до EAGAIN, но не больше READ_LIMIT. Возвращает false, если клиент
+// закрыл соединение или произошла ошибка; прочитанное до этого остаётся в message_builder.
 bool read_from_client(smtp_connection_state_t *connection_state)
 {
     assert(connection_state->mode == CONNECTION_READING);
 
-    int len = read_from_socket(connection_state->socket, connection_state->read_buffer.data, connection_state->read_buffer.capacity);
-    if (len <= 0)
+    for (int total = 0; total < READ_LIMIT; )
     {
-        LOG("Error reading data");
-        return false;
-    }
-    //LOG("Received message %.*s", len, connection_state->read_buffer.data);
+        // Читаем сразу в приёмный буфер сборщика строк, без промежуточной копии
+        char *buf = message_builder_reserve(&connection_state->mb, READ_CHUNK);
+        int len = read_from_socket(connection_state->socket, buf, READ_CHUNK);
+        if (len == -EAGAIN)
+        {
+            return true;
+        }
 
-    message_builder_add_string(&connection_state->mb, connection_state->read_buffer.data, len);
+        if (len == 0)
+        {
+            LOG_DEBUG("Client closed connection");
+            return false;
+        }
+        if (len < 0)
+        {
+            LOG_ERROR("Error reading data: %d", -len);
+            return false;
+        }
+        //LOG_TRACE("Received message %.*s", len, buf);
 
+        message_builder_commit(&connection_state->mb, len);
+        total += len;
+    }
     return true;
 }
 
 
 
-void handle_message_data(smtp_worker_thread_state_t *worker_state, smtp_connection_state_t *conn_state, message_t *msg)
+// Копит тело письма в буфере соединения. При асинхронной записи заполненный
+// буфер целиком переходит к письму, и соединение получает новый. Для сегментов
+// тело копится целиком: в сегмент оно попадает одной записью
+static void spool_message_data(smtp_worker_thread_state_t *worker_state, smtp_connection_state_t *conn_state,
+        const char *data, int len)
+{
+    // Остаток слишком большого письма не пишется: ответ 552 дадим на его конец
+    conn_state->data_size += len;
+    if (message_too_big(worker_state, conn_state))
+    {
+        return;
+    }
+    if (worker_state->segment_size > 0)
+    {
+        dynamic_vector_copy_back(&conn_state->body, data, len);
+        return;
+    }
+    if (worker_state->deduplicate)
+    {
+        sha256_update(&conn_state->body_hash, data, len);
+    }
+
+    if (!conn_state->job)
+    {
+        spool_buffer_append(&conn_state->spool, conn_state->fd, data, len, &worker_state->spool_stats);
+        return;
+    }
+
+    if (spool_buffer_store(&conn_state->spool, data, len))
+    {
+        return;
+    }
+
+    int pending_len;
+    char *pending = spool_buffer_take(&conn_state->spool, &pending_len);
+    if (pending)
+    {
+        spool_io_write(&worker_state->spool_io, conn_state->job, pending, pending_len);
+        worker_state->spool_stats.flushes++;
+        worker_state->spool_stats.bytes += pending_len;
+    }
+
+    if (!spool_buffer_store(&conn_state->spool, data, len))
+    {
+        char *copy = malloc(len);
+        memcpy(copy, data, len);
+        spool_io_write(&worker_state->spool_io, conn_state->job, copy, len);
+        worker_state->spool_stats.flushes++;
+        worker_state->spool_stats.bytes += len;
+    }
+}
+
+// Передаёт принятые байты тела письма в буфер записи файла.
+// Возвращает true, если письмо закончилось и можно разбирать команды дальше
+static bool receive_message_data(smtp_worker_thread_state_t *worker_state, smtp_connection_state_t *conn_state)
 {
     assert(conn_state->is_receiving_data);
-    // Приняли точку - конец сообщения
-    if (msg->len == 1 && msg->text[0] == '.')
+
+    int len;
+    char *data = message_builder_raw_data(&conn_state->mb, &len);
+    int consumed;
+    bool finished;
+    int decoded = data_stream_decode(&conn_state->data_stream, data, len, &consumed, &finished);
+    if (decoded > 0)
     {
-        fsm_step(conn_state->state, FSM_EV_ENDDATA, conn_state, worker_state, NULL);
+        conn_state->data_started = true;
+        spool_message_data(worker_state, conn_state, data, decoded);
     }
-    else
+    message_builder_consume_raw(&conn_state->mb, consumed);
+
+    if (finished)
     {
-        write(conn_state->fd, msg->text, msg->len);
-        write(conn_state->fd, "\r\n", 2);
+        message_builder_leave_raw(&conn_state->mb);
+        fsm_step(conn_state->state, FSM_EV_ENDDATA, conn_state, worker_state, NULL);
     }
+    return finished;
 }
 
 te_fsm_event find_event(smtp_client_command command)
@@ -207,150 +345,528 @@ te_fsm_event find_event(smtp_client_command command)
 void handle_message(smtp_worker_thread_state_t *worker_state, smtp_connection_state_t *conn_state, message_t *msg)
 {
     assert(!conn_state->is_receiving_data);
-    command_match_t match = client_command_parse_message(msg);
+    command_match_t match = client_command_parse_message(msg, &worker_state->regex_context);
     te_fsm_event event = find_event(match.command);
     fsm_step(conn_state->state, event, conn_state, worker_state, &match);
 }
 
 void handle_timeout(smtp_worker_thread_state_t *worker_state, smtp_connection_state_t *conn_state)
 {
-    assert(worker_state->current_time.tv_sec > conn_state->timeout);
+    if (conn_state->mode == CONNECTION_SPOOLING || conn_state->mode == CONNECTION_THROTTLED)
+    {
+        // Ответ на письмо даст окончание записи: 421 до него смешался бы
+        // с ним. Клиент, которого не читаем, тоже не виноват. Таймер перезапустится
+        return;
+    }
+    if (conn_state->mode == CONNECTION_WRITING || conn_state->state == FSM_ST_QUITTED)
+    {
+        // Клиент не забирает ответ - прощаться бесполезно, просто закрываем
+        LOG_DEBUG("Write timed out");
+        conn_state->mode = CONNECTION_READING;
+        conn_state->state = FSM_ST_QUITTED;
+        return;
+    }
     fsm_step(conn_state->state, FSM_EV_TIMEOUT, conn_state, worker_state, NULL); 
 }
 
-void worker_loop(smtp_worker_thread_state_t *state)
+static enum smtp_timeout_phase connection_timeout_phase(smtp_connection_state_t *connection_state)
 {
-    smtp_connection_state_t *connection_states = (smtp_connection_state_t*)state->connection_states.data;
-    fd_set readfds;
-    fd_set writefds;
-    while (state->should_run)
+    // Пока письмо записывается, ждём так же, как ответа на конец письма
+    if (connection_state->mode == CONNECTION_WRITING || connection_state->mode == CONNECTION_SYNCING
+            || connection_state->mode == CONNECTION_SPOOLING)
     {
-        int maxfd = state->worker_socket;
-        state->current_time = smtpgettime();
-        time_t current_time_sec = state->current_time.tv_sec;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
+        return connection_state->write_phase;
+    }
 
-        FD_SET(state->worker_socket, &readfds);
+    if (connection_state->is_receiving_data)
+    {
+        return connection_state->data_started ? TIMEOUT_DATA_BLOCK : TIMEOUT_DATA_INIT;
+    }
 
-        for (int i = 0; i < state->connection_states.size; i++)
+    switch (connection_state->state)
+    {
+    case FSM_ST_INIT:
+        return TIMEOUT_GREETING;
+    case FSM_ST_AWAITING_ADDRESS:
+    case FSM_ST_AWAITING_RCPT:
+    case FSM_ST_AWAITING_DATA:
+        return TIMEOUT_RCPT;
+    default:
+        return TIMEOUT_MAIL;
+    }
+}
+
+static bool write_backlog_full(smtp_connection_state_t *connection_state)
+{
+    return connection_state->write_buffer.size - connection_state->write_buffer_pos >= WRITE_BACKLOG_LIMIT;
+}
+
+// Обрабатываем все готовые строки сразу: при PIPELINING (RFC 2920) клиент
+// присылает группу команд, и ответы на них копятся в write_buffer
+static void handle_client_messages(smtp_worker_thread_state_t *state, smtp_connection_state_t *connection_state)
+{
+    // Забираем готовые строки пачками; они указывают в приёмный буфер
+    // и живут до message_builder_release_lines
+    message_t lines[MESSAGE_BATCH];
+    // После QUIT команды уже не обрабатываем, а пока письмо ждёт записи
+    // на диск или скопилось много неотправленных ответов, откладываем следующие
+    while (connection_state->state != FSM_ST_QUITTED && connection_state->mode != CONNECTION_SYNCING
+            && connection_state->mode != CONNECTION_SPOOLING && !write_backlog_full(connection_state))
+    {
+        if (connection_state->is_receiving_data)
         {
-            smtp_connection_state_t *connection_state = connection_states + i;
-            if(connection_state->mode == CONNECTION_WRITING)
+            if (!receive_message_data(state, connection_state))
             {
-                FD_SET(connection_state->socket, &writefds);
+                break; // Ждём продолжения письма
+            }
+            continue;
+        }
+
+        int count = message_builder_take_lines(&connection_state->mb, lines, MESSAGE_BATCH);
+        if (count == 0)
+        {
+            break;
+        }
+
+        for (int i = 0; i < count && connection_state->state != FSM_ST_QUITTED; i++)
+        {
+            message_t *msg = lines + i;
+            connection_state->current_message = msg;
+            handle_message(state, connection_state, msg);
+            connection_state->current_message = NULL;
+
+            if (connection_state->is_receiving_data)
+            {
+                // Тело письма идёт сразу за "DATA\r\n" и дальше принимается
+                // потоком, минуя разбиение на строки
+                data_stream_reset(&connection_state->data_stream);
+                message_builder_enter_raw(&connection_state->mb, msg->text + msg->len + 2);
+                break;
+            }
+        }
+    }
+    message_builder_release_lines(&connection_state->mb);
+}
+
+// Отправляет накопленные ответы. Если ушли все, разбирает команды, отложенные
+// из-за полного буфера ответов: новых данных в сокете для них может и не быть
+static void send_replies(smtp_worker_thread_state_t *state, smtp_connection_state_t *connection_state)
+{
+    while (connection_state->mode == CONNECTION_WRITING)
+    {
+        if (!write_to_client(connection_state))
+        {
+            connection_state->mode = CONNECTION_READING;
+            connection_state->state = FSM_ST_QUITTED;
+            return;
+        }
+        if (connection_state->mode == CONNECTION_WRITING)
+        {
+            return; // Остаток отправим, когда сокет будет готов
+        }
+        handle_client_messages(state, connection_state);
+    }
+}
+
+static void handle_connection_event(smtp_worker_thread_state_t *state, smtp_connection_state_t *connection_state, int events)
+{
+    if (connection_state->mode == CONNECTION_WRITING && (events & SMTP_POLL_WRITE))
+    {
+        send_replies(state, connection_state);
+    }
+    else if (connection_state->mode == CONNECTION_READING && (events & SMTP_POLL_READ))
+    {
+        bool alive = read_from_client(connection_state);
+        handle_client_messages(state, connection_state);
+        if (!alive)
+        {
+            LOG_DEBUG("Client disconnected by himself");
+            connection_state->mode = CONNECTION_READING;
+            connection_state->state = FSM_ST_QUITTED;
+        }
+        else
+        {
+            // Сокет почти всегда готов к записи: отправляем накопленные
+            // ответы сразу, не дожидаясь следующего пробуждения
+            send_replies(state, connection_state);
+        }
+    }
+}
+
+// Вызывается после активности на соединении: обновляет регистрацию сокета
+// после смены режима, переставляет таймер под текущую фазу и отмечает
+// соединение к закрытию, если ответ на QUIT уже отправлен
+static void update_connection(smtp_worker_thread_state_t *state, int index)
+{
+    smtp_connection_state_t *connection_state = get_connection(state, index);
+    if (connection_state->mode == CONNECTION_READING && connection_state->state == FSM_ST_QUITTED)
+    {
+        dynamic_vector_copy_elem_back(&state->closing_connections, &index);
+        return;
+    }
+
+    // Тело, которое не успевает записываться, дальше не принимаем
+    if (connection_state->mode == CONNECTION_READING && connection_state->job
+            && spool_io_throttle(connection_state->job))
+    {
+        connection_state->mode = CONNECTION_THROTTLED;
+    }
+
+    // Групповая запись письма заканчивается в этой же итерации, а на время
+    // асинхронной снимаем сокет с наблюдения, чтобы не просыпаться впустую
+    if (connection_state->mode != connection_state->registered_mode
+            && connection_state->mode != CONNECTION_SYNCING)
+    {
+        bool watched = mode_watched(connection_state->mode);
+        bool was_watched = mode_watched(connection_state->registered_mode);
+        if (!watched && was_watched)
+        {
+            smtp_poll_remove(&state->poll, connection_state->socket);
+        }
+        else if (watched && !was_watched)
+        {
+            smtp_poll_add(&state->poll, connection_state->socket, index,
+                    mode_interest(connection_state->mode));
+        }
+        else if (watched)
+        {
+            smtp_poll_modify(&state->poll, connection_state->socket, index,
+                    mode_interest(connection_state->mode));
+        }
+        connection_state->registered_mode = connection_state->mode;
+    }
+
+    enum smtp_timeout_phase phase = connection_timeout_phase(connection_state);
+    timer_wheel_reschedule(&state->timers, connection_state->timer,
+            state->current_time.tv_sec + state->timeouts[phase]);
+}
+
+// Письмо сохранено: отправляем придержанный ответ и обрабатываем команды,
+// пришедшие вслед за письмом. Они могут закончить ещё одно письмо
+static void resume_connection(smtp_worker_thread_state_t *state, int index)
+{
+    smtp_connection_state_t *connection_state = get_connection(state, index);
+    connection_state->mode = CONNECTION_WRITING;
+    handle_client_messages(state, connection_state);
+    send_replies(state, connection_state);
+    update_connection(state, index);
+}
+
+// Групповая запись писем, законченных за итерацию
+static void commit_pending_messages(smtp_worker_thread_state_t *state)
+{
+    int first = 0;
+    while (first < state->pending_syncs.size)
+    {
+        int last = state->pending_syncs.size;
+        sync_pending_messages(state, first, last);
+
+        for (int i = first; i < last; i++)
+        {
+            int index = ((int*)state->pending_syncs.data)[i];
+            // Если клиент отключился, соединение уже ждёт закрытия
+            if (get_connection(state, index)->mode == CONNECTION_SYNCING)
+            {
+                resume_connection(state, index);
+            }
+        }
+        first = last;
+    }
+    dynamic_vector_clear(&state->pending_syncs);
+}
+
+// Отвечает на письма, асинхронная запись которых закончилась, и снова
+// читает соединения, записи которых догнали приём
+static void complete_spool_jobs(smtp_worker_thread_state_t *state, bool ready)
+{
+    spool_io_t *io = &state->spool_io;
+    if (ready)
+    {
+        spool_io_process(io);
+    }
+
+    // Записи догнали приём: тело письма снова читается
+    int *drained = (int*)io->drained.data;
+    for (int i = 0; i < io->drained.size; i++)
+    {
+        smtp_connection_state_t *connection_state = get_connection(state, drained[i]);
+        if (connection_state->mode == CONNECTION_THROTTLED)
+        {
+            connection_state->mode = CONNECTION_READING;
+            update_connection(state, drained[i]);
+        }
+    }
+    dynamic_vector_clear(&io->drained);
+
+    while (io->results.size > 0)
+    {
+        // Возобновлённые соединения могут дописать новые результаты
+        int count = io->results.size;
+        spool_result_t results[count];
+        memcpy(results, io->results.data, sizeof(results));
+        dynamic_vector_clear(&io->results);
+
+        for (int i = 0; i < count; i++)
+        {
+            smtp_connection_state_t *connection_state = get_connection(state, results[i].owner);
+            connection_state->job = NULL;
+            if (message_too_big(state, connection_state))
+            {
+                reject_oversized_message(state, connection_state);
             }
             else
             {
-                FD_SET(connection_state->socket, &readfds);
+                bool ok = results[i].ok && deliver_to_other_recepients(state, connection_state);
+                finish_message_delivery(connection_state, ok);
+            }
+            if (connection_state->mode == CONNECTION_SPOOLING)
+            {
+                resume_connection(state, results[i].owner);
             }
+        }
+    }
+}
+
+static int compare_indices_desc(const void *a, const void *b)
+{
+    return *(const int*)b - *(const int*)a;
+}
+
+// Удаляем с конца: dynamic_vector_delete_at переносит на место удалённого
+// последний элемент, который в этом случае уже не ждёт закрытия
+static void close_finished_connections(smtp_worker_thread_state_t *state)
+{
+    int *indices = (int*)state->closing_connections.data;
+    int count = state->closing_connections.size;
+    qsort(indices, count, sizeof(int), &compare_indices_desc);
 
-            if (connection_state->socket > maxfd)
+    for (int i = 0; i < count; i++)
+    {
+        int index = indices[i];
+        smtp_connection_state_t *connection_state = get_connection(state, index);
+        LOG_TRACE("Closing a connection");
+        smtp_poll_remove(&state->poll, connection_state->socket);
+        timer_wheel_remove(&state->timers, connection_state->timer);
+        close_connection_state(state, connection_state);
+        dynamic_vector_delete_at(&state->connection_states, index);
+        atomic_fetch_sub(&state->current_sockets, 1);
+
+        if (index < state->connection_states.size)
+        {
+            smtp_connection_state_t *moved = get_connection(state, index);
+            if (mode_watched(moved->registered_mode))
+            {
+                smtp_poll_modify(&state->poll, moved->socket, index,
+                        mode_interest(moved->registered_mode));
+            }
+            timer_wheel_set_owner(&state->timers, moved->timer, index);
+            if (moved->job)
             {
-                maxfd = connection_state->socket;
+                moved->job->owner = index;
             }
         }
+    }
+
+    dynamic_vector_clear(&state->closing_connections);
+}
+
+// Пишет счётчики записи тел писем в журнал, если они изменились
+// с прошлого раза и прошло SPOOL_STATS_INTERVAL секунд
+static void report_spool_stats(smtp_worker_thread_state_t *state)
+{
+    if (state->current_time.tv_sec - state->spool_stats_reported < SPOOL_STATS_INTERVAL
+            || state->spool_stats.flushes == state->spool_stats_reported_flushes)
+    {
+        return;
+    }
+    LOG_INFO("Spool: %ld writes, %ld bytes", state->spool_stats.flushes, state->spool_stats.bytes);
+    state->spool_stats_reported = state->current_time.tv_sec;
+    state->spool_stats_reported_flushes = state->spool_stats.flushes;
+}
+
+void worker_loop(smtp_worker_thread_state_t *state)
+{
+    if (!smtp_poll_init(&state->poll)
+            || !smtp_poll_add(&state->poll, state->worker_socket, SMTP_POLL_MASTER_INDEX, SMTP_POLL_READ))
+    {
+        LOG_ERROR("Could not initialize worker poll");
+        return;
+    }
+
+    if ((state->listen_socket >= 0
+                && !smtp_poll_add(&state->poll, state->listen_socket, SMTP_POLL_LISTEN_INDEX, SMTP_POLL_READ))
+            || (state->listen_socket_v6 >= 0
+                && !smtp_poll_add(&state->poll, state->listen_socket_v6, SMTP_POLL_LISTEN_V6_INDEX, SMTP_POLL_READ)))
+    {
+        LOG_ERROR("Could not watch worker listen sockets");
+        return;
+    }
+    if (!command_regex_context_init(&state->regex_context))
+    {
+        LOG_ERROR("Could not create regex context");
+        return;
+    }
+    if (state->spool_backend != SPOOL_IO_NONE)
+    {
+        if (!spool_io_init(&state->spool_io, state->spool_backend)
+                || !smtp_poll_add(&state->poll, state->spool_io.event_fd, SMTP_POLL_SPOOL_INDEX, SMTP_POLL_READ))
+        {
+            LOG_ERROR("Could not start asynchronous spool");
+            return;
+        }
+        // В лог попадает способ, выбранный с учётом отката на пул потоков
+        state->spool_backend = state->spool_io.backend;
+        LOG_DEBUG("Asynchronous spool backend %d", (int)state->spool_backend);
+    }
+    state->closing_connections = dynamic_vector_create(sizeof(int), 16);
+    state->expired_connections = dynamic_vector_create(sizeof(int), 16);
+    state->pending_syncs = dynamic_vector_create(sizeof(int), 16);
+    state->current_time = smtpgettime();
+    state->spool_stats_reported = state->current_time.tv_sec;
+    set_log_clock(&state->current_time);
+    if (!unique_id_init(&state->ids, state->id))
+    {
+        LOG_WARN("getrandom failed, seeding file names from time");
+    }
+    if (state->segment_size > 0)
+    {
+        segment_spool_init(&state->segments, state->maildir->segments_fd, state->id, state->segment_size,
+                state->current_time.tv_sec, state->durability != DURABILITY_NONE);
+    }
+    state->timers = timer_wheel_create(state->current_time.tv_sec);
 
+    while (state->should_run)
+    {
         struct timespec sleep_time;
-        sleep_time.tv_sec = calculate_sleep_time(connection_states,
-                state->connection_states.size, current_time_sec);
+        sleep_time.tv_sec = timer_wheel_next_timeout(&state->timers, max_sleep_time);
         sleep_time.tv_nsec = 0;
-        
 
-        int ready = pselect(maxfd + 1, &readfds, &writefds, NULL, &sleep_time, NULL);
+        if (state->spool_backend != SPOOL_IO_NONE)
+        {
+            spool_io_submit(&state->spool_io);
+        }
+        int ready = smtp_poll_wait(&state->poll, &sleep_time);
+        state->current_time = smtpgettime();
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
 
         if (ready < 0)
         {
-            printf("PSELECT ERROR: %d\n", errno);
-            return;
+            LOG_ERROR("Worker poll error: %d", errno);
+            break;
         }
 
-        for (int i = 0; i < state->connection_states.size; i++)
+        bool master_ready = false;
+        bool listen_ready = false;
+        bool listen_v6_ready = false;
+        bool spool_ready = false;
+        smtp_poll_event_t *events = (smtp_poll_event_t*)state->poll.events.data;
+        for (int e = 0; e < ready; e++)
         {
-            smtp_connection_state_t *connection_state = connection_states + i;
-            if (connection_state->mode == CONNECTION_WRITING && FD_ISSET(connection_state->socket, &writefds))
+            int index = events[e].index;
+            if (index == SMTP_POLL_MASTER_INDEX)
+            {
+                master_ready = true;
+                continue;
+            }
+            if (index == SMTP_POLL_LISTEN_INDEX)
             {
-                connection_state->timeout = current_time_sec + state->timeout_secs;
-                write_to_client(connection_state);
+                listen_ready = true;
+                continue;
             }
-            else if (connection_state->mode == CONNECTION_READING && FD_ISSET(connection_state->socket, &readfds))
+            if (index == SMTP_POLL_LISTEN_V6_INDEX)
             {
-                connection_state->timeout = current_time_sec + state->timeout_secs;
-                if (!read_from_client(connection_state))
-                {
-                    LOG("Client disconnected by himself");
-                    connection_state->state = FSM_ST_QUITTED;
-                    continue;
-                }
-                int messages = message_builder_ready_message_count(&connection_state->mb);
-                for (int i = 0; i < messages; i++)
-                {
-                    message_t msg = message_builder_get_message(&connection_state->mb);
-                    connection_state->current_message = &msg;
-                    if (connection_state->is_receiving_data)
-                    {
-                        handle_message_data(state, connection_state, &msg);
-                    }
-                    else
-                    {
-                        handle_message(state, connection_state, &msg);
-                    }
-                    connection_state->current_message = NULL;
-                    message_free(&msg);
-                }
+                listen_v6_ready = true;
+                continue;
             }
-            else if (connection_state->mode == CONNECTION_READING && current_time_sec > connection_state->timeout)
+            if (index == SMTP_POLL_SPOOL_INDEX)
             {
-                LOG("Connection timed out %d %d", (int)connection_state->timeout, (int)current_time_sec);
-                handle_timeout(state, connection_state);
+                spool_ready = true;
+                continue;
             }
-            LOG("Connection %d new state %d", i, (int)connection_state->state);
+
+            handle_connection_event(state, get_connection(state, index), events[e].events);
+            update_connection(state, index);
+            LOG_TRACE("Connection %d new state %d", index, (int)get_connection(state, index)->state);
+        }
+        commit_pending_messages(state);
+        if (state->spool_backend != SPOOL_IO_NONE)
+        {
+            complete_spool_jobs(state, spool_ready);
         }
 
-        int size = state->connection_states.size;
-        for (int i = 0; i < size; i++)
+        timer_wheel_advance(&state->timers, state->current_time.tv_sec, &state->expired_connections);
+        int *expired = (int*)state->expired_connections.data;
+        for (int i = 0; i < state->expired_connections.size; i++)
         {
-            smtp_connection_state_t *connection_state = connection_states + i;
+            smtp_connection_state_t *connection_state = get_connection(state, expired[i]);
             if (connection_state->mode == CONNECTION_READING && connection_state->state == FSM_ST_QUITTED)
             {
-                LOG("Closing a connection");
-                close_connection_state(connection_state);
-                dynamic_vector_delete_at(&state->connection_states, i);
-                size--;
+                continue; // Уже ждёт закрытия
             }
+            LOG_DEBUG("Connection %d timed out", expired[i]);
+            handle_timeout(state, connection_state);
+            update_connection(state, expired[i]);
+        }
+        dynamic_vector_clear(&state->expired_connections);
+
+        close_finished_connections(state);
+        report_spool_stats(state);
+
+        if (listen_ready)
+        {
+            accept_connections(state, state->listen_socket);
         }
-#if 0
-        for (int i = 0; i < size; i++)
+
+        if (listen_v6_ready)
         {
-            smtp_connection_state_t *connection_state = connection_states + i;
-            if (connection_state->mode == CONNECTION_READING && connection_state->timeout > current_time_sec)
-            {
-                
-            }
+            accept_connections(state, state->listen_socket_v6);
         }
-#endif
 
-        if (FD_ISSET(state->worker_socket, &readfds))
+        if (master_ready)
         {
             handle_master_command(state);
             if (!state->should_run) break;
         }
     }
-    LOG("Closing everything");
+    LOG_INFO("Closing everything");
+    LOG_INFO("Spool: %ld writes, %ld bytes", state->spool_stats.flushes, state->spool_stats.bytes);
 
     for (int i = 0; i < state->connection_states.size; i++)
     {
-        smtp_connection_state_t *connection_state = connection_states + i;
-        close_connection_state(connection_state);
+        close_connection_state(state, get_connection(state, i));
     }
 
 
     dynamic_vector_close(&state->connection_states);
-    maildir_close(state->maildir);
+    dynamic_vector_close(&state->closing_connections);
+    dynamic_vector_close(&state->expired_connections);
+    dynamic_vector_close(&state->pending_syncs);
+    timer_wheel_close(&state->timers);
+    command_regex_context_free(&state->regex_context);
+    if (state->spool_backend != SPOOL_IO_NONE)
+    {
+        smtp_poll_remove(&state->poll, state->spool_io.event_fd);
+        spool_io_close(&state->spool_io);
+    }
+    if (state->segment_size > 0)
+    {
+        segment_spool_close(&state->segments);
+    }
+    smtp_poll_close(&state->poll);
     close(state->master_socket);
     close(state->worker_socket);
+    if (state->listen_socket >= 0)
+    {
+        close(state->listen_socket);
+    }
+    if (state->listen_socket_v6 >= 0)
+    {
+        close(state->listen_socket_v6);
+    }
     free(state->hostname);
 
-    LOG("Shutting down");
+    LOG_INFO("Shutting down");
 }
-
@@ -12,6 +12,14 @@
 #include "maildir.h"
 #include "message_builder.h"
 #include "commands.h"
+#include "smtp_poll.h"
+#include "timer_wheel.h"
+#include "data_stream.h"
+#include "spool_buffer.h"
+#include "spool_io.h"
+#include "segment_spool.h"
+#include "unique_id.h"
+#include "sha256.h"
 
 #include <stdbool.h>
 #include <stdatomic.h>
@@ -20,6 +28,31 @@
 #include <time.h>
 
 
+/**
+ * Наибольшее число получателей письма (RFC 5321, 4.5.3.1.8)
+ */
+#define SMTP_MAX_RECEPIENTS 100
+
+/**
+ * Наибольший размер письма по умолчанию (RFC 1870), задаётся флагом -M
+ */
+#define SMTP_DEFAULT_MAX_MESSAGE_SIZE (32 * 1024 * 1024)
+
+/**
+ * Получатель письма
+ */
+typedef struct smtp_recepient_t
+{
+    /**
+     * Смещение строки получателя в буфере получателей
+     */
+    int offset;
+    /**
+     * Разобранная строка; поля отсчитываются от её начала
+     */
+    command_match_t match;
+} smtp_recepient_t;
+
 /**
  * Текущее состояние сокета соединения: пишем или получаем
  */
@@ -27,6 +60,78 @@ enum smtp_connection_mode
 {
     CONNECTION_READING,
     CONNECTION_WRITING,
+    /**
+     * Письмо принято и ждёт групповой записи на диск. Ответ на него
+     * и последующие команды придержаны до конца итерации
+     */
+    CONNECTION_SYNCING,
+    /**
+     * Письмо передано асинхронной записи. Сокет не наблюдается, ответ
+     * и последующие команды ждут её завершения
+     */
+    CONNECTION_SPOOLING,
+    /**
+     * Тело письма принимается быстрее, чем асинхронно записывается.
+     * Сокет не наблюдается, пока записи не догонят приём
+     */
+    CONNECTION_THROTTLED,
+};
+
+/**
+ * Когда принятое письмо сбрасывается на диск
+ */
+enum smtp_durability
+{
+    /**
+     * Не сбрасывается, 250 отвечаем сразу
+     */
+    DURABILITY_NONE,
+    /**
+     * fsync файла и папки перед каждым ответом 250
+     */
+    DURABILITY_MESSAGE,
+    /**
+     * Письма, закончившиеся за одну итерацию рабочего цикла, сбрасываются
+     * вместе, с одним fsync на папку. Ответы 250 ждут окончания записи
+     */
+    DURABILITY_GROUP,
+};
+
+
+/**
+ * Фазы сессии, у каждой из которых свой тайм-аут (RFC 5321, 4.5.3.2)
+ */
+enum smtp_timeout_phase
+{
+    /**
+     * Ждём HELO/EHLO после приветствия
+     */
+    TIMEOUT_GREETING,
+    /**
+     * Ждём MAIL FROM
+     */
+    TIMEOUT_MAIL,
+    /**
+     * Ждём RCPT TO или DATA
+     */
+    TIMEOUT_RCPT,
+    /**
+     * Отправили 354, ждём первую строку письма
+     */
+    TIMEOUT_DATA_INIT,
+    /**
+     * Ждём очередной блок данных письма
+     */
+    TIMEOUT_DATA_BLOCK,
+    /**
+     * Отправляем ответ на конец данных письма
+     */
+    TIMEOUT_DATA_TERMINATION,
+    /**
+     * Отправляем любой другой ответ: клиент не читает сокет
+     */
+    TIMEOUT_WRITE,
+    TIMEOUT_PHASE_COUNT
 };
 
 
@@ -47,15 +152,41 @@ typedef struct smtp_connection_state_t
      * Состояние @a socket
      */
     enum smtp_connection_mode mode;
+    /**
+     * Режим, с которым @a socket зарегистрирован в #smtp_poll_t.
+     * Если отличается от @a mode, регистрацию нужно обновить.
+     */
+    enum smtp_connection_mode registered_mode;
     /**
      * Получаем команды или данные письма
      */
     bool is_receiving_data;
     
     /**
-     * Время наступления тайм-аута
+     * Таймер соединения в @a timers рабочего потока
+     */
+    int timer;
+    /**
+     * Получен ли хотя бы один байт письма после DATA
+     */
+    bool data_started;
+    /**
+     * Размер письма, заявленный в MAIL FROM (SIZE=), 0 - не заявлен
      */
-    time_t timeout;
+    long long declared_size;
+    /**
+     * Принято байт тела. Сверх наибольшего размера письма байты
+     * отбрасываются, а на конец DATA сервер отвечает 552
+     */
+    long long data_size;
+    /**
+     * Разбор тела письма
+     */
+    data_stream_t data_stream;
+    /**
+     * Фаза тайм-аута, пока отправляем ответ
+     */
+    enum smtp_timeout_phase write_phase;
 
     
     /**
@@ -67,15 +198,26 @@ typedef struct smtp_connection_state_t
      */
     int write_buffer_pos;
 
-    /**
-     * Буфер прочитанных данных
-     */
-    dynamic_vector_t read_buffer;
-
     /**
      * Дескриптор файла письма
      */
     int fd;
+    /**
+     * Буфер записи тела письма в @a fd
+     */
+    spool_buffer_t spool;
+    /**
+     * Асинхронная запись письма, NULL если письмо пишется в @a fd
+     */
+    spool_job_t *job;
+    /**
+     * Тело письма целиком, если письма пишутся в сегменты
+     */
+    dynamic_vector_t body;
+    /**
+     * Хеш принятой части тела, если одинаковые тела хранятся один раз
+     */
+    sha256_t body_hash;
     
     /**
      * Собиратель сообщений клиента из прочитанных данных
@@ -83,18 +225,21 @@ typedef struct smtp_connection_state_t
     message_builder_t mb;
     
     /**
-     * Соответствие строки отправителя
+     * Буфер, в котором храним строку отправителя
+     */
+    dynamic_vector_t sender_buffer;
+    /**
+     * Соответствие строки отправителя (поля указывают в @a sender_buffer)
      */
     command_match_t from;
-    // TODO: более одного получателя
     /**
-     * Буфер, в котором храним строку получателя
+     * Буфер, в котором подряд храним строки получателей
      */
     dynamic_vector_t recepient_buffer;
     /**
-     * Структура регэксп-матча получателя (нужна для вытаскивания параметров)
+     * Получатели письма, #smtp_recepient_t
      */
-    command_match_t recepient;
+    dynamic_vector_t recepients;
     
     /**
      * Имя файла
@@ -131,11 +276,25 @@ typedef struct smtp_worker_thread_state_t
      * Сокет, из которого рабочий поток читает команды главного потока
      */
     int worker_socket;
+    /**
+     * Собственные слушающие сокеты IPv4 и IPv6 в режиме SO_REUSEPORT,
+     * -1 если соединения принимает главный поток
+     */
+    int listen_socket;
+    int listen_socket_v6;
 
     /**
      * Вектор для хранения состояния соединений
      */
     dynamic_vector_t connection_states;
+    /**
+     * Наблюдаемые сокеты соединений и сокет команд главного потока
+     */
+    smtp_poll_t poll;
+    /**
+     * Индексы соединений, которые нужно закрыть в конце итерации
+     */
+    dynamic_vector_t closing_connections;
     /**
      * Прекращение работы
      */
@@ -154,6 +313,61 @@ typedef struct smtp_worker_thread_state_t
      * Количество полученных писем
      */
     int deliveries;
+    /**
+     * Генератор имён файлов писем
+     */
+    unique_id_t ids;
+    /**
+     * Общий для всех потоков счётчик писем: без случайных имён файлы
+     * называются по нему, чтобы имена разных потоков не совпадали
+     */
+    atomic_int *shared_deliveries;
+    /**
+     * Размер буфера записи тела письма у каждого соединения
+     */
+    int spool_buffer_size;
+    /**
+     * Наибольший размер письма, 0 - без ограничения
+     */
+    long long max_message_size;
+    /**
+     * Счётчики записи тел писем
+     */
+    spool_stats_t spool_stats;
+    /**
+     * Когда счётчики записи последний раз попали в журнал и сколько
+     * записей было к тому времени
+     */
+    time_t spool_stats_reported;
+    long spool_stats_reported_flushes;
+    /**
+     * Режим сброса писем на диск
+     */
+    enum smtp_durability durability;
+    /**
+     * Индексы соединений, письма которых ждут групповой записи
+     */
+    dynamic_vector_t pending_syncs;
+    /**
+     * Способ асинхронной записи писем, #SPOOL_IO_NONE - писать из цикла
+     */
+    enum spool_io_backend spool_backend;
+    /**
+     * Асинхронная запись писем
+     */
+    spool_io_t spool_io;
+    /**
+     * Размер сегментов, 0 - письма пишутся в maildir по файлу на письмо
+     */
+    uint64_t segment_size;
+    /**
+     * Сегменты потока
+     */
+    segment_spool_t segments;
+    /**
+     * Одинаковые тела писем хранятся один раз, см. #maildir_open_blobs
+     */
+    bool deduplicate;
     /**
      * Имя текущего сервера
      */
@@ -167,9 +381,21 @@ typedef struct smtp_worker_thread_state_t
      */
     firedns_state dns_state;
     /**
-     * Настройка таймаута в секундах
+     * Тайм-ауты фаз #smtp_timeout_phase в секундах
+     */
+    int timeouts[TIMEOUT_PHASE_COUNT];
+    /**
+     * Таймеры соединений
+     */
+    timer_wheel_t timers;
+    /**
+     * Индексы соединений с истёкшими таймерами
+     */
+    dynamic_vector_t expired_connections;
+    /**
+     * Стек JIT и данные совпадений регулярных выражений команд
      */
-    int timeout_secs;
+    command_regex_context_t regex_context;
 } smtp_worker_thread_state_t;
 
 /**
@@ -223,3 +449,33 @@ void server_recv_quit(te_fsm_state new_state, smtp_worker_thread_state_t *thread
         smtp_connection_state_t *state, command_match_t match);
 void server_timeout(te_fsm_state new_state, smtp_connection_state_t *state);
 
+/**
+ * Сбрасывает на диск письма соединений из @a pending_syncs с @a first
+ * по @a last (не включая) и дописывает ответы на них. Режим соединений
+ * не меняет: возобновить их должен рабочий цикл
+ */
+void sync_pending_messages(smtp_worker_thread_state_t *thread_state, int first, int last);
+
+/**
+ * Отвечает на конец письма: 250, если оно сохранено, иначе 451,
+ * и освобождает всё, что относилось к письму
+ */
+void finish_message_delivery(smtp_connection_state_t *state, bool stored);
+
+/**
+ * Превышен ли наибольший размер письма
+ */
+bool message_too_big(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state);
+
+/**
+ * Отвечает 552 на письмо больше наибольшего размера и удаляет его файл
+ */
+void reject_oversized_message(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state);
+
+/**
+ * Ссылается на письмо, уже перенесённое к первому получателю, для
+ * остальных получателей и, если нужна надёжность, сбрасывает ссылки на диск.
+ * Одинаковые тела перед этим заменяются общим, см. #maildir_deduplicate
+ */
+bool deliver_to_other_recepients(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state);
+
@@ -1,10 +1,13 @@
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <sys/socket.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include "serverstate-fsm.h"
 #include "smtp_worker.h"
 #include "commands.h"
@@ -13,24 +16,59 @@
 #include "util.h"
 #include "maildir.h"
 
-void create_file(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
+static int connection_index(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
+{
+    return state - (smtp_connection_state_t*)thread_state->connection_states.data;
+}
+
+static void name_message_file(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
 {
     if (thread_state->random_filenames)
     {
-        int random_number;
-        get_random(sizeof(int), (char*)&random_number);
-
-        generate_filename(state->filename, sizeof(state->filename), thread_state->current_time, random_number, getpid(),
-                thread_state->id, thread_state->deliveries, thread_state->hostname);
-        state->fd = maildir_create_in_tmp(thread_state->maildir, state->filename);
-        thread_state->deliveries++;
+        unique_id_filename(&thread_state->ids, state->filename, sizeof(state->filename),
+                thread_state->current_time, thread_state->hostname);
     }
     else
     {
-        snprintf(state->filename, sizeof(state->filename), "%d.mail", (int)thread_state->deliveries);
-        state->fd = maildir_create_in_tmp(thread_state->maildir, state->filename);
-        thread_state->deliveries++;
+        snprintf(state->filename, sizeof(state->filename), "%d.mail",
+                atomic_fetch_add(thread_state->shared_deliveries, 1));
     }
+    thread_state->deliveries++;
+}
+
+void create_file(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
+{
+    name_message_file(thread_state, state);
+    state->fd = maildir_create_in_tmp(thread_state->maildir, state->filename);
+
+    // Место под заявленный размер выделяется сразу, чтобы файл лёг на диск
+    // одним куском. Это только подсказка: ошибку можно не замечать
+    if (state->fd >= 0 && state->declared_size > 0)
+    {
+        fallocate(state->fd, FALLOC_FL_KEEP_SIZE, 0, state->declared_size);
+    }
+}
+
+// Освобождает место, выделенное под заявленный размер и не занятое телом:
+// за концом файла оно иначе осталось бы занятым. Его освобождает обрезка
+// файла по его же размеру
+static void release_reserved_space(smtp_connection_state_t *state)
+{
+    if (state->declared_size > state->data_size && ftruncate(state->fd, state->data_size) != 0)
+    {
+        LOG_ERROR("Failed to release space of %s: %d", state->filename, errno);
+    }
+}
+
+// Файл письма открывается асинхронно, тело пишется по мере заполнения буфера
+static void create_spool_job(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
+{
+    name_message_file(thread_state, state);
+
+    maildir_t *maildir = thread_state->maildir;
+    state->fd = 0;
+    state->job = spool_io_open(&thread_state->spool_io, maildir->tmp_fd, state->filename,
+            maildir->use_tmpfile, state->declared_size, connection_index(thread_state, state));
 }
 
 static bool same_address(firedns_state *state, const char *hostname, int fd)
@@ -62,11 +100,12 @@ static bool same_mx_address(firedns_state *state, const char *hostname, int fd)
     return same_address(state, mx_name, fd);
 }
 
+// Ответы дописываются в конец буфера: при конвейерной обработке (RFC 2920)
+// ответы на несколько команд уходят клиенту одним send
 static void write_message(smtp_connection_state_t *state, const char *msg)
 {
     int len = strlen(msg);
     dynamic_vector_copy_back(&state->write_buffer, msg, len);
-    state->write_buffer.size = len;
 }
 
 static void write_message_format(smtp_connection_state_t *state, const char *format, ...)
@@ -76,26 +115,27 @@ static void write_message_format(smtp_connection_state_t *state, const char *for
     int len = vsnprintf(NULL, 0, format, args1);
     va_end(args1);
 
-    dynamic_vector_reserve_at_least(&state->write_buffer, len + 1);
+    int offset = state->write_buffer.size;
+    dynamic_vector_reserve_at_least(&state->write_buffer, offset + len + 1);
 
     va_list args2;
     va_start(args2, format);
-    vsnprintf(state->write_buffer.data, state->write_buffer.capacity, format, args2);
+    vsnprintf((char*)state->write_buffer.data + offset, len + 1, format, args2);
     va_end(args2);
 
-    state->write_buffer.size = len;
+    state->write_buffer.size = offset + len;
 }
 
 void server_recv_helo(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
-    LOG("Processing HELO");
+    LOG_TRACE("Processing HELO");
 
-    char *domain = NULL;
+    const char *domain = NULL;
     int len;
-    if (!command_get_substring(&match, "domain", &domain, &len))
+    if (!command_get_field(&match, COMMAND_FIELD_DOMAIN, &domain, &len))
     {
-        LOG("No domain provided in HELO");
+        LOG_DEBUG("No domain provided in HELO");
         write_message(state, get_server_reply(REPLY_SYNTAX_ERROR_IN_PARAMS));
         state->mode = CONNECTION_WRITING;
         command_match_free(&match);
@@ -103,35 +143,35 @@ void server_recv_helo(te_fsm_state new_state, smtp_worker_thread_state_t *thread
     }
 
 #ifdef CHECK_LEGIT
-    if (!same_mx_address(&thread_state->dns_state, domain, state->socket))
+    char domain_name[256];
+    snprintf(domain_name, sizeof(domain_name), "%.*s", len, domain);
+    if (!same_mx_address(&thread_state->dns_state, domain_name, state->socket))
     {
-        LOG("HELO domain's MX record and connected socket have different addresses");
+        LOG_DEBUG("HELO domain's MX record and connected socket have different addresses");
         write_message(state, "421 Closing transmission channel\r\n");
         state->mode = CONNECTION_WRITING;
         state->state = FSM_ST_QUITTED;
-        command_free_substring(domain);
         command_match_free(&match);
         return;
     }
 #endif // CHECK_LEGIT
-    write_message_format(state, "250 %s greets %s\r\n", thread_state->hostname, domain);
+    write_message_format(state, "250 %s greets %.*s\r\n", thread_state->hostname, len, domain);
     state->mode = CONNECTION_WRITING;
     state->state = new_state;
 
-    command_free_substring(domain);
     command_match_free(&match);
 }
 
 void server_recv_ehlo(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
-    LOG("Processing EHLO");
+    LOG_TRACE("Processing EHLO");
 
-    char *domain = NULL;
+    const char *domain = NULL;
     int len;
-    if (!command_get_substring(&match, "domain", &domain, &len))
+    if (!command_get_field(&match, COMMAND_FIELD_DOMAIN, &domain, &len))
     {
-        LOG("No domain provided in EHLO");
+        LOG_DEBUG("No domain provided in EHLO");
         write_message(state, get_server_reply(REPLY_SYNTAX_ERROR_IN_PARAMS));
         state->mode = CONNECTION_WRITING;
         command_match_free(&match);
@@ -139,22 +179,23 @@ void server_recv_ehlo(te_fsm_state new_state, smtp_worker_thread_state_t *thread
     }
 
 #ifdef CHECK_LEGIT
-    if (!same_mx_address(&thread_state->dns_state, domain, state->socket))
+    char domain_name[256];
+    snprintf(domain_name, sizeof(domain_name), "%.*s", len, domain);
+    if (!same_mx_address(&thread_state->dns_state, domain_name, state->socket))
     {
-        LOG("EHLO domain's MX record and connected socket have different addresses, aborting.");
+        LOG_DEBUG("EHLO domain's MX record and connected socket have different addresses, aborting.");
         write_message(state, "421 Closing transmission channel\r\n");
         state->mode = CONNECTION_WRITING;
         state->state = FSM_ST_QUITTED;
-        command_free_substring(domain);
         command_match_free(&match);
         return;
     }
 #endif // CHECK_LEGIT
 
-    write_message_format(state, "250-%s greets %s\r\n250 VRFY\r\n", thread_state->hostname, domain);
+    write_message_format(state, "250-%s greets %.*s\r\n250-PIPELINING\r\n250-SIZE %lld\r\n250 VRFY\r\n",
+            thread_state->hostname, len, domain, thread_state->max_message_size);
     state->mode = CONNECTION_WRITING;
     state->state = new_state;
-    command_free_substring(domain);
     command_match_free(&match);
 }
 
@@ -163,7 +204,7 @@ void server_recv_vrfy(te_fsm_state new_state, smtp_worker_thread_state_t *thread
         smtp_connection_state_t *state, command_match_t match)
 {
     (void)thread_state;
-    LOG("Processing VRFY");
+    LOG_TRACE("Processing VRFY");
     write_message(state, "550 No such user here \r\n");
     state->mode = CONNECTION_WRITING;
     state->state = new_state;
@@ -173,51 +214,78 @@ void server_recv_vrfy(te_fsm_state new_state, smtp_worker_thread_state_t *thread
 void server_recv_mailfrom(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
-    LOG("Processing MAIL FROM");
-    (void)thread_state;
-    write_message(state, "250 OK\r\n");
+    LOG_TRACE("Processing MAIL FROM");
     state->mode = CONNECTION_WRITING;
+
+    // RFC 1870: письмо, заранее заявленное слишком большим, отклоняем
+    // до передачи тела
+    long long declared_size = 0;
+    const char *size;
+    int size_len;
+    if (command_get_field(&match, COMMAND_FIELD_SIZE, &size, &size_len))
+    {
+        char digits[24];
+        snprintf(digits, sizeof(digits), "%.*s", size_len, size);
+        unsigned long long value = strtoull(digits, NULL, 10);
+        declared_size = value > LLONG_MAX ? LLONG_MAX : (long long)value;
+        if (thread_state->max_message_size > 0 && declared_size > thread_state->max_message_size)
+        {
+            LOG_DEBUG("Declared size %lld exceeds %lld", declared_size, thread_state->max_message_size);
+            write_message(state, get_server_reply(REPLY_MESSAGE_TOO_BIG));
+            command_match_free(&match);
+            return;
+        }
+    }
+    write_message(state, "250 OK\r\n");
+    state->declared_size = declared_size;
+
+    // Как и строку получателя, храним копию: отправитель нужен до конца письма
+    dynamic_vector_clear(&state->sender_buffer);
+    dynamic_vector_copy_back(&state->sender_buffer, match.text, state->current_message->len);
     state->from = match;
+    state->from.text = state->sender_buffer.data;
+
     state->state = new_state;
 }
 
 void server_recv_rcptto(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
-    LOG("Processing RCPT TO");
+    LOG_TRACE("Processing RCPT TO");
     (void)thread_state;
-    command_match_free(&match);
-    write_message(state, "250 OK\r\n");
     state->mode = CONNECTION_WRITING;
-    dynamic_vector_copy_back(&state->recepient_buffer, state->current_message->text, 
-            state->current_message->len);
+    state->state = new_state;
 
-    message_t msg_copy;
-    msg_copy.text = state->recepient_buffer.data;
-    msg_copy.len = state->recepient_buffer.size;
-    state->recepient = client_command_parse_message(&msg_copy);
-    assert(state->recepient.command == CLIENT_RCPTTO);
+    // RFC 5321, 4.5.3.1.10: лишних получателей отклоняем, остальные
+    // получат письмо
+    if (state->recepients.size >= SMTP_MAX_RECEPIENTS)
+    {
+        write_message(state, get_server_reply(REPLY_TOO_MANY_RECIPIENTS));
+        command_match_free(&match);
+        return;
+    }
+    write_message(state, "250 OK\r\n");
 
-    state->state = new_state;
+    // Строка команды живёт только до конца обработки пачки, поэтому храним
+    // её копию; поля совпадения - смещения, их достаточно перенести на копию
+    smtp_recepient_t recepient = { .offset = state->recepient_buffer.size, .match = match };
+    recepient.match.text = NULL;
+    dynamic_vector_copy_back(&state->recepient_buffer, match.text, state->current_message->len);
+    dynamic_vector_copy_elem_back(&state->recepients, &recepient);
 }
 
 void server_recv_rset(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
     (void)thread_state;
-    LOG("Processing RSET");
-
-    if (state->recepient.match_data)
-    {
-        command_match_free(&state->recepient);
-    }
+    LOG_TRACE("Processing RSET");
 
-    if (state->from.match_data)
-    {
-        command_match_free(&state->from);
-    }
+    command_match_free(&state->from);
+    state->declared_size = 0;
 
+    dynamic_vector_clear(&state->recepients);
     dynamic_vector_clear(&state->recepient_buffer);
+    dynamic_vector_clear(&state->sender_buffer);
 
     write_message(state, "250 OK\r\n");
     state->mode = CONNECTION_WRITING;
@@ -228,7 +296,7 @@ void server_recv_rset(te_fsm_state new_state, smtp_worker_thread_state_t *thread
 void server_recv_unknown(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
-    LOG("Processing unknown command");
+    LOG_TRACE("Processing unknown command");
     (void)thread_state;
     write_message(state, "500 Syntax error, command unrecognized\r\n");
     state->mode = CONNECTION_WRITING;
@@ -239,7 +307,7 @@ void server_recv_unknown(te_fsm_state new_state, smtp_worker_thread_state_t *thr
 void server_recv_error(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
-    LOG("Processing bad command");
+    LOG_TRACE("Processing bad command");
     (void)thread_state;
     write_message(state, "503 Bad sequence of commands\r\n");
     state->mode = CONNECTION_WRITING;
@@ -247,72 +315,462 @@ void server_recv_error(te_fsm_state new_state, smtp_worker_thread_state_t *threa
     command_match_free(&match);
 }
 
-void move_file_to_destination(smtp_worker_thread_state_t *thread_state,
-        smtp_connection_state_t *state)
+// Разобранная строка получателя номер @a index. Строки лежат в общем
+// буфере, который растёт, поэтому указатель на строку берём при обращении
+static command_match_t get_recepient(smtp_connection_state_t *state, int index)
 {
-    char *dst_domain;
+    smtp_recepient_t *recepient = (smtp_recepient_t*)state->recepients.data + index;
+    command_match_t match = recepient->match;
+    match.text = (char*)state->recepient_buffer.data + recepient->offset;
+    return match;
+}
+
+// Имя, под которым письмо получает получатель номер @a index
+static void recepient_filename(smtp_connection_state_t *state, int index, char *buf, int len)
+{
+    if (index == 0)
+    {
+        snprintf(buf, len, "%s", state->filename);
+    }
+    else
+    {
+        snprintf(buf, len, "%s.%d", state->filename, index);
+    }
+}
+
+// Папка назначения письма по домену получателя номер @a index
+static enum maildir_folder destination_folder(smtp_worker_thread_state_t *thread_state,
+        smtp_connection_state_t *state, int index)
+{
+    command_match_t recepient = get_recepient(state, index);
+    const char *dst_domain;
     int dst_domain_len;
-    command_get_substring(&state->recepient, "domain", &dst_domain, &dst_domain_len);
-    if (!dst_domain || dst_domain_len <= 0)
+    if (!command_get_field(&recepient, COMMAND_FIELD_DOMAIN, &dst_domain, &dst_domain_len)
+            || dst_domain_len <= 0)
     {
-        LOG("No domain. Leaving mail in tmp");
-        return;
+        LOG_DEBUG("No domain. Leaving mail in tmp");
+        return MAILDIR_TMP;
     }
 
     if (strlen(thread_state->hostname) == (unsigned long)dst_domain_len 
             && memcmp(thread_state->hostname, dst_domain, dst_domain_len) == 0)
     {
-        maildir_move_to_cur(thread_state->maildir, state->filename);
+        return MAILDIR_CUR;
     }
-    else
+    return MAILDIR_RELAY;
+}
+
+// Заменяет письмо первого получателя ссылкой на тело с тем же хешем.
+// Ошибка не мешает доставке: письмо просто остаётся отдельным файлом
+static void deduplicate_body(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
+{
+    if (!thread_state->deduplicate)
+    {
+        return;
+    }
+    char digest[SHA256_HEX_SIZE + 1];
+    sha256_final_hex(&state->body_hash, digest);
+    if (!maildir_deduplicate(thread_state->maildir, destination_folder(thread_state, state, 0),
+            state->filename, digest))
+    {
+        LOG_ERROR("Failed to deduplicate %s: %d", state->filename, errno);
+    }
+}
+
+// Ссылается на письмо первого получателя для остальных, отмечая
+// в @a touched их папки
+static bool link_other_recepients(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state,
+        bool touched[MAILDIR_FOLDER_COUNT])
+{
+    enum maildir_folder first = destination_folder(thread_state, state, 0);
+    for (int i = 1; i < state->recepients.size; i++)
+    {
+        enum maildir_folder folder = destination_folder(thread_state, state, i);
+        char name[sizeof(state->filename) + 16];
+        recepient_filename(state, i, name, sizeof(name));
+        if (!maildir_link_delivered(thread_state->maildir, first, state->filename, folder, name))
+        {
+            LOG_ERROR("Failed to link %s for recepient %d: %d", state->filename, i, errno);
+            return false;
+        }
+        touched[folder] = true;
+    }
+    return true;
+}
+
+// Сбрасывает на диск записи о письме в подпапках разбитых папок
+// для получателей начиная с @a first
+static bool sync_sharded_entries(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state,
+        int first)
+{
+    for (int i = first; i < state->recepients.size; i++)
+    {
+        enum maildir_folder folder = destination_folder(thread_state, state, i);
+        char name[sizeof(state->filename) + 16];
+        recepient_filename(state, i, name, sizeof(name));
+        if (maildir_is_sharded(thread_state->maildir, folder)
+                && !maildir_sync_entry(thread_state->maildir, folder, name))
+        {
+            LOG_ERROR("Failed to sync shard of %s: %d", name, errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Переносит письмо из tmp к первому получателю и ссылается на него
+// для остальных: тело на диске одно. Отмечает в @a touched папки,
+// в которых появились письма
+static bool move_file_to_destination(smtp_worker_thread_state_t *thread_state,
+        smtp_connection_state_t *state, bool touched[MAILDIR_FOLDER_COUNT])
+{
+    enum maildir_folder folder = destination_folder(thread_state, state, 0);
+    bool moved;
+    switch (folder)
+    {
+    case MAILDIR_CUR:
+        moved = maildir_move_to_cur(thread_state->maildir, state->fd, state->filename);
+        break;
+    case MAILDIR_RELAY:
+        moved = maildir_move_to_relay(thread_state->maildir, state->fd, state->filename);
+        break;
+    default:
+        moved = maildir_keep_in_tmp(thread_state->maildir, state->fd, state->filename);
+        break;
+    }
+
+    if (!moved)
     {
-        maildir_move_to_relay(thread_state->maildir, state->filename);
+        LOG_ERROR("Failed to move %s out of tmp: %d", state->filename, errno);
+        return false;
+    }
+    touched[folder] = true;
+    deduplicate_body(thread_state, state);
+    return link_other_recepients(thread_state, state, touched);
+}
+
+// Сбрасывает на диск записи о письме в неразбитых папках @a touched
+// и в подпапках разбитых для получателей начиная с @a first
+static bool sync_touched_folders(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state,
+        bool touched[MAILDIR_FOLDER_COUNT], int first)
+{
+    for (int folder = 0; folder < MAILDIR_FOLDER_COUNT; folder++)
+    {
+        if (touched[folder] && !maildir_is_sharded(thread_state->maildir, folder)
+                && !maildir_sync_folder(thread_state->maildir, folder))
+        {
+            LOG_ERROR("Failed to sync maildir folder %d: %d", folder, errno);
+            return false;
+        }
     }
+    return sync_sharded_entries(thread_state, state, first);
+}
 
-    command_free_substring(dst_domain);
+bool deliver_to_other_recepients(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
+{
+    bool touched[MAILDIR_FOLDER_COUNT] = {false};
+    deduplicate_body(thread_state, state);
+    if (!link_other_recepients(thread_state, state, touched))
+    {
+        return false;
+    }
+    // Запись первого получателя уже сбросила асинхронная запись
+    return thread_state->durability == DURABILITY_NONE
+        || sync_touched_folders(thread_state, state, touched, 1);
+}
+
+// Отвечает на конец DATA и забывает письмо
+static void end_transaction(smtp_connection_state_t *state, const char *reply)
+{
+    write_message(state, reply);
+
+    if (state->fd > 0)
+    {
+        close(state->fd);
+    }
+    state->fd = 0;
+
+    command_match_free(&state->from);
+    state->declared_size = 0;
+    state->data_size = 0;
+    dynamic_vector_clear(&state->recepients);
+    dynamic_vector_clear(&state->recepient_buffer);
+    dynamic_vector_clear(&state->sender_buffer);
+    dynamic_vector_clear(&state->body);
+}
+
+void finish_message_delivery(smtp_connection_state_t *state, bool stored)
+{
+    end_transaction(state, stored ? "250 OK\r\n" : get_server_reply(REPLY_ACTION_ABORTED));
+}
+
+bool message_too_big(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
+{
+    return thread_state->max_message_size > 0 && state->data_size > thread_state->max_message_size;
+}
+
+void reject_oversized_message(smtp_worker_thread_state_t *thread_state, smtp_connection_state_t *state)
+{
+    LOG_DEBUG("Message %s exceeds %lld bytes", state->filename, thread_state->max_message_size);
+    if (thread_state->segment_size == 0)
+    {
+        maildir_remove_from_tmp(thread_state->maildir, state->filename);
+    }
+    end_transaction(state, get_server_reply(REPLY_MESSAGE_TOO_BIG));
+}
+
+// Данные файла должны попасть на диск раньше, чем запись о нём в папке
+static bool store_message_synced(smtp_worker_thread_state_t *thread_state,
+        smtp_connection_state_t *state)
+{
+    if (fdatasync(state->fd) != 0)
+    {
+        LOG_ERROR("Failed to sync %s: %d", state->filename, errno);
+        return false;
+    }
+
+    bool touched[MAILDIR_FOLDER_COUNT] = {false};
+    return move_file_to_destination(thread_state, state, touched)
+        && sync_touched_folders(thread_state, state, touched, 0);
+}
+
+// Дописывает письмо в сегмент потока. В групповом режиме сегмент
+// сбрасывается на диск один раз за итерацию в sync_pending_messages
+static bool store_message_in_segment(smtp_worker_thread_state_t *thread_state,
+        smtp_connection_state_t *state)
+{
+    const char *from = "";
+    int from_len = 0;
+    command_get_field(&state->from, COMMAND_FIELD_SENDER, &from, &from_len);
+
+    // Тело копируется в сегмент один раз, записи остальных получателей
+    // ссылаются на него
+    for (int i = 0; i < state->recepients.size; i++)
+    {
+        command_match_t recepient = get_recepient(state, i);
+        const char *rcpt = "";
+        int rcpt_len = 0;
+        command_get_field(&recepient, COMMAND_FIELD_RECEPIENT, &rcpt, &rcpt_len);
+        if (!segment_spool_append(&thread_state->segments, from, from_len, rcpt, rcpt_len,
+                state->body.data, state->body.size, destination_folder(thread_state, state, i), i > 0))
+        {
+            return false;
+        }
+    }
+    if (thread_state->durability == DURABILITY_MESSAGE && !segment_spool_sync(&thread_state->segments))
+    {
+        return false;
+    }
+    return true;
 }
 
 void server_recv_enddata(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
-    LOG("Processing end of DATA");
+    LOG_TRACE("Processing end of DATA");
     assert(state->is_receiving_data == true);
 
-    write_message(state, "250 OK\r\n");
     state->is_receiving_data = false;
     state->mode = CONNECTION_WRITING;
+    state->write_phase = TIMEOUT_DATA_TERMINATION;
     state->state = new_state;
     command_match_free(&match);
 
-    move_file_to_destination(thread_state, state);
-    close(state->fd);
-    state->fd = 0;
+    if (message_too_big(thread_state, state) && state->job)
+    {
+        // Файл удалим, когда асинхронная запись его закроет
+        state->job->failed = true;
+        spool_io_finish(&thread_state->spool_io, state->job, -1, false, false);
+        state->mode = CONNECTION_SPOOLING;
+        return;
+    }
+    if (message_too_big(thread_state, state))
+    {
+        reject_oversized_message(thread_state, state);
+        return;
+    }
 
-    command_match_free(&state->from);
-    command_match_free(&state->recepient);
-    dynamic_vector_clear(&state->recepient_buffer);
+    if (state->job)
+    {
+        // Остаток тела, перенос и сброс на диск выполнит асинхронная запись,
+        // ответ даст рабочий цикл по её завершении. Групповой режим здесь
+        // не нужен: сбросы разных писем и так идут параллельно
+        spool_io_t *io = &thread_state->spool_io;
+        int len;
+        char *rest = spool_buffer_take(&state->spool, &len);
+        if (rest)
+        {
+            spool_io_write(io, state->job, rest, len);
+        }
+        // Остальным получателям ссылки создаст рабочий цикл,
+        // когда письмо окажется у первого
+        int folder = destination_folder(thread_state, state, 0);
+        maildir_t *maildir = thread_state->maildir;
+        bool sharded = maildir_is_sharded(maildir, folder);
+        int dst_dirfd = sharded ? maildir_open_shard(maildir, folder, state->filename)
+            : maildir_folder_fd(maildir, folder);
+        if (dst_dirfd < 0)
+        {
+            // Письмо закроется, не попав в папку, и получит 451
+            LOG_ERROR("Failed to open shard for %s: %d", state->filename, errno);
+            state->job->failed = true;
+        }
+        spool_io_finish(io, state->job, dst_dirfd, sharded && dst_dirfd >= 0,
+                thread_state->durability != DURABILITY_NONE);
+        state->mode = CONNECTION_SPOOLING;
+        return;
+    }
+
+    if (thread_state->segment_size > 0)
+    {
+        bool stored = store_message_in_segment(thread_state, state);
+        if (stored && thread_state->durability == DURABILITY_GROUP)
+        {
+            int index = connection_index(thread_state, state);
+            dynamic_vector_copy_elem_back(&thread_state->pending_syncs, &index);
+            state->mode = CONNECTION_SYNCING;
+            return;
+        }
+        finish_message_delivery(state, stored);
+        return;
+    }
+
+    // 250 можно отвечать только когда всё тело уже в файле
+    if (!spool_buffer_flush(&state->spool, state->fd, &thread_state->spool_stats))
+    {
+        LOG_ERROR("Failed to write %s: %d", state->filename, errno);
+        finish_message_delivery(state, false);
+        return;
+    }
+    release_reserved_space(state);
+
+    switch (thread_state->durability)
+    {
+    case DURABILITY_NONE:
+    {
+        bool touched[MAILDIR_FOLDER_COUNT] = {false};
+        finish_message_delivery(state, move_file_to_destination(thread_state, state, touched));
+        break;
+    }
+    case DURABILITY_MESSAGE:
+        finish_message_delivery(state, store_message_synced(thread_state, state));
+        break;
+    case DURABILITY_GROUP:
+    {
+        // Ответ даст sync_pending_messages в конце итерации
+        int index = connection_index(thread_state, state);
+        dynamic_vector_copy_elem_back(&thread_state->pending_syncs, &index);
+        state->mode = CONNECTION_SYNCING;
+        break;
+    }
+    }
+}
+
+void sync_pending_messages(smtp_worker_thread_state_t *thread_state, int first, int last)
+{
+    smtp_connection_state_t *connections = thread_state->connection_states.data;
+    int *indices = (int*)thread_state->pending_syncs.data;
+    LOG_TRACE("Syncing %d messages", last - first);
+
+    if (thread_state->segment_size > 0)
+    {
+        // Письма из прежних сегментов уже сброшены при их смене,
+        // остальные лежат в текущем: хватает одного msync
+        bool synced = segment_spool_sync(&thread_state->segments);
+        for (int i = first; i < last; i++)
+        {
+            finish_message_delivery(connections + indices[i], synced);
+        }
+        return;
+    }
+
+    // Сначала запускаем запись всех файлов, чтобы диск писал их вместе,
+    // и только потом ждём каждый
+    for (int i = first; i < last; i++)
+    {
+        sync_file_range(connections[indices[i]].fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+
+    maildir_t *maildir = thread_state->maildir;
+    bool stored[last - first];
+    bool touched[MAILDIR_FOLDER_COUNT] = {false};
+    for (int i = first; i < last; i++)
+    {
+        smtp_connection_state_t *state = connections + indices[i];
+        stored[i - first] = false;
+        if (fdatasync(state->fd) != 0)
+        {
+            LOG_ERROR("Failed to sync %s: %d", state->filename, errno);
+            continue;
+        }
+        stored[i - first] = move_file_to_destination(thread_state, state, touched);
+    }
+
+    // Неразбитые папки сбрасываются один раз на всю группу,
+    // разбитые - по подпапке на письмо
+    bool synced[MAILDIR_FOLDER_COUNT];
+    for (int folder = 0; folder < MAILDIR_FOLDER_COUNT; folder++)
+    {
+        synced[folder] = !touched[folder] || maildir_is_sharded(maildir, folder)
+            || maildir_sync_folder(maildir, folder);
+        if (!synced[folder])
+        {
+            LOG_ERROR("Failed to sync maildir folder %d: %d", folder, errno);
+        }
+    }
+
+    for (int i = first; i < last; i++)
+    {
+        smtp_connection_state_t *state = connections + indices[i];
+        bool ok = stored[i - first];
+        for (int r = 0; ok && r < state->recepients.size; r++)
+        {
+            ok = synced[destination_folder(thread_state, state, r)];
+        }
+        finish_message_delivery(state, ok && sync_sharded_entries(thread_state, state, 0));
+    }
 }
 
 void server_recv_data(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
     assert(state->is_receiving_data == false);
-    LOG("Processing DATA");
+    LOG_TRACE("Processing DATA");
     (void)thread_state;
     state->mode = CONNECTION_WRITING;
     state->state = new_state;
     state->is_receiving_data = true;
+    state->data_started = false;
+    state->data_size = 0;
     write_message(state, "354 Start mail input; end with <CRLF>.<CRLF>\r\n");
     command_match_free(&match);
+    if (thread_state->deduplicate)
+    {
+        sha256_init(&state->body_hash);
+    }
 
-    create_file(thread_state, state);
+    if (thread_state->segment_size > 0)
+    {
+        dynamic_vector_clear(&state->body);
+        thread_state->deliveries++;
+        return;
+    }
+    if (thread_state->spool_backend != SPOOL_IO_NONE)
+    {
+        create_spool_job(thread_state, state);
+    }
+    else
+    {
+        create_file(thread_state, state);
+    }
+    spool_buffer_reset(&state->spool);
 }
 
 
 void server_recv_quit(te_fsm_state new_state, smtp_worker_thread_state_t *thread_state,
         smtp_connection_state_t *state, command_match_t match)
 {
-    LOG("Processing QUIT");
+    LOG_TRACE("Processing QUIT");
     (void)thread_state;
     write_message_format(state, "221 %s Service closing transmission channel\r\n", thread_state->hostname);
     state->mode = CONNECTION_WRITING;
@@ -322,7 +780,7 @@ void server_recv_quit(te_fsm_state new_state, smtp_worker_thread_state_t *thread
 
 void server_timeout(te_fsm_state new_state, smtp_connection_state_t *state)
 {
-    LOG("Processing timeout");
+    LOG_TRACE("Processing timeout");
     write_message(state, "421 Closing transmission channel\r\n");
     state->mode = CONNECTION_WRITING;
     state->state = new_state;
@@ -0,0 +1,123 @@
+#include "spool_buffer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+
+void spool_buffer_init(spool_buffer_t *spool, int capacity)
+{
+    spool->data = NULL;
+    spool->size = 0;
+    spool->capacity = capacity;
+    spool->failed = false;
+}
+
+void spool_buffer_reset(spool_buffer_t *spool)
+{
+    spool->size = 0;
+    spool->failed = false;
+}
+
+// writev до конца: запись в файл может оказаться частичной
+static bool write_all(int fd, struct iovec *iov, int iovcnt, spool_stats_t *stats)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        stats->flushes++;
+        stats->bytes += written;
+
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+bool spool_buffer_store(spool_buffer_t *spool, const char *data, int len)
+{
+    if (spool->size + len > spool->capacity)
+    {
+        return false;
+    }
+
+    if (!spool->data)
+    {
+        spool->data = malloc(spool->capacity);
+    }
+    memcpy(spool->data + spool->size, data, len);
+    spool->size += len;
+    return true;
+}
+
+char *spool_buffer_take(spool_buffer_t *spool, int *len)
+{
+    if (spool->size == 0)
+    {
+        return NULL;
+    }
+
+    char *data = spool->data;
+    *len = spool->size;
+    spool->data = NULL;
+    spool->size = 0;
+    return data;
+}
+
+bool spool_buffer_append(spool_buffer_t *spool, int fd, const char *data, int len, spool_stats_t *stats)
+{
+    if (spool->failed)
+    {
+        return false;
+    }
+
+    if (spool_buffer_store(spool, data, len))
+    {
+        return true;
+    }
+
+    struct iovec iov[2] =
+    {
+        { .iov_base = spool->data, .iov_len = spool->size },
+        { .iov_base = (void*)data, .iov_len = len },
+    };
+    int first = spool->size > 0 ? 0 : 1;
+    spool->size = 0;
+    spool->failed = !write_all(fd, iov + first, 2 - first, stats);
+    return !spool->failed;
+}
+
+bool spool_buffer_flush(spool_buffer_t *spool, int fd, spool_stats_t *stats)
+{
+    if (!spool->failed && spool->size > 0)
+    {
+        struct iovec iov = { .iov_base = spool->data, .iov_len = spool->size };
+        spool->failed = !write_all(fd, &iov, 1, stats);
+    }
+    spool->size = 0;
+    return !spool->failed;
+}
+
+void spool_buffer_close(spool_buffer_t *spool)
+{
+    free(spool->data);
+    spool->data = NULL;
+    spool->size = 0;
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <stdbool.h>
+
+/**
+ * @file
+ * @brief Отложенная запись тела письма в файл
+ *
+ * Принятые байты тела копятся в буфере соединения и уходят в файл
+ * письма одним writev, когда буфер заполняется или письмо заканчивается.
+ * Так на письмо приходится по системному вызову на каждые
+ * @a capacity байт, а не на каждое чтение из сокета.
+ */
+
+/**
+ * Размер буфера по умолчанию
+ */
+#define SPOOL_BUFFER_DEFAULT_SIZE (64 * 1024)
+
+/**
+ * Счётчики записи рабочего потока
+ */
+typedef struct spool_stats_t
+{
+    /**
+     * Количество вызовов write/writev
+     */
+    long flushes;
+    /**
+     * Записано байт
+     */
+    long bytes;
+} spool_stats_t;
+
+/**
+ * Буфер записи тела письма
+ */
+typedef struct spool_buffer_t
+{
+    /**
+     * Память выделяется при первой записи
+     */
+    char *data;
+    int size;
+    int capacity;
+    /**
+     * Запись в файл не удалась. Остальные байты письма отбрасываются,
+     * ошибку вернёт #spool_buffer_flush
+     */
+    bool failed;
+} spool_buffer_t;
+
+/**
+ * Готовит буфер ёмкостью @a capacity байт, память пока не выделяется
+ */
+void spool_buffer_init(spool_buffer_t *spool, int capacity);
+
+/**
+ * Сбрасывает буфер перед новым письмом
+ */
+void spool_buffer_reset(spool_buffer_t *spool);
+
+/**
+ * Дописывает @a len байт тела письма. Если они не помещаются, накопленное
+ * и новые байты записываются в @a fd одним writev, без копирования.
+ *
+ * @return false, если запись в файл не удалась
+ */
+bool spool_buffer_append(spool_buffer_t *spool, int fd, const char *data, int len, spool_stats_t *stats);
+
+/**
+ * Копирует @a len байт в буфер, если они помещаются, ничего не записывая
+ *
+ * @return false, если места не хватает
+ */
+bool spool_buffer_store(spool_buffer_t *spool, const char *data, int len);
+
+/**
+ * Отдаёт накопленные байты вместе с памятью (её нужно освободить free).
+ * Следующая запись выделит буфер заново
+ *
+ * @return NULL, если буфер пуст
+ */
+char *spool_buffer_take(spool_buffer_t *spool, int *len);
+
+/**
+ * Записывает накопленное в @a fd
+ *
+ * @return false, если запись этого письма не удалась, сейчас или раньше
+ */
+bool spool_buffer_flush(spool_buffer_t *spool, int fd, spool_stats_t *stats);
+
+/**
+ * Освобождает память буфера
+ */
+void spool_buffer_close(spool_buffer_t *spool);
@@ -0,0 +1,938 @@
+#include "spool_io.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "logger.h"
+
+// Размер кольца отправки io_uring
+#define SPOOL_URING_ENTRIES 256
+// Потоков в пуле, если io_uring недоступен
+#define SPOOL_POOL_THREADS 4
+
+/**
+ * Системный вызов, выполняемый асинхронно
+ */
+enum spool_op_type
+{
+    SPOOL_OP_OPEN,
+    SPOOL_OP_WRITE,
+    SPOOL_OP_FSYNC,
+    SPOOL_OP_DATASYNC,
+    SPOOL_OP_RENAME,
+    SPOOL_OP_LINK,
+    SPOOL_OP_CLOSE,
+    SPOOL_OP_FALLOCATE,
+    SPOOL_OP_TRUNCATE,
+};
+
+typedef struct spool_op_t
+{
+    spool_job_t *job;
+    enum spool_op_type type;
+    int fd;
+    const char *path;
+    int fd2;
+    const char *path2;
+    int flags;
+    /**
+     * Память записи; @a data и @a len - ещё не записанная её часть
+     */
+    char *buffer;
+    char *data;
+    int len;
+    long long offset;
+    /**
+     * Длина диапазона fallocate
+     */
+    long long length;
+    /**
+     * Результат вызова или -errno
+     */
+    int result;
+} spool_op_t;
+
+
+static spool_op_t *create_op(spool_job_t *job, enum spool_op_type type, int fd)
+{
+    spool_op_t *op = calloc(1, sizeof(spool_op_t));
+    op->job = job;
+    op->type = type;
+    op->fd = fd;
+    return op;
+}
+
+static int perform_op(spool_op_t *op)
+{
+    int result;
+    switch (op->type)
+    {
+    case SPOOL_OP_OPEN:
+        result = openat(op->fd, op->path, op->flags, 0644);
+        break;
+    case SPOOL_OP_WRITE:
+        result = pwrite(op->fd, op->data, op->len, op->offset);
+        break;
+    case SPOOL_OP_FSYNC:
+        result = fsync(op->fd);
+        break;
+    case SPOOL_OP_DATASYNC:
+        result = fdatasync(op->fd);
+        break;
+    case SPOOL_OP_RENAME:
+        result = renameat(op->fd, op->path, op->fd2, op->path2);
+        break;
+    case SPOOL_OP_LINK:
+        result = linkat(op->fd, op->path, op->fd2, op->path2, op->flags);
+        break;
+    case SPOOL_OP_CLOSE:
+        result = close(op->fd);
+        break;
+    case SPOOL_OP_FALLOCATE:
+        result = fallocate(op->fd, op->flags, op->offset, op->length);
+        break;
+    case SPOOL_OP_TRUNCATE:
+        result = ftruncate(op->fd, op->offset);
+        break;
+    default:
+        result = -1;
+        errno = EINVAL;
+        break;
+    }
+    return result < 0 ? -errno : result;
+}
+
+
+// ---------------------------------------------------------------------------
+// io_uring через системные вызовы, без liburing
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_close(spool_uring_t *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    dynamic_vector_close(&ring->overflow);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Ядро должно уметь все операции письма: RENAMEAT и LINKAT появились
+// только в 5.11 и 5.15
+static bool uring_supports_ops(int fd)
+{
+    static const int required[] =
+    {
+        IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC,
+        IORING_OP_RENAMEAT, IORING_OP_LINKAT, IORING_OP_CLOSE, IORING_OP_FALLOCATE
+    };
+
+    int ops_count = IORING_OP_LAST;
+    size_t size = sizeof(struct io_uring_probe) + ops_count * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported = uring_register(fd, IORING_REGISTER_PROBE, probe, ops_count) == 0;
+    for (size_t i = 0; supported && i < sizeof(required) / sizeof(required[0]); i++)
+    {
+        supported = required[i] <= probe->last_op
+            && (probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+static bool uring_init(spool_uring_t *ring, int event_fd)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->overflow = dynamic_vector_create(sizeof(spool_op_t*), 64);
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = uring_setup(SPOOL_URING_ENTRIES, &params);
+    if (ring->fd < 0)
+    {
+        ring->fd = -1;
+        return false;
+    }
+
+    if (!uring_supports_ops(ring->fd))
+    {
+        uring_close(ring);
+        return false;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        uring_close(ring);
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            uring_close(ring);
+            return false;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_close(ring);
+        return false;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->entries = params.sq_entries;
+    ring->cq_entries = params.cq_entries;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    if (uring_register(ring->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) != 0)
+    {
+        uring_close(ring);
+        return false;
+    }
+    return true;
+}
+
+static void uring_submit(spool_uring_t *ring)
+{
+    unsigned to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (to_submit > 0)
+    {
+        int submitted = uring_enter(ring->fd, to_submit, 0, 0);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // Операции остаются в кольце и уйдут со следующей отправкой
+            LOG_ERROR("io_uring_enter failed: %d", errno);
+            return;
+        }
+        to_submit -= submitted;
+    }
+}
+
+static unsigned uring_sq_used(spool_uring_t *ring)
+{
+    return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// Можно ли добавить операцию: в кольце отправки есть свободное место,
+// а завершения всех незабранных поместятся в кольцо завершений
+static bool uring_has_room(spool_uring_t *ring)
+{
+    if (ring->inflight >= ring->cq_entries)
+        return false;
+    if (uring_sq_used(ring) < ring->entries)
+        return true;
+    uring_submit(ring);
+    return uring_sq_used(ring) < ring->entries;
+}
+
+static void uring_write_sqe(spool_uring_t *ring, spool_op_t *op)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = ring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->user_data = (unsigned long long)(uintptr_t)op;
+    switch (op->type)
+    {
+    case SPOOL_OP_OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->len = 0644;
+        sqe->open_flags = op->flags;
+        break;
+    case SPOOL_OP_WRITE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uintptr_t)op->data;
+        sqe->len = op->len;
+        sqe->off = op->offset;
+        break;
+    case SPOOL_OP_FSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        break;
+    case SPOOL_OP_DATASYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    case SPOOL_OP_RENAME:
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->len = op->fd2;
+        sqe->addr2 = (uintptr_t)op->path2;
+        break;
+    case SPOOL_OP_LINK:
+        sqe->opcode = IORING_OP_LINKAT;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->len = op->fd2;
+        sqe->addr2 = (uintptr_t)op->path2;
+        sqe->hardlink_flags = op->flags;
+        break;
+    case SPOOL_OP_CLOSE:
+        sqe->opcode = IORING_OP_CLOSE;
+        break;
+    case SPOOL_OP_FALLOCATE:
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->off = op->offset;
+        sqe->addr = op->length;
+        sqe->len = op->flags;
+        break;
+    case SPOOL_OP_TRUNCATE:
+        // Выполняется в push_op
+        break;
+    }
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->inflight++;
+}
+
+static void uring_push(spool_uring_t *ring, spool_op_t *op)
+{
+    // Пока есть отложенные операции, новые встают за ними
+    if (ring->overflow_head < ring->overflow.size || !uring_has_room(ring))
+    {
+        dynamic_vector_copy_elem_back(&ring->overflow, &op);
+        return;
+    }
+    uring_write_sqe(ring, op);
+}
+
+// Переносит в кольцо отложенные операции, сколько поместится
+static void uring_push_overflow(spool_uring_t *ring)
+{
+    spool_op_t **ops = ring->overflow.data;
+    while (ring->overflow_head < ring->overflow.size && uring_has_room(ring))
+    {
+        uring_write_sqe(ring, ops[ring->overflow_head++]);
+    }
+    if (ring->overflow_head == ring->overflow.size)
+    {
+        dynamic_vector_clear(&ring->overflow);
+        ring->overflow_head = 0;
+    }
+}
+
+static void complete_op(spool_io_t *io, spool_op_t *op);
+
+static void uring_reap(spool_io_t *io)
+{
+    spool_uring_t *ring = &io->uring;
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = ring->cqes + (head & *ring->cq_mask);
+        spool_op_t *op = (spool_op_t*)(uintptr_t)cqe->user_data;
+        op->result = cqe->res;
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        ring->inflight--;
+
+        complete_op(io, op);
+    }
+    uring_push_overflow(ring);
+}
+
+
+// ---------------------------------------------------------------------------
+// Пул потоков
+
+static void notify(int event_fd)
+{
+    unsigned long long one = 1;
+    ssize_t written = write(event_fd, &one, sizeof(one));
+    (void)written;
+}
+
+static void *pool_thread_fn(void *arg)
+{
+    spool_threads_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        while (pool->queue.size == 0 && !pool->stopping)
+        {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->queue.size == 0)
+        {
+            break;
+        }
+
+        // Очередь не сдвигается: голова просто переходит дальше
+        spool_op_t *op = ((spool_op_t**)pool->queue.data)[pool->queue_head++];
+        if (pool->queue_head == pool->queue.size)
+        {
+            dynamic_vector_clear(&pool->queue);
+            pool->queue_head = 0;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        op->result = perform_op(op);
+
+        pthread_mutex_lock(&pool->lock);
+        dynamic_vector_copy_elem_back(&pool->done, &op);
+        notify(pool->event_fd);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static bool pool_init(spool_threads_t *pool, int event_fd)
+{
+    pool->queue = dynamic_vector_create(sizeof(spool_op_t*), 64);
+    pool->done = dynamic_vector_create(sizeof(spool_op_t*), 64);
+    pool->queue_head = 0;
+    pool->event_fd = event_fd;
+    pool->stopping = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->threads = malloc(sizeof(pthread_t) * SPOOL_POOL_THREADS);
+    pool->count = 0;
+    for (int i = 0; i < SPOOL_POOL_THREADS; i++)
+    {
+        if (pthread_create(pool->threads + i, NULL, pool_thread_fn, pool) != 0)
+        {
+            break;
+        }
+        pool->count++;
+    }
+    return pool->count > 0;
+}
+
+static void pool_close(spool_threads_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    dynamic_vector_close(&pool->queue);
+    dynamic_vector_close(&pool->done);
+}
+
+static void pool_submit(spool_threads_t *pool, dynamic_vector_t *queued)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queue_head > 0)
+    {
+        // Взятые операции в начале очереди больше не нужны
+        spool_op_t **ops = pool->queue.data;
+        memmove(ops, ops + pool->queue_head, (pool->queue.size - pool->queue_head) * sizeof(spool_op_t*));
+        pool->queue.size -= pool->queue_head;
+        pool->queue_head = 0;
+    }
+    dynamic_vector_copy_back(&pool->queue, queued->data, queued->size);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    dynamic_vector_clear(queued);
+}
+
+static void pool_reap(spool_io_t *io, dynamic_vector_t *done)
+{
+    spool_threads_t *pool = &io->pool;
+    pthread_mutex_lock(&pool->lock);
+    dynamic_vector_copy_back(done, pool->done.data, pool->done.size);
+    dynamic_vector_clear(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < done->size; i++)
+    {
+        complete_op(io, ((spool_op_t**)done->data)[i]);
+    }
+    dynamic_vector_clear(done);
+}
+
+
+// ---------------------------------------------------------------------------
+// Шаги письма
+
+static void push_op(spool_io_t *io, spool_op_t *op)
+{
+    if (io->backend == SPOOL_IO_URING && op->type == SPOOL_OP_TRUNCATE)
+    {
+        // ftruncate в io_uring появился только в 6.9. Обрезка незаписанного
+        // хвоста меняет лишь метаданные, её можно выполнить сразу
+        op->result = perform_op(op);
+        complete_op(io, op);
+    }
+    else if (io->backend == SPOOL_IO_URING)
+    {
+        uring_push(&io->uring, op);
+    }
+    else
+    {
+        dynamic_vector_copy_elem_back(&io->queued, &op);
+    }
+}
+
+// Запись закончилась или отброшена. Если соединение не читалось из-за
+// незаписанного, а его стало вдвое меньше предела, соединение снова читается
+static void release_write(spool_io_t *io, spool_job_t *job, long long len)
+{
+    job->unwritten -= len;
+    if (job->throttled && job->unwritten <= SPOOL_JOB_MAX_UNWRITTEN / 2)
+    {
+        job->throttled = false;
+        if (job->owner >= 0)
+        {
+            dynamic_vector_copy_elem_back(&io->drained, &job->owner);
+        }
+    }
+}
+
+static void submit_write(spool_io_t *io, spool_op_t *op)
+{
+    op->fd = op->job->fd;
+    op->job->inflight++;
+    push_op(io, op);
+}
+
+static void finish_job(spool_io_t *io, spool_job_t *job)
+{
+    if (job->owner >= 0)
+    {
+        spool_result_t result = { .owner = job->owner, .ok = !job->failed };
+        dynamic_vector_copy_elem_back(&io->results, &result);
+    }
+    if (job->own_dst_dirfd)
+    {
+        close(job->dst_dirfd);
+    }
+    dynamic_vector_close(&job->waiting);
+    free(job);
+    io->jobs--;
+}
+
+static void start_close(spool_io_t *io, spool_job_t *job)
+{
+    if (job->fd < 0)
+    {
+        finish_job(io, job);
+        return;
+    }
+    job->stage = SPOOL_JOB_CLOSING;
+    push_op(io, create_op(job, SPOOL_OP_CLOSE, job->fd));
+}
+
+static void start_move(spool_io_t *io, spool_job_t *job)
+{
+    // Именованный файл, оставляемый в tmp, переносить некуда
+    if (job->dst_dirfd < 0 || (!job->tmpfile && job->dst_dirfd == job->tmp_dirfd))
+    {
+        start_close(io, job);
+        return;
+    }
+
+    job->stage = SPOOL_JOB_MOVING;
+    spool_op_t *op;
+    if (job->tmpfile)
+    {
+        // Имя безымянному файлу даём через /proc: для AT_EMPTY_PATH
+        // нужна CAP_DAC_READ_SEARCH
+        snprintf(job->proc_path, sizeof(job->proc_path), "/proc/self/fd/%d", job->fd);
+        op = create_op(job, SPOOL_OP_LINK, AT_FDCWD);
+        op->path = job->proc_path;
+        op->flags = AT_SYMLINK_FOLLOW;
+    }
+    else
+    {
+        op = create_op(job, SPOOL_OP_RENAME, job->tmp_dirfd);
+        op->path = job->name;
+    }
+    op->fd2 = job->dst_dirfd;
+    op->path2 = job->name;
+    push_op(io, op);
+}
+
+
+static void advance_job(spool_io_t *io, spool_job_t *job);
+
+// Файл готов: уходят записи, ждавшие открытия
+static void start_writing(spool_io_t *io, spool_job_t *job)
+{
+    job->stage = SPOOL_JOB_WRITING;
+    for (int i = 0; i < job->waiting.size; i++)
+    {
+        spool_op_t *write_op = ((spool_op_t**)job->waiting.data)[i];
+        if (job->fd >= 0)
+        {
+            submit_write(io, write_op);
+        }
+        else
+        {
+            release_write(io, job, write_op->len);
+            free(write_op->buffer);
+            free(write_op);
+        }
+    }
+    dynamic_vector_clear(&job->waiting);
+    advance_job(io, job);
+}
+
+static void finish_writing(spool_io_t *io, spool_job_t *job)
+{
+    if (job->failed)
+    {
+        start_close(io, job);
+    }
+    else if (job->sync)
+    {
+        job->stage = SPOOL_JOB_SYNCING;
+        push_op(io, create_op(job, SPOOL_OP_DATASYNC, job->fd));
+    }
+    else
+    {
+        start_move(io, job);
+    }
+}
+
+// Все записи закончились: дальше шаги идут по одному
+static void advance_job(spool_io_t *io, spool_job_t *job)
+{
+    if (job->stage != SPOOL_JOB_WRITING || !job->finishing || job->inflight > 0)
+    {
+        return;
+    }
+
+    // Тело оказалось меньше заявленного: место за концом файла иначе
+    // осталось бы занятым, пока файл существует. Его освобождает обрезка
+    // файла по его же размеру
+    if (job->fd >= 0 && job->reserved > job->offset)
+    {
+        job->stage = SPOOL_JOB_RELEASING;
+        spool_op_t *op = create_op(job, SPOOL_OP_TRUNCATE, job->fd);
+        op->offset = job->offset;
+        push_op(io, op);
+        return;
+    }
+    finish_writing(io, job);
+}
+
+static void fail_job(spool_job_t *job, spool_op_t *op)
+{
+    LOG_ERROR("Spool operation %d on %s failed: %d", (int)op->type, job->name, -op->result);
+    job->failed = true;
+}
+
+static void complete_op(spool_io_t *io, spool_op_t *op)
+{
+    spool_job_t *job = op->job;
+    // Место выделяется только ради порядка блоков на диске,
+    // письмо пишется и без него
+    if (op->result < 0 && op->type != SPOOL_OP_FALLOCATE && op->type != SPOOL_OP_TRUNCATE)
+    {
+        fail_job(job, op);
+    }
+
+    switch (op->type)
+    {
+    case SPOOL_OP_OPEN:
+        job->fd = op->result >= 0 ? op->result : -1;
+        if (job->fd >= 0 && job->reserved > 0)
+        {
+            job->stage = SPOOL_JOB_RESERVING;
+            spool_op_t *reserve = create_op(job, SPOOL_OP_FALLOCATE, job->fd);
+            reserve->flags = FALLOC_FL_KEEP_SIZE;
+            reserve->length = job->reserved;
+            push_op(io, reserve);
+            break;
+        }
+        start_writing(io, job);
+        break;
+
+    case SPOOL_OP_FALLOCATE:
+        start_writing(io, job);
+        break;
+
+    case SPOOL_OP_TRUNCATE:
+        finish_writing(io, job);
+        break;
+
+    case SPOOL_OP_WRITE:
+        if (op->result >= 0 && op->result < op->len)
+        {
+            // Частичная запись: дописываем остаток той же операцией
+            op->data += op->result;
+            op->len -= op->result;
+            op->offset += op->result;
+            push_op(io, op);
+            return;
+        }
+        free(op->buffer);
+        release_write(io, job, op->data - op->buffer + op->len);
+        job->inflight--;
+        advance_job(io, job);
+        break;
+
+    case SPOOL_OP_DATASYNC:
+        if (job->failed)
+            start_close(io, job);
+        else
+            start_move(io, job);
+        break;
+
+    case SPOOL_OP_RENAME:
+    case SPOOL_OP_LINK:
+        if (!job->failed && job->sync)
+        {
+            job->stage = SPOOL_JOB_SYNCING_DIR;
+            push_op(io, create_op(job, SPOOL_OP_FSYNC, job->dst_dirfd));
+        }
+        else
+        {
+            start_close(io, job);
+        }
+        break;
+
+    case SPOOL_OP_FSYNC:
+        start_close(io, job);
+        break;
+
+    case SPOOL_OP_CLOSE:
+        finish_job(io, job);
+        break;
+    }
+    free(op);
+}
+
+
+// ---------------------------------------------------------------------------
+
+bool spool_io_init(spool_io_t *io, enum spool_io_backend backend)
+{
+    memset(io, 0, sizeof(*io));
+    io->uring.fd = -1;
+    io->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->event_fd < 0)
+    {
+        LOG_ERROR("Could not create spool eventfd: %d", errno);
+        return false;
+    }
+    io->queued = dynamic_vector_create(sizeof(spool_op_t*), 64);
+    io->results = dynamic_vector_create(sizeof(spool_result_t), 16);
+    io->drained = dynamic_vector_create(sizeof(int), 16);
+
+    if (backend == SPOOL_IO_URING && !uring_init(&io->uring, io->event_fd))
+    {
+        LOG_WARN("io_uring is not available, using spool thread pool");
+        backend = SPOOL_IO_THREADS;
+    }
+    if (backend == SPOOL_IO_THREADS && !pool_init(&io->pool, io->event_fd))
+    {
+        LOG_ERROR("Could not start spool thread pool");
+        close(io->event_fd);
+        return false;
+    }
+
+    io->backend = backend;
+    return true;
+}
+
+void spool_io_close(spool_io_t *io)
+{
+    spool_io_submit(io);
+    while (io->jobs > 0)
+    {
+        struct pollfd pfd = { .fd = io->event_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        {
+            LOG_ERROR("Waiting for spool jobs failed: %d", errno);
+            break;
+        }
+        spool_io_process(io);
+        dynamic_vector_clear(&io->results);
+        dynamic_vector_clear(&io->drained);
+    }
+
+    if (io->backend == SPOOL_IO_URING)
+    {
+        uring_close(&io->uring);
+    }
+    else
+    {
+        pool_close(&io->pool);
+    }
+    close(io->event_fd);
+    dynamic_vector_close(&io->queued);
+    dynamic_vector_close(&io->results);
+    dynamic_vector_close(&io->drained);
+}
+
+spool_job_t *spool_io_open(spool_io_t *io, int tmp_dirfd, const char *name, bool tmpfile,
+        long long reserve, int owner)
+{
+    spool_job_t *job = calloc(1, sizeof(spool_job_t));
+    job->owner = owner;
+    job->stage = SPOOL_JOB_OPENING;
+    job->fd = -1;
+    job->waiting = dynamic_vector_create(sizeof(spool_op_t*), 4);
+    job->tmp_dirfd = tmp_dirfd;
+    job->dst_dirfd = -1;
+    job->tmpfile = tmpfile;
+    job->reserved = reserve;
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    io->jobs++;
+
+    spool_op_t *op = create_op(job, SPOOL_OP_OPEN, tmp_dirfd);
+    op->path = tmpfile ? "." : job->name;
+    op->flags = tmpfile ? (O_TMPFILE | O_WRONLY | O_CLOEXEC) : (O_CREAT | O_WRONLY | O_CLOEXEC);
+    push_op(io, op);
+    return job;
+}
+
+void spool_io_write(spool_io_t *io, spool_job_t *job, char *data, int len)
+{
+    if (job->failed || len == 0)
+    {
+        free(data);
+        return;
+    }
+
+    spool_op_t *op = create_op(job, SPOOL_OP_WRITE, -1);
+    op->buffer = data;
+    op->data = data;
+    op->len = len;
+    op->offset = job->offset;
+    job->offset += len;
+    job->unwritten += len;
+
+    if (job->stage == SPOOL_JOB_OPENING || job->stage == SPOOL_JOB_RESERVING)
+    {
+        dynamic_vector_copy_elem_back(&job->waiting, &op);
+    }
+    else
+    {
+        submit_write(io, op);
+    }
+}
+
+bool spool_io_throttle(spool_job_t *job)
+{
+    if (job->unwritten > SPOOL_JOB_MAX_UNWRITTEN)
+    {
+        job->throttled = true;
+    }
+    return job->throttled;
+}
+
+void spool_io_finish(spool_io_t *io, spool_job_t *job, int dst_dirfd, bool own_dst_dirfd, bool sync)
+{
+    job->finishing = true;
+    job->dst_dirfd = dst_dirfd;
+    job->own_dst_dirfd = own_dst_dirfd;
+    job->sync = sync;
+    advance_job(io, job);
+}
+
+void spool_io_abandon(spool_io_t *io, spool_job_t *job)
+{
+    job->owner = -1;
+    if (!job->finishing)
+    {
+        spool_io_finish(io, job, -1, false, false);
+    }
+}
+
+void spool_io_submit(spool_io_t *io)
+{
+    if (io->backend == SPOOL_IO_URING)
+    {
+        uring_push_overflow(&io->uring);
+        uring_submit(&io->uring);
+    }
+    else if (io->queued.size > 0)
+    {
+        pool_submit(&io->pool, &io->queued);
+    }
+}
+
+int spool_io_process(spool_io_t *io)
+{
+    unsigned long long count;
+    ssize_t got = read(io->event_fd, &count, sizeof(count));
+    (void)got;
+
+    if (io->backend == SPOOL_IO_URING)
+    {
+        uring_reap(io);
+    }
+    else
+    {
+        dynamic_vector_t done = dynamic_vector_create(sizeof(spool_op_t*), 16);
+        pool_reap(io, &done);
+        dynamic_vector_close(&done);
+    }
+
+    // Следующие шаги писем уходят сразу, не дожидаясь конца итерации
+    spool_io_submit(io);
+    return io->results.size;
+}
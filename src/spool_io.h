@@ -0,0 +1,296 @@
+#pragma once
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * @file
+ * @brief Асинхронная запись писем на диск
+ *
+ * Открытие файла письма, запись тела, fdatasync, перенос из tmp и fsync
+ * папки выполняются без блокировки рабочего цикла: через io_uring, а если
+ * ядро его не поддерживает - пулом потоков. О завершённых операциях
+ * сообщает @a event_fd, который рабочий цикл наблюдает вместе с сокетами.
+ *
+ * Каждое письмо - это #spool_job_t. Записи одного письма идут параллельно
+ * по своим смещениям, остальные шаги выполняются по очереди после них.
+ */
+
+#include "dynamic_vector.h"
+
+/**
+ * Сколько байт тела одного письма может ждать записи. Если больше,
+ * соединение перестаёт читаться, пока записи не догонят приём
+ */
+#define SPOOL_JOB_MAX_UNWRITTEN (1024 * 1024)
+
+/**
+ * Способ выполнения операций
+ */
+enum spool_io_backend
+{
+    /**
+     * Асинхронный ввод-вывод выключен, файлы пишутся прямо из рабочего цикла
+     */
+    SPOOL_IO_NONE,
+    SPOOL_IO_URING,
+    SPOOL_IO_THREADS,
+};
+
+/**
+ * Шаг, который выполняет письмо
+ */
+enum spool_job_stage
+{
+    SPOOL_JOB_OPENING,
+    /**
+     * Место под письмо выделяется заранее, записи ждут
+     */
+    SPOOL_JOB_RESERVING,
+    SPOOL_JOB_WRITING,
+    /**
+     * Освобождается выделенное заранее, но не занятое телом место
+     */
+    SPOOL_JOB_RELEASING,
+    SPOOL_JOB_SYNCING,
+    SPOOL_JOB_MOVING,
+    SPOOL_JOB_SYNCING_DIR,
+    SPOOL_JOB_CLOSING,
+};
+
+/**
+ * Запись одного письма
+ */
+typedef struct spool_job_t
+{
+    /**
+     * Индекс соединения, которому сообщить о завершении;
+     * -1, если соединение уже закрыто
+     */
+    int owner;
+    enum spool_job_stage stage;
+    /**
+     * Дескриптор файла, -1 пока он не открыт
+     */
+    int fd;
+    /**
+     * Смещение следующей записи
+     */
+    long long offset;
+    /**
+     * Выделено заранее под тело, см. #spool_io_open
+     */
+    long long reserved;
+    /**
+     * Незавершённые записи тела
+     */
+    int inflight;
+    /**
+     * Байт тела, переданных #spool_io_write и ещё не записанных
+     */
+    long long unwritten;
+    /**
+     * Соединение не читается из-за @a unwritten, см. #spool_io_throttle
+     */
+    bool throttled;
+    /**
+     * Записи, ждущие открытия файла
+     */
+    dynamic_vector_t waiting;
+    /**
+     * Вызвана #spool_io_finish
+     */
+    bool finishing;
+    /**
+     * Один из шагов не удался
+     */
+    bool failed;
+
+    int tmp_dirfd;
+    /**
+     * Папка назначения, -1 - оставить файл как есть
+     */
+    int dst_dirfd;
+    /**
+     * @a dst_dirfd закрывается вместе с письмом
+     */
+    bool own_dst_dirfd;
+    bool tmpfile;
+    bool sync;
+    char name[128];
+    char proc_path[32];
+} spool_job_t;
+
+/**
+ * Завершённое письмо
+ */
+typedef struct spool_result_t
+{
+    /**
+     * Индекс соединения
+     */
+    int owner;
+    /**
+     * Письмо записано и перенесено
+     */
+    bool ok;
+} spool_result_t;
+
+/**
+ * Кольцо io_uring, отображённое в память процесса
+ */
+typedef struct spool_uring_t
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    unsigned cq_entries;
+    /**
+     * Операции в кольце и в ядре, завершения которых ещё не забраны.
+     * Их не больше @a cq_entries, иначе завершения не поместятся
+     */
+    unsigned inflight;
+    /**
+     * Операции, которым не хватило места в кольце, и первая из них.
+     * Уходят в кольцо по мере завершения предыдущих
+     */
+    dynamic_vector_t overflow;
+    int overflow_head;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} spool_uring_t;
+
+/**
+ * Пул потоков, выполняющих операции блокирующими вызовами
+ */
+typedef struct spool_threads_t
+{
+    pthread_t *threads;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /**
+     * Операции к выполнению и выполненные, под @a lock
+     */
+    dynamic_vector_t queue;
+    dynamic_vector_t done;
+    /**
+     * Первая ещё не взятая операция в @a queue
+     */
+    int queue_head;
+    bool stopping;
+    /**
+     * Куда сообщать о выполненных операциях
+     */
+    int event_fd;
+} spool_threads_t;
+
+/**
+ * Асинхронный ввод-вывод рабочего потока
+ */
+typedef struct spool_io_t
+{
+    enum spool_io_backend backend;
+    /**
+     * Становится читаемым, когда есть завершённые операции
+     */
+    int event_fd;
+    spool_uring_t uring;
+    spool_threads_t pool;
+    /**
+     * Операции, подготовленные до #spool_io_submit (только пул потоков)
+     */
+    dynamic_vector_t queued;
+    /**
+     * Незавершённые письма
+     */
+    int jobs;
+    /**
+     * #spool_result_t завершённых писем
+     */
+    dynamic_vector_t results;
+    /**
+     * Индексы соединений, записи писем которых догнали приём
+     */
+    dynamic_vector_t drained;
+} spool_io_t;
+
+/**
+ * Запускает ввод-вывод. Если io_uring недоступен или не умеет нужных
+ * операций, используется пул потоков; выбранный способ - в @a io->backend
+ *
+ * @return false при ошибке
+ */
+bool spool_io_init(spool_io_t *io, enum spool_io_backend backend);
+
+/**
+ * Дожидается всех писем и освобождает ресурсы
+ */
+void spool_io_close(spool_io_t *io);
+
+/**
+ * Начинает письмо: создаёт в @a tmp_dirfd файл @a name, или безымянный
+ * файл при @a tmpfile
+ *
+ * @param reserve - ожидаемый размер тела: столько места выделяется
+ * fallocate до первой записи, чтобы файл лёг на диск одним куском.
+ * Не занятое телом место освобождается при завершении. 0 - не выделять
+ */
+spool_job_t *spool_io_open(spool_io_t *io, int tmp_dirfd, const char *name, bool tmpfile,
+        long long reserve, int owner);
+
+/**
+ * Дописывает в файл письма @a len байт. Память @a data должна быть
+ * выделена malloc, она освобождается после записи
+ */
+void spool_io_write(spool_io_t *io, spool_job_t *job, char *data, int len);
+
+/**
+ * Проверяет, не скопилось ли у письма больше #SPOOL_JOB_MAX_UNWRITTEN
+ * незаписанных байт. Если скопилось, соединение нужно перестать читать:
+ * когда незаписанного станет вдвое меньше, его индекс появится в
+ * @a io->drained после #spool_io_process
+ */
+bool spool_io_throttle(spool_job_t *job);
+
+/**
+ * Завершает письмо после всех записей: при @a sync - fdatasync, затем
+ * перенос в @a dst_dirfd (при @a sync - и fsync папки) и закрытие файла.
+ * При @a own_dst_dirfd письмо закроет и @a dst_dirfd. Результат появится
+ * в #spool_io_process
+ */
+void spool_io_finish(spool_io_t *io, spool_job_t *job, int dst_dirfd, bool own_dst_dirfd, bool sync);
+
+/**
+ * Соединение закрыто: письмо дописывается и закрывается без уведомления
+ * и, если не было завершено, никуда не переносится
+ */
+void spool_io_abandon(spool_io_t *io, spool_job_t *job);
+
+/**
+ * Отдаёт на выполнение все подготовленные операции
+ */
+void spool_io_submit(spool_io_t *io);
+
+/**
+ * Обрабатывает завершённые операции и запускает следующие шаги писем
+ *
+ * Завершённые письма дописываются в @a io->results, соединения, которые
+ * снова можно читать, - в @a io->drained; их нужно забрать и очистить
+ * векторы. Письмо, файл которого не открылся, может попасть туда
+ * и сразу из #spool_io_finish.
+ *
+ * @return количество писем в @a io->results
+ */
+int spool_io_process(spool_io_t *io);
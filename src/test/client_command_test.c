@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "../commands.h"
+#include "../util.h"
 
 
 char buf[512];
@@ -17,35 +18,70 @@ message_t create_message(const char *text)
 }
 
 
-void assert_message(const char *messageText, enum smtp_client_command expected_command,
-                    const char *capture_name, const char *expected_str)
+static void assert_match(command_match_t *match, enum smtp_client_command expected_command,
+                         const char *capture_name, const char *expected_str)
 {
-    bool init = client_command_parser_init();
-    ck_assert(init);
-    message_t msg = create_message(messageText);
-    
-    command_match_t match = client_command_parse_message(&msg);
-    
-    ck_assert_int_eq(expected_command, match.command);
+    ck_assert_int_eq(expected_command, match->command);
     
     if (expected_command == CLIENT_UNKNOWN_COMMAND) return;
     if (!capture_name || ! expected_str) return;
-    ck_assert(match.match_data != NULL);
+    ck_assert(command_has_substring(match, capture_name));
     
     char *str;
     int len;
     
-    bool result = command_get_substring(&match, capture_name, &str, &len);
+    bool result = command_get_substring(match, capture_name, &str, &len);
     
     ck_assert(result);
     ck_assert(strlen(expected_str) == (unsigned long)len);
     ck_assert(memcmp(str, expected_str, len) == 0);
     
     command_free_substring(str);
+}
+
+void assert_message(const char *messageText, enum smtp_client_command expected_command,
+                    const char *capture_name, const char *expected_str)
+{
+    bool init = client_command_parser_init();
+    ck_assert(init);
+    message_t msg = create_message(messageText);
+    
+    // Оба разборщика должны давать одинаковый результат
+    command_match_t match = client_command_parse_message_regex(&msg, NULL);
+    assert_match(&match, expected_command, capture_name, expected_str);
+
+    command_regex_context_t context;
+    ck_assert(command_regex_context_init(&context));
+    match = client_command_parse_message_regex(&msg, &context);
+    assert_match(&match, expected_command, capture_name, expected_str);
+    command_regex_context_free(&context);
+
+    command_parse_line(msg.text, msg.len, &match);
+    assert_match(&match, expected_command, capture_name, expected_str);
     
     free(msg.text);
 }
 
+static command_regex_context_t fuzz_context;
+
+static void assert_same_parse(const char *text, int len)
+{
+    message_t msg = { .text = (char*)text, .len = len };
+    command_match_t expected = client_command_parse_message_regex(&msg, &fuzz_context);
+    command_match_t got;
+    command_parse_line(text, len, &got);
+
+    ck_assert_msg(expected.command == got.command, "Command mismatch for '%.*s': %d != %d",
+                  len, text, expected.command, got.command);
+    if (expected.command == CLIENT_UNKNOWN_COMMAND) return;
+    for (int field = 0; field < COMMAND_FIELD_COUNT; field++)
+    {
+        ck_assert_msg(expected.fields[field].offset == got.fields[field].offset
+                      && expected.fields[field].len == got.fields[field].len,
+                      "Field %d mismatch for '%.*s'", field, len, text);
+    }
+}
+
 
 
 START_TEST(helo)
@@ -129,6 +165,17 @@ START_TEST(mailfrom_ip)
 }
 END_TEST
 
+START_TEST(mailfrom_size)
+{
+    assert_message("MAIL FROM:<Smith@bar.com> SIZE=1024", CLIENT_MAILFROM, "size", "1024");
+    assert_message("MAIL FROM:<Smith@bar.com> size=0", CLIENT_MAILFROM, "sender", "<Smith@bar.com>");
+    assert_message("MAIL FROM:<> SIZE=12", CLIENT_MAILFROM, "emptyrpath", "<>");
+    assert_message("MAIL FROM:<Smith@bar.com> SIZE=", CLIENT_UNKNOWN_COMMAND, NULL, NULL);
+    assert_message("MAIL FROM:<Smith@bar.com> SIZE=123456789012345678901", CLIENT_UNKNOWN_COMMAND, NULL, NULL);
+    assert_message("MAIL FROM:<Smith@bar.com> BODY=8BITMIME", CLIENT_UNKNOWN_COMMAND, NULL, NULL);
+}
+END_TEST
+
 START_TEST(rcptto)
 {
     assert_message("RCPT TO:<Fgsfds@gmail.com>", CLIENT_RCPTTO, "recepient", "<Fgsfds@gmail.com>");
@@ -139,6 +186,61 @@ START_TEST(rcptto)
 }
 END_TEST
 
+START_TEST(parsers_agree)
+{
+    ck_assert(client_command_parser_init());
+    ck_assert(command_regex_context_init(&fuzz_context));
+    const char *seeds[] = {
+        "HELO foo.com", "helo a-b.c_d", "EHLO [127.0.0.1]", "EHLO [IPv6:1:2:3:4:5:6:7:8]",
+        "VRFY foo", "RSET", "QUIT", "DATA", ".", "MAIL FROM:<>", "mail from:<a.b@cc.dd>",
+        "MAIL FROM:<Bob@[10.0.0.1]>", "MAIL FROM:<a@bb.cc> SIZE=1024", "RCPT TO:<Postmaster>", "rcpt to:<postMaster@aa.bb>",
+        "RCPT TO:<postmaster@[1.2.3.4]>", "RCPT TO:<x!y@aa-bb.cc>", "Helo aa.bb", "QUIT\n",
+    };
+    const char alphabet[] = "aZ09_-.@<>[]: \t\n:IPv6Postmaster!=";
+
+    srand(7);
+    char buf[64];
+    for (size_t i = 0; i < ARRAYNUM(seeds); i++)
+    {
+        assert_same_parse(seeds[i], strlen(seeds[i]));
+        // Случайные правки исходной строки: замена, удаление и вставка символа
+        for (int round = 0; round < 2000; round++)
+        {
+            int len = strlen(seeds[i]);
+            memcpy(buf, seeds[i], len);
+            int edits = 1 + rand() % 3;
+            for (int e = 0; e < edits; e++)
+            {
+                int pos = rand() % (len + 1);
+                char c = alphabet[rand() % (sizeof(alphabet) - 1)];
+                switch (rand() % 3)
+                {
+                case 0:
+                    if (pos < len) buf[pos] = c;
+                    break;
+                case 1:
+                    if (pos < len)
+                    {
+                        memmove(buf + pos, buf + pos + 1, len - pos - 1);
+                        len--;
+                    }
+                    break;
+                default:
+                    if (len + 1 < (int)sizeof(buf))
+                    {
+                        memmove(buf + pos + 1, buf + pos, len - pos);
+                        buf[pos] = c;
+                        len++;
+                    }
+                }
+            }
+            assert_same_parse(buf, len);
+        }
+    }
+    command_regex_context_free(&fuzz_context);
+}
+END_TEST
+
 Suite *command_parse_suite(void)
 {
     Suite *s;
@@ -157,7 +259,9 @@ Suite *command_parse_suite(void)
     tcase_add_test(tc_core, mailfrom);
     tcase_add_test(tc_core, mailfrom_emptyreversepath);
     tcase_add_test(tc_core, mailfrom_ip);
+    tcase_add_test(tc_core, mailfrom_size);
     tcase_add_test(tc_core, rcptto);
+    tcase_add_test(tc_core, parsers_agree);
     suite_add_tcase(s, tc_core);
     return s;
 }
@@ -0,0 +1,74 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../crlf_scan.h"
+
+
+static int reference_find(const char *data, int from, int len)
+{
+    for (int i = from; i < len - 1; i++)
+    {
+        if (data[i] == '\r' && data[i + 1] == '\n')
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void check_all(const char *data, int from, int len)
+{
+    ck_assert_int_eq(crlf_find(data, from, len), reference_find(data, from, len));
+}
+
+START_TEST(finds_pair_on_block_boundaries)
+{
+    char data[130];
+    // Пара "\r\n" во всех позициях, в том числе разрезанная границей блока
+    for (int pos = 0; pos < (int)sizeof(data) - 1; pos++)
+    {
+        memset(data, 'a', sizeof(data));
+        data[pos] = '\r';
+        data[pos + 1] = '\n';
+        for (int from = 0; from < 40; from += 7)
+        {
+            check_all(data, from, sizeof(data));
+        }
+        // Пара за пределами длины не находится
+        check_all(data, 0, pos + 1);
+    }
+}
+END_TEST
+
+START_TEST(ignores_lone_cr_and_lf)
+{
+    srand(42);
+    char data[1000];
+    for (int round = 0; round < 200; round++)
+    {
+        for (size_t i = 0; i < sizeof(data); i++)
+        {
+            int r = rand() % 16;
+            data[i] = r == 0 ? '\r' : r == 1 ? '\n' : 'x';
+        }
+        int from = rand() % 64;
+        check_all(data, from, sizeof(data) - rand() % 64);
+    }
+}
+END_TEST
+
+
+Suite *crlf_scan_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("CRLF Scan");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, finds_pair_on_block_boundaries);
+    tcase_add_test(tc_core, ignores_lone_cr_and_lf);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,107 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../data_stream.h"
+
+
+// Подаёт input кусками по chunk байт, как их отдавал бы сокет, повторно
+// передавая непотреблённый хвост. Возвращает количество байт до конца письма
+static int feed(const char *input, int chunk, char *body, int *body_len)
+{
+    data_stream_t stream;
+    data_stream_reset(&stream);
+
+    int input_len = strlen(input);
+    char buffer[256];
+    int buffered = 0;
+    int pos = 0;
+    *body_len = 0;
+
+    while (pos < input_len)
+    {
+        int len = input_len - pos < chunk ? input_len - pos : chunk;
+        memcpy(buffer + buffered, input + pos, len);
+        pos += len;
+        buffered += len;
+
+        int consumed;
+        bool finished;
+        int decoded = data_stream_decode(&stream, buffer, buffered, &consumed, &finished);
+        memcpy(body + *body_len, buffer, decoded);
+        *body_len += decoded;
+
+        memmove(buffer, buffer + consumed, buffered - consumed);
+        buffered -= consumed;
+        if (finished)
+        {
+            return pos - buffered;
+        }
+    }
+    return -1;
+}
+
+static void check_body(const char *input, const char *expected, const char *rest)
+{
+    int input_len = strlen(input);
+    for (int chunk = 1; chunk <= input_len; chunk++)
+    {
+        char body[256];
+        int body_len;
+        int end = feed(input, chunk, body, &body_len);
+        ck_assert_int_eq(end, input_len - (int)strlen(rest));
+        ck_assert_int_eq(body_len, strlen(expected));
+        ck_assert(memcmp(body, expected, body_len) == 0);
+    }
+}
+
+START_TEST(plain_body)
+{
+    check_body("HELLO\r\nWORLD\r\n.\r\n", "HELLO\r\nWORLD\r\n", "");
+}
+END_TEST
+
+START_TEST(empty_body)
+{
+    check_body(".\r\n", "", "");
+}
+END_TEST
+
+START_TEST(dot_stuffing_removed)
+{
+    check_body("..doubledot\r\nTEST.\r\n.x\r\n..\r\n.\r\n", ".doubledot\r\nTEST.\r\nx\r\n.\r\n", "");
+    // Точка с '\r', за которым не идёт '\n', - тоже экранированная строка
+    check_body(".\rA\r\n.\r\n", "\rA\r\n", "");
+}
+END_TEST
+
+START_TEST(terminator_only_at_line_start)
+{
+    check_body("A.\r\n\r.\r\nB\r\n.\r\n", "A.\r\n\r.\r\nB\r\n", "");
+    check_body("A\n.\r\nB\r\n.\r\n", "A\n.\r\nB\r\n", "");
+}
+END_TEST
+
+START_TEST(stops_after_terminator)
+{
+    check_body("BODY\r\n.\r\nQUIT\r\n", "BODY\r\n", "QUIT\r\n");
+}
+END_TEST
+
+
+Suite *data_stream_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("Data Stream");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, plain_body);
+    tcase_add_test(tc_core, empty_body);
+    tcase_add_test(tc_core, dot_stuffing_removed);
+    tcase_add_test(tc_core, terminator_only_at_line_start);
+    tcase_add_test(tc_core, stops_after_terminator);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,181 @@
+#include <check.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "../log_binary.h"
+#include "../logger.h"
+
+
+static int encode(char *out, int size, uint16_t event, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = log_encode_record(out, size, event, 1, 0, format, args);
+    va_end(args);
+    return len;
+}
+
+// Описывает событие 0 с форматом @a format и называет поток 1
+static void describe(log_decoder_t *decoder, const char *format)
+{
+    char record[512];
+    char text[64];
+    int text_len;
+    int len = log_encode_special(record, sizeof(record), LOG_EVENT_START, 0, "");
+    ck_assert_int_eq(log_decode_record(decoder, record, len, text, sizeof(text), &text_len), len);
+    len = log_encode_special(record, sizeof(record), LOG_EVENT_DESCRIPTION, 0, LOG_DESCRIPTION_FORMAT,
+        0, LOG_LEVEL_WARN, 42, "file.c", format);
+    ck_assert_int_eq(log_decode_record(decoder, record, len, text, sizeof(text), &text_len), len);
+    len = log_encode_special(record, sizeof(record), LOG_EVENT_THREAD_NAME, 1, LOG_THREAD_NAME_FORMAT, "WORKER1");
+    ck_assert_int_eq(log_decode_record(decoder, record, len, text, sizeof(text), &text_len), len);
+    ck_assert_int_eq(text_len, 0);
+}
+
+// Текст записи без времени: его формат зависит от часового пояса
+static void decode_message(log_decoder_t *decoder, const char *record, int len, char *message)
+{
+    char text[LOG_RECORD_MAX];
+    int text_len;
+    ck_assert_int_eq(log_decode_record(decoder, record, len, text, sizeof(text), &text_len), len);
+    text[text_len] = '\0';
+
+    const char *tail = strstr(text, " WARN file.c:42 ");
+    ck_assert_ptr_ne(tail, NULL);
+    ck_assert(strncmp(text, "[WORKER1] ", 10) == 0);
+    strcpy(message, tail + strlen(" WARN file.c:42 "));
+}
+
+#define CHECK_ROUND_TRIP(FORMAT, ...) \
+    do \
+    { \
+        log_decoder_t decoder; \
+        log_decoder_init(&decoder); \
+        describe(&decoder, FORMAT); \
+        char record[LOG_RECORD_MAX]; \
+        int len = encode(record, sizeof(record), 0, FORMAT, __VA_ARGS__); \
+        char message[LOG_RECORD_MAX]; \
+        decode_message(&decoder, record, len, message); \
+        char expected[LOG_RECORD_MAX]; \
+        snprintf(expected, sizeof(expected), FORMAT "\n", __VA_ARGS__); \
+        ck_assert_str_eq(message, expected); \
+        log_decoder_close(&decoder); \
+    } while (0)
+
+START_TEST(arguments_survive_round_trip)
+{
+    CHECK_ROUND_TRIP("Connection %d new state %d", 3, -7);
+    CHECK_ROUND_TRIP("Spool: %ld writes, %lld bytes, %zu", 12L, -5LL, (size_t)9);
+    CHECK_ROUND_TRIP("%5s|%-4d|%x|%c|%%|%.2f|%hhu", "ab", 1, 255u, 'q', 2.5, (unsigned char)200);
+    CHECK_ROUND_TRIP("Received message %.*s", 5, "HELO there");
+    CHECK_ROUND_TRIP("%*d|%-*s|%.3s", 6, 42, 4, "x", "abcdef");
+    CHECK_ROUND_TRIP("Failed to sync %s: %d", "1.mail", 5);
+}
+END_TEST
+
+START_TEST(long_string_is_truncated)
+{
+    log_decoder_t decoder;
+    log_decoder_init(&decoder);
+    describe(&decoder, "%s %d");
+
+    char text[200];
+    memset(text, 'a', sizeof(text) - 1);
+    text[sizeof(text) - 1] = '\0';
+    char record[64];
+    int len = encode(record, sizeof(record), 0, "%s %d", text, 5);
+    ck_assert(len <= (int)sizeof(record));
+
+    char message[LOG_RECORD_MAX];
+    decode_message(&decoder, record, len, message);
+    // Строка заняла всё место, число не поместилось: остались пробел и перевод строки
+    ck_assert_int_eq(strlen(message), sizeof(record) - sizeof(log_record_header_t) - 2 + 2);
+    ck_assert_str_eq(message + strlen(message) - 2, " \n");
+    ck_assert_int_eq(message[0], 'a');
+    log_decoder_close(&decoder);
+}
+END_TEST
+
+START_TEST(partial_record_waits_for_more)
+{
+    log_decoder_t decoder;
+    log_decoder_init(&decoder);
+    describe(&decoder, "%d");
+
+    char record[64];
+    int len = encode(record, sizeof(record), 0, "%d", 1);
+    char text[LOG_RECORD_MAX];
+    int text_len;
+    ck_assert_int_eq(log_decode_record(&decoder, record, 4, text, sizeof(text), &text_len), 0);
+    ck_assert_int_eq(log_decode_record(&decoder, record, len - 1, text, sizeof(text), &text_len), 0);
+
+    memset(record, 0, sizeof(log_record_header_t));
+    ck_assert_int_eq(log_decode_record(&decoder, record, len, text, sizeof(text), &text_len), -1);
+    log_decoder_close(&decoder);
+}
+END_TEST
+
+START_TEST(microseconds_are_printed_on_request)
+{
+    log_decoder_t decoder;
+    log_decoder_init(&decoder);
+    describe(&decoder, "tick");
+
+    char record[64];
+    int len = log_encode_special(record, sizeof(record), 0, 1, "tick");
+    // Время служебной записи не задаётся, ставим его сами
+    log_record_header_t header;
+    memcpy(&header, record, sizeof(header));
+    header.timestamp = 1500000000ULL * 1000000000ULL + 123456789ULL;
+    memcpy(record, &header, sizeof(header));
+
+    char text[LOG_RECORD_MAX];
+    int text_len;
+    decoder.microseconds = true;
+    ck_assert_int_eq(log_decode_record(&decoder, record, len, text, sizeof(text), &text_len), len);
+    text[text_len] = '\0';
+    ck_assert_ptr_ne(strstr(text, ".123456 WARN file.c:42 tick\n"), NULL);
+
+    decoder.microseconds = false;
+    ck_assert_int_eq(log_decode_record(&decoder, record, len, text, sizeof(text), &text_len), len);
+    text[text_len] = '\0';
+    ck_assert_ptr_eq(strstr(text, ".123456"), NULL);
+    log_decoder_close(&decoder);
+}
+END_TEST
+
+START_TEST(dropped_records_match_text_mode)
+{
+    log_decoder_t decoder;
+    log_decoder_init(&decoder);
+
+    char record[64];
+    int len = log_encode_special(record, sizeof(record), LOG_EVENT_DROPPED, 3, LOG_DROPPED_FORMAT, 17ULL, 3);
+    char text[LOG_RECORD_MAX];
+    int text_len;
+    ck_assert_int_eq(log_decode_record(&decoder, record, len, text, sizeof(text), &text_len), len);
+    text[text_len] = '\0';
+
+    char expected[64];
+    snprintf(expected, sizeof(expected), LOG_DROPPED_FORMAT, 17ULL, 3);
+    ck_assert_str_eq(text, expected);
+    log_decoder_close(&decoder);
+}
+END_TEST
+
+
+Suite *log_binary_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("Binary log");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, arguments_survive_round_trip);
+    tcase_add_test(tc_core, long_string_is_truncated);
+    tcase_add_test(tc_core, partial_record_waits_for_more);
+    tcase_add_test(tc_core, microseconds_are_printed_on_request);
+    tcase_add_test(tc_core, dropped_records_match_text_mode);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
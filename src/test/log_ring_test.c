@@ -0,0 +1,98 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../log_ring.h"
+
+
+static log_ring_t *create_ring(uint32_t capacity)
+{
+    log_ring_t *ring = malloc(log_ring_size(capacity));
+    log_ring_init(ring, capacity);
+    return ring;
+}
+
+// Забирает всё содержимое кольца в строку
+static int take_all(log_ring_t *ring, char *out)
+{
+    struct iovec iov[2];
+    uint64_t end;
+    int count = log_ring_peek(ring, iov, &end);
+    int len = 0;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    out[len] = '\0';
+    log_ring_consume(ring, end);
+    return count;
+}
+
+START_TEST(records_come_out_in_order)
+{
+    log_ring_t *ring = create_ring(64);
+    char out[65];
+
+    ck_assert_int_eq(take_all(ring, out), 0);
+    ck_assert(log_ring_push(ring, "first\n", 6));
+    ck_assert(log_ring_push(ring, "second\n", 7));
+    ck_assert_int_eq(take_all(ring, out), 1);
+    ck_assert_str_eq(out, "first\nsecond\n");
+    ck_assert_int_eq(take_all(ring, out), 0);
+    free(ring);
+}
+END_TEST
+
+START_TEST(record_wraps_around)
+{
+    log_ring_t *ring = create_ring(16);
+    char out[17];
+
+    ck_assert(log_ring_push(ring, "0123456789\n", 11));
+    take_all(ring, out);
+    // Запись начинается в конце буфера и продолжается с его начала
+    ck_assert(log_ring_push(ring, "abcdefghij\n", 11));
+    ck_assert_int_eq(take_all(ring, out), 2);
+    ck_assert_str_eq(out, "abcdefghij\n");
+    free(ring);
+}
+END_TEST
+
+START_TEST(overflow_drops_and_counts)
+{
+    log_ring_t *ring = create_ring(16);
+    char out[17];
+
+    ck_assert(log_ring_push(ring, "0123456789\n", 11));
+    ck_assert(!log_ring_push(ring, "abcdef\n", 7));
+    ck_assert(!log_ring_push(ring, "ghijkl\n", 7));
+    ck_assert(log_ring_push(ring, "mnop\n", 5));
+    ck_assert(!log_ring_push(ring, "q\n", 2));
+
+    ck_assert_int_eq(log_ring_take_drops(ring), 3);
+    ck_assert_int_eq(log_ring_take_drops(ring), 0);
+    take_all(ring, out);
+    ck_assert_str_eq(out, "0123456789\nmnop\n");
+
+    // После чтения место снова есть
+    ck_assert(log_ring_push(ring, "abcdef\n", 7));
+    ck_assert_int_eq(log_ring_take_drops(ring), 0);
+    free(ring);
+}
+END_TEST
+
+
+Suite *log_ring_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("Log ring");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, records_come_out_in_order);
+    tcase_add_test(tc_core, record_wraps_around);
+    tcase_add_test(tc_core, overflow_drops_and_counts);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
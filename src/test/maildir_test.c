@@ -0,0 +1,175 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../maildir.h"
+#include "test_util.h"
+
+
+// Ищет письмо в подпапках cur, возвращает путь к нему от корня maildir
+static bool find_in_shards(maildir_t *maildir, const char *filename, char *path, int len)
+{
+    for (int a = 0; a < maildir->shard_fanout; a++)
+    {
+        for (int b = 0; b < maildir->shard_fanout; b++)
+        {
+            snprintf(path, len, "cur/%02x/%02x/%s", a, b, filename);
+            if (faccessat(maildir->root_fd, path, F_OK, 0) == 0)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+START_TEST(sharded_delivery)
+{
+    maildir_t maildir = create_test_maildir();
+    ck_assert(maildir_set_sharding(&maildir, 16));
+    ck_assert(maildir_is_sharded(&maildir, MAILDIR_CUR));
+    ck_assert(!maildir_is_sharded(&maildir, MAILDIR_TMP));
+
+    int fd = maildir_create_in_tmp(&maildir, "1.mail");
+    ck_assert_int_ge(fd, 0);
+    ck_assert(maildir_move_to_cur(&maildir, fd, "1.mail"));
+    ck_assert(maildir_sync_entry(&maildir, MAILDIR_CUR, "1.mail"));
+    close(fd);
+
+    // Письмо лежит в подпапке, которую выбирает maildir_open_shard
+    char path[128];
+    ck_assert(find_in_shards(&maildir, "1.mail", path, sizeof(path)));
+    ck_assert_int_ne(faccessat(maildir.cur_fd, "1.mail", F_OK, 0), 0);
+    int shard_fd = maildir_open_shard(&maildir, MAILDIR_CUR, "1.mail");
+    ck_assert_int_ge(shard_fd, 0);
+    ck_assert_int_eq(faccessat(shard_fd, "1.mail", F_OK, 0), 0);
+    close(shard_fd);
+    maildir_close(&maildir);
+
+    // Разбиение записано в maildir и не меняется
+    maildir = open_test_maildir();
+    ck_assert_int_eq(maildir.shard_fanout, 16);
+    ck_assert(maildir_set_sharding(&maildir, 16));
+    ck_assert(!maildir_set_sharding(&maildir, 32));
+    ck_assert(!maildir_set_sharding(&maildir, 0));
+    maildir_close(&maildir);
+
+    // path - "cur/xx/yy/1.mail"
+    char level2[16];
+    snprintf(level2, sizeof(level2), "%.9s", path);
+    char level1[16];
+    snprintf(level1, sizeof(level1), "%.6s", path);
+    const char *cleanup[] = { path, level2, level1, "layout" };
+    remove_test_maildir(cleanup, 4);
+}
+END_TEST
+
+START_TEST(delivered_message_is_linked)
+{
+    maildir_t maildir = create_test_maildir();
+
+    int fd = maildir_create_in_tmp(&maildir, "1.mail");
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(write(fd, "body", 4), 4);
+    ck_assert(maildir_move_to_cur(&maildir, fd, "1.mail"));
+    close(fd);
+    ck_assert(maildir_link_delivered(&maildir, MAILDIR_CUR, "1.mail", MAILDIR_RELAY, "1.mail.1"));
+    ck_assert(!maildir_link_delivered(&maildir, MAILDIR_CUR, "2.mail", MAILDIR_RELAY, "2.mail.1"));
+
+    // Тело на диске одно
+    struct stat first, second;
+    ck_assert_int_eq(fstatat(maildir.cur_fd, "1.mail", &first, 0), 0);
+    ck_assert_int_eq(fstatat(maildir.relay_fd, "1.mail.1", &second, 0), 0);
+    ck_assert_int_eq(first.st_ino, second.st_ino);
+    ck_assert_int_eq(second.st_nlink, 2);
+    maildir_close(&maildir);
+
+    const char *cleanup[] = { "cur/1.mail", "relay/1.mail.1" };
+    remove_test_maildir(cleanup, 2);
+}
+END_TEST
+
+// Доставляет письмо с телом @a body в cur
+static void deliver(maildir_t *maildir, char *filename, const char *body)
+{
+    int fd = maildir_create_in_tmp(maildir, filename);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(write(fd, body, strlen(body)), strlen(body));
+    ck_assert(maildir_move_to_cur(maildir, fd, filename));
+    close(fd);
+}
+
+START_TEST(same_bodies_are_stored_once)
+{
+    maildir_t maildir = create_test_maildir();
+    ck_assert(maildir_open_blobs(&maildir));
+
+    // Хеши условные: maildir им доверяет
+    deliver(&maildir, "1.mail", "body");
+    deliver(&maildir, "2.mail", "body");
+    deliver(&maildir, "3.mail", "other");
+    ck_assert(maildir_deduplicate(&maildir, MAILDIR_CUR, "1.mail", "aa01"));
+    ck_assert(maildir_deduplicate(&maildir, MAILDIR_CUR, "2.mail", "aa01"));
+    ck_assert(maildir_deduplicate(&maildir, MAILDIR_CUR, "3.mail", "bb02"));
+
+    struct stat first, second, blob;
+    ck_assert_int_eq(fstatat(maildir.cur_fd, "1.mail", &first, 0), 0);
+    ck_assert_int_eq(fstatat(maildir.cur_fd, "2.mail", &second, 0), 0);
+    ck_assert_int_eq(fstatat(maildir.blobs_fd, "aa/aa01", &blob, 0), 0);
+    ck_assert_int_eq(first.st_ino, blob.st_ino);
+    ck_assert_int_eq(second.st_ino, blob.st_ino);
+    ck_assert_int_eq(blob.st_nlink, 3);
+    ck_assert_int_ne(faccessat(maildir.tmp_fd, "2.mail.blob", F_OK, 0), 0);
+
+    // Тело без писем удаляется, остальные остаются
+    ck_assert_int_eq(unlinkat(maildir.cur_fd, "3.mail", 0), 0);
+    ck_assert_int_eq(maildir_collect_blobs(&maildir), 1);
+    ck_assert_int_ne(faccessat(maildir.blobs_fd, "bb/bb02", F_OK, 0), 0);
+    ck_assert_int_eq(maildir_collect_blobs(&maildir), 0);
+    maildir_close(&maildir);
+
+    const char *cleanup[] = { "cur/1.mail", "cur/2.mail", "blobs/aa/aa01", "blobs/aa", "blobs/bb", "blobs" };
+    remove_test_maildir(cleanup, 6);
+}
+END_TEST
+
+START_TEST(invalid_layout_is_rejected)
+{
+    maildir_t maildir = create_test_maildir();
+    ck_assert(!maildir_set_sharding(&maildir, 1));
+    ck_assert(!maildir_set_sharding(&maildir, MAILDIR_MAX_SHARD_FANOUT + 1));
+    ck_assert(maildir_set_sharding(&maildir, 0));
+
+    int fd = openat(maildir.root_fd, "layout", O_CREAT | O_WRONLY, 0644);
+    ck_assert_int_eq(write(fd, "shards 1\n", 9), 9);
+    close(fd);
+    maildir_close(&maildir);
+
+    int error;
+    maildir = maildir_open(test_root(), &error);
+    ck_assert_int_eq(error, EINVAL);
+
+    const char *cleanup[] = { "layout" };
+    remove_test_maildir(cleanup, 1);
+}
+END_TEST
+
+
+Suite *maildir_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("Maildir");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, sharded_delivery);
+    tcase_add_test(tc_core, delivered_message_is_linked);
+    tcase_add_test(tc_core, same_bodies_are_stored_once);
+    tcase_add_test(tc_core, invalid_layout_is_rejected);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
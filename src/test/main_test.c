@@ -3,6 +3,18 @@
 
 Suite *message_builder_suite(void);
 Suite *command_parse_suite(void);
+Suite *timer_wheel_suite(void);
+Suite *crlf_scan_suite(void);
+Suite *data_stream_suite(void);
+Suite *spool_buffer_suite(void);
+Suite *spool_io_suite(void);
+Suite *segment_spool_suite(void);
+Suite *maildir_suite(void);
+Suite *unique_id_suite(void);
+Suite *sha256_suite(void);
+Suite *log_ring_suite(void);
+Suite *log_binary_suite(void);
+Suite *log_writer_suite(void);
 
 int main()
 {
@@ -12,6 +24,18 @@ int main()
     s = message_builder_suite();
     sr = srunner_create(s);
     srunner_add_suite(sr, command_parse_suite());
+    srunner_add_suite(sr, timer_wheel_suite());
+    srunner_add_suite(sr, crlf_scan_suite());
+    srunner_add_suite(sr, data_stream_suite());
+    srunner_add_suite(sr, spool_buffer_suite());
+    srunner_add_suite(sr, spool_io_suite());
+    srunner_add_suite(sr, segment_spool_suite());
+    srunner_add_suite(sr, maildir_suite());
+    srunner_add_suite(sr, unique_id_suite());
+    srunner_add_suite(sr, sha256_suite());
+    srunner_add_suite(sr, log_ring_suite());
+    srunner_add_suite(sr, log_binary_suite());
+    srunner_add_suite(sr, log_writer_suite());
     
     srunner_set_fork_status(sr, CK_NOFORK);    
     
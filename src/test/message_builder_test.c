@@ -19,8 +19,19 @@ void check_message(message_builder_t *builder, const char *str)
 void check_unparsed_buffer(message_builder_t *builder, const char *str)
 {
     int len = strlen(str);
-    ck_assert_int_eq(builder->unparsed_message_buffer.size, len);
-    ck_assert(memcmp(builder->unparsed_message_buffer.data, str, len) == 0);
+    int unparsed_len;
+    const char *unparsed = message_builder_unparsed(builder, &unparsed_len);
+    ck_assert_int_eq(unparsed_len, len);
+    ck_assert(memcmp(unparsed, str, len) == 0);
+}
+
+void check_line(message_builder_t *builder, const char *str)
+{
+    int len = strlen(str);
+    message_t line;
+    ck_assert(message_builder_next_line(builder, &line));
+    ck_assert_int_eq(line.len, len);
+    ck_assert(memcmp(line.text, str, len) == 0);
 }
 
 START_TEST(partial_message)
@@ -119,6 +130,128 @@ START_TEST(message_ends_with_caret)
 }
 END_TEST
 
+START_TEST(lines_point_into_buffer)
+{
+    message_builder_t builder = create_message_builder();
+    message_builder_add_string(&builder, "HELLO\r\nWORLD\r\nTE", 16);
+
+    message_t first, second, none;
+    ck_assert(message_builder_next_line(&builder, &first));
+    ck_assert(message_builder_next_line(&builder, &second));
+    ck_assert(!message_builder_next_line(&builder, &none));
+
+    // Строки не копируются: обе указывают в приёмный буфер
+    ck_assert_ptr_eq(first.text, builder.buffer.data);
+    ck_assert_ptr_eq(second.text, first.text + 7);
+    ck_assert(memcmp(second.text, "WORLD", 5) == 0);
+    message_builder_release_lines(&builder);
+
+    // После освобождения хвост сдвигается в начало буфера
+    char *place = message_builder_reserve(&builder, 5);
+    memcpy(place, "ST\r\nX", 5);
+    message_builder_commit(&builder, 5);
+    ck_assert_int_eq(message_builder_ready_message_count(&builder), 1);
+    check_line(&builder, "TEST");
+    check_unparsed_buffer(&builder, "X");
+    ck_assert_int_eq(builder.buffer.size, 7);
+
+    message_builder_release_lines(&builder);
+    message_builder_close(&builder);
+}
+END_TEST
+
+START_TEST(pending_lines_survive_compaction)
+{
+    message_builder_t builder = create_message_builder();
+    message_builder_add_string(&builder, "A\r\nB\r\nC\r", 8);
+
+    check_line(&builder, "A");
+    message_builder_release_lines(&builder);
+
+    // "B" ещё не выдана и должна пережить сдвиг буфера
+    message_builder_add_string(&builder, "\n", 1);
+    ck_assert_int_eq(message_builder_ready_message_count(&builder), 2);
+    check_line(&builder, "B");
+    check_line(&builder, "C");
+    check_unparsed_buffer(&builder, "");
+
+    message_builder_release_lines(&builder);
+    message_builder_close(&builder);
+}
+END_TEST
+
+START_TEST(line_queue_wraps_and_grows)
+{
+    message_builder_t builder = create_message_builder();
+    char line[16];
+
+    // Сдвигаем голову очереди, чтобы следующий рост прошёл через границу кольца
+    for (int i = 0; i < 10; i++)
+    {
+        int len = sprintf(line, "L%d\r\n", i);
+        message_builder_add_string(&builder, line, len);
+    }
+    for (int i = 0; i < 10; i++)
+    {
+        sprintf(line, "L%d", i);
+        check_message(&builder, line);
+    }
+
+    for (int i = 0; i < 100; i++)
+    {
+        int len = sprintf(line, "M%d\r\n", i);
+        message_builder_add_string(&builder, line, len);
+    }
+    ck_assert_int_eq(message_builder_ready_message_count(&builder), 100);
+
+    message_t lines[64];
+    ck_assert_int_eq(message_builder_take_lines(&builder, lines, 64), 64);
+    ck_assert_int_eq(message_builder_take_lines(&builder, lines + 0, 0), 0);
+    for (int i = 0; i < 64; i++)
+    {
+        int len = sprintf(line, "M%d", i);
+        ck_assert_int_eq(lines[i].len, len);
+        ck_assert(memcmp(lines[i].text, line, len) == 0);
+    }
+    message_builder_release_lines(&builder);
+
+    ck_assert_int_eq(message_builder_take_lines(&builder, lines, 64), 36);
+    ck_assert(memcmp(lines[35].text, "M99", 3) == 0);
+    ck_assert_int_eq(message_builder_ready_message_count(&builder), 0);
+
+    message_builder_release_lines(&builder);
+    message_builder_close(&builder);
+}
+END_TEST
+
+START_TEST(raw_mode_returns_pending_lines)
+{
+    message_builder_t builder = create_message_builder();
+    message_builder_add_string(&builder, "DATA\r\nBODY\r\n.\r\nQU", 17);
+
+    message_t data;
+    ck_assert(message_builder_next_line(&builder, &data));
+    message_builder_enter_raw(&builder, data.text + data.len + 2);
+    ck_assert_int_eq(message_builder_ready_message_count(&builder), 0);
+
+    // Уже выделенные строки тела снова видны как сырые байты
+    int len;
+    char *raw = message_builder_raw_data(&builder, &len);
+    ck_assert_int_eq(len, 11);
+    ck_assert(memcmp(raw, "BODY\r\n.\r\nQU", 11) == 0);
+    message_builder_consume_raw(&builder, 9);
+    message_builder_leave_raw(&builder);
+    message_builder_release_lines(&builder);
+
+    // После выхода из режима остаток снова разбирается на строки
+    message_builder_add_string(&builder, "IT\r\n", 4);
+    check_line(&builder, "QUIT");
+
+    message_builder_release_lines(&builder);
+    message_builder_close(&builder);
+}
+END_TEST
+
 
 Suite *message_builder_suite(void)
 {
@@ -135,6 +268,10 @@ Suite *message_builder_suite(void)
     tcase_add_test(tc_core, two_messages);
     tcase_add_test(tc_core, multiple_messages_in_one_chunk);
     tcase_add_test(tc_core, message_ends_with_caret);
+    tcase_add_test(tc_core, lines_point_into_buffer);
+    tcase_add_test(tc_core, pending_lines_survive_compaction);
+    tcase_add_test(tc_core, line_queue_wraps_and_grows);
+    tcase_add_test(tc_core, raw_mode_returns_pending_lines);
     suite_add_tcase(s, tc_core);
     return s;
 }
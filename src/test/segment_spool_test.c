@@ -0,0 +1,197 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../segment_spool.h"
+#include "test_util.h"
+
+
+// maildir с папкой сегментов
+static maildir_t open_segment_maildir()
+{
+    maildir_t maildir = create_test_maildir();
+    ck_assert(maildir_open_segments(&maildir));
+    return maildir;
+}
+
+static void remove_segment_maildir(maildir_t *maildir, const char **files, int count)
+{
+    maildir_close(maildir);
+    const char *paths[8];
+    ck_assert_int_lt(count, 8);
+    memcpy(paths, files, count * sizeof(*files));
+    paths[count] = "segments";
+    remove_test_maildir(paths, count + 1);
+}
+
+static void map_segment(const char *name, bool writable, segment_t *segment)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s/segments/%s", test_root(), name);
+    ck_assert(segment_map(path, writable, segment));
+}
+
+START_TEST(append_rotates_segments)
+{
+    maildir_t maildir = open_segment_maildir();
+    segment_spool_t spool;
+    segment_spool_init(&spool, maildir.segments_fd, 1, 4096, 100, true);
+
+    char body[1500];
+    memset(body, 'x', sizeof(body));
+    for (int i = 0; i < 3; i++)
+    {
+        body[0] = '0' + i;
+        ck_assert(segment_spool_append(&spool, "a@b.ru", 6, "c@d.ru", 6, body, sizeof(body), MAILDIR_CUR, false));
+    }
+    // Третье письмо не поместилось и начало второй сегмент
+    ck_assert_int_eq(spool.sequence, 2);
+    ck_assert_int_eq(spool.current.count, 1);
+
+    // До сброса письмо не считается принятым
+    segment_record_t record;
+    ck_assert(segment_get_record(&spool.current, 0, &record));
+    ck_assert_int_eq(record.state, SEGMENT_ENTRY_WRITTEN);
+    ck_assert(segment_spool_sync(&spool));
+    ck_assert(segment_get_record(&spool.current, 0, &record));
+    ck_assert_int_eq(record.state, SEGMENT_ENTRY_COMMITTED);
+    segment_spool_close(&spool);
+
+    // Первый сегмент сброшен при смене
+    segment_t segment;
+    map_segment("100-W1-0.seg", false, &segment);
+    ck_assert_int_eq(segment.count, 2);
+    for (int i = 0; i < 2; i++)
+    {
+        ck_assert(segment_get_record(&segment, i, &record));
+        ck_assert_int_eq(record.state, SEGMENT_ENTRY_COMMITTED);
+        ck_assert_int_eq(record.folder, MAILDIR_CUR);
+        ck_assert_int_eq(record.from_len, 6);
+        ck_assert(memcmp(record.from, "a@b.ru", 6) == 0);
+        ck_assert(memcmp(record.rcpt, "c@d.ru", 6) == 0);
+        ck_assert_int_eq(record.body_len, sizeof(body));
+        ck_assert_int_eq(record.body[0], '0' + i);
+    }
+    ck_assert(!segment_get_record(&segment, 2, &record));
+    segment_unmap(&segment);
+
+    const char *files[] = { "segments/100-W1-0.seg", "segments/100-W1-1.seg" };
+    remove_segment_maildir(&maildir, files, 2);
+}
+END_TEST
+
+START_TEST(oversized_message_gets_own_segment)
+{
+    maildir_t maildir = open_segment_maildir();
+    segment_spool_t spool;
+    segment_spool_init(&spool, maildir.segments_fd, 2, 4096, 100, false);
+
+    char *body = calloc(10000, 1);
+    ck_assert(segment_spool_append(&spool, "", 0, "", 0, body, 10000, MAILDIR_TMP, false));
+    ck_assert(spool.current.capacity >= 10000);
+    free(body);
+    segment_spool_close(&spool);
+
+    const char *files[] = { "segments/100-W2-0.seg" };
+    remove_segment_maildir(&maildir, files, 1);
+}
+END_TEST
+
+START_TEST(too_long_address_is_rejected)
+{
+    maildir_t maildir = open_segment_maildir();
+    segment_spool_t spool;
+    segment_spool_init(&spool, maildir.segments_fd, 5, 4096, 100, false);
+
+    int len = UINT16_MAX + 1;
+    char *address = calloc(len, 1);
+    ck_assert(!segment_spool_append(&spool, address, len, "c@d.ru", 6, "body", 4, MAILDIR_CUR, false));
+    ck_assert(!segment_spool_append(&spool, "a@b.ru", 6, address, len, "body", 4, MAILDIR_CUR, false));
+    ck_assert(segment_spool_append(&spool, address, UINT16_MAX, "c@d.ru", 6, "body", 4, MAILDIR_CUR, false));
+    free(address);
+
+    segment_record_t record;
+    ck_assert_int_eq(spool.current.count, 1);
+    ck_assert(segment_get_record(&spool.current, 0, &record));
+    ck_assert_int_eq(record.from_len, UINT16_MAX);
+    ck_assert(memcmp(record.body, "body", 4) == 0);
+    segment_spool_close(&spool);
+
+    const char *files[] = { "segments/100-W5-0.seg" };
+    remove_segment_maildir(&maildir, files, 1);
+}
+END_TEST
+
+START_TEST(recipients_share_body)
+{
+    maildir_t maildir = open_segment_maildir();
+    segment_spool_t spool;
+    segment_spool_init(&spool, maildir.segments_fd, 4, 4096, 100, false);
+    ck_assert(segment_spool_append(&spool, "a@b.ru", 6, "c@d.ru", 6, "shared", 6, MAILDIR_CUR, false));
+    uint64_t end = spool.current.data_end;
+    ck_assert(segment_spool_append(&spool, "a@b.ru", 6, "e@f.ru", 6, "shared", 6, MAILDIR_RELAY, true));
+    // Вторая запись - только отправитель и получатель
+    ck_assert_int_eq(spool.current.data_end - end, 16);
+    segment_spool_close(&spool);
+
+    segment_t segment;
+    map_segment("100-W4-0.seg", false, &segment);
+    ck_assert_int_eq(segment.count, 2);
+    segment_record_t first;
+    segment_record_t second;
+    ck_assert(segment_get_record(&segment, 0, &first));
+    ck_assert(segment_get_record(&segment, 1, &second));
+    ck_assert_ptr_eq(first.body, second.body);
+    ck_assert_int_eq(second.body_len, 6);
+    ck_assert(memcmp(second.rcpt, "e@f.ru", 6) == 0);
+    ck_assert_int_eq(second.folder, MAILDIR_RELAY);
+    segment_unmap(&segment);
+
+    const char *files[] = { "segments/100-W4-0.seg" };
+    remove_segment_maildir(&maildir, files, 1);
+}
+END_TEST
+
+START_TEST(export_to_maildir)
+{
+    maildir_t maildir = open_segment_maildir();
+    segment_spool_t spool;
+    segment_spool_init(&spool, maildir.segments_fd, 3, 4096, 100, false);
+    ck_assert(segment_spool_append(&spool, "a@b.ru", 6, "c@d.ru", 6, "local", 5, MAILDIR_CUR, false));
+    ck_assert(segment_spool_append(&spool, "a@b.ru", 6, "e@f.ru", 6, "remote", 6, MAILDIR_RELAY, false));
+    segment_spool_close(&spool);
+
+    segment_t segment;
+    map_segment("100-W3-0.seg", true, &segment);
+    ck_assert_int_eq(segment_export(&segment, &maildir, "seg"), 2);
+    check_file(maildir.root_fd, "cur/seg.0", "local");
+    check_file(maildir.root_fd, "relay/seg.1", "remote");
+    // Выгруженные письма повторно не выгружаются
+    ck_assert_int_eq(segment_export(&segment, &maildir, "seg"), 0);
+    segment_unmap(&segment);
+
+    const char *files[] = { "segments/100-W3-0.seg", "cur/seg.0", "relay/seg.1" };
+    remove_segment_maildir(&maildir, files, 3);
+}
+END_TEST
+
+
+Suite *segment_spool_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("Segment spool");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, append_rotates_segments);
+    tcase_add_test(tc_core, oversized_message_gets_own_segment);
+    tcase_add_test(tc_core, too_long_address_is_rejected);
+    tcase_add_test(tc_core, recipients_share_body);
+    tcase_add_test(tc_core, export_to_maildir);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,58 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../sha256.h"
+
+
+static void check_hash(const char *data, int len, int chunk, const char *expected)
+{
+    sha256_t sha;
+    sha256_init(&sha);
+    for (int i = 0; i < len; i += chunk)
+    {
+        sha256_update(&sha, data + i, len - i < chunk ? len - i : chunk);
+    }
+    char hex[SHA256_HEX_SIZE + 1];
+    sha256_final_hex(&sha, hex);
+    ck_assert_str_eq(hex, expected);
+}
+
+START_TEST(known_digests)
+{
+    check_hash("", 0, 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    check_hash("abc", 3, 3, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    const char *two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    check_hash(two_blocks, strlen(two_blocks), 56,
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+END_TEST
+
+START_TEST(chunking_does_not_matter)
+{
+    // Миллион 'a' разными порциями, в том числе не кратными блоку
+    int len = 1000000;
+    char *data = malloc(len);
+    memset(data, 'a', len);
+    const char *expected = "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0";
+    check_hash(data, len, len, expected);
+    check_hash(data, len, 1, expected);
+    check_hash(data, len, 63, expected);
+    check_hash(data, len, 4097, expected);
+    free(data);
+}
+END_TEST
+
+
+Suite *sha256_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("SHA-256");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, known_digests);
+    tcase_add_test(tc_core, chunking_does_not_matter);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,98 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../spool_buffer.h"
+
+
+static void check_file(FILE *file, const char *expected)
+{
+    int len = strlen(expected);
+    char buf[256];
+    ck_assert_int_eq(pread(fileno(file), buf, sizeof(buf), 0), len);
+    ck_assert(memcmp(buf, expected, len) == 0);
+}
+
+START_TEST(small_appends_are_coalesced)
+{
+    FILE *file = tmpfile();
+    spool_stats_t stats = {0};
+    spool_buffer_t spool;
+    spool_buffer_init(&spool, 16);
+
+    ck_assert(spool_buffer_append(&spool, fileno(file), "abc", 3, &stats));
+    ck_assert(spool_buffer_append(&spool, fileno(file), "def", 3, &stats));
+    ck_assert_int_eq(stats.flushes, 0);
+
+    ck_assert(spool_buffer_flush(&spool, fileno(file), &stats));
+    ck_assert_int_eq(stats.flushes, 1);
+    ck_assert_int_eq(stats.bytes, 6);
+    check_file(file, "abcdef");
+
+    // Пустой буфер не пишется
+    ck_assert(spool_buffer_flush(&spool, fileno(file), &stats));
+    ck_assert_int_eq(stats.flushes, 1);
+
+    spool_buffer_close(&spool);
+    fclose(file);
+}
+END_TEST
+
+START_TEST(overflow_writes_pending_and_new_bytes_at_once)
+{
+    FILE *file = tmpfile();
+    spool_stats_t stats = {0};
+    spool_buffer_t spool;
+    spool_buffer_init(&spool, 8);
+
+    ck_assert(spool_buffer_append(&spool, fileno(file), "12345", 5, &stats));
+    ck_assert(spool_buffer_append(&spool, fileno(file), "6789AB", 6, &stats));
+    ck_assert_int_eq(stats.flushes, 1);
+    ck_assert_int_eq(spool.size, 0);
+    check_file(file, "123456789AB");
+
+    ck_assert(spool_buffer_append(&spool, fileno(file), "CD", 2, &stats));
+    ck_assert(spool_buffer_flush(&spool, fileno(file), &stats));
+    ck_assert_int_eq(stats.flushes, 2);
+    check_file(file, "123456789ABCD");
+
+    spool_buffer_close(&spool);
+    fclose(file);
+}
+END_TEST
+
+START_TEST(write_error_is_reported_on_flush)
+{
+    spool_stats_t stats = {0};
+    spool_buffer_t spool;
+    spool_buffer_init(&spool, 4);
+
+    ck_assert(!spool_buffer_append(&spool, -1, "123456", 6, &stats));
+    // Остаток письма отбрасывается, ошибка остаётся до нового письма
+    ck_assert(!spool_buffer_append(&spool, -1, "7", 1, &stats));
+    ck_assert(!spool_buffer_flush(&spool, -1, &stats));
+    ck_assert_int_eq(stats.flushes, 0);
+
+    spool_buffer_reset(&spool);
+    ck_assert(spool_buffer_append(&spool, -1, "8", 1, &stats));
+
+    spool_buffer_close(&spool);
+}
+END_TEST
+
+
+Suite *spool_buffer_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("Spool Buffer");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, small_appends_are_coalesced);
+    tcase_add_test(tc_core, overflow_writes_pending_and_new_bytes_at_once);
+    tcase_add_test(tc_core, write_error_is_reported_on_flush);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,224 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../spool_io.h"
+#include "test_util.h"
+
+
+// Ждёт, пока не завершится хотя бы одно письмо
+static spool_result_t wait_result(spool_io_t *io)
+{
+    spool_io_submit(io);
+    while (io->results.size == 0)
+    {
+        struct pollfd pfd = { .fd = io->event_fd, .events = POLLIN };
+        ck_assert_int_eq(poll(&pfd, 1, 5000), 1);
+        spool_io_process(io);
+    }
+    spool_result_t result = ((spool_result_t*)io->results.data)[0];
+    dynamic_vector_stable_delete_at(&io->results, 0);
+    return result;
+}
+
+static void deliver_message(enum spool_io_backend backend, bool tmpfile)
+{
+    char root[] = "/tmp/spool_io_testXXXXXX";
+    ck_assert_ptr_ne(mkdtemp(root), NULL);
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+    mkdirat(root_fd, "tmp", 0777);
+    mkdirat(root_fd, "cur", 0777);
+    int tmp_fd = openat(root_fd, "tmp", O_RDONLY | O_DIRECTORY);
+    int cur_fd = openat(root_fd, "cur", O_RDONLY | O_DIRECTORY);
+
+    spool_io_t io;
+    ck_assert(spool_io_init(&io, backend));
+
+    // Записи до открытия файла ждут его, остальные идут сразу
+    spool_job_t *job = spool_io_open(&io, tmp_fd, "1.mail", tmpfile, 0, 7);
+    spool_io_write(&io, job, strdup("Hello, "), 7);
+    spool_io_submit(&io);
+    spool_io_write(&io, job, strdup("world"), 5);
+    spool_io_finish(&io, job, cur_fd, false, true);
+
+    spool_result_t result = wait_result(&io);
+    ck_assert_int_eq(result.owner, 7);
+    ck_assert(result.ok);
+    check_file(cur_fd, "1.mail", "Hello, world");
+    ck_assert_int_ne(faccessat(tmp_fd, "1.mail", F_OK, 0), 0);
+
+    // Брошенное письмо закрывается само и никому не отвечает
+    job = spool_io_open(&io, tmp_fd, "2.mail", tmpfile, 0, 8);
+    spool_io_write(&io, job, strdup("lost"), 4);
+    spool_io_abandon(&io, job);
+    spool_io_close(&io);
+    ck_assert_int_ne(faccessat(cur_fd, "2.mail", F_OK, 0), 0);
+    // Именованный файл остаётся в tmp, безымянный исчезает
+    ck_assert_int_eq(faccessat(tmp_fd, "2.mail", F_OK, 0) == 0, !tmpfile);
+
+    unlinkat(cur_fd, "1.mail", 0);
+    unlinkat(tmp_fd, "2.mail", 0);
+    unlinkat(root_fd, "tmp", AT_REMOVEDIR);
+    unlinkat(root_fd, "cur", AT_REMOVEDIR);
+    close(tmp_fd);
+    close(cur_fd);
+    close(root_fd);
+    rmdir(root);
+}
+
+START_TEST(uring_delivers_message)
+{
+    deliver_message(SPOOL_IO_URING, false);
+    deliver_message(SPOOL_IO_URING, true);
+}
+END_TEST
+
+START_TEST(thread_pool_delivers_message)
+{
+    deliver_message(SPOOL_IO_THREADS, false);
+    deliver_message(SPOOL_IO_THREADS, true);
+}
+END_TEST
+
+// Заявленное место выделяется до записи, лишнее освобождается
+static void reserve_space(enum spool_io_backend backend)
+{
+    char root[] = "/tmp/spool_io_testXXXXXX";
+    ck_assert_ptr_ne(mkdtemp(root), NULL);
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+
+    spool_io_t io;
+    ck_assert(spool_io_init(&io, backend));
+    spool_job_t *job = spool_io_open(&io, root_fd, "1.mail", false, 1 << 20, 5);
+    spool_io_write(&io, job, strdup("short"), 5);
+    spool_io_finish(&io, job, root_fd, false, false);
+
+    spool_result_t result = wait_result(&io);
+    ck_assert(result.ok);
+    check_file(root_fd, "1.mail", "short");
+    struct stat st;
+    ck_assert_int_eq(fstatat(root_fd, "1.mail", &st, 0), 0);
+    ck_assert_int_lt(st.st_blocks * 512, 1 << 20);
+    spool_io_close(&io);
+
+    unlinkat(root_fd, "1.mail", 0);
+    close(root_fd);
+    rmdir(root);
+}
+
+START_TEST(reserved_space_is_released)
+{
+    reserve_space(SPOOL_IO_URING);
+    reserve_space(SPOOL_IO_THREADS);
+}
+END_TEST
+
+START_TEST(failed_open_is_reported)
+{
+    spool_io_t io;
+    ck_assert(spool_io_init(&io, SPOOL_IO_THREADS));
+
+    spool_job_t *job = spool_io_open(&io, -1, "1.mail", false, 0, 3);
+    spool_io_write(&io, job, strdup("body"), 4);
+    spool_io_finish(&io, job, -1, false, false);
+
+    spool_result_t result = wait_result(&io);
+    ck_assert_int_eq(result.owner, 3);
+    ck_assert(!result.ok);
+    spool_io_close(&io);
+}
+END_TEST
+
+// Соединение, у которого скопилось много незаписанного, снова читается,
+// когда записи догнали приём
+START_TEST(backlog_is_throttled)
+{
+    char root[] = "/tmp/spool_io_testXXXXXX";
+    ck_assert_ptr_ne(mkdtemp(root), NULL);
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+
+    spool_io_t io;
+    ck_assert(spool_io_init(&io, SPOOL_IO_THREADS));
+    spool_job_t *job = spool_io_open(&io, root_fd, "1.mail", false, 0, 4);
+    ck_assert(!spool_io_throttle(job));
+    for (int i = 0; i < 3; i++)
+    {
+        int len = SPOOL_JOB_MAX_UNWRITTEN / 2;
+        spool_io_write(&io, job, calloc(1, len), len);
+    }
+    ck_assert(spool_io_throttle(job));
+    spool_io_finish(&io, job, root_fd, false, false);
+
+    spool_result_t result = wait_result(&io);
+    ck_assert(result.ok);
+    ck_assert_int_eq(io.drained.size, 1);
+    ck_assert_int_eq(((int*)io.drained.data)[0], 4);
+    spool_io_close(&io);
+
+    unlinkat(root_fd, "1.mail", 0);
+    close(root_fd);
+    rmdir(root);
+}
+END_TEST
+
+// Операций больше, чем мест в кольце: лишние ждут завершения предыдущих
+START_TEST(uring_overflow_is_queued)
+{
+    char root[] = "/tmp/spool_io_testXXXXXX";
+    ck_assert_ptr_ne(mkdtemp(root), NULL);
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+
+    spool_io_t io;
+    ck_assert(spool_io_init(&io, SPOOL_IO_URING));
+    const int jobs = 300;
+    for (int i = 0; i < jobs; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%d.mail", i);
+        spool_job_t *job = spool_io_open(&io, root_fd, name, false, 0, i);
+        for (int w = 0; w < 4; w++)
+        {
+            spool_io_write(&io, job, strdup("ab"), 2);
+        }
+        spool_io_finish(&io, job, root_fd, false, false);
+    }
+
+    for (int i = 0; i < jobs; i++)
+    {
+        ck_assert(wait_result(&io).ok);
+    }
+    for (int i = 0; i < jobs; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%d.mail", i);
+        check_file(root_fd, name, "abababab");
+        unlinkat(root_fd, name, 0);
+    }
+    spool_io_close(&io);
+    close(root_fd);
+    rmdir(root);
+}
+END_TEST
+
+
+Suite *spool_io_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("Spool IO");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, uring_delivers_message);
+    tcase_add_test(tc_core, thread_pool_delivers_message);
+    tcase_add_test(tc_core, reserved_space_is_released);
+    tcase_add_test(tc_core, failed_open_is_reported);
+    tcase_add_test(tc_core, backlog_is_throttled);
+    tcase_add_test(tc_core, uring_overflow_is_queued);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,60 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "test_util.h"
+
+
+static char root[] = "/tmp/maildir_testXXXXXX";
+
+maildir_t create_test_maildir(void)
+{
+    // mkdtemp портит шаблон: без сброса второй вызов получит EINVAL
+    strcpy(root, "/tmp/maildir_testXXXXXX");
+    ck_assert_ptr_ne(mkdtemp(root), NULL);
+    return open_test_maildir();
+}
+
+maildir_t open_test_maildir(void)
+{
+    int error;
+    maildir_t maildir = maildir_open(root, &error);
+    ck_assert_int_eq(error, 0);
+    return maildir;
+}
+
+const char *test_root(void)
+{
+    return root;
+}
+
+void remove_test_maildir(const char **paths, int count)
+{
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+    for (int i = 0; i < count; i++)
+    {
+        struct stat st;
+        ck_assert_int_eq(fstatat(root_fd, paths[i], &st, 0), 0);
+        ck_assert_int_eq(unlinkat(root_fd, paths[i], S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0), 0);
+    }
+    const char *dirs[] = { "tmp", "cur", "relay" };
+    for (int i = 0; i < 3; i++)
+    {
+        ck_assert_int_eq(unlinkat(root_fd, dirs[i], AT_REMOVEDIR), 0);
+    }
+    close(root_fd);
+    rmdir(root);
+}
+
+void check_file(int dirfd, const char *name, const char *expected)
+{
+    char buf[64];
+    int fd = openat(dirfd, name, O_RDONLY);
+    ck_assert_int_ge(fd, 0);
+    int len = read(fd, buf, sizeof(buf));
+    close(fd);
+    ck_assert_int_eq(len, strlen(expected));
+    ck_assert(memcmp(buf, expected, len) == 0);
+}
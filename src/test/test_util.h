@@ -0,0 +1,34 @@
+#pragma once
+#include "../maildir.h"
+
+/**
+ * @file
+ * @brief Общие заготовки тестов
+ */
+
+/**
+ * Создаёт пустую временную папку и открывает в ней maildir. Путь к папке
+ * возвращает #test_root до следующего вызова
+ */
+maildir_t create_test_maildir(void);
+
+/**
+ * Снова открывает maildir, созданный #create_test_maildir
+ */
+maildir_t open_test_maildir(void);
+
+/**
+ * Папка последнего #create_test_maildir
+ */
+const char *test_root(void);
+
+/**
+ * Удаляет @a paths (пути от корня maildir, файлы или пустые папки),
+ * папки maildir и сам корень
+ */
+void remove_test_maildir(const char **paths, int count);
+
+/**
+ * Проверяет, что файл @a name в @a dirfd содержит ровно @a expected
+ */
+void check_file(int dirfd, const char *name, const char *expected);
@@ -0,0 +1,131 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "../timer_wheel.h"
+
+
+void check_expired(dynamic_vector_t *expired, int count, const int *owners)
+{
+    ck_assert_int_eq(expired->size, count);
+    for (int i = 0; i < count; i++)
+    {
+        int owner = ((int*)expired->data)[i];
+        bool found = false;
+        for (int j = 0; j < count; j++)
+        {
+            found = found || owners[j] == owner;
+        }
+        ck_assert(found);
+    }
+    dynamic_vector_clear(expired);
+}
+
+START_TEST(fires_at_deadline)
+{
+    timer_wheel_t wheel = timer_wheel_create(1000);
+    dynamic_vector_t expired = dynamic_vector_create(sizeof(int), 4);
+    timer_wheel_add(&wheel, 1010, 7);
+
+    timer_wheel_advance(&wheel, 1009, &expired);
+    check_expired(&expired, 0, NULL);
+
+    timer_wheel_advance(&wheel, 1010, &expired);
+    int owners[] = { 7 };
+    check_expired(&expired, 1, owners);
+
+    dynamic_vector_close(&expired);
+    timer_wheel_close(&wheel);
+}
+END_TEST
+
+START_TEST(fires_after_cascade)
+{
+    // Срок на верхних уровнях: таймер должен спуститься и сработать вовремя
+    timer_wheel_t wheel = timer_wheel_create(60);
+    dynamic_vector_t expired = dynamic_vector_create(sizeof(int), 4);
+    timer_wheel_add(&wheel, 125, 1);
+    timer_wheel_add(&wheel, 60 + 600, 2);
+    timer_wheel_add(&wheel, 60 + 5000, 3);
+
+    timer_wheel_advance(&wheel, 124, &expired);
+    check_expired(&expired, 0, NULL);
+    timer_wheel_advance(&wheel, 125, &expired);
+    int first[] = { 1 };
+    check_expired(&expired, 1, first);
+
+    timer_wheel_advance(&wheel, 659, &expired);
+    check_expired(&expired, 0, NULL);
+    timer_wheel_advance(&wheel, 660, &expired);
+    int second[] = { 2 };
+    check_expired(&expired, 1, second);
+
+    timer_wheel_advance(&wheel, 5059, &expired);
+    check_expired(&expired, 0, NULL);
+    timer_wheel_advance(&wheel, 5060, &expired);
+    int third[] = { 3 };
+    check_expired(&expired, 1, third);
+
+    dynamic_vector_close(&expired);
+    timer_wheel_close(&wheel);
+}
+END_TEST
+
+START_TEST(reschedule_and_remove)
+{
+    timer_wheel_t wheel = timer_wheel_create(0);
+    dynamic_vector_t expired = dynamic_vector_create(sizeof(int), 4);
+    int a = timer_wheel_add(&wheel, 10, 1);
+    int b = timer_wheel_add(&wheel, 10, 2);
+
+    timer_wheel_reschedule(&wheel, a, 20);
+    timer_wheel_remove(&wheel, b);
+    timer_wheel_advance(&wheel, 15, &expired);
+    check_expired(&expired, 0, NULL);
+
+    timer_wheel_set_owner(&wheel, a, 5);
+    timer_wheel_advance(&wheel, 30, &expired);
+    int owners[] = { 5 };
+    check_expired(&expired, 1, owners);
+
+    // Сработавший таймер можно переставить повторно
+    timer_wheel_reschedule(&wheel, a, 31);
+    timer_wheel_advance(&wheel, 31, &expired);
+    check_expired(&expired, 1, owners);
+
+    // Освобождённый узел используется снова
+    ck_assert_int_eq(timer_wheel_add(&wheel, 40, 9), b);
+
+    dynamic_vector_close(&expired);
+    timer_wheel_close(&wheel);
+}
+END_TEST
+
+START_TEST(next_timeout)
+{
+    timer_wheel_t wheel = timer_wheel_create(0);
+    ck_assert_int_eq(timer_wheel_next_timeout(&wheel, 30), 30);
+
+    timer_wheel_add(&wheel, 5, 1);
+    ck_assert_int_eq(timer_wheel_next_timeout(&wheel, 30), 5);
+    ck_assert_int_eq(timer_wheel_next_timeout(&wheel, 3), 3);
+
+    timer_wheel_close(&wheel);
+}
+END_TEST
+
+
+Suite *timer_wheel_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("Timer Wheel");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, fires_at_deadline);
+    tcase_add_test(tc_core, fires_after_cascade);
+    tcase_add_test(tc_core, reschedule_and_remove);
+    tcase_add_test(tc_core, next_timeout);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,75 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../unique_id.h"
+
+
+static int compare_ids(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+START_TEST(ids_do_not_repeat)
+{
+    unique_id_t ids;
+    unique_id_init(&ids, 1);
+
+    const int count = 100000;
+    uint64_t *values = malloc(sizeof(uint64_t) * count);
+    for (int i = 0; i < count; i++)
+    {
+        values[i] = unique_id_next(&ids);
+    }
+    qsort(values, count, sizeof(uint64_t), compare_ids);
+    for (int i = 1; i < count; i++)
+    {
+        ck_assert(values[i] != values[i - 1]);
+    }
+    free(values);
+
+    // Даже с тем же состоянием генератора имена потоков различаются
+    unique_id_t other = ids;
+    other.worker_id = 2;
+    struct timespec time = { .tv_sec = 100, .tv_nsec = 0 };
+    char name[128];
+    char other_name[128];
+    unique_id_filename(&ids, name, sizeof(name), time, "host");
+    unique_id_filename(&other, other_name, sizeof(other_name), time, "host");
+    ck_assert(strcmp(name, other_name) != 0);
+}
+END_TEST
+
+START_TEST(message_id_format)
+{
+    unique_id_t ids;
+    unique_id_init(&ids, 3);
+    struct timespec time = { .tv_sec = 100, .tv_nsec = 0 };
+    char first[128];
+    char second[128];
+    unique_id_message_id(&ids, first, sizeof(first), time, "mysmtp.pvs.bmstu");
+    unique_id_message_id(&ids, second, sizeof(second), time, "mysmtp.pvs.bmstu");
+
+    ck_assert_int_eq(first[0], '<');
+    ck_assert_int_eq(first[strlen(first) - 1], '>');
+    ck_assert_ptr_ne(strstr(first, "@mysmtp.pvs.bmstu>"), NULL);
+    ck_assert(strcmp(first, second) != 0);
+    ck_assert_int_eq(ids.sequence, 2);
+}
+END_TEST
+
+
+Suite *unique_id_suite(void)
+{
+    Suite *s;
+    TCase *tc_core;
+
+    s = suite_create("Unique ID");
+    tc_core = tcase_create("Core");
+
+    tcase_add_test(tc_core, ids_do_not_repeat);
+    tcase_add_test(tc_core, message_id_format);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,223 @@
+#include "timer_wheel.h"
+#include <assert.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+// Дальше этого горизонта таймер всё равно будет переноситься вниз по уровням
+#define MAX_DELAY (((time_t)1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+static timer_node_t *node_at(timer_wheel_t *wheel, int timer)
+{
+    assert(timer >= 0 && timer < wheel->nodes.size);
+    return (timer_node_t*)wheel->nodes.data + timer;
+}
+
+static int level_shift(int level)
+{
+    return TIMER_WHEEL_SLOT_BITS * level;
+}
+
+timer_wheel_t timer_wheel_create(time_t now)
+{
+    timer_wheel_t wheel;
+    wheel.nodes = dynamic_vector_create(sizeof(timer_node_t), 32);
+    wheel.free_list = TIMER_NONE;
+    wheel.current = now;
+    wheel.active = 0;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+        {
+            wheel.slots[level][slot] = TIMER_NONE;
+        }
+    }
+
+    return wheel;
+}
+
+void timer_wheel_close(timer_wheel_t *wheel)
+{
+    dynamic_vector_close(&wheel->nodes);
+    wheel->free_list = TIMER_NONE;
+    wheel->active = 0;
+}
+
+// Кладёт узел в слот относительно текущего времени колеса. Уровень -
+// старшая группа разрядов, в которой срок отличается от текущего времени.
+static void link_node(timer_wheel_t *wheel, int timer)
+{
+    timer_node_t *node = node_at(wheel, timer);
+    assert(node->level < 0);
+
+    time_t deadline = node->deadline;
+    if (deadline < wheel->current)
+    {
+        deadline = wheel->current;
+    }
+    if (deadline - wheel->current > MAX_DELAY)
+    {
+        deadline = wheel->current + MAX_DELAY;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1
+            && (deadline >> level_shift(level + 1)) != (wheel->current >> level_shift(level + 1)))
+    {
+        level++;
+    }
+    int slot = (deadline >> level_shift(level)) & SLOT_MASK;
+
+    int head = wheel->slots[level][slot];
+    node->level = level;
+    node->slot = slot;
+    node->prev = TIMER_NONE;
+    node->next = head;
+    if (head != TIMER_NONE)
+    {
+        node_at(wheel, head)->prev = timer;
+    }
+    wheel->slots[level][slot] = timer;
+    wheel->active++;
+}
+
+static void unlink_node(timer_wheel_t *wheel, int timer)
+{
+    timer_node_t *node = node_at(wheel, timer);
+    if (node->level < 0) return;
+
+    if (node->prev != TIMER_NONE)
+    {
+        node_at(wheel, node->prev)->next = node->next;
+    }
+    else
+    {
+        wheel->slots[node->level][node->slot] = node->next;
+    }
+
+    if (node->next != TIMER_NONE)
+    {
+        node_at(wheel, node->next)->prev = node->prev;
+    }
+
+    node->level = -1;
+    node->prev = TIMER_NONE;
+    node->next = TIMER_NONE;
+    wheel->active--;
+}
+
+int timer_wheel_add(timer_wheel_t *wheel, time_t deadline, int owner)
+{
+    int timer = wheel->free_list;
+    if (timer != TIMER_NONE)
+    {
+        wheel->free_list = node_at(wheel, timer)->next;
+    }
+    else
+    {
+        timer_node_t empty = {0};
+        timer = wheel->nodes.size;
+        dynamic_vector_copy_elem_back(&wheel->nodes, &empty);
+    }
+
+    timer_node_t *node = node_at(wheel, timer);
+    node->owner = owner;
+    node->level = -1;
+    timer_wheel_reschedule(wheel, timer, deadline);
+    return timer;
+}
+
+void timer_wheel_reschedule(timer_wheel_t *wheel, int timer, time_t deadline)
+{
+    unlink_node(wheel, timer);
+    // Текущая секунда уже обработана, раньше следующей таймер не сработает
+    if (deadline <= wheel->current)
+    {
+        deadline = wheel->current + 1;
+    }
+    node_at(wheel, timer)->deadline = deadline;
+    link_node(wheel, timer);
+}
+
+void timer_wheel_remove(timer_wheel_t *wheel, int timer)
+{
+    unlink_node(wheel, timer);
+    timer_node_t *node = node_at(wheel, timer);
+    node->owner = -1;
+    node->next = wheel->free_list;
+    wheel->free_list = timer;
+}
+
+void timer_wheel_set_owner(timer_wheel_t *wheel, int timer, int owner)
+{
+    node_at(wheel, timer)->owner = owner;
+}
+
+static void cascade(timer_wheel_t *wheel, int level)
+{
+    int slot = (wheel->current >> level_shift(level)) & SLOT_MASK;
+    int timer = wheel->slots[level][slot];
+    while (timer != TIMER_NONE)
+    {
+        int next = node_at(wheel, timer)->next;
+        unlink_node(wheel, timer);
+        link_node(wheel, timer);
+        timer = next;
+    }
+}
+
+void timer_wheel_advance(timer_wheel_t *wheel, time_t now, dynamic_vector_t *expired)
+{
+    if (wheel->active == 0 && now > wheel->current)
+    {
+        wheel->current = now;
+        return;
+    }
+
+    while (wheel->current < now)
+    {
+        wheel->current++;
+
+        // Переносим вниз слоты верхних уровней, начиная с самого старшего,
+        // когда младшие разряды времени обнулились
+        int top = 0;
+        while (top < TIMER_WHEEL_LEVELS - 1
+                && (wheel->current & (((time_t)1 << level_shift(top + 1)) - 1)) == 0)
+        {
+            top++;
+        }
+        for (int level = top; level > 0; level--)
+        {
+            cascade(wheel, level);
+        }
+
+        int slot = wheel->current & SLOT_MASK;
+        int timer = wheel->slots[0][slot];
+        while (timer != TIMER_NONE)
+        {
+            timer_node_t *node = node_at(wheel, timer);
+            int next = node->next;
+            unlink_node(wheel, timer);
+            dynamic_vector_copy_elem_back(expired, &node->owner);
+            timer = next;
+        }
+    }
+}
+
+time_t timer_wheel_next_timeout(timer_wheel_t *wheel, time_t max)
+{
+    if (wheel->active == 0)
+    {
+        return max;
+    }
+
+    for (time_t i = 1; i <= max; i++)
+    {
+        time_t tick = wheel->current + i;
+        if ((tick & SLOT_MASK) == 0 || wheel->slots[0][tick & SLOT_MASK] != TIMER_NONE)
+        {
+            return i;
+        }
+    }
+
+    return max;
+}
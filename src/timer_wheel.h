@@ -0,0 +1,123 @@
+#pragma once
+#include <stdbool.h>
+#include <time.h>
+#include "dynamic_vector.h"
+
+/**
+ * @file
+ * @brief Иерархическое колесо таймеров рабочего потока
+ *
+ * Разрешение колеса - одна секунда. Четыре уровня по 64 слота покрывают
+ * 2^24 секунд. Постановка, перепостановка и снятие таймера выполняются
+ * за O(1), срабатывание - за O(1) на таймер с амортизированным переносом
+ * между уровнями.
+ *
+ * Узлы таймеров хранятся в отдельном пуле и связаны индексами, поэтому
+ * владельцы (соединения) могут свободно перемещаться в памяти.
+ */
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+/**
+ * Идентификатор отсутствующего таймера
+ */
+#define TIMER_NONE (-1)
+
+/**
+ * Узел таймера в пуле колеса
+ */
+typedef struct timer_node_t
+{
+    /**
+     * Момент срабатывания, секунды
+     */
+    time_t deadline;
+    /**
+     * Индекс владельца, возвращается при срабатывании
+     */
+    int owner;
+    /**
+     * Соседи в списке слота (или следующий свободный узел)
+     */
+    int prev;
+    int next;
+    /**
+     * Уровень и слот, в котором лежит узел; -1, если узел не в колесе
+     */
+    int level;
+    int slot;
+} timer_node_t;
+
+/**
+ * Колесо таймеров
+ */
+typedef struct timer_wheel_t
+{
+    /**
+     * Пул узлов #timer_node_t
+     */
+    dynamic_vector_t nodes;
+    /**
+     * Голова списка свободных узлов
+     */
+    int free_list;
+    /**
+     * Головы списков узлов в слотах
+     */
+    int slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    /**
+     * Последняя обработанная секунда
+     */
+    time_t current;
+    /**
+     * Количество таймеров, стоящих в колесе
+     */
+    int active;
+} timer_wheel_t;
+
+/**
+ * Создаёт колесо, текущее время которого \p now
+ */
+timer_wheel_t timer_wheel_create(time_t now);
+
+/**
+ * Освобождает колесо
+ */
+void timer_wheel_close(timer_wheel_t *wheel);
+
+/**
+ * Заводит таймер на момент \p deadline для владельца \p owner.
+ * \returns идентификатор таймера
+ */
+int timer_wheel_add(timer_wheel_t *wheel, time_t deadline, int owner);
+
+/**
+ * Переставляет таймер \p timer на момент \p deadline. Работает и для
+ * сработавшего таймера.
+ */
+void timer_wheel_reschedule(timer_wheel_t *wheel, int timer, time_t deadline);
+
+/**
+ * Удаляет таймер и освобождает его узел
+ */
+void timer_wheel_remove(timer_wheel_t *wheel, int timer);
+
+/**
+ * Меняет владельца таймера (например, после перемещения соединения)
+ */
+void timer_wheel_set_owner(timer_wheel_t *wheel, int timer, int owner);
+
+/**
+ * Продвигает колесо до момента \p now. Владельцы сработавших таймеров
+ * дописываются в вектор int \p expired. Сработавшие таймеры остаются
+ * выделенными, их нужно переставить или удалить.
+ */
+void timer_wheel_advance(timer_wheel_t *wheel, time_t now, dynamic_vector_t *expired);
+
+/**
+ * Через сколько секунд (но не больше \p max) колесу нужно продвинуться:
+ * до ближайшего срабатывания или переноса между уровнями.
+ */
+time_t timer_wheel_next_timeout(timer_wheel_t *wheel, time_t max);
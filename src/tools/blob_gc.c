@@ -0,0 +1,48 @@
+/**
+ * @file
+ * @brief Сборка мусора в папке тел писем
+ *
+ * Удаляет из maildir/blobs тела, на которые больше не ссылается ни одно
+ * письмо: письма удалили или забрали из cur и relay. Можно запускать
+ * при работающем сервере.
+ *
+ * Запуск: make tools && ./tools/blob_gc maildir/
+ */
+#include <stdio.h>
+#include <string.h>
+#include "../maildir.h"
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        printf("Usage: %s maildir\n", argv[0]);
+        return 1;
+    }
+
+    int error;
+    maildir_t maildir = maildir_open(argv[1], &error);
+    if (error != 0)
+    {
+        fprintf(stderr, "maildir: %s\n", strerror(error));
+        return 1;
+    }
+    if (!maildir_open_blobs(&maildir))
+    {
+        perror("blobs");
+        maildir_close(&maildir);
+        return 1;
+    }
+
+    int removed = maildir_collect_blobs(&maildir);
+    maildir_close(&maildir);
+    if (removed < 0)
+    {
+        perror("collect");
+        return 1;
+    }
+
+    printf("Removed %d unreferenced bodies\n", removed);
+    return 0;
+}
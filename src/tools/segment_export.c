@@ -0,0 +1,69 @@
+/**
+ * @file
+ * @brief Выгрузка сегмента в maildir
+ *
+ * Раскладывает принятые письма сегмента по папкам maildir так же, как их
+ * разложил бы сервер без сегментов, и помечает их выгруженными. Повторный
+ * запуск на том же сегменте ничего не выгружает.
+ *
+ * Запуск: make tools && ./tools/segment_export maildir/segments/<сегмент> maildir/
+ */
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include "../segment_spool.h"
+
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: %s segment maildir\n", argv[0]);
+        return 1;
+    }
+
+    segment_t segment;
+    if (!segment_map(argv[1], true, &segment))
+    {
+        perror("segment");
+        return 1;
+    }
+
+    int error;
+    maildir_t maildir = maildir_open(argv[2], &error);
+    if (error != 0)
+    {
+        fprintf(stderr, "maildir: %s\n", strerror(error));
+        segment_unmap(&segment);
+        return 1;
+    }
+
+    // Имена писем начинаются с имени сегмента: выгрузки разных сегментов
+    // не пересекаются
+    char prefix[256];
+    snprintf(prefix, sizeof(prefix), "%s", basename(argv[1]));
+    char *extension = strstr(prefix, ".seg");
+    if (extension)
+    {
+        *extension = '\0';
+    }
+
+    // Состояния писем сбрасываются после самих писем: письмо, помеченное
+    // выгруженным, уже лежит в maildir на диске
+    int exported = segment_export(&segment, &maildir, prefix);
+    if (msync(segment.base, segment.capacity, MS_SYNC) != 0 && exported >= 0)
+    {
+        exported = -1;
+    }
+    segment_unmap(&segment);
+    maildir_close(&maildir);
+    if (exported < 0)
+    {
+        perror("export");
+        return 1;
+    }
+
+    printf("Exported %d messages\n", exported);
+    return 0;
+}
@@ -0,0 +1,87 @@
+/**
+ * @file
+ * @brief Чтение двоичного журнала
+ *
+ * Печатает журнал, записанный сервером с флагом -B, в том же виде,
+ * в каком его пишет текстовый режим. С -U время печатается
+ * с микросекундами, как у сервера с тем же флагом.
+ *
+ * Запуск: make tools && ./tools/smtplogdump [-U] smtp_log.bin
+ */
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../log_binary.h"
+#include "../logger.h"
+
+
+int main(int argc, char **argv)
+{
+    bool microseconds = argc == 3 && strcmp(argv[1], "-U") == 0;
+    if (argc != 2 && !microseconds)
+    {
+        printf("Usage: %s [-U] log_file\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[argc - 1];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    log_decoder_t decoder;
+    log_decoder_init(&decoder);
+    decoder.microseconds = microseconds;
+
+    static char data[1 << 16];
+    char text[LOG_RECORD_MAX];
+    int len = 0;
+    long offset = 0;
+    int result = 0;
+    while (true)
+    {
+        int read_bytes = read(fd, data + len, sizeof(data) - len);
+        if (read_bytes < 0)
+        {
+            perror("read");
+            result = 1;
+            break;
+        }
+        len += read_bytes;
+
+        int pos = 0;
+        int consumed;
+        int text_len;
+        while ((consumed = log_decode_record(&decoder, data + pos, len - pos, text, sizeof(text), &text_len)) > 0)
+        {
+            fwrite(text, 1, text_len, stdout);
+            pos += consumed;
+            offset += consumed;
+        }
+        if (consumed < 0)
+        {
+            fprintf(stderr, "Malformed record at offset %ld\n", offset);
+            result = 1;
+            break;
+        }
+
+        memmove(data, data + pos, len - pos);
+        len -= pos;
+        if (read_bytes == 0)
+        {
+            if (len > 0)
+            {
+                fprintf(stderr, "Truncated record at the end of file\n");
+            }
+            break;
+        }
+    }
+
+    log_decoder_close(&decoder);
+    close(fd);
+    return result;
+}
@@ -0,0 +1,45 @@
+#include "unique_id.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "maildir.h"
+
+
+bool unique_id_init(unique_id_t *ids, int worker_id)
+{
+    ids->sequence = 0;
+    ids->worker_id = worker_id;
+    ids->pid = getpid();
+
+    if (getrandom(&ids->state, sizeof(ids->state), 0) == sizeof(ids->state))
+    {
+        return true;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ids->state = ((uint64_t)now.tv_sec << 32) ^ now.tv_nsec ^ (uintptr_t)ids ^ ((uint64_t)ids->pid << 16);
+    return false;
+}
+
+uint64_t unique_id_next(unique_id_t *ids)
+{
+    ids->sequence++;
+    uint64_t z = (ids->state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void unique_id_filename(unique_id_t *ids, char *buf, int len, struct timespec time, char *hostname)
+{
+    uint64_t id = unique_id_next(ids);
+    generate_filename(buf, len, time, id, ids->pid, ids->worker_id, ids->sequence, hostname);
+}
+
+void unique_id_message_id(unique_id_t *ids, char *buf, int len, struct timespec time, const char *hostname)
+{
+    uint64_t id = unique_id_next(ids);
+    snprintf(buf, len, "<%ld.%016llx.%d.%d@%s>", (long)time.tv_sec, (unsigned long long)id,
+            ids->pid, ids->worker_id, hostname);
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @file
+ * @brief Уникальные идентификаторы писем
+ *
+ * Генератор заводится у каждого рабочего потока и один раз получает
+ * зерно от getrandom(). Дальше идентификаторы считаются без системных
+ * вызовов: это splitmix64 от счётчика, начатого с зерна. splitmix64 -
+ * биекция, поэтому внутри потока идентификаторы не повторяются, пока
+ * счётчик не обойдёт все 2^64 значения. Между потоками и процессами
+ * имена различают номер потока и pid.
+ */
+
+/**
+ * Генератор идентификаторов рабочего потока
+ */
+typedef struct unique_id_t
+{
+    /**
+     * Состояние splitmix64
+     */
+    uint64_t state;
+    /**
+     * Выданные идентификаторы
+     */
+    uint64_t sequence;
+    int worker_id;
+    /**
+     * pid запоминается при создании: getpid() - системный вызов
+     */
+    int pid;
+} unique_id_t;
+
+/**
+ * Заводит генератор потока @a worker_id
+ *
+ * @return false, если getrandom() не сработал. Генератор всё равно
+ * пригоден: зерно берётся из времени и адреса, уникальность имён
+ * обеспечивают номер потока, pid и счётчик
+ */
+bool unique_id_init(unique_id_t *ids, int worker_id);
+
+/**
+ * Следующий идентификатор
+ */
+uint64_t unique_id_next(unique_id_t *ids);
+
+/**
+ * Имя файла письма в maildir, см. #generate_filename
+ */
+void unique_id_filename(unique_id_t *ids, char *buf, int len, struct timespec time, char *hostname);
+
+/**
+ * Значение заголовка Message-ID (RFC 5322, 3.6.4): "<id@hostname>"
+ */
+void unique_id_message_id(unique_id_t *ids, char *buf, int len, struct timespec time, const char *hostname);
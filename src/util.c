@@ -1,10 +1,22 @@
 #include <unistd.h>
 #include <sys/types.h>
-#include <fcntl.h>
+#include <sys/random.h>
+#include <errno.h>
+#include "util.h"
 
 
 void get_random(size_t size, char *buf)
 {
-     int urandom = open("/dev/urandom", O_RDONLY);
-     read(urandom, buf, size);
-}
\ No newline at end of file
+    while (size > 0)
+    {
+        ssize_t got = getrandom(buf, size, 0);
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += got;
+        size -= got;
+    }
+}